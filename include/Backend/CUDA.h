@@ -1,8 +1,37 @@
 #pragma once
 #include "IR/IR.h"
+#include "Backend/Profile.h"
+
+#include <map>
+#include <vector>
 
 namespace KernelCodeGen {
 
-std::string CUDAGen(mlir::ModuleOp &module);
+/// @brief how the host launches one kernel emitted by CUDAGen.
+struct KernelLaunch {
+  std::string name;
+  mlir::AffineParallelOp kernel;
+  /// the values passed as kernel arguments, in the order of the prototype.
+  std::vector<mlir::Value> params;
+  /// cuda order: x, y, z.
+  std::vector<int64_t> grid;
+  std::vector<int64_t> block;
+};
+
+/// @brief emitted kernels of the funcs tagged with "func.fingerprint", by fingerprint. a func already in the cache
+///        is not emitted again, its kernels are copied under their new names.
+struct KernelCache {
+  struct Kernel {
+    std::string name;
+    std::string source;
+  };
+  std::map<int64_t, std::vector<Kernel>> funcs;
+};
+
+/// @brief cuda source of the kernels of `module`, `launches` (if given) collects their launch configs.
+///        with `profile` enabled the phase markers of Rewriter::profile_phases turn into clock64() timers.
+///        `cache` (if given, ignored when profiling) replays and records the kernels of fingerprinted funcs.
+std::string CUDAGen(mlir::ModuleOp &module, std::vector<KernelLaunch>* launches = nullptr, const ProfileConfig& profile = {},
+                    KernelCache* cache = nullptr);
 
-}
\ No newline at end of file
+}
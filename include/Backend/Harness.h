@@ -0,0 +1,22 @@
+#pragma once
+#include "IR/IR.h"
+
+#include <string>
+
+namespace KernelCodeGen {
+
+/// @brief standalone benchmark program of the kernels of `optimized`: allocates and fills the graph inputs,
+///        checks the kernels once against a host (C++) run of the naive funcs of `reference`, then times
+///        warm-up + timed iterations with cuda events and prints json.
+///        built with -DKCG_HOST_ONLY it only runs the host reference, so it can be verified without a gpu.
+///        returns "" if the graph can't be flattened into kernel launches.
+std::string BenchmarkHarness(mlir::ModuleOp& reference, mlir::ModuleOp& optimized);
+
+/// @brief a graph input of integers is filled with values in [0, bound): the extent of the dim it indexes, which the
+///        operators indexing with it record in its "index.bound" attr, or 1 (zeros) if none does.
+int64_t indexBound(mlir::memref::AllocOp allocOp);
+
+/// @brief a call result nobody consumes, directly or through a view, is an output of the graph.
+bool isGraphOutput(mlir::Value value);
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "IR/IR.h"
+
+#include <string>
+#include <vector>
+
+namespace KernelCodeGen {
+
+/// @brief how `optimize` checks a config before it becomes the best of its optimizer, see setValidation.
+struct ValidationConfig {
+  bool enable = false;
+  /// the static dims larger than this are shrunk, never below the largest BLOCK_SIZE* of the config.
+  int64_t minDim = 128;
+  /// ops interpreted per run of the graph, a larger graph leaves the config unvalidated.
+  int64_t maxOps = 1 << 26;
+};
+
+/// @brief outputs of a host run of a graph, in graph order.
+struct HostRun {
+  bool ok = false;
+  /// the run read or wrote out of the bounds of a buffer or deadlocked at a barrier, a bug of the schedule rather
+  /// than a limit of the interpreter.
+  bool scheduleError = false;
+  std::string reason;
+  std::vector<std::vector<double>> outputs;
+  std::vector<mlir::Type> elementTypes;
+};
+
+/// @brief shrinks every static dim of `module` larger than `minDim`, in the memref types and the constant loop bounds:
+///        it is halved while it stays at least `minDim` and keeps its power-of-two factor up to `minDim`, so a tile
+///        that divided the dim still does. fails (with `reason`) on views of shrunk buffers.
+bool ShrinkShapes(mlir::ModuleOp module, int64_t minDim, std::string& reason);
+
+/// @brief runs the graph of `module` on the host: the inputs are filled as in BenchmarkHarness, the naive funcs run
+///        op by op and the kernels block by block, the threads of a block in lockstep at their barriers and shuffles.
+///        cp.async copies complete at once. an unsupported op fails the run instead of asserting.
+HostRun InterpretGraph(mlir::ModuleOp module, int64_t maxOps);
+
+/// @brief compares the outputs of two runs of the same graph with the tolerances of BenchmarkHarness (without fast math),
+///        `reason` locates the first mismatch.
+bool CompareRuns(const HostRun& reference, const HostRun& candidate, std::string& reason);
+
+}
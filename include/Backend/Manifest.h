@@ -0,0 +1,67 @@
+#pragma once
+#include "IR/IR.h"
+
+#include <string>
+#include <vector>
+
+namespace KernelCodeGen {
+
+/// @brief peak numbers of the target device, the roofline of the manifest is drawn with them.
+///        the defaults are the A100 (SXM4, fp32).
+struct DeviceSpec {
+  std::string name = "A100";
+  /// fp32 on the cuda cores, GFLOP/s.
+  double peakGFlops = 19500.0;
+  /// tf32 on the tensor cores (the "affine.mma" kernels), GFLOP/s.
+  double peakMMAGFlops = 156000.0;
+  /// dram bandwidth, GB/s.
+  double bandwidthGBs = 1555.0;
+};
+
+/// @brief the static profile of one kernel emitted by CUDAGen.
+struct KernelProfile {
+  std::string kernel;
+  std::string func;
+  std::string op;
+  /// cuda order: x, y, z.
+  std::vector<int64_t> grid;
+  std::vector<int64_t> block;
+  int64_t sharedBytes = 0;
+  int64_t registers = 0;
+  int64_t flops = 0;
+  /// every global buffer read and written once.
+  int64_t minGlobalBytes = 0;
+  /// every global access of every thread which passes the ifs around it, caches ignored.
+  int64_t globalBytes = 0;
+  bool mma = false;
+};
+
+/// @brief profiles the kernels of `module` in the order (and with the names) CUDAGen emits them.
+///        the loops multiply the ops of their body by their trip count, the ifs by the share of the threads and
+///        iterations their condition holds for (see activeFraction in Manifest.cc).
+std::vector<KernelProfile> profileKernels(mlir::ModuleOp& module);
+
+/// @brief the work no schedule of the naive (not lowered) `funcOp` gets below: the flops of its loops, the buffers
+///        it only reads read once and the ones it writes written once.
+KernelProfile profileWork(mlir::func::FuncOp funcOp);
+
+/// @brief roofline latency in us: `flops` at `peakGFlops` or `bytes` at `bandwidthGBs`, whichever takes longer.
+double rooflineUs(int64_t flops, int64_t bytes, double peakGFlops, double bandwidthGBs);
+
+/// @brief the kernels of a module on the roofline, summed over the kernels (in us).
+struct RooflineEstimate {
+  /// every global access of every thread goes to dram, the caches are ignored.
+  double latencyUs = 0.0;
+  /// every global buffer moved once: no schedule of the same kernels gets below it.
+  double boundUs = 0.0;
+  int64_t flops = 0;
+  int64_t minGlobalBytes = 0;
+};
+
+RooflineEstimate estimateRoofline(mlir::ModuleOp& module, const DeviceSpec& device = {});
+
+/// @brief json manifest of the kernels of `module`: launch config, resources, FLOPs, bytes, arithmetic
+///        intensity, roofline bound, predicted latency (every access) and its lower bound (every buffer once) on `device`.
+std::string KernelManifest(mlir::ModuleOp& module, const DeviceSpec& device = {});
+
+}
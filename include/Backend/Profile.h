@@ -0,0 +1,36 @@
+#pragma once
+#include "enum.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace KernelCodeGen {
+
+struct KernelLaunch;
+
+/// @brief the clock64() phase timers of CUDAGen. when enabled every kernel takes one more argument,
+///        `long long* kcg_profile`, sized by profileBufferSize; disabled, nothing is emitted at all.
+struct ProfileConfig {
+  bool enable = false;
+  /// the blocks whose linear id is a multiple of blockStride are sampled.
+  int64_t blockStride = 1;
+  /// so are their warps whose id is a multiple of warpStride, lane 0 writes the record of the warp.
+  int64_t warpStride = 1;
+  /// a record: block, warp, cycles of the whole kernel, then the cycles of each phase.
+  static constexpr int64_t FIELDS = 3 + static_cast<int64_t>(Phase::count);
+};
+
+const char* phaseName(Phase phase);
+
+/// @brief warps sampled in a block of `launch`.
+int64_t sampledWarps(const KernelLaunch& launch, const ProfileConfig& config);
+
+/// @brief elements (long long) of the profiling buffer of `launch`.
+int64_t profileBufferSize(const KernelLaunch& launch, const ProfileConfig& config);
+
+/// @brief json per-phase cycle breakdown of the records in `buffer` (copied back after `launch` ran).
+///        cycles outside every phase are reported as "other".
+std::string ProfileReport(const KernelLaunch& launch, const ProfileConfig& config, const std::vector<int64_t>& buffer);
+
+}
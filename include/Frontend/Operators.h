@@ -18,10 +18,11 @@ struct ComputeDAG {
   ComputeDAG(mlir::OpBuilder& builder_) : builder(builder_) {};
   ComputeDAG() = default;
   template <typename OperatorType, typename... Args>
-  mlir::Value create(Args &&...args) {
+  auto create(Args &&...args) -> decltype(OperatorType::build(this, std::forward<Args>(args)...)) {
     // auto block = builder.getInsertionBlock();
     // auto iter = builder.getInsertionPoint();
-    mlir::Value result;
+    // most operators return a mlir::Value, Split returns one view per section.
+    decltype(OperatorType::build(this, std::forward<Args>(args)...)) result;
     {
       // mlir::OpBuilder::InsertionGuard guard(builder);
       //Need to gurantee that OperatorType::build only create a nested AffineForOp or AllocOp.
@@ -43,6 +44,18 @@ struct ComputeDAG {
     }
   }
 
+  /// @brief fast-math for every operator of the graph, see Rewriter::fast_math for what changes and the error bounds.
+  void setFastMath(bool enable = true) {
+    if (enable) {
+      module->setAttr(std::string("compute_dag.fast_math"), builder.getUnitAttr());
+    } else {
+      module->removeAttr(std::string("compute_dag.fast_math"));
+    }
+  }
+
+  /// @brief fast-math only for the operator producing `output` (and the operators sharing its func).
+  void setFastMath(mlir::Value output, bool enable = true);
+
   // ComputeDAG& operator=(const ComputeDAG& other) {
   //   if (module != other.module) {
   //     module = other.module;
@@ -132,4 +145,30 @@ struct Gather : Operator<Gather> {
   // static std::vector<mlir::Value> build(ComputeDAG* graph, mlir::Value input, int indices, const std::int64_t& axis=0, const std::string& dtype_ = {""});
 };
 
+/*----------------------------views---------------------------------*/
+// The operators below don't build any function, they only produce memref views
+// (strided layouts) of existing buffers, so no data is copied.
+
+// A strided window of `input`, strides default to 1 for every dim.
+struct Slice : Operator<Slice> {
+  static mlir::Value build(ComputeDAG* graph, mlir::Value input, const std::vector<int64_t>& offsets, 
+    const std::vector<int64_t>& sizes, const std::vector<int64_t>& strides = {});
+};
+
+// Split `input` into `sections` along `axis`, returns one view for each section.
+struct Split : Operator<Split> {
+  static std::vector<mlir::Value> build(ComputeDAG* graph, mlir::Value input, const std::vector<int64_t>& sections, int64_t axis = 0);
+};
+
+// Reinterpret a contiguous buffer with `shape`.
+struct Reshape : Operator<Reshape> {
+  static mlir::Value build(ComputeDAG* graph, mlir::Value input, const std::vector<int64_t>& shape);
+};
+
+// Allocate the concatenated buffer and make the producers of `inputs` write into
+// their own slice of it directly. The inputs must be placeholders or function results.
+struct Concat : Operator<Concat> {
+  static mlir::Value build(ComputeDAG* graph, const std::vector<mlir::Value>& inputs, int64_t axis = 0);
+};
+
 }
@@ -2,7 +2,12 @@
 
 #include "Frontend/Operators.h"
 #include "Optimizer/Optimizer.h"
+#include "Optimizer/Snapshot.h"
+#include "Optimizer/TuneTrace.h"
 #include "Backend/CUDA.h"
+#include "Backend/Manifest.h"
+#include "Backend/Harness.h"
+#include "Backend/Interpreter.h"
 #include "log.h"
 
 // #include "ComputeDAG.h"
@@ -19,13 +24,41 @@
 #include <initializer_list>
 #include <climits>
 #include <cfloat>
+#include <chrono>
+#include <algorithm>
 
 namespace KernelCodeGen {
 
+/// @brief wall time of one optimizer in `optimize`: the match on the module, then each config tried.
+struct OptimizerTiming {
+  std::string optimizer;
+  double matchMs = 0.0;
+  std::vector<double> trialMs;
+  /// configs skipped because their roofline bound couldn't beat the best one.
+  int pruned = 0;
+  /// why the search ended early: "trials", "time", "bound", or empty.
+  std::string stop;
+  /// roofline estimate of the best config and its bound, the kernels of this optimizer only (us).
+  double bestUs = 0.0;
+  double boundUs = 0.0;
+};
+
+/// @brief limits of the config search of `optimize`, for the whole graph or for one optimizer. 0 doesn't limit.
+///        the first config of a matched optimizer always runs, so every operator gets lowered.
+struct TuneBudget {
+  double ms = 0.0;
+  int trials = 0;
+  /// an optimizer stops once its best config is within this fraction (0.1 is 10%) of the roofline bound.
+  double boundTolerance = 0.0;
+};
+
+/// @brief the process-wide context of every generator: the dialects are loaded on the first call only.
+mlir::MLIRContext& sharedContext();
+
 class KernelCodeGenerator {
 public:
-  KernelCodeGenerator(const std::string& platform_ = {"CUDA"}) : builder(&context), graph(builder), platform(std::move(platform_)) {
-    initMLIRContext();
+  KernelCodeGenerator(const std::string& platform_ = {"CUDA"}) : context(sharedContext()), builder(&context), graph(builder), 
+                                                                 platform(std::move(platform_)) {
     // opts.push_back(std::move(std::make_unique<MatmulOptimizer>()));
     // opts.push_back(std::move(std::make_unique<BinaryOptimizer>()));
     // opts.push_back(std::move(std::make_unique<ElementWiseOptimizer>()));
@@ -34,47 +67,67 @@ public:
     // opts.push_back(std::move(std::make_unique<FMHAOptimizer>()));
     matmulConfigs = {
       { {"BLOCK_SIZE_M", 128}, {"BLOCK_SIZE_N", 128}, {"BLOCK_SIZE_K", 8}, {"GROUP_SIZE_M", 8}, 
-        {"THREAD_SIZE_M", 8}, {"THREAD_SIZE_N", 8}, {"VECTORIZE_WIDTH", 4}, {"WARP_SIZE", 32}}
+        {"THREAD_SIZE_M", 8}, {"THREAD_SIZE_N", 8}, {"VECTORIZE_WIDTH", 4}, {"WARP_SIZE", 32}, {"STAGES", 2}, {"ASYNC_COPY", 0}, {"MMA", 0}, {"UNROLL_BUDGET", 8192},
+        {"WARP_SPECIALIZE", 0}}
     };
     binaryConfigs = {
-      {{"BLOCK_SIZE_M", 64}, {"BLOCK_SIZE_N", 64}, {"THREAD_SIZE_M", 4}, {"THREAD_SIZE_N", 4}, {"VECTORIZE_WIDTH", 4}}
+      {{"BLOCK_SIZE_M", 64}, {"BLOCK_SIZE_N", 64}, {"THREAD_SIZE_M", 4}, {"THREAD_SIZE_N", 4}, {"VECTORIZE_WIDTH", 4}, {"UNROLL_BUDGET", 8192}, {"GRID_CAP", 65535}, {"SM_COUNT", 108},
+       {"BLOCK_COARSEN", 1}, {"GRID_COARSEN", 1}}
     };
     elementWiseConfigs = {
-      {{"BLOCK_SIZE_M", 64}, {"BLOCK_SIZE_N", 64}, {"THREAD_SIZE_M", 4}, {"THREAD_SIZE_N", 4}, {"VECTORIZE_WIDTH", 4}}
+      {{"BLOCK_SIZE_M", 64}, {"BLOCK_SIZE_N", 64}, {"THREAD_SIZE_M", 4}, {"THREAD_SIZE_N", 4}, {"VECTORIZE_WIDTH", 4}, {"UNROLL_BUDGET", 8192}, {"GRID_CAP", 65535}, {"SM_COUNT", 108},
+       {"BLOCK_COARSEN", 1}, {"GRID_COARSEN", 1}}
     };
     layerNormConfigs = {
-      {{"BLOCK_SIZE", 2048}, {"THREAD_SIZE", 4}, {"VECTORIZE_WIDTH", 4}}
+      {{"BLOCK_SIZE", 2048}, {"THREAD_SIZE", 4}, {"VECTORIZE_WIDTH", 4}, {"UNROLL_BUDGET", 8192}}
     };
     gatherConfigs = {
-      {{"BLOCK_SIZE_M", 64}, {"BLOCK_SIZE_N", 64}, {"THREAD_SIZE_M", 4}, {"THREAD_SIZE_N", 4}, {"VECTORIZE_WIDTH", 4}}
+      {{"BLOCK_SIZE_M", 64}, {"BLOCK_SIZE_N", 64}, {"THREAD_SIZE_M", 4}, {"THREAD_SIZE_N", 4}, {"VECTORIZE_WIDTH", 4}, {"GRID_CAP", 65535}, {"SM_COUNT", 108},
+       {"BLOCK_COARSEN", 1}, {"GRID_COARSEN", 1}}
     };
     fmhaConfigs = {
       {{"BLOCK_SIZE", 128}, {"HdxBr", 128 * 64}, {"BrxBc", 128 * 64}, {"WarpX_O", 2}, {"Slice", 8},
-       {"BrTileS", 8}, {"BcTileS", 8}, {"BrTileO", 8}, {"HdTileO", 8}, {"Width", 4}, {"WARP_SIZE", 32}}
+       {"BrTileS", 8}, {"BcTileS", 8}, {"BrTileO", 8}, {"HdTileO", 8}, {"Width", 4}, {"WARP_SIZE", 32}, {"STAGES", 2}, {"ASYNC_COPY", 0}, {"MMA", 0}, {"UNROLL_BUDGET", 8192}}
     };
     batchMatmulConfigs = {
-      {{"BLOCK_SIZE_M", 128}, {"FOR_SIZE_N", 64}, {"BLOCK_SIZE_K", 8}, {"THREAD_SIZE", 8}, {"Slice", 8}, {"VECTORIZE_WIDTH", 4}}
+      {{"BLOCK_SIZE_M", 128}, {"FOR_SIZE_N", 64}, {"BLOCK_SIZE_K", 8}, {"THREAD_SIZE", 8}, {"Slice", 8}, {"VECTORIZE_WIDTH", 4}, {"STAGES", 2}, {"ASYNC_COPY", 0}, {"MMA", 0}, {"UNROLL_BUDGET", 8192}}
+    };
+    // tried only after enableExtraConfigs: a warp-specialized cp.async pipeline, coarsened blocks and grids.
+    extraConfigs["Matmul"] = {
+      { {"BLOCK_SIZE_M", 128}, {"BLOCK_SIZE_N", 128}, {"BLOCK_SIZE_K", 8}, {"GROUP_SIZE_M", 8}, 
+        {"THREAD_SIZE_M", 8}, {"THREAD_SIZE_N", 8}, {"VECTORIZE_WIDTH", 4}, {"WARP_SIZE", 32}, {"STAGES", 3}, {"ASYNC_COPY", 1}, {"MMA", 0}, {"UNROLL_BUDGET", 8192},
+        {"WARP_SPECIALIZE", 1}}
+    };
+    for (auto name : {"Binary", "ElementWise"}) {
+      extraConfigs[name] = {
+        {{"BLOCK_SIZE_M", 64}, {"BLOCK_SIZE_N", 64}, {"THREAD_SIZE_M", 4}, {"THREAD_SIZE_N", 4}, {"VECTORIZE_WIDTH", 4}, {"UNROLL_BUDGET", 8192}, {"GRID_CAP", 65535}, {"SM_COUNT", 108},
+         {"BLOCK_COARSEN", 2}, {"GRID_COARSEN", 4}}
+      };
+    }
+    extraConfigs["Gather"] = {
+      {{"BLOCK_SIZE_M", 64}, {"BLOCK_SIZE_N", 64}, {"THREAD_SIZE_M", 4}, {"THREAD_SIZE_N", 4}, {"VECTORIZE_WIDTH", 4}, {"GRID_CAP", 65535}, {"SM_COUNT", 108},
+       {"BLOCK_COARSEN", 2}, {"GRID_COARSEN", 4}}
     };
   }
   KernelCodeGenerator() = delete;
+  // the modules are owned by one generator only.
+  KernelCodeGenerator(const KernelCodeGenerator&) = delete;
+  KernelCodeGenerator& operator=(const KernelCodeGenerator&) = delete;
 
-  void initMLIRContext() {
-    // context.getOrLoadDialect<mlir::compute_dag::ComputeDAGDialect>();
-    // context.getOrLoadDialect<mlir::schedule::ScheduleDialect>();
-    context.getOrLoadDialect<mlir::AffineDialect>();
-    context.getOrLoadDialect<mlir::memref::MemRefDialect>();
-    context.getOrLoadDialect<mlir::func::FuncDialect>();
-    context.getOrLoadDialect<mlir::arith::ArithmeticDialect>();
-    context.getOrLoadDialect<mlir::gpu::GPUDialect>();
-    context.getOrLoadDialect<mlir::vector::VectorDialect>();
-    context.getOrLoadDialect<mlir::scf::SCFDialect>();
-    context.getOrLoadDialect<mlir::math::MathDialect>();
-    mlir::registerAllPasses();
+  ~KernelCodeGenerator() {
+    // the context outlives the generator, its modules are freed here.
+    for (auto module : ownedModules) {
+      module->erase();
+    }
+    clearIncremental();
+    // the snapshots are clones in the shared context too, the other generators keep theirs.
+    KCGSnapshot::clear(this);
+    if (KCGSnapshot::owner == this) KCGSnapshot::owner = nullptr;
   }
 
   ComputeDAG& createGraph(const std::string& graphName) {
     minLatency = FLT_MAX;
-    graph.module = mlir::ModuleOp::create(builder.getUnknownLoc(), mlir::Optional<mlir::StringRef>(std::move(graphName)));
+    graph.module = own(mlir::ModuleOp::create(builder.getUnknownLoc(), mlir::Optional<mlir::StringRef>(std::move(graphName))));
     graph.builder.setInsertionPointToEnd(graph.module.getBody());
     return graph;
   }
@@ -91,6 +144,7 @@ public:
     module->dump();
     if (mlir::failed(mlir::verify(module))) {
       module->emitError("module verification error");
+      KCGSnapshot::print(llvm::errs(), -1, this);
       assert(false);
     }
   }
@@ -115,46 +169,240 @@ public:
 
   void resetModule(mlir::ModuleOp& module) {
     mlir::Operation *cloned = backupModule_->clone();
-    module = mlir::dyn_cast<mlir::ModuleOp>(cloned);   
+    module = own(mlir::dyn_cast<mlir::ModuleOp>(cloned));
+  }
+
+  void resetModule(mlir::ModuleOp& module, CloneMapping& mapping) {
+    mlir::Operation *cloned = backupModule_->clone(mapping.mapper);
+    module = own(mlir::dyn_cast<mlir::ModuleOp>(cloned));
   }
 
   void backupModule(mlir::ModuleOp& module) {
     mlir::Operation *cloned = module->clone();
-    backupModule_ = mlir::dyn_cast<mlir::ModuleOp>(cloned);
+    drop(backupModule_);
+    backupModule_ = own(mlir::dyn_cast<mlir::ModuleOp>(cloned));
+  }
+
+  mlir::ModuleOp own(mlir::ModuleOp module) {
+    ownedModules.push_back(module);
+    return module;
+  }
+
+  /// @brief erases an owned module nothing refers to anymore, and nulls `module`.
+  void drop(mlir::ModuleOp& module) {
+    if (!module) return;
+    ownedModules.erase(std::remove(ownedModules.begin(), ownedModules.end(), module), ownedModules.end());
+    module->erase();
+    module = mlir::ModuleOp();
   }
 
   void saveBestModule(mlir::ModuleOp& module) {
     mlir::Operation *cloned = module->clone();
-    bestModule = mlir::dyn_cast<mlir::ModuleOp>(cloned);    
+    drop(bestModule);
+    bestModule = own(mlir::dyn_cast<mlir::ModuleOp>(cloned));
   }
 
+  /// @brief tunes every optimizer of `opts` on a copy of the graph. the returned module stays valid until the next call.
   mlir::ModuleOp& optimize(ComputeDAG& graph_);
 
-  float evaluate(mlir::ModuleOp& module) {
-    return 0.0f;
-  }
+  /// @brief swaps each func of `module` whose fingerprint was optimized before for a copy of the optimized func,
+  ///        `funcIds` gets the fingerprint id of every func.
+  void reuseOptimizedFuncs(mlir::ModuleOp& module, std::map<std::string, int64_t>& funcIds);
+
+  /// @brief keeps a copy of every func of `module` lowered to kernels, by the fingerprint id of its naive func.
+  void cacheOptimizedFuncs(mlir::ModuleOp& module, const std::map<std::string, int64_t>& funcIds);
+
+  /// @brief the settings the optimized funcs depend on besides their fingerprint: the optimizers, their configs,
+  ///        the device, the budgets and the validation.
+  std::string tuningKey() const;
+
+  /// @brief tries every config of `opt` on a clone of the module. the matches are found once on the
+  ///        backup and mapped onto each clone, only the transforms run per config.
+  template<typename OptType>
+  void tune(OptType& opt, mlir::ModuleOp& module, std::vector<std::map<std::string, int>>& configs,
+            std::map<std::string, int>& config);
+
+  /// @brief rebuilds the module being tuned at reduced shapes (the naive graph shrunk, then the optimizers applied
+  ///        before with their configs), runs OptType with the current config on it, and compares its outputs with the
+  ///        naive funcs on the host interpreter. `references` keeps the naive outputs by the shrunk size.
+  ///        the mma.sync kernels run on their fma fallback there, their fragments are only checked by MMALayout::verify.
+  ///        returns "passed", "mismatch" or "unvalidated", `detail` says where or why.
+  template<typename OptType>
+  std::string validate(const std::map<std::string, int>& config, std::map<int64_t, HostRun>& references, std::string& detail);
+
+  /// @brief roofline estimate of the kernels of `module` on the device (us). FLT_MAX if one of `funcOps` (the funcs being
+  ///        tuned, every func of the module if empty) spills registers: the funcs optimized before are not judged again.
+  float evaluate(mlir::ModuleOp& module, const std::vector<mlir::func::FuncOp>& funcOps = {});
+
+  /// @brief sets `reason` if `trials` or the time since `start` used up `budget`.
+  bool outOfBudget(const TuneBudget& budget, int trials, std::chrono::steady_clock::time_point start, std::string& reason);
 
   std::string codegen(mlir::ModuleOp module) {
     if (platform == "CUDA") {
-      return std::move(CUDAGen(module));
+      launches.clear();
+      // the launches of the last codegen refer to its profiled module.
+      drop(profiledModule);
+      if (profile.enable) {
+        // the timers are emitted from markers, the module itself stays untouched.
+        profiledModule = own(mlir::dyn_cast<mlir::ModuleOp>(module->clone()));
+        Rewriter::profile_phases(profiledModule);
+        return std::move(CUDAGen(profiledModule, &launches, profile));
+      }
+      return std::move(CUDAGen(module, &launches, {}, incremental ? &kernelCache : nullptr));
     }
     return "";
   }
 
+  /// @brief instruments the kernels of the next `codegen` with the clock64() phase timers.
+  void setProfile(const ProfileConfig& profile_) {
+    profile = profile_;
+  }
+
+  /// @brief the kernels emitted by the last `codegen`, with their launch configs.
+  const std::vector<KernelLaunch>& getLaunches() const {
+    return launches;
+  }
+
+  /// @brief per-phase cycle breakdown of the profiling buffer of the `kernel`-th kernel of the last `codegen`.
+  std::string profileReport(int kernel, const std::vector<int64_t>& buffer) {
+    return ProfileReport(launches[kernel], profile, buffer);
+  }
+
+  /// @brief json manifest of the kernels `codegen` emits, to be saved next to the source.
+  std::string manifest(mlir::ModuleOp module) {
+    return KernelManifest(module, device);
+  }
+
+  /// @brief standalone benchmark of the kernels of `module`, checked against the naive funcs of the graph.
+  std::string harness(mlir::ModuleOp module) {
+    if (platform == "CUDA") {
+      return BenchmarkHarness(graph.module, module);
+    }
+    return "";
+  }
+
+  /// @brief timings of the last `optimize`, finalizeMs covers the module-wide rewrites after the tuning.
+  const std::vector<OptimizerTiming>& getOptimizerTimings() const {
+    return optimizerTimings;
+  }
+
+  /// @brief every config considered by the last `optimize`, see TuneTraceJsonl, TuneChromeTrace and TuneConvergenceReport.
+  const std::vector<TuneTrial>& getTuneTrace() const {
+    return tuneTrace;
+  }
+
+  double getFinalizeTime() const {
+    return finalizeMs;
+  }
+
+  /// @brief budget of the whole config search of `optimize`, with pruning on the roofline bound.
+  void setTuneBudget(const TuneBudget& budget) {
+    graphBudget = budget;
+  }
+
+  /// @brief budget of one optimizer, by name (e.g. "Matmul").
+  void setTuneBudget(const std::string& optimizer, const TuneBudget& budget) {
+    opBudgets[optimizer] = budget;
+  }
+
+  /// @brief checks each config about to become the best of its optimizer on random inputs at reduced shapes,
+  ///        a config computing wrong results is dropped. see ValidationConfig.
+  void setValidation(const ValidationConfig& validation_) {
+    validation = validation_;
+  }
+
+  /// @brief replaces the configs `optimize` tries for an optimizer, by name (e.g. "Matmul").
+  void setConfigs(const std::string& optimizer, const std::vector<std::map<std::string, int>>& configs) {
+    if (auto current = configsOf(optimizer)) *current = configs;
+  }
+
+  /// @brief also tries the extra configs of an optimizer (see the constructor) after its own ones.
+  ///        the config with the lowest roofline estimate is kept, so they may replace the default.
+  void enableExtraConfigs(const std::string& optimizer) {
+    auto current = configsOf(optimizer);
+    if (!current) return;
+    auto& extra = extraConfigs[optimizer];
+    current->insert(current->end(), extra.begin(), extra.end());
+  }
+
+  void setDevice(const DeviceSpec& device_) {
+    device = device_;
+  }
+
+  /// @brief incremental mode: `optimize` only tunes the funcs whose fingerprint (signature + structure of the body)
+  ///        wasn't optimized by a previous call, and `codegen` only emits their kernels. the cache is kept until
+  ///        the mode is turned off, or until `optimize` runs with other settings (see tuningKey).
+  void setIncremental(bool incremental_) {
+    incremental = incremental_;
+    if (!incremental) clearIncremental();
+  }
+
+  void clearIncremental() {
+    for (auto& item : optimizedFuncs) {
+      item.second.erase();
+    }
+    optimizedFuncs.clear();
+    fingerprints.clear();
+    kernelCache.funcs.clear();
+  }
+
+  /// @brief the funcs the last `optimize` took from the incremental cache.
+  int getReusedFuncs() const {
+    return reusedFuncs;
+  }
+
   void setLogMode(Log level) {
     KCGLog::level = level;
   }
+
+  /// @brief debug-mode ir snapshots: the ring size, the step names to keep (substrings, empty keeps all),
+  ///        and whether each one is also printed when captured.
+  void setSnapshot(size_t capacity, const std::vector<std::string>& steps = {}, bool echo = false) {
+    KCGSnapshot::clear(this);
+    KCGSnapshot::capacity = capacity;
+    KCGSnapshot::filter = steps;
+    KCGSnapshot::echo = echo;
+  }
+
+  void dumpSnapshots(int count = -1, bool diff = false) {
+    if (diff) KCGSnapshot::printDiffs(llvm::errs(), this);
+    else KCGSnapshot::print(llvm::errs(), count, this);
+  }
 public:
   std::vector<std::unique_ptr<Optimizer>> opts;
 
 private:
-  mlir::MLIRContext context;
+  mlir::MLIRContext& context;
   mlir::OpBuilder builder;
   mlir::ModuleOp backupModule_;
   mlir::ModuleOp bestModule;
+  mlir::ModuleOp profiledModule;
   ComputeDAG graph;
   std::string platform;
+  DeviceSpec device;
+  ProfileConfig profile;
+  std::vector<KernelLaunch> launches;
+  std::vector<mlir::ModuleOp> ownedModules;
+  bool incremental = false;
+  int reusedFuncs = 0;
+  // naive func fingerprint -> its id, the "func.fingerprint" of the optimized func.
+  std::map<std::string, int64_t> fingerprints;
+  // fingerprint id -> optimized func, not in any module.
+  std::map<int64_t, mlir::func::FuncOp> optimizedFuncs;
+  KernelCache kernelCache;
+  // the tuningKey the cached funcs were optimized with.
+  std::string cachedTuningKey;
   float minLatency = FLT_MAX;
+  TuneBudget graphBudget;
+  ValidationConfig validation;
+  // the optimizers the running `optimize` applied so far and their configs, `validate` replays them.
+  std::vector<std::pair<Optimizer*, std::map<std::string, int>>> appliedOpts;
+  std::map<std::string, TuneBudget> opBudgets;
+  std::chrono::steady_clock::time_point tuneStart;
+  int tuneTrials = 0;
+  std::vector<OptimizerTiming> optimizerTimings;
+  std::vector<TuneTrial> tuneTrace;
+  double finalizeMs = 0.0;
   std::vector<std::map<std::string, int>> matmulConfigs;
   std::vector<std::map<std::string, int>> fmhaConfigs;
   std::vector<std::map<std::string, int>> binaryConfigs;
@@ -162,6 +410,20 @@ private:
   std::vector<std::map<std::string, int>> gatherConfigs;
   std::vector<std::map<std::string, int>> layerNormConfigs;
   std::vector<std::map<std::string, int>> batchMatmulConfigs;
+  // optimizer name -> the configs enableExtraConfigs adds.
+  std::map<std::string, std::vector<std::map<std::string, int>>> extraConfigs;
+
+  std::vector<std::map<std::string, int>>* configsOf(const std::string& optimizer) {
+    if (optimizer == "Matmul") return &matmulConfigs;
+    if (optimizer == "FMHA") return &fmhaConfigs;
+    if (optimizer == "Binary") return &binaryConfigs;
+    if (optimizer == "ElementWise") return &elementWiseConfigs;
+    if (optimizer == "Gather") return &gatherConfigs;
+    if (optimizer == "LayerNorm") return &layerNormConfigs;
+    if (optimizer == "BatchMatmul") return &batchMatmulConfigs;
+    llvm::errs() << "No configs for the optimizer " << optimizer << "\n";
+    return nullptr;
+  }
 };
 
 }
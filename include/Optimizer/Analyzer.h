@@ -2,43 +2,16 @@
 
 #include "IR/IR.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SetVector.h"
+
 #include <vector>
+#include <string>
 
 namespace KernelCodeGen {
 
-struct CompareLoop {
-  int operator()(const mlir::AffineForOp& x, const mlir::AffineForOp& y) const {
-    mlir::Operation* x_ptr = x;
-    mlir::Operation* y_ptr = y;
-    auto x_hashCode = reinterpret_cast<size_t>(x_ptr);
-    auto y_hashCode = reinterpret_cast<size_t>(y_ptr);
-    if (x_hashCode >= y_hashCode) return 0;
-    else return 1;
-  }
-};
-
-struct CompareFunc {
-  int operator()(const mlir::func::FuncOp& x, const mlir::func::FuncOp& y) const {
-    mlir::Operation* x_ptr = x;
-    mlir::Operation* y_ptr = y;
-    auto x_hashCode = reinterpret_cast<size_t>(x_ptr);
-    auto y_hashCode = reinterpret_cast<size_t>(y_ptr);
-    if (x_hashCode >= y_hashCode) return 0;
-    else return 1;
-  }
-};
-
-struct CompareFuncCall {
-  int operator()(const mlir::func::CallOp& x, const mlir::func::CallOp& y) const {
-    mlir::Operation* x_ptr = x;
-    mlir::Operation* y_ptr = y;
-    auto x_hashCode = reinterpret_cast<size_t>(x_ptr);
-    auto y_hashCode = reinterpret_cast<size_t>(y_ptr);
-    if (x_hashCode >= y_hashCode) return 0;
-    else return 1;
-  }
-};
-
 struct Analyzer {
   Analyzer() = default;
   static std::vector<mlir::AffineForOp> collectOutermostLoop(mlir::ModuleOp& module); 
@@ -62,12 +35,35 @@ struct Analyzer {
     }
     return result;
   }
+  /// @brief the funcs of `module` whose names have `targetFuncName` as one of their '_' separated fields
+  ///        (e.g. "Elementwise" matches "Relu_Elementwise_2_256") and are not lowered yet, all of them if it is empty.
   static std::vector<mlir::func::FuncOp> collectFunctions(mlir::ModuleOp& module, const std::string& targetFuncName = {""});
   static std::vector<mlir::AffineForOp> collectFuncLoops(mlir::func::FuncOp funcOp);
   static std::vector<mlir::func::CallOp> collectFuncCalls(mlir::ModuleOp& module);
   static mlir::func::FuncOp getTargetFunction(mlir::ModuleOp& module, const std::string& targetFuncName);
+
+  /// @brief same as above, through a symbol table built once by the caller for many lookups.
+  static mlir::func::FuncOp getTargetFunction(mlir::SymbolTable& symbolTable, const std::string& targetFuncName);
   static int getUsersNumber(mlir::Value::user_range users);
 
+  /// @brief `buffer` can be accessed by `width` wide vectors at indices multiple of `width`: its innermost stride is 1,
+  ///        and its offset, outer strides and innermost dim keep each vector in the row and aligned to its size.
+  static bool isVectorizable(mlir::Value buffer, int64_t width);
+
+  /// @brief the widest vector, at most `width`, all of `buffers` can be accessed by.
+  static int64_t getVectorWidth(const std::vector<mlir::Value>& buffers, int64_t width);
+
+  /// @brief textual form of `funcOp` with its symbol name dropped, so two funcs
+  ///        that only differ in names (of the func or of SSA values) get the same key.
+  /// @param funcOp
+  /// @return
+  static std::string getStructuralKey(mlir::func::FuncOp funcOp);
+
+  /// @brief hash of `getStructuralKey`, used to bucket candidate duplicated kernels.
+  /// @param funcOp
+  /// @return
+  static size_t getStructuralHash(mlir::func::FuncOp funcOp);
+
   template<typename OpType, typename ParentOpType>
   static OpType getLastOp(ParentOpType father) {
     auto& ops = father.getBody()->getOperations();
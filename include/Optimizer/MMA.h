@@ -0,0 +1,76 @@
+#pragma once
+
+#include "IR/IR.h"
+
+#include <string>
+#include <vector>
+
+namespace KernelCodeGen {
+
+inline int64_t floorDiv(int64_t lhs, int64_t rhs) { return lhs / rhs; }
+inline mlir::AffineExpr floorDiv(mlir::AffineExpr lhs, int64_t rhs) { return lhs.floorDiv(rhs); }
+
+/// @brief lane layouts of the warp level mma.sync.m16n8k8 tf32 fragments (PTX ISA: "Matrix Fragments for mma.m16n8k8").
+///        A is 16x8 (row major), B is 8x8 (col major), C/D is 16x8. every lane holds 4 registers of A, 2 of B and 4 of C.
+///        with lane = 4 * groupID + threadID_in_group, register r of each fragment holds:
+///        A: (groupID + 8 * (r % 2), threadID_in_group + 4 * (r / 2))
+///        B: (threadID_in_group + 4 * r, groupID)
+///        C: (groupID + 8 * (r / 2), 2 * threadID_in_group + r % 2)
+///        the formulas are templated, so the affine maps of the generated IR and the host emulation share them.
+struct MMALayout {
+  static constexpr int64_t M = 16;
+  static constexpr int64_t N = 8;
+  static constexpr int64_t K = 8;
+  static constexpr int64_t WARP_SIZE = 32;
+  static constexpr int64_t A_REGS = 4;
+  static constexpr int64_t B_REGS = 2;
+  static constexpr int64_t C_REGS = 4;
+
+  template <typename T> static T groupId(T lane) { return floorDiv(lane, 4); }
+  template <typename T> static T threadInGroup(T lane) { return lane % 4; }
+
+  template <typename T> static T rowA(T lane, T r) { return groupId(lane) + (r % 2) * 8; }
+  template <typename T> static T colA(T lane, T r) { return threadInGroup(lane) + floorDiv(r, 2) * 4; }
+  template <typename T> static T rowB(T lane, T r) { return threadInGroup(lane) + r * 4; }
+  template <typename T> static T colB(T lane, T r) { return groupId(lane); }
+  template <typename T> static T rowC(T lane, T r) { return groupId(lane) + floorDiv(r, 2) * 8; }
+  template <typename T> static T colC(T lane, T r) { return threadInGroup(lane) * 2 + r % 2; }
+
+  /// the lane computing C register `i` needs A(rowC, k): it is held by `srcLaneA` in its register `regA`.
+  template <typename T> static T srcLaneA(T lane, T i, T k) { return groupId(lane) * 4 + k % 4; }
+  template <typename T> static T regA(T i, T k) { return floorDiv(i, 2) + floorDiv(k, 4) * 2; }
+
+  /// the lane computing C register `i` needs B(k, colC): it is held by `srcLaneB` in its register `regB`.
+  template <typename T> static T srcLaneB(T lane, T i, T k) { return colC(lane, i) * 4 + k % 4; }
+  template <typename T> static T regB(T i, T k) { return floorDiv(k, 4); }
+
+  /// @brief f32 operands are fed to the tensor cores as tf32 (sm_80). the backend has no half type,
+  ///        so the f16 shapes are not generated.
+  static bool supported(mlir::Type elementA, mlir::Type elementB) {
+    return elementA.isF32() && elementB.isF32();
+  }
+
+  /// @brief extra elements per row of the [k][m] (or [k][n]) shared memory tiles, so the 4x8 lanes of a fragment load
+  ///        hit 32 different banks (what the ldmatrix swizzle gives, but the accesses stay affine).
+  static constexpr int64_t SMEM_SKEW = 8;
+
+  /// @brief host emulation of one warp wide D = A x B + C, all row major (16x8, 8x8, 16x8).
+  ///        the operands are scattered into the fragments of 32 lanes, each lane gathers its products through
+  ///        the shuffles of the generated fallback, and D is gathered back from the C fragments.
+  ///        A and B are truncated to tf32 like the tensor cores do.
+  static std::vector<float> emulate(const std::vector<float>& A, const std::vector<float>& B, const std::vector<float>& C);
+
+  /// @brief whether a block tile of `blockM` x `blockN` stepping `blockK` along k, split into warp tiles of
+  ///        `warpM` x `warpN` over `threads` threads, can be lowered to mma.sync: the operands are f32, the k steps
+  ///        are whole K steps, the warp tiles are whole 16x8 fragments and the block has one warp per warp tile.
+  ///        `reason` says which constraint doesn't hold.
+  static bool fits(int64_t blockM, int64_t blockN, int64_t blockK, int64_t warpM, int64_t warpN, int64_t threads,
+                   mlir::Type elementA, mlir::Type elementB, std::string& reason);
+
+  /// @brief checks that every lane reads, through srcLane/reg, the register actually holding the element of A and B it
+  ///        needs, then compares `emulate` with a host GEMM on random operands.
+  /// @return max abs error, 0 if the layouts are consistent, infinity if a fragment register is misplaced.
+  static float verify(int trials = 8);
+};
+
+}
@@ -26,6 +26,33 @@ struct BatchMatmulDescriptor {
 
 namespace KernelCodeGen {
 
+/// @brief maps the ops and values of a module onto its clone, so the matches `applicable` found on
+///        the module are reused by every tuning trial, which runs on a fresh clone.
+struct CloneMapping {
+  mlir::BlockAndValueMapping mapper;
+
+  mlir::Value map(mlir::Value value) const {
+    if (!value) return value;
+    return mapper.lookupOrDefault(value);
+  }
+  mlir::func::FuncOp map(mlir::func::FuncOp funcOp) const {
+    return mlir::cast<mlir::func::FuncOp>(mapper.lookup(&funcOp.front())->getParentOp());
+  }
+  mlir::AffineForOp map(mlir::AffineForOp forOp) const {
+    return mlir::cast<mlir::AffineForOp>(mapper.lookup(forOp.getBody())->getParentOp());
+  }
+  /// the calls of the graph all return a buffer.
+  mlir::func::CallOp map(mlir::func::CallOp callOp) const {
+    return mlir::cast<mlir::func::CallOp>(mapper.lookup(callOp->getResult(0)).getDefiningOp());
+  }
+  template<typename T>
+  std::vector<T> map(const std::vector<T>& items) const {
+    std::vector<T> res;
+    for (auto item : items) res.push_back(map(item));
+    return res;
+  }
+};
+
 struct Optimizer {
   virtual bool applicable(mlir::ModuleOp& module) = 0;
   virtual void applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& builder) = 0;
@@ -45,6 +72,8 @@ struct MatmulOptimizer : Optimizer {
 
   virtual bool applicable(mlir::ModuleOp& module) override;
   virtual void applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& builder) override;
+  /// @brief takes the matches of `analysis` (found on the module the trial is cloned from) over to the clone.
+  void remap(const MatmulOptimizer& analysis, const CloneMapping& mapping);
 
   mlir::AffineMap getAffineMap(const std::string& mapIdentifier, mlir::OpBuilder& builder);
 
@@ -56,12 +85,12 @@ struct MatmulOptimizer : Optimizer {
 
   // using the outermost loop represent a matmul.
   // std::set<mlir::AffineForOp, CompareLoop> matmuls;
-  std::set<mlir::func::FuncOp, CompareFunc> matmuls;
+  llvm::SetVector<mlir::func::FuncOp> matmuls;
 
 
   // Map: from outermost loop to all loops in the matmul(loopM->[loopM, loopN, loopK]).
   // std::map<mlir::AffineForOp, std::vector<mlir::AffineForOp>, CompareLoop> matmulLoops;
-  std::map<mlir::func::FuncOp, std::vector<mlir::AffineForOp>, CompareFunc> matmulLoops;
+  llvm::DenseMap<mlir::func::FuncOp, std::vector<mlir::AffineForOp>> matmulLoops;
 
 
   // Memory: A, B, C
@@ -74,7 +103,7 @@ struct MatmulOptimizer : Optimizer {
 
   // loopM->[A, B, C]
   // std::map<mlir::AffineForOp, MemoryBuffer, CompareLoop> matmulBuffers;
-  std::map<mlir::func::FuncOp, MemoryBuffer, CompareFunc> matmulBuffers;
+  llvm::DenseMap<mlir::func::FuncOp, MemoryBuffer> matmulBuffers;
 
   static std::map<std::string, int> matmulConfig;
 };
@@ -85,6 +114,7 @@ struct BinaryOptimizer : Optimizer {
   }
   virtual bool applicable(mlir::ModuleOp& module) override;
   virtual void applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& builder) override;
+  void remap(const BinaryOptimizer& analysis, const CloneMapping& mapping);
 
   mlir::AffineMap getAffineMap(const std::string& mapIdentifier, mlir::OpBuilder& builder, const std::vector<int64_t> &extras={}, 
                                 const int needDims=0, const int oneDimNums=0);
@@ -119,9 +149,9 @@ struct BinaryOptimizer : Optimizer {
     mlir::Value C;
   };
 
-  std::map<mlir::func::FuncOp, MemoryBuffer, CompareFunc> binaryBuffers;
-  std::set<mlir::func::FuncOp, CompareFunc> binarys;
-  std::map<mlir::func::FuncOp, std::vector<mlir::AffineForOp>, CompareFunc> binaryLoops;
+  llvm::DenseMap<mlir::func::FuncOp, MemoryBuffer> binaryBuffers;
+  llvm::SetVector<mlir::func::FuncOp> binarys;
+  llvm::DenseMap<mlir::func::FuncOp, std::vector<mlir::AffineForOp>> binaryLoops;
   static std::map<std::string, int> binaryConfig;
 };
 
@@ -131,6 +161,7 @@ struct ElementWiseOptimizer : Optimizer {
   }
   virtual bool applicable(mlir::ModuleOp& module) override;
   virtual void applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& builder) override;
+  void remap(const ElementWiseOptimizer& analysis, const CloneMapping& mapping);
   mlir::AffineMap getAffineMap(const std::string& mapIdentifier, mlir::OpBuilder& builder, const std::vector<int64_t> &extras={});
   void clear() {
     elementWiseBuffers.clear();
@@ -143,9 +174,9 @@ struct ElementWiseOptimizer : Optimizer {
     mlir::Value output;
   };
 
-  std::map<mlir::func::FuncOp, MemoryBuffer, CompareFunc> elementWiseBuffers;
-  std::set<mlir::func::FuncOp, CompareFunc> elementWises;
-  std::map<mlir::func::FuncOp, std::vector<mlir::AffineForOp>, CompareFunc> elementWiseLoops;
+  llvm::DenseMap<mlir::func::FuncOp, MemoryBuffer> elementWiseBuffers;
+  llvm::SetVector<mlir::func::FuncOp> elementWises;
+  llvm::DenseMap<mlir::func::FuncOp, std::vector<mlir::AffineForOp>> elementWiseLoops;
   static std::map<std::string, int> elementWiseConfig;
 };
 
@@ -155,6 +186,7 @@ struct LayerNormOptimizer : Optimizer {
   }
   virtual bool applicable(mlir::ModuleOp& module) override;
   virtual void applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& builder) override;
+  void remap(const LayerNormOptimizer& analysis, const CloneMapping& mapping);
   mlir::AffineMap getAffineMap(const std::string& mapIdentifier, mlir::OpBuilder& builder, const std::vector<int64_t> &extras={});
   mlir::AffineParallelOp combineParallel(std::vector<mlir::AffineParallelOp> pals);
   mlir::AffineForOp write(mlir::AffineForOp forOp, std::vector<mlir::Value> buffers);
@@ -176,9 +208,9 @@ struct LayerNormOptimizer : Optimizer {
     mlir::Value output;
   };
 
-  std::map<mlir::func::FuncOp, MemoryBuffer, CompareFunc> layerNormBuffers;
-  std::set<mlir::func::FuncOp, CompareFunc> layerNorms;
-  std::map<mlir::func::FuncOp, std::vector<mlir::AffineForOp>, CompareFunc> layerNormLoops;
+  llvm::DenseMap<mlir::func::FuncOp, MemoryBuffer> layerNormBuffers;
+  llvm::SetVector<mlir::func::FuncOp> layerNorms;
+  llvm::DenseMap<mlir::func::FuncOp, std::vector<mlir::AffineForOp>> layerNormLoops;
   static std::map<std::string, int> layerNormConfig;
 };
 
@@ -188,6 +220,7 @@ struct GatherOptimizer : Optimizer {
   }
   virtual bool applicable(mlir::ModuleOp& module) override;
   virtual void applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& builder) override;
+  void remap(const GatherOptimizer& analysis, const CloneMapping& mapping);
   mlir::AffineMap getAffineMap(const std::string& mapIdentifier, mlir::OpBuilder& builder, const std::vector<int64_t> &extras={});
   void oneIndexLoad(mlir::AffineForOp forOp, mlir::AffineParallelOp pal);
 
@@ -203,9 +236,9 @@ struct GatherOptimizer : Optimizer {
     mlir::Value output;
   };
 
-  std::map<mlir::func::FuncOp, MemoryBuffer, CompareFunc> gatherBuffers;
-  std::set<mlir::func::FuncOp, CompareFunc> gathers;
-  std::map<mlir::func::FuncOp, std::vector<mlir::AffineForOp>, CompareFunc> gatherLoops;
+  llvm::DenseMap<mlir::func::FuncOp, MemoryBuffer> gatherBuffers;
+  llvm::SetVector<mlir::func::FuncOp> gathers;
+  llvm::DenseMap<mlir::func::FuncOp, std::vector<mlir::AffineForOp>> gatherLoops;
   static std::map<std::string, int> gatherConfig;
 };
 
@@ -217,6 +250,7 @@ struct FMHAOptimizer : Optimizer {
 
   virtual bool applicable(mlir::ModuleOp& module) override;
   virtual void applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& builder) override;
+  void remap(const FMHAOptimizer& analysis, const CloneMapping& mapping);
 
   mlir::AffineMap getAffineMap(const std::string& mapIdentifier, mlir::OpBuilder& builder);
 
@@ -230,11 +264,11 @@ struct FMHAOptimizer : Optimizer {
   }
 
   ///< Avoid dumplicted cases.
-  std::set<mlir::func::CallOp, CompareFuncCall> uniqueFuncCalls;
+  llvm::DenseSet<mlir::func::CallOp> uniqueFuncCalls;
 
 
   // Map: from the first batched matmul call to {softmax, second batched matmul}
-  std::map<mlir::func::CallOp, std::vector<mlir::func::CallOp>, CompareFuncCall> call2callsMap;
+  llvm::MapVector<mlir::func::CallOp, std::vector<mlir::func::CallOp>> call2callsMap;
 
   // Memory: 
   struct MemoryBuffer {
@@ -247,7 +281,7 @@ struct FMHAOptimizer : Optimizer {
     BatchMatmulDescriptor matmul2;
   };
 
-  std::map<mlir::func::CallOp, MemoryBuffer, CompareFuncCall> call2bufferMap;
+  llvm::DenseMap<mlir::func::CallOp, MemoryBuffer> call2bufferMap;
 
   static std::map<std::string, int> fmhaConfig;
 };
@@ -260,6 +294,7 @@ struct BatchMatmulOptimizer : Optimizer {
 
   virtual bool applicable(mlir::ModuleOp& module) override;
   virtual void applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& builder) override;
+  void remap(const BatchMatmulOptimizer& analysis, const CloneMapping& mapping);
 
   mlir::AffineMap getAffineMap(const std::string& mapIdentifier, mlir::OpBuilder& builder, const int64_t batchNum=0);
 
@@ -277,9 +312,9 @@ struct BatchMatmulOptimizer : Optimizer {
     BatchMatmulDescriptor matmul;
   };
 
-  std::map<mlir::func::FuncOp, MemoryBuffer, CompareFunc> batchMatmulBuffers;
-  std::set<mlir::func::FuncOp, CompareFunc> batchMatmuls;
-  std::map<mlir::func::FuncOp, std::vector<mlir::AffineForOp>, CompareFunc> batchMatmulLoops;
+  llvm::DenseMap<mlir::func::FuncOp, MemoryBuffer> batchMatmulBuffers;
+  llvm::SetVector<mlir::func::FuncOp> batchMatmuls;
+  llvm::DenseMap<mlir::func::FuncOp, std::vector<mlir::AffineForOp>> batchMatmulLoops;
   static std::map<std::string, int> batchMatmulConfig;
   
 };
@@ -64,9 +64,18 @@ struct Rewriter {
   /// @param forOp 
   /// @param num_output 
   /// @param factors 
+  /// @param guardTail when the upper bound is not divisible by the largest factor, the last outer iteration
+  ///        runs over the bound; the body is then guarded by an affine.if ("affine.tail") so the nest stays
+  ///        perfect for reorder/parallel/unroll. without it the loop must be divisible.
   /// @return 
   static std::vector<mlir::AffineForOp> split(mlir::AffineForOp forOp, 
-                                              uint64_t num_output, std::vector<int64_t>&& factors);
+                                              uint64_t num_output, std::vector<int64_t>&& factors, bool guardTail = false);
+
+  /// @brief versions `forOp` on its "affine.tail" guards: if (the whole tile is in bound) {main} else {forOp}.
+  ///        the guards of main are dropped, so it can be vectorized like a divisible loop.
+  /// @param forOp the per-thread tile.
+  /// @return the main loop, or `forOp` itself when it has no guard.
+  static mlir::AffineForOp version_tail(mlir::AffineForOp forOp);
   
   /// @brief 
   /// @param loops 
@@ -77,11 +86,30 @@ struct Rewriter {
   /// @param forOp 
   static void reorder(const std::vector<mlir::AffineForOp>& forOp);
 
-  /// @brief 
+  /// @brief maps perfectly nested loops to a parallel level (blockIdx/threadIdx z, y, x).
+  ///        more than three loops are folded: the leading loops become one dim, delinearized in the body.
   /// @param forOp 
   /// @return 
   static mlir::AffineParallelOp parallel(const std::vector<mlir::AffineForOp>& forOp);
 
+  /// @brief when the grid is over `maxBlocks` (or a dim is over the hardware limit), launches min(grid, `maxBlocks`)
+  ///        1-D blocks, rounded down to a multiple of `smCount`, which stride over the old grid. the old block indexes are delinearized
+  ///        from (stride * gridDim.x + blockIdx.x), the block levels (also those in a grid coarsening loop) are
+  ///        guarded when the last stride is partial.
+  /// @param gridLevel 
+  /// @param maxBlocks 
+  /// @param smCount 
+  /// @return the new grid level, or `gridLevel` itself when it isn't capped or can't be guarded.
+  static mlir::AffineParallelOp grid_stride(mlir::AffineParallelOp gridLevel, int64_t maxBlocks, int64_t smCount);
+
+  /// @brief divides the x dim of `parallelOp` by `factor`, each block/thread runs `factor` of the old ones
+  ///        in a loop. the old index is (i * newExtent + x), so neighbouring threads still touch neighbouring
+  ///        tiles in every iteration (coalescing is kept).
+  /// @param parallelOp grid or block level.
+  /// @param factor 
+  /// @return the coarsening loop, null when `factor` <= 1 or doesn't divide the dim.
+  static mlir::AffineForOp coarsen(mlir::AffineParallelOp parallelOp, int64_t factor);
+
   /// @brief 
   /// @param parallelLevel 
   /// @param ms 
@@ -161,7 +189,8 @@ struct Rewriter {
   /// @return 
   static mlir::gpu::BarrierOp barrier(mlir::AffineForOp compute_at, Position pos);
 
-  /// @brief 
+  /// @brief turns the loads and stores of `readOrWrite` into `width` wide vector accesses. the loop is left scalar
+  ///        if one of its global buffers is a view that can't be accessed by such vectors (see Analyzer::isVectorizable).
   /// @param readOrWrite 
   /// @param width 
   /// @return 
@@ -190,13 +219,50 @@ struct Rewriter {
   static std::vector<std::vector<mlir::AffineForOp>> get_write(mlir::AffineParallelOp parallelLevel, mlir::Value dst);
 
 
-  /// @brief double buffer for `buffer`, and pipeline for `readBody`. all of them are computead at `compute_at`
+  /// @brief multi buffer (`stages` copies) for `buffer`, and pipeline for `readBody`. all of them are computead at `compute_at`
   /// @param readBody 
   /// @param buffer 
   /// @param compute_at 
-  /// @return
-  static std::vector<std::vector<mlir::AffineForOp>> pipeline(std::vector<mlir::AffineForOp> readBodys, mlir::Value& buffer, mlir::AffineForOp compute_at);
-
+  /// @param stages number of buffers, the loop prefetches `stages - 1` iterations ahead.
+  /// @return {prologue bodies of every stage, bodies in the loop}
+  static std::vector<std::vector<mlir::AffineForOp>> pipeline(std::vector<mlir::AffineForOp> readBodys, mlir::Value& buffer, mlir::AffineForOp compute_at, int64_t stages = 2);
+
+  /// @brief pipeline the global->register->shared copies (`loads[i]`, `stores[i]` fill `buffers[i]`) together:
+  ///        the prologue ends with `prefix`, the loads of next tiles are issued before `compute`, 
+  ///        and the stores (followed by `suffix`) are placed after it.
+  /// @return {prologue, loads and stores in the loop}
+  static std::vector<std::vector<mlir::AffineForOp>> pipeline(std::vector<mlir::AffineForOp> loads, std::vector<mlir::AffineForOp> stores,
+    std::vector<mlir::Value>& buffers, mlir::AffineForOp compute_at, mlir::Operation* compute, 
+    mlir::gpu::BarrierOp prefix, mlir::gpu::BarrierOp suffix, int64_t stages);
+
+  /// @brief fuse the register staged copy (`load`: global->register, `store`: register->shared) into
+  ///        a direct global->shared copy, which is emitted as cp.async. the register buffer is erased if unused.
+  /// @param load 
+  /// @param store 
+  /// @return the fused copy, placed at `load`.
+  static mlir::AffineForOp async_copy(mlir::AffineForOp load, mlir::AffineForOp store);
+
+  /// @brief pipeline the async copies filling `buffers`: the prologue is waited by `prefix`, copies of next tiles
+  ///        are issued before `compute`, and `suffix` (after `compute`) commits them and waits for the next tile.
+  /// @return {prologue, copies in the loop}
+  static std::vector<std::vector<mlir::AffineForOp>> async_pipeline(std::vector<mlir::AffineForOp> copies,
+    std::vector<mlir::Value>& buffers, mlir::AffineForOp compute_at, mlir::Operation* compute, 
+    mlir::gpu::BarrierOp prefix, mlir::gpu::BarrierOp suffix, int64_t stages);
+
+  /// @brief warp-specialize the block: `producerWarps` warps are appended to the block and do all the `copies`
+  ///        (global->shared, in order) into a ring of `stages` buffers, the original threads only compute.
+  ///        the handoff is done by named barriers: full[s] (producers arrive, consumers sync) and
+  ///        empty[s] (consumers arrive, producers sync), `prefix` and `suffix` are erased.
+  /// @param blockLevel 
+  /// @param compute_at the loop over tiles, its body computes on the buffers.
+  /// @param copies the copy loops in `compute_at`, indexed by the thread ids of `blockLevel`.
+  /// @param async the copies are cp.async, the producers wait for them before they arrive.
+  /// @return the role if: {producers} else {consumers}
+  static mlir::AffineIfOp warp_specialize(mlir::AffineParallelOp blockLevel, mlir::AffineForOp compute_at, 
+    std::vector<mlir::AffineForOp> copies, std::vector<mlir::Value>& buffers, mlir::gpu::BarrierOp prefix, 
+    mlir::gpu::BarrierOp suffix, int64_t stages, int64_t producerWarps, int64_t warpSize, bool async);
+
+  /// @brief make the reads of pipelined `buffer` in `scope` select the next stage.
   static void change_double_buffer(mlir::AffineForOp, mlir::Value buffer);
 
   /// @brief 
@@ -215,21 +281,60 @@ struct Rewriter {
   /// @param pos 
   static void extract_loop(mlir::Operation* srcOp, mlir::AffineForOp forOp, int64_t iteration);
 
-  /// @brief 
-  /// @param op 
-  static void take_off_true_if(mlir::ModuleOp module);
-
-  /// @brief 
-  /// @param op 
-  static void delete_false_if(mlir::ModuleOp module);
+  /// @brief takes off the ifs which are always true and deletes (or replaces by their else) the ifs which are
+  ///        always false, decided by the bounds of their operands. both rewrites run in one greedy driver
+  ///        limited to the ifs of `scope` (usually the func being optimized).
+  /// @param scope 
+  static void simplify_if(mlir::Operation* scope);
 
   /// @brief 
   /// @param forOp 
-  static void unroll(mlir::ModuleOp module, mlir::function_ref<bool(mlir::AffineForOp)> unrollCheckFn);
+  static void unroll(mlir::Operation* scope, mlir::function_ref<bool(mlir::AffineForOp)> unrollCheckFn);
 
   /// @brief 
   /// @param forOp 
-  static void unrollAttribute(mlir::ModuleOp module, mlir::function_ref<bool(mlir::AffineForOp)> unrollCheckFn);
+  static void unrollAttribute(mlir::Operation* scope, mlir::function_ref<bool(mlir::AffineForOp)> unrollCheckFn);
+
+  /// @brief merge the funcs which are structurally identical (differ only in names),
+  ///        redirect their calls to the first one, so each unique kernel is emitted once.
+  /// @param module
+  /// @return number of erased funcs.
+  static int deduplicate_kernels(mlir::ModuleOp module);
+
+  /// @brief fast-math for the funcs tagged "func.fast_math" (or all of them if the module is tagged "compute_dag.fast_math").
+  ///        at the IR level x / sqrt(y) becomes x * rsqrt(y) and a * b + c becomes fma(a, b, c); the f32 exp, tanh, log,
+  ///        pow and div are tagged "fast.math" and emitted as intrinsics. error bounds (CUDA math API, sm_70+):
+  ///        fma: one rounding instead of two, <= 0.5 ulp.
+  ///        rsqrtf: 2 ulp.
+  ///        exp2f(x * log2e): 2 ulp + the rounding of the prescale, |x| * 2^-24 relative (~1e-5 at the fp32 range end).
+  ///        __fdividef: 2 ulp for |y| in [2^-126, 2^126], 0 for larger |y|.
+  ///        __logf: 2^-21.41 absolute for x in [0.5, 2], relative outside.
+  ///        __powf: __exp2f(y * __log2f(x)), the error grows with |y * log2(x)|.
+  ///        tanh as 1 - 2 / (exp2(2x * log2e) + 1): ~2^-22 absolute, the relative error is large only around 0,
+  ///        where the GELU multiplies it by x.
+  /// @param module
+  /// @return number of rewritten or tagged ops.
+  static int fast_math(mlir::ModuleOp module);
+
+  /// @brief tags `op` and everything nested in it with the phase it belongs to, for the ops the backend
+  ///        can't classify by their memory accesses (e.g. the softmax of FMHA).
+  static void set_phase(mlir::Operation* op, Phase phase);
+
+  /// @brief puts the begin/end markers of the in-kernel phase timers around the runs of ops of one phase:
+  ///        staging (global -> local -> shared, cp.async), barriers, compute (fragment loads, arithmetic, mma),
+  ///        epilogue (stores to global) and the tagged phases. an op mixing phases isn't timed as a whole,
+  ///        its body is. the markers are arith.constant tagged "profile.begin"/"profile.end", run it on a copy.
+  /// @param module
+  /// @return number of timed regions.
+  static int profile_phases(mlir::ModuleOp module);
+
+  /// @brief promote the local buffers to registers after unrolling: when every access of a buffer folds to
+  ///        constant indices, the accesses get constant maps and the alloc is marked "memory.scalar", so the
+  ///        backend declares one scalar per element. indices resolved only by #pragma unroll are accepted as is.
+  ///        a buffer indexed by anything else is marked "memory.dynamic" (it would live in local memory).
+  /// @param funcOp the optimized kernel, the other kernels of the module may index their registers at runtime.
+  /// @return number of dynamically indexed buffers, the tuner rejects the config if it isn't 0.
+  static int scalar_replace(mlir::func::FuncOp funcOp);
 
   /// @brief 
   /// @param module 
@@ -242,6 +347,14 @@ struct Rewriter {
   static mlir::AffineForOp outer_product(mlir::OpBuilder& builder, mlir::Value tileC, 
     mlir::Value fragA, mlir::Value fragB, int64_t m, int64_t n);
 
+  /// @brief warp level tileC += fragA x fragB with mma.sync.m16n8k8, see MMALayout for the fragment layouts.
+  ///        tileC is [2 * mTiles][2 * nTiles], fragA holds 4 registers per m tile, fragB 2 per n tile.
+  ///        the loop of the C registers is tagged `affine.mma` for the backend, its body is the shuffle fallback.
+  /// @param laneMap map of `operands` to the lane id in the warp.
+  /// @return the outermost loop.
+  static mlir::AffineForOp mma(mlir::OpBuilder& builder, mlir::Value tileC, mlir::Value fragA, mlir::Value fragB,
+    mlir::AffineMap laneMap, llvm::SmallVector<mlir::Value> operands, int64_t mTiles, int64_t nTiles);
+
   /*----------------------------------------------------------------*/
   
   static std::vector<mlir::AffineForOp> combineToTowDim(std::vector<mlir::AffineForOp> loops);
@@ -0,0 +1,55 @@
+#pragma once
+#include "IR/IR.h"
+#include "log.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace KernelCodeGen {
+
+/// @brief debug-mode ir snapshots of the optimizers. a step clones only the func it transforms into a
+///        bounded ring, the text is printed lazily, on a verification failure or on request.
+struct KCGSnapshot {
+  struct Entry {
+    int64_t id;
+    std::string step;
+    std::string scope;
+    mlir::Operation* ir;
+    /// the generator the snapshot was captured for.
+    const void* owner;
+  };
+
+  /// @brief keeps a copy of `scope` (a func, or the module) after `step`, if debug logging is on
+  ///        and the step passes the filter. the oldest snapshot is dropped when the ring is full.
+  static void capture(mlir::Operation* scope, const std::string& step);
+
+  /// @brief prints the last `count` snapshots of `owner_`, all of them if count < 0.
+  static void print(llvm::raw_ostream& os, int count = -1, const void* owner_ = owner);
+
+  /// @brief line diff of snapshot `id` against the previous snapshot of the same scope and owner.
+  static void diff(llvm::raw_ostream& os, int64_t id);
+
+  /// @brief the diffs of every snapshot of `owner_` in the ring, oldest first.
+  static void printDiffs(llvm::raw_ostream& os, const void* owner_ = owner);
+
+  static const std::deque<Entry>& entries() { return ring; }
+
+  /// @brief frees the snapshots of `owner_`, the other generators keep theirs.
+  static void clear(const void* owner_);
+
+  /// @brief the generator the next snapshots are captured for, set by it when it starts optimizing.
+  static const void* owner;
+
+  static size_t capacity;
+  /// @brief substrings of the step names to keep, empty keeps every step.
+  static std::vector<std::string> filter;
+  /// @brief also prints each snapshot when it's captured.
+  static bool echo;
+
+private:
+  static std::deque<Entry> ring;
+  static int64_t nextId;
+};
+
+}
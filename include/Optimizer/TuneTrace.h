@@ -0,0 +1,46 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace KernelCodeGen {
+
+/// @brief one config of one optimizer in `optimize`, in the order they were considered.
+struct TuneTrial {
+  std::string optimizer;
+  /// position of the config in the list of the optimizer.
+  int index = 0;
+  std::map<std::string, int> config;
+  bool applicable = true;
+  /// "ok", "failed", "pruned", "skipped" or "not_applicable", `reason` says why it isn't "ok".
+  std::string status;
+  std::string reason;
+  /// since the start of `optimize`.
+  double startMs = 0.0;
+  /// the match runs once per optimizer, it is on the first config only.
+  double matchMs = 0.0;
+  double transformMs = 0.0;
+  double evaluateMs = 0.0;
+  /// a config about to become the best is checked against the naive funcs when validation is on: "passed",
+  /// "mismatch" (the trial failed) or "unvalidated: <why>", empty if it wasn't checked.
+  std::string validation;
+  double validateMs = 0.0;
+  /// roofline estimates (us) of the kernels of the optimizer, negative if there is none.
+  double latencyUs = -1.0;
+  double bestUs = -1.0;
+  double boundUs = -1.0;
+};
+
+/// @brief the trials as json lines, one object per trial.
+std::string TuneTraceJsonl(const std::vector<TuneTrial>& trials);
+
+/// @brief the trials in the chrome trace event format (chrome://tracing, perfetto): one track per optimizer,
+///        with its match, transform, evaluation and validation slices.
+std::string TuneChromeTrace(const std::vector<TuneTrial>& trials);
+
+/// @brief per optimizer: the best-so-far estimate after each trial, where the best was found, the gap to
+///        the roofline bound and where the time went, as json.
+std::string TuneConvergenceReport(const std::vector<TuneTrial>& trials);
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "IR/IR.h"
+
+#include <map>
+
+namespace KernelCodeGen {
+
+/// @brief chooses how every constant loop is unrolled: fully in the IR (Rewriter::unroll), fully or partially
+///        by the backend (#pragma unroll [N]), or not at all (#pragma unroll 1), so that the estimated size of
+///        each kernel stays under a budget. the budget is the "UNROLL_BUDGET" of the optimizer configs, counted in
+///        estimated instructions (the default 8192 is about the 128KB of SASS the instruction cache holds).
+struct UnrollPlanner {
+  struct Decision {
+    int64_t tripCount;
+    /// tripCount: full unroll, 1: rolled.
+    int64_t factor;
+    /// the full unroll is done on the IR.
+    bool inIR;
+  };
+
+  /// @brief plans the loops which have no "affine.loop" attribute yet and applies the plan:
+  ///        trip count < `fullLimit` is unrolled in the IR, trip count <= `pragmaLimit` by #pragma unroll.
+  ///        while a kernel is over `budget`, the loop whose demotion (to the next smaller divisor of its trip count)
+  ///        saves the most is demoted. a budget <= 0 means no budget.
+  /// @param scope the func being optimized, or a module to plan all of its funcs.
+  /// @return estimated size of the largest kernel.
+  static int64_t plan(mlir::Operation* scope, int64_t fullLimit, int64_t pragmaLimit, int64_t budget);
+
+  /// @brief estimated number of instructions emitted for `op`. the loops without a decision are
+  ///        read from their attributes.
+  static int64_t estimate(mlir::Operation* op, const std::map<mlir::Operation*, Decision>& decisions = {});
+};
+
+}
@@ -28,4 +28,14 @@ enum class Layout {
   colMajor = 1,
 };
 
+// The phases the in-kernel timers tell apart.
+enum class Phase {
+  stage = 0,
+  barrier = 1,
+  compute = 2,
+  epilogue = 3,
+  softmax = 4,
+  count = 5,
+};
+
 }
\ No newline at end of file
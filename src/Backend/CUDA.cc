@@ -1,9 +1,11 @@
 #include "IR/IR.h"
 #include "Optimizer/Analyzer.h"
+#include "Optimizer/MMA.h"
 #include "Backend/CUDA.h"
 #include "enum.h"
 #include "log.h"
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/Twine.h"
 #include "llvm/ADT/TypeSwitch.h"
 #include "llvm/Support/raw_ostream.h"
@@ -23,35 +25,11 @@ int64_t kernelCounter = 0;
 
 int64_t varCounter = 0;
 
-struct CompareValue {
-  int operator()(const mlir::Value& x, const mlir::Value& y) const {
-    // auto x_hashCode = reinterpret_cast<size_t>(&x);
-    // auto y_hashCode = reinterpret_cast<size_t>(&y);
-    // if (x_hashCode >= y_hashCode) return 0;
-    if (x == y) return 0;
-    auto x_hashCode = x.getAsOpaquePointer();
-    auto y_hashCode = y.getAsOpaquePointer();
-    if (x_hashCode >= y_hashCode) return 0;
-    else return 1;
-  }
-};
-
-struct CompareKernel {
-  int operator()(const mlir::AffineParallelOp& x, const mlir::AffineParallelOp& y) const {
-    mlir::Operation* x_ptr = x;
-    mlir::Operation* y_ptr = y;
-    auto x_hashCode = reinterpret_cast<size_t>(x_ptr);
-    auto y_hashCode = reinterpret_cast<size_t>(y_ptr);
-    if (x_hashCode >= y_hashCode) return 0;
-    else return 1;
-  }
-};
-
 std::stringstream source;
 
-std::map<mlir::Value, std::string, CompareValue> valueNameMap;
+llvm::DenseMap<mlir::Value, std::string> valueNameMap;
 
-std::map<mlir::AffineParallelOp, std::string, CompareKernel> kernelNameMap;
+llvm::DenseMap<mlir::AffineParallelOp, std::string> kernelNameMap;
 
 std::string getKernelName() {
   return std::string("kernel") + std::to_string(kernelCounter++);
@@ -91,7 +69,8 @@ struct Indent {
 /// the way. The only data member is the current indentation level.
 class CUDAGenerator {
 public:
-  CUDAGenerator() {
+  CUDAGenerator(std::vector<KernelLaunch>* launches_ = nullptr, const ProfileConfig& profile_ = {}, KernelCache* cache_ = nullptr)
+    : launches(launches_), profile(profile_), cache(cache_) {
     kernelCounter = 0;
     varCounter = 0;
     valueNameMap.clear();
@@ -107,6 +86,7 @@ private:
   void codegen(mlir::arith::ConstantIntOp);
   void codegen(mlir::arith::MulFOp);
   void codegen(mlir::arith::AddFOp);
+  void codegen(mlir::math::FmaOp);
   void codegen(mlir::arith::MaxFOp);
   void codegen(mlir::arith::SubFOp);
   void codegen(mlir::arith::DivFOp);
@@ -114,13 +94,16 @@ private:
   void codegen(mlir::arith::CmpFOp);
   void codegen(mlir::math::TanhOp);
   void codegen(mlir::math::SqrtOp);
+  void codegen(mlir::math::RsqrtOp);
   void codegen(mlir::math::LogOp);
   void codegen(mlir::arith::BitcastOp);
+  void codegen(mlir::arith::IndexCastOp);
   void codegen(mlir::math::ExpOp);
   void codegen(mlir::memref::AllocOp);
   void codegen(mlir::AffineApplyOp);
   void codegen(mlir::AffineIfOp);
   void codegen(mlir::AffineForOp);
+  void codegenMMA(mlir::AffineForOp);
   void codegen(mlir::AffineLoadOp);
   void codegen(mlir::memref::LoadOp);
   void codegen(mlir::AffineStoreOp);
@@ -132,6 +115,13 @@ private:
   void codegen(mlir::func::FuncOp);
   void codegen(mlir::AffineMap, const llvm::SmallVector<mlir::Value>&);
   std::string codegen(mlir::AffineExpr, const llvm::SmallVector<mlir::Value>&);
+  std::string codegenGlobalIndex(mlir::MemRefType, llvm::ArrayRef<mlir::AffineExpr>, const llvm::SmallVector<mlir::Value>&, int64_t element = 0);
+  void codegenProfileRecord(const std::vector<int64_t>& blockDims);
+  std::vector<KernelLaunch>* launches;
+  ProfileConfig profile;
+  KernelCache* cache;
+  // the cached kernel the next codegen(AffineParallelOp) replays.
+  const KernelCache::Kernel* replay = nullptr;
 
   // Actually print spaces matching the current indentation level
   void indent() {
@@ -171,6 +161,10 @@ void varDeclear(mlir::Value var) {
   if (memorySpace == static_cast<int>(MemorySpace::global)) {
     // llvm::errs() << getContinusStar(dims.size()) << " " << varName;
     source << getContinusStar(1) << " " << varName;
+  } else if (op && op->hasAttr(std::string("memory.scalar"))) {
+    for (int64_t i = 0; i < memrefType.getNumElements(); i++) {
+      source << (i == 0 ? " " : ", ") << varName << "_" << i;
+    }
   } else {
     source << " " << varName;
     for (int i = 0; i < dims.size(); i++) {
@@ -179,6 +173,45 @@ void varDeclear(mlir::Value var) {
   }
 }
 
+/// @brief the local buffer is promoted to scalars by Rewriter::scalar_replace.
+bool isScalarBuffer(mlir::Value mem) {
+  auto op = mem.getDefiningOp();
+  return op && op->hasAttr(std::string("memory.scalar"));
+}
+
+/// @brief name of the scalar holding the element at the constant indices (row major linearized), plus `offset`.
+std::string getScalarName(mlir::Value mem, llvm::ArrayRef<mlir::AffineExpr> exprs, int64_t offset = 0) {
+  auto shape = mem.getType().dyn_cast<mlir::MemRefType>().getShape();
+  int64_t index = 0;
+  for (int i = 0; i < exprs.size(); i++) {
+    auto constExpr = exprs[i].dyn_cast<mlir::AffineConstantExpr>();
+    if (!constExpr) {
+      llvm::errs() << "Scalar buffer is accessed with non-constant indices\n";
+      assert(false);
+    }
+    index = index * shape[i] + constExpr.getValue();
+  }
+  return getValueName(mem) + "_" + std::to_string(index + offset);
+}
+
+/// @brief strides (in elements) and offset of a global memref. The layout map is honored,
+///        so views (slices, splits, parts of a concat) are addressed in place.
+/// @param type 
+/// @param offset 
+/// @return 
+std::vector<int64_t> getGlobalStrides(mlir::MemRefType type, int64_t& offset) {
+  llvm::SmallVector<int64_t> strides;
+  if (mlir::failed(mlir::getStridesAndOffset(type, strides, offset))) {
+    llvm::errs() << "Only strided layout is supported for global memory\n";
+    assert(false);
+  }
+  assert(!mlir::ShapedType::isDynamicStrideOrOffset(offset));
+  for (auto stride : strides) {
+    assert(!mlir::ShapedType::isDynamicStrideOrOffset(stride));
+  }
+  return std::vector<int64_t>(strides.begin(), strides.end());
+}
+
 /// @brief collect value and its name to valueNameMap
 /// @param node 
 /// @return return the operands not defined in the `node`'s scope.
@@ -186,7 +219,7 @@ std::vector<mlir::Value> collectVars(mlir::AffineParallelOp node) {
 
   std::vector<std::string> int3str {"x", "y", "z"};
   int id = 0;
-  std::map<mlir::Value, int, CompareValue> outsidesVars;
+  llvm::DenseMap<mlir::Value, int> outsidesVars;
 
   //parallel index
   node.walk<mlir::WalkOrder::PreOrder>([&](mlir::AffineParallelOp parallelOp) {
@@ -312,6 +345,11 @@ std::vector<mlir::Value> collectVars(mlir::AffineParallelOp node) {
     setValueName(result, "temp" + std::to_string(tempCounter++));
   });
 
+  node.walk<mlir::WalkOrder::PreOrder>([&](mlir::math::FmaOp fmaOp) {
+    auto result = fmaOp.getResult();
+    setValueName(result, "temp" + std::to_string(tempCounter++));
+  });
+
   node.walk<mlir::WalkOrder::PreOrder>([&](mlir::arith::MaxFOp maxOp) {
     auto result = maxOp.getResult();
     setValueName(result, "temp" + std::to_string(tempCounter++));
@@ -352,6 +390,11 @@ std::vector<mlir::Value> collectVars(mlir::AffineParallelOp node) {
     setValueName(result, "temp" + std::to_string(tempCounter++));
   });
 
+  node.walk<mlir::WalkOrder::PreOrder>([&](mlir::math::RsqrtOp rsqrtOp) {
+    auto result = rsqrtOp.getResult();
+    setValueName(result, "temp" + std::to_string(tempCounter++));
+  });
+
   node.walk<mlir::WalkOrder::PreOrder>([&](mlir::math::LogOp logOp) {
     auto result = logOp.getResult();
     setValueName(result, "temp" + std::to_string(tempCounter++));
@@ -362,6 +405,11 @@ std::vector<mlir::Value> collectVars(mlir::AffineParallelOp node) {
     setValueName(result, "temp" + std::to_string(tempCounter++));
   });
 
+  node.walk<mlir::WalkOrder::PreOrder>([&](mlir::arith::IndexCastOp castOp) {
+    auto result = castOp.getResult();
+    setValueName(result, "temp" + std::to_string(tempCounter++));
+  });
+
   node.walk<mlir::WalkOrder::PreOrder>([&](mlir::gpu::ShuffleOp shflOp) {
     auto result = shflOp.getResult(0);
     setValueName(result, "temp" + std::to_string(tempCounter++));
@@ -384,7 +432,30 @@ void CUDAGenerator::codegen(mlir::memref::AllocOp allocOp) {
   source << ";\n";
 }
 
-void CUDAGenerator::codegen(mlir::gpu::BarrierOp) {
+void CUDAGenerator::codegen(mlir::gpu::BarrierOp barrierOp) {
+  if (barrierOp->hasAttr(std::string("async.wait"))) {
+    // commit the cp.async issued so far as one group, then wait until at most N groups are in flight.
+    auto groups = barrierOp->getAttr(std::string("async.wait")).dyn_cast<mlir::IntegerAttr>().getInt();
+    indent();
+    source << "asm volatile(\"cp.async.commit_group;\\n\" ::);\n";
+    indent();
+    source << "asm volatile(\"cp.async.wait_group " << groups << ";\\n\" ::);\n";
+  }
+  if (barrierOp->hasAttr(std::string("barrier.id"))) {
+    // named barrier shared by a subset of warps (warp specialization).
+    auto id = barrierOp->getAttr(std::string("barrier.id")).dyn_cast<mlir::IntegerAttr>().getInt();
+    auto count = barrierOp->getAttr(std::string("barrier.count")).dyn_cast<mlir::IntegerAttr>().getInt();
+    indent();
+    if (barrierOp->hasAttr(std::string("barrier.arrive"))) {
+      // bar.arrive doesn't wait, make the shared memory accesses visible first.
+      source << "__threadfence_block();\n";
+      indent();
+      source << "asm volatile(\"bar.arrive " << id << ", " << count << ";\\n\" ::: \"memory\");\n";
+    } else {
+      source << "asm volatile(\"bar.sync " << id << ", " << count << ";\\n\" ::: \"memory\");\n";
+    }
+    return;
+  }
   indent();
   source << "__syncthreads();\n";
 }
@@ -433,6 +504,19 @@ std::string CUDAGenerator::codegen(mlir::AffineExpr expr, const llvm::SmallVecto
 }
 void CUDAGenerator::codegen(mlir::AffineMap map, const llvm::SmallVector<mlir::Value>& operands) {}
 
+/// @brief `element` is added to the innermost index, it addresses one element of a vector access.
+std::string CUDAGenerator::codegenGlobalIndex(mlir::MemRefType type, llvm::ArrayRef<mlir::AffineExpr> exprs, 
+                                              const llvm::SmallVector<mlir::Value>& operands, int64_t element) {
+  int64_t offset;
+  auto strides = getGlobalStrides(type, offset);
+  std::string result = "[";
+  for (int i = 0; i < exprs.size(); i++) {
+    result += this->codegen(exprs[i], operands) + " * " + std::to_string(strides[i]) + " + ";
+  }
+  result += std::to_string(offset + element * strides.back()) + "]";
+  return result;
+}
+
 void CUDAGenerator::codegen(mlir::AffineApplyOp applyOp) {
   auto map = applyOp.getAffineMap();
   auto operands = applyOp.getMapOperands();
@@ -461,6 +545,19 @@ void CUDAGenerator::codegen(mlir::arith::ConstantFloatOp floatOp) {
 }
 
 void CUDAGenerator::codegen(mlir::arith::ConstantIntOp intOp) {
+  // the phase markers of Rewriter::profile_phases.
+  if (intOp->hasAttr(std::string("profile.begin"))) {
+    if (!profile.enable) return;
+    indent();
+    source << "kcg_t = clock64();\n";
+    return;
+  }
+  if (auto phase = intOp->getAttrOfType<mlir::IntegerAttr>(std::string("profile.end"))) {
+    if (!profile.enable) return;
+    indent();
+    source << "kcg_phase[" << phase.getInt() << "] += clock64() - kcg_t;\n";
+    return;
+  }
   auto eleT = intOp.getType();
   indent();
   source << "constexpr " << toCStr(eleT) << " "
@@ -481,6 +578,15 @@ void CUDAGenerator::codegen(mlir::arith::AddFOp addOp) {
                << getValueName(addOp.getLhs()) << " + "
                << getValueName(addOp.getRhs()) << ";\n";
 }
+void CUDAGenerator::codegen(mlir::math::FmaOp fmaOp) {
+  indent();
+  std::string func = fmaOp.getType().isF32() ? "fmaf(" : "fma(";
+  source << "auto " << getValueName(fmaOp.getResult()) << " = " << func
+               << getValueName(fmaOp.getA()) << ", "
+               << getValueName(fmaOp.getB()) << ", "
+               << getValueName(fmaOp.getC()) << ");\n";
+}
+
 void CUDAGenerator::codegen(mlir::arith::MaxFOp maxOp) {
   indent();
   source << "auto " << getValueName(maxOp.getResult()) << " = max("
@@ -494,8 +600,19 @@ void CUDAGenerator::codegen(mlir::arith::SubFOp subOp) {
                << getValueName(subOp.getRhs()) << ";\n";
 }
 
+/// @brief tagged by Rewriter::fast_math, the error bounds are listed there.
+bool isFastMath(mlir::Operation* op) {
+  return op->hasAttr(std::string("fast.math"));
+}
+
 void CUDAGenerator::codegen(mlir::arith::DivFOp divOp) {
   indent();
+  if (isFastMath(divOp)) {
+    source << "auto " << getValueName(divOp.getResult()) << " = __fdividef("
+                 << getValueName(divOp.getLhs()) << ", "
+                 << getValueName(divOp.getRhs()) << ");\n";
+    return;
+  }
   source << "auto " << getValueName(divOp.getResult()) << " = "
                << getValueName(divOp.getLhs()) << " / "
                << getValueName(divOp.getRhs()) << ";\n";
@@ -503,13 +620,20 @@ void CUDAGenerator::codegen(mlir::arith::DivFOp divOp) {
 
 void CUDAGenerator::codegen(mlir::math::PowFOp powOp) {
   indent();
-  source << "auto " << getValueName(powOp.getResult()) << " = powf("
+  std::string func = isFastMath(powOp) ? "__powf(" : "powf(";
+  source << "auto " << getValueName(powOp.getResult()) << " = " << func
                << getValueName(powOp.getLhs()) << ", "
                << getValueName(powOp.getRhs()) << ");\n";
 }
 
 void CUDAGenerator::codegen(mlir::math::TanhOp tanhOp) {
   indent();
+  if (isFastMath(tanhOp)) {
+    // tanh(x) = 1 - 2 / (e^2x + 1), saturates to +-1 without inf / inf.
+    source << "auto " << getValueName(tanhOp.getResult()) << " = 1.0f - __fdividef(2.0f, exp2f(2.885390082f * "
+                 << getValueName(tanhOp.getOperand()) << ") + 1.0f);\n";
+    return;
+  }
   source << "auto " << getValueName(tanhOp.getResult()) << " = tanhf("
                << getValueName(tanhOp.getOperand()) << ");\n";
 }
@@ -520,9 +644,16 @@ void CUDAGenerator::codegen(mlir::math::SqrtOp sqrtOp) {
                << getValueName(sqrtOp.getOperand()) << ");\n";
 }
 
+void CUDAGenerator::codegen(mlir::math::RsqrtOp rsqrtOp) {
+  indent();
+  source << "auto " << getValueName(rsqrtOp.getResult()) << " = rsqrtf("
+               << getValueName(rsqrtOp.getOperand()) << ");\n";
+}
+
 void CUDAGenerator::codegen(mlir::math::LogOp logOp) {
   indent();
-  source << "auto " << getValueName(logOp.getResult()) << " = logf("
+  std::string func = isFastMath(logOp) ? "__logf(" : "logf(";
+  source << "auto " << getValueName(logOp.getResult()) << " = " << func
                << getValueName(logOp.getOperand()) << ");\n";
 }
 
@@ -539,6 +670,12 @@ void CUDAGenerator::codegen(mlir::arith::BitcastOp castOp) {
                 << getValueName(castOp.getOperand()) << ");\n";
 }
 
+void CUDAGenerator::codegen(mlir::arith::IndexCastOp castOp) {
+  indent();
+  source << "int " << getValueName(castOp.getResult()) << " = "
+               << getValueName(castOp.getIn()) << ";\n";
+}
+
 void CUDAGenerator::codegen(mlir::arith::CmpFOp cmpOp) {
   indent();
   auto cmp_type = cmpOp.getPredicate();
@@ -558,6 +695,12 @@ void CUDAGenerator::codegen(mlir::arith::CmpFOp cmpOp) {
 
 void CUDAGenerator::codegen(mlir::math::ExpOp expOp) {
   indent();
+  if (isFastMath(expOp)) {
+    // e^x = 2^(x * log2e), exp2f is a single ex2.approx.
+    source << "auto " << getValueName(expOp.getResult()) << " = exp2f(1.442695041f * "
+                 << getValueName(expOp.getOperand()) << ");\n";
+    return;
+  }
   source << "auto " << getValueName(expOp.getResult()) << " = exp("
                << getValueName(expOp.getOperand()) << ");\n";
 }
@@ -566,62 +709,86 @@ void CUDAGenerator::codegen(mlir::AffineIfOp ifOp) {
   auto iset = ifOp.getIntegerSet();
   int numConstraints = iset.getNumConstraints();
   auto operands = ifOp.getOperands();
-  indent();
-  source << "if (";
-  for (int i = 0; i < numConstraints; i += 1) {
-    auto expr = iset.getConstraint(i);
-    auto isEq = iset.isEq(i);
-    std::string relation = isEq ? "==" : ">=";
-    source << this->codegen(expr, operands) << " " << relation << " 0 && ";
-  }
-  source << " true) {\n";
-  {
+  auto codegenBlock = [&](mlir::Block* block) {
     INDENT();
-    auto& ops = ifOp.getBody()->getOperations();
+    auto& ops = block->getOperations();
     for (auto& op : ops) {
       if (auto forOp = mlir::dyn_cast<mlir::AffineForOp>(&op)) {
         this->codegen(forOp);
       } else if (auto ifOp = mlir::dyn_cast<mlir::AffineIfOp>(&op)) {
         this->codegen(ifOp);
+      } else if (auto loadOp = mlir::dyn_cast<mlir::AffineLoadOp>(&op)) {
+        this->codegen(loadOp);
+      } else if (auto applyOp = mlir::dyn_cast<mlir::AffineApplyOp>(&op)) {
+        this->codegen(applyOp);
+      } else if (auto memLoadOp = mlir::dyn_cast<mlir::memref::LoadOp>(&op)) {
+        this->codegen(memLoadOp);
+      } else if (auto storeOp = mlir::dyn_cast<mlir::AffineStoreOp>(&op)) {
+        this->codegen(storeOp);
+      } else if (auto vecLoad = mlir::dyn_cast<mlir::AffineVectorLoadOp>(&op)) {
+        this->codegen(vecLoad);
+      } else if (auto vecStore = mlir::dyn_cast<mlir::AffineVectorStoreOp>(&op)) {
+        this->codegen(vecStore);
       } else if (auto constOp = mlir::dyn_cast<mlir::arith::ConstantIndexOp>(&op)) {
         this->codegen(constOp);
       } else if (auto constOp = mlir::dyn_cast<mlir::arith::ConstantFloatOp>(&op)) {
         this->codegen(constOp);
       } else if (auto intOp = mlir::dyn_cast<mlir::arith::ConstantIntOp>(&op)) {
         this->codegen(intOp);
-      } else if (auto vecLoad = mlir::dyn_cast<mlir::AffineVectorLoadOp>(&op)) {
-        this->codegen(vecLoad);
-      } else if (auto vecStore = mlir::dyn_cast<mlir::AffineVectorStoreOp>(&op)) {
-        this->codegen(vecStore);
-      } else if (auto barrierOp = mlir::dyn_cast<mlir::gpu::BarrierOp>(&op)) {
-        this->codegen(barrierOp);
-      } else if (auto storeOp = mlir::dyn_cast<mlir::AffineStoreOp>(&op)) {
-        this->codegen(storeOp);
-      } else if (auto loadOp = mlir::dyn_cast<mlir::AffineLoadOp>(&op)) {
-        this->codegen(loadOp);
-      } else if (auto memLoadOp = mlir::dyn_cast<mlir::memref::LoadOp>(&op)) {
-        this->codegen(memLoadOp);
-      } else if (auto maxOp = mlir::dyn_cast<mlir::arith::MaxFOp>(&op)) {
-        this->codegen(maxOp);
       } else if (auto mulOp = mlir::dyn_cast<mlir::arith::MulFOp>(&op)) {
         this->codegen(mulOp);
       } else if (auto addOp = mlir::dyn_cast<mlir::arith::AddFOp>(&op)) {
         this->codegen(addOp);
-      } else if (auto subOp = mlir::dyn_cast<mlir::arith::SubFOp>(&op)) {
-        this->codegen(subOp);
-      } else if (auto divOp = mlir::dyn_cast<mlir::arith::DivFOp>(&op)) {
-        this->codegen(divOp);
+      } else if (auto fmaOp = mlir::dyn_cast<mlir::math::FmaOp>(&op)) {
+        this->codegen(fmaOp);
+      } else if (auto powOp = mlir::dyn_cast<mlir::math::PowFOp>(&op)) {
+        this->codegen(powOp);
+      } else if (auto cmpOp = mlir::dyn_cast<mlir::arith::CmpFOp>(&op)) {
+        this->codegen(cmpOp);
+      } else if (auto tanhOp = mlir::dyn_cast<mlir::math::TanhOp>(&op)) {
+        this->codegen(tanhOp);
       } else if (auto sqrtOp = mlir::dyn_cast<mlir::math::SqrtOp>(&op)) {
         this->codegen(sqrtOp);
-      } else if (auto expOp = mlir::dyn_cast<mlir::math::ExpOp>(&op)) {
-        this->codegen(expOp);
+      } else if (auto rsqrtOp = mlir::dyn_cast<mlir::math::RsqrtOp>(&op)) {
+        this->codegen(rsqrtOp);
+      } else if (auto logOp = mlir::dyn_cast<mlir::math::LogOp>(&op)) {
+        this->codegen(logOp);
+      } else if (auto divOp = mlir::dyn_cast<mlir::arith::DivFOp>(&op)) {
+        this->codegen(divOp);
+      } else if (auto barrierOp = mlir::dyn_cast<mlir::gpu::BarrierOp>(&op)) {
+        this->codegen(barrierOp);
       } else if (auto shflOp = mlir::dyn_cast<mlir::gpu::ShuffleOp>(&op)) {
         this->codegen(shflOp);
+      } else if (auto castOp = mlir::dyn_cast<mlir::arith::IndexCastOp>(&op)) {
+        this->codegen(castOp);
+      } else if (auto allocOp = mlir::dyn_cast<mlir::memref::AllocOp>(&op)) {
+        this->codegen(allocOp);
+      } else if (auto maxOp = mlir::dyn_cast<mlir::arith::MaxFOp>(&op)) {
+        this->codegen(maxOp);
+      } else if (auto subOp = mlir::dyn_cast<mlir::arith::SubFOp>(&op)) {
+        this->codegen(subOp);
+      } else if (auto expOp = mlir::dyn_cast<mlir::math::ExpOp>(&op)) {
+        this->codegen(expOp);
       } else {
         auto yieldOp = mlir::dyn_cast<mlir::AffineYieldOp>(&op);
         assert(yieldOp);
       }
     }
+  };
+  indent();
+  source << "if (";
+  for (int i = 0; i < numConstraints; i += 1) {
+    auto expr = iset.getConstraint(i);
+    auto isEq = iset.isEq(i);
+    std::string relation = isEq ? "==" : ">=";
+    source << this->codegen(expr, operands) << " " << relation << " 0 && ";
+  }
+  source << " true) {\n";
+  codegenBlock(ifOp.getThenBlock());
+  if (ifOp.hasElse()) {
+    indent();
+    source << "} else {\n";
+    codegenBlock(ifOp.getElseBlock());
   }
   indent();
   source << "}\n";
@@ -629,34 +796,20 @@ void CUDAGenerator::codegen(mlir::AffineIfOp ifOp) {
 
 void CUDAGenerator::codegen(mlir::AffineLoadOp loadOp) {
   indent();
-  source << "auto " << getValueName(loadOp.getResult()) << " = " 
-               << getValueName(loadOp.getMemref());
   auto map = loadOp.getAffineMap();
   auto operands = loadOp.getMapOperands();
   auto exprs = map.getResults();
+  if (isScalarBuffer(loadOp.getMemref())) {
+    source << "auto " << getValueName(loadOp.getResult()) << " = " << getScalarName(loadOp.getMemref(), exprs) << ";\n";
+    return;
+  }
+  source << "auto " << getValueName(loadOp.getResult()) << " = " 
+               << getValueName(loadOp.getMemref());
 
   auto type = loadOp.getMemref().getType().dyn_cast<mlir::MemRefType>();
   auto memorySpace = type.getMemorySpaceAsInt();
   if (memorySpace == static_cast<int>(MemorySpace::global)) {
-    auto shape = type.getShape();
-    std::vector<int> strides;
-    auto size = shape.size();
-    for (int i = 0; i < shape.size(); i++) {
-      if (i == 0) {
-        strides.push_back(1);
-      } else {
-        strides.push_back(strides[i - 1] * shape[size - i]);
-      }
-    }
-    source << "[";
-    int index = exprs.size() - 1;
-    for (auto expr : exprs) {
-      std::string suffix = "";
-      auto stride = strides[index--];
-      if (stride >= 10240) suffix += "";
-      source << this->codegen(expr, operands) << " * " << stride << suffix << " + ";
-    }
-    source << "0]";
+    source << codegenGlobalIndex(type, exprs, llvm::SmallVector<mlir::Value>(operands));
   } else {
     for (auto expr : exprs) {
       source << "[" << this->codegen(expr, operands) << "]";
@@ -680,25 +833,7 @@ void CUDAGenerator::codegen(mlir::memref::LoadOp loadOp) {
   auto type = loadOp.getMemref().getType().dyn_cast<mlir::MemRefType>();
   auto memorySpace = type.getMemorySpaceAsInt();
   if (memorySpace == static_cast<int>(MemorySpace::global)) {
-    auto shape = type.getShape();
-    std::vector<int> strides;
-    auto size = shape.size();
-    for (int i = 0; i < shape.size(); i++) {
-      if (i == 0) {
-        strides.push_back(1);
-      } else {
-        strides.push_back(strides[i - 1] * shape[size - i]);
-      }
-    }
-    source << "[";
-    int index = exprs.size() - 1;
-    for (auto expr : exprs) {
-      std::string suffix = "";
-      auto stride = strides[index--];
-      if (stride >= 10240) suffix += "";
-      source << this->codegen(expr, operands) << " * " << stride << suffix << " + ";
-    }
-    source << "0]";
+    source << codegenGlobalIndex(type, exprs, llvm::SmallVector<mlir::Value>(operands));
   } else {
     for (auto expr : exprs) {
       source << "[" << this->codegen(expr, operands) << "]";
@@ -709,33 +844,19 @@ void CUDAGenerator::codegen(mlir::memref::LoadOp loadOp) {
 
 void CUDAGenerator::codegen(mlir::AffineStoreOp storeOp) {
   indent();
-  source << getValueName(storeOp.getMemref());
   auto map = storeOp.getAffineMap();
   auto operands = storeOp.getMapOperands();
   auto exprs = map.getResults();
+  if (isScalarBuffer(storeOp.getMemref())) {
+    source << getScalarName(storeOp.getMemref(), exprs) << " = " << getValueName(storeOp.getValue()) << ";\n";
+    return;
+  }
+  source << getValueName(storeOp.getMemref());
 
   auto type = storeOp.getMemref().getType().dyn_cast<mlir::MemRefType>();
   auto memorySpace = type.getMemorySpaceAsInt();
   if (memorySpace == static_cast<int>(MemorySpace::global)) {
-    auto shape = type.getShape();
-    std::vector<int> strides;
-    auto size = shape.size();
-    for (int i = 0; i < shape.size(); i++) {
-      if (i == 0) {
-        strides.push_back(1);
-      } else {
-        strides.push_back(strides[i - 1] * shape[size -i]);
-      }
-    }
-    source << "[";
-    int index = exprs.size() - 1;
-    for (auto expr : exprs) {
-      std::string suffix = "";
-      auto stride = strides[index--];
-      if (stride >= 10240) suffix += "";
-      source << this->codegen(expr, operands) << " * " << stride << suffix << " + ";
-    }
-    source << "0]";
+    source << codegenGlobalIndex(type, exprs, llvm::SmallVector<mlir::Value>(operands));
   } else {
     for (auto expr : exprs) {
       source << "[" << this->codegen(expr, operands) << "]";
@@ -766,11 +887,51 @@ std::string getVectorFetchType(mlir::VectorType vt) {
   return "float" + std::to_string(totalFloat);
 }
 
+/// @brief a vector access of a global view is emitted as one fetch only if the view allows it (see Analyzer::isVectorizable),
+///        otherwise element by element (see getVectorElement).
+bool isVectorAccessible(mlir::Value mem, mlir::VectorType vecType) {
+  auto type = mem.getType().dyn_cast<mlir::MemRefType>();
+  if (type.getMemorySpaceAsInt() != static_cast<int>(MemorySpace::global)) return true;
+  return Analyzer::isVectorizable(mem, vecType.getNumElements());
+}
+
+/// @brief the element of a vector value, for any element type and width.
+std::string getVectorElement(const std::string& vec, mlir::VectorType vecType, int64_t element) {
+  return "reinterpret_cast<" + toCStr(vecType.getElementType()) + "*>(&" + vec + ")[" + std::to_string(element) + "]";
+}
+
+/// @brief the global->shared copy which is issued as cp.async (sm_80+).
+bool isAsyncCopy(mlir::AffineVectorStoreOp storeOp) {
+  return storeOp->hasAttr(std::string("async.copy"));
+}
+
+/// @brief the load is folded into the cp.async of its users.
+bool isAsyncCopySource(mlir::AffineVectorLoadOp loadOp) {
+  auto users = loadOp.getResult().getUsers();
+  if (users.empty()) return false;
+  for (auto user : users) {
+    auto storeOp = mlir::dyn_cast<mlir::AffineVectorStoreOp>(user);
+    if (!storeOp || !isAsyncCopy(storeOp)) return false;
+  }
+  return true;
+}
+
 void CUDAGenerator::codegen(mlir::AffineVectorLoadOp loadOp) {
+  if (isAsyncCopySource(loadOp)) return;
   indent();
   source << "auto " << getValueName(loadOp.getResult()) << " = ";
+  if (isScalarBuffer(loadOp.getMemref())) {
+    auto exprs = loadOp.getAffineMap().getResults();
+    auto width = loadOp.getVectorType().getNumElements();
+    source << "make_float" << width << "(";
+    for (int64_t i = 0; i < width; i++) {
+      source << (i == 0 ? "" : ", ") << getScalarName(loadOp.getMemref(), exprs, i);
+    }
+    source << ");\n";
+    return;
+  }
 
-  auto codegenMemref = [&](mlir::AffineVectorLoadOp loadOp) -> std::string {
+  auto codegenMemref = [&](mlir::AffineVectorLoadOp loadOp, int64_t element) -> std::string {
     auto result = getValueName(loadOp.getMemref());
     auto map = loadOp.getAffineMap();
     auto operands = loadOp.getMapOperands();
@@ -779,25 +940,7 @@ void CUDAGenerator::codegen(mlir::AffineVectorLoadOp loadOp) {
     auto type = loadOp.getMemref().getType().dyn_cast<mlir::MemRefType>();
     auto memorySpace = type.getMemorySpaceAsInt();
     if (memorySpace == static_cast<int>(MemorySpace::global)) {
-      auto shape = type.getShape();
-      auto size = shape.size();
-      std::vector<int> strides;
-      for (int i = 0; i < shape.size(); i++) {
-        if (i == 0) {
-          strides.push_back(1);
-        } else {
-          strides.push_back(strides[i - 1] * shape[size - i]);
-        }
-      }
-      result += "[";
-      int index = exprs.size() - 1;
-      for (auto expr : exprs) {
-        std::string suffix = "";
-        auto stride = strides[index--];
-        if (stride >= 10240) suffix += "";
-        result += this->codegen(expr, operands) + " * " + std::to_string(stride)  + suffix + " + ";
-      }
-      result += "0]";
+      result += codegenGlobalIndex(type, exprs, llvm::SmallVector<mlir::Value>(operands), element);
     } else {
       for (auto expr : exprs) {
         result += "[" + this->codegen(expr, operands) + "]";
@@ -809,13 +952,23 @@ void CUDAGenerator::codegen(mlir::AffineVectorLoadOp loadOp) {
 
   auto vecType = loadOp.getVectorType();
   auto vstr = getVectorFetchType(vecType);
-  source << "(reinterpret_cast<" << vstr << "*>(&(" << codegenMemref(loadOp) << "))[0]);\n";
+  if (!isVectorAccessible(loadOp.getMemref(), vecType)) {
+    // a view with a non-unit innermost stride or a misaligned offset is read element by element.
+    auto name = getValueName(loadOp.getResult());
+    source << vstr << "();\n";
+    for (int64_t i = 0; i < vecType.getNumElements(); i++) {
+      indent();
+      source << getVectorElement(name, vecType, i) << " = " << codegenMemref(loadOp, i) << ";\n";
+    }
+    return;
+  }
+  source << "(reinterpret_cast<" << vstr << "*>(&(" << codegenMemref(loadOp, 0) << "))[0]);\n";
 
 }
 
 void CUDAGenerator::codegen(mlir::AffineVectorStoreOp storeOp) {
 
-  auto codegenMemref = [&](mlir::AffineVectorStoreOp storeOp) -> std::string {
+  auto codegenMemref = [&](mlir::AffineVectorStoreOp storeOp, int64_t element) -> std::string {
     auto result = getValueName(storeOp.getMemref());
     auto map = storeOp.getAffineMap();
     auto operands = storeOp.getMapOperands();
@@ -824,41 +977,146 @@ void CUDAGenerator::codegen(mlir::AffineVectorStoreOp storeOp) {
     auto type = storeOp.getMemref().getType().dyn_cast<mlir::MemRefType>();
     auto memorySpace = type.getMemorySpaceAsInt();
     if (memorySpace == static_cast<int>(MemorySpace::global)) {
-      auto shape = type.getShape();
-      std::vector<int> strides;
-      auto size = shape.size();
-      for (int i = 0; i < shape.size(); i++) {
-        if (i == 0) {
-          strides.push_back(1);
-        } else {
-          strides.push_back(strides[i - 1] * shape[size - i]);
-        }
-      }
-      result += "[";
-      int index = exprs.size() - 1;
-      for (auto expr : exprs) {
-        std::string suffix = "";
-        auto stride = strides[index--];
-        if (stride >= 10240) suffix += "";
-        result += this->codegen(expr, operands) + " * " + std::to_string(stride)  + suffix + " + ";
-      }
-      result += "0]";
+      result += codegenGlobalIndex(type, exprs, llvm::SmallVector<mlir::Value>(operands), element);
     } else {
-      for (auto expr : exprs) {
-        result += "[" + this->codegen(expr, operands) + "]";
+      for (int i = 0; i < exprs.size(); i++) {
+        auto index = this->codegen(exprs[i], operands);
+        if (i == exprs.size() - 1 && element != 0) index = "(" + index + " + " + std::to_string(element) + ")";
+        result += "[" + index + "]";
       }
     }
     return result;
   };
+  const char* components[] = {"x", "y", "z", "w"};
 
   indent();
   auto vecType = storeOp.getVectorType();
+  if (isScalarBuffer(storeOp.getMemref())) {
+    auto exprs = storeOp.getAffineMap().getResults();
+    assert(vecType.getNumElements() <= 4);
+    for (int64_t i = 0; i < vecType.getNumElements(); i++) {
+      if (i != 0) indent();
+      source << getScalarName(storeOp.getMemref(), exprs, i) << " = " 
+             << getValueName(storeOp.getValue()) << "." << components[i] << ";\n";
+    }
+    return;
+  }
+  if (isAsyncCopy(storeOp)) {
+    auto loadOp = storeOp.getValue().getDefiningOp<mlir::AffineVectorLoadOp>();
+    assert(loadOp);
+    auto srcType = loadOp.getMemref().getType().dyn_cast<mlir::MemRefType>();
+    assert(srcType.getMemorySpaceAsInt() == static_cast<int>(MemorySpace::global));
+    auto srcIndex = [&](int64_t element) {
+      return getValueName(loadOp.getMemref()) + codegenGlobalIndex(srcType, loadOp.getAffineMap().getResults(), 
+                                                                   llvm::SmallVector<mlir::Value>(loadOp.getMapOperands()), element);
+    };
+    if (!isVectorAccessible(loadOp.getMemref(), vecType)) {
+      // cp.async needs an aligned contiguous source, a strided view is copied synchronously element by element.
+      for (int64_t i = 0; i < vecType.getNumElements(); i++) {
+        if (i != 0) indent();
+        source << codegenMemref(storeOp, i) << " = " << srcIndex(i) << ";\n";
+      }
+      return;
+    }
+    auto src = srcIndex(0);
+    auto bytes = vecType.getNumElements() * vecType.getElementTypeBitWidth() / 8;
+    if (bytes != 4 && bytes != 8 && bytes != 16) {
+      llvm::errs() << "cp.async only copies 4, 8 or 16 bytes\n";
+      assert(false);
+    }
+    // 16 bytes copies can bypass L1.
+    std::string cacheOp = bytes == 16 ? "cg" : "ca";
+    source << "asm volatile(\"cp.async." << cacheOp << ".shared.global [%0], [%1], " << bytes << ";\\n\" :: "
+           << "\"r\"(static_cast<unsigned>(__cvta_generic_to_shared(&(" << codegenMemref(storeOp, 0) << ")))), "
+           << "\"l\"(&(" << src << ")));\n";
+    return;
+  }
+  if (!isVectorAccessible(storeOp.getMemref(), vecType)) {
+    // a view with a non-unit innermost stride or a misaligned offset is written element by element.
+    for (int64_t i = 0; i < vecType.getNumElements(); i++) {
+      if (i != 0) indent();
+      source << codegenMemref(storeOp, i) << " = " << getVectorElement(getValueName(storeOp.getValue()), vecType, i) << ";\n";
+    }
+    return;
+  }
   auto vstr = getVectorFetchType(vecType);
-  source << "(reinterpret_cast<" << vstr << "*>(&(" << codegenMemref(storeOp) << "))[0])";
+  source << "(reinterpret_cast<" << vstr << "*>(&(" << codegenMemref(storeOp, 0) << "))[0])";
   source << " = " << getValueName(storeOp.getValue()) << ";\n";
 }
 
+/// @brief one mma.sync for the loop tagged by Rewriter::mma, the shuffle fallback in its body is dropped.
+///        the body loads fragA, fragB and tileC (in this order), the registers are their addresses
+///        with the loop ivs fixed to the (i, k) each register is read at.
+void CUDAGenerator::codegenMMA(mlir::AffineForOp forOp) {
+  auto kLoop = mlir::dyn_cast<mlir::AffineForOp>(forOp.getBody()->front());
+  assert(kLoop);
+  std::vector<mlir::AffineLoadOp> loadOps;
+  kLoop.walk([&](mlir::AffineLoadOp loadOp) { loadOps.push_back(loadOp); });
+  assert(loadOps.size() == 3);
+
+  auto iv = forOp.getInductionVar();
+  auto kv = kLoop.getInductionVar();
+  auto access = [&](mlir::AffineLoadOp loadOp, int64_t i, int64_t k) -> std::string {
+    auto map = loadOp.getAffineMap();
+    auto operands = llvm::SmallVector<mlir::Value>(loadOp.getMapOperands());
+    llvm::SmallVector<mlir::AffineExpr> dims;
+    for (int j = 0; j < operands.size(); j++) {
+      if (operands[j] == iv) {
+        dims.push_back(mlir::getAffineConstantExpr(i, forOp->getContext()));
+      } else if (operands[j] == kv) {
+        dims.push_back(mlir::getAffineConstantExpr(k, forOp->getContext()));
+      } else {
+        dims.push_back(mlir::getAffineDimExpr(j, forOp->getContext()));
+      }
+    }
+    llvm::SmallVector<mlir::AffineExpr> exprs;
+    for (auto expr : map.getResults()) {
+      exprs.push_back(mlir::simplifyAffineExpr(expr.replaceDims(dims), operands.size(), 0));
+    }
+    if (isScalarBuffer(loadOp.getMemref())) return getScalarName(loadOp.getMemref(), exprs);
+    auto result = getValueName(loadOp.getMemref());
+    for (auto expr : exprs) {
+      result += "[" + this->codegen(expr, operands) + "]";
+    }
+    return result;
+  };
+  // any (i, k) reading register r.
+  auto fragReg = [&](int64_t r, bool isA) -> std::pair<int64_t, int64_t> {
+    for (int64_t i = 0; i < MMALayout::C_REGS; i++) {
+      for (int64_t k = 0; k < MMALayout::K; k++) {
+        if ((isA ? MMALayout::regA(i, k) : MMALayout::regB(i, k)) == r) return {i, k};
+      }
+    }
+    assert(false);
+    return {0, 0};
+  };
+
+  std::vector<std::string> c, a, b;
+  for (int64_t r = 0; r < MMALayout::C_REGS; r++) {
+    c.push_back("\"+f\"(" + access(loadOps[2], r, 0) + ")");
+  }
+  for (int64_t r = 0; r < MMALayout::A_REGS; r++) {
+    auto reg = fragReg(r, true);
+    a.push_back("\"r\"(__float_as_uint(" + access(loadOps[0], reg.first, reg.second) + "))");
+  }
+  for (int64_t r = 0; r < MMALayout::B_REGS; r++) {
+    auto reg = fragReg(r, false);
+    b.push_back("\"r\"(__float_as_uint(" + access(loadOps[1], reg.first, reg.second) + "))");
+  }
+  indent();
+  source << "asm volatile(\"mma.sync.aligned.m16n8k8.row.col.f32.tf32.tf32.f32 "
+         << "{%0, %1, %2, %3}, {%4, %5, %6, %7}, {%8, %9}, {%0, %1, %2, %3};\\n\"\n";
+  indent();
+  source << "  : " << c[0] << ", " << c[1] << ", " << c[2] << ", " << c[3] << "\n";
+  indent();
+  source << "  : " << a[0] << ", " << a[1] << ", " << a[2] << ", " << a[3] << ", " << b[0] << ", " << b[1] << ");\n";
+}
+
 void CUDAGenerator::codegen(mlir::AffineForOp forOp) {
+  if (forOp->hasAttr(std::string("affine.mma"))) {
+    codegenMMA(forOp);
+    return;
+  }
   
   auto lb = forOp.getConstantLowerBound();
   auto ub = forOp.getConstantUpperBound();
@@ -871,7 +1129,11 @@ void CUDAGenerator::codegen(mlir::AffineForOp forOp) {
     auto builder = mlir::OpBuilder(forOp->getContext());
     if (strAttr.compare(builder.getStringAttr("unroll")) == 0) {
       indent();
-      source << "#pragma unroll\n";
+      source << "#pragma unroll";
+      if (auto factor = forOp->getAttrOfType<mlir::IntegerAttr>(std::string("affine.unroll_factor"))) {
+        source << " " << factor.getInt();
+      }
+      source << "\n";
     }
   }
 
@@ -909,6 +1171,8 @@ void CUDAGenerator::codegen(mlir::AffineForOp forOp) {
         this->codegen(mulOp);
       } else if (auto addOp = mlir::dyn_cast<mlir::arith::AddFOp>(&op)) {
         this->codegen(addOp);
+      } else if (auto fmaOp = mlir::dyn_cast<mlir::math::FmaOp>(&op)) {
+        this->codegen(fmaOp);
       } else if (auto powOp = mlir::dyn_cast<mlir::math::PowFOp>(&op)) {
         this->codegen(powOp);
       } else if (auto cmpOp = mlir::dyn_cast<mlir::arith::CmpFOp>(&op)) {
@@ -917,6 +1181,8 @@ void CUDAGenerator::codegen(mlir::AffineForOp forOp) {
         this->codegen(tanhOp);
       } else if (auto sqrtOp = mlir::dyn_cast<mlir::math::SqrtOp>(&op)) {
         this->codegen(sqrtOp);
+      } else if (auto rsqrtOp = mlir::dyn_cast<mlir::math::RsqrtOp>(&op)) {
+        this->codegen(rsqrtOp);
       } else if (auto logOp = mlir::dyn_cast<mlir::math::LogOp>(&op)) {
         this->codegen(logOp);
       } else if (auto divOp = mlir::dyn_cast<mlir::arith::DivFOp>(&op)) {
@@ -925,6 +1191,8 @@ void CUDAGenerator::codegen(mlir::AffineForOp forOp) {
         this->codegen(barrierOp);
       } else if (auto shflOp = mlir::dyn_cast<mlir::gpu::ShuffleOp>(&op)) {
         this->codegen(shflOp);
+      } else if (auto castOp = mlir::dyn_cast<mlir::arith::IndexCastOp>(&op)) {
+        this->codegen(castOp);
       } else if (auto allocOp = mlir::dyn_cast<mlir::memref::AllocOp>(&op)) {
         this->codegen(allocOp);
       } else if (auto maxOp = mlir::dyn_cast<mlir::arith::MaxFOp>(&op)) {
@@ -964,6 +1232,8 @@ void CUDAGenerator::codegen(mlir::AffineForOp forOp) {
             this->codegen(mulOp);
           } else if (auto addOp = mlir::dyn_cast<mlir::arith::AddFOp>(&innerOp)) {
             this->codegen(addOp);
+          } else if (auto fmaOp = mlir::dyn_cast<mlir::math::FmaOp>(&innerOp)) {
+            this->codegen(fmaOp);
           } else if (auto divOp = mlir::dyn_cast<mlir::arith::DivFOp>(&innerOp)) {
             this->codegen(divOp);
           } else if (auto subOp = mlir::dyn_cast<mlir::arith::SubFOp>(&innerOp)) {
@@ -976,6 +1246,8 @@ void CUDAGenerator::codegen(mlir::AffineForOp forOp) {
             this->codegen(tanhOp);
           } else if (auto sqrtop = mlir::dyn_cast<mlir::math::SqrtOp>(&innerOp)) {
             this->codegen(sqrtop);
+          } else if (auto rsqrtOp = mlir::dyn_cast<mlir::math::RsqrtOp>(&innerOp)) {
+            this->codegen(rsqrtOp);
           } else if (auto logop = mlir::dyn_cast<mlir::math::LogOp>(&innerOp)) {
             this->codegen(logop);
           } else if (auto castOp = mlir::dyn_cast<mlir::arith::BitcastOp>(&innerOp)) {
@@ -1015,16 +1287,7 @@ void CUDAGenerator::codegen(mlir::AffineParallelOp node) {
   node.walk<mlir::WalkOrder::PreOrder>([&](mlir::AffineParallelOp parallelOp) {
     blockDims = Analyzer::getParallelNumber(parallelOp, totalNumber);
   });
-  // Annotation
-  indent();
-  source << "// grid dims:(";
-  for (auto dim : gridDims) source << dim << ", ";
-  source << ")" << ", block dims:(";
-  for (auto dim : blockDims) source << dim << ", ";
-  source << ")\n";
 
-  // kernel prototype
-  indent();
   /*---------------重排args-----------------*/
   std::vector<mlir::Value> inputVars, outputVars;
   for (auto var : outsideVars) {
@@ -1043,15 +1306,49 @@ void CUDAGenerator::codegen(mlir::AffineParallelOp node) {
   }
   inputVars.insert(inputVars.end(), outputVars.begin(), outputVars.end());
   /*--------------------------------*/
-  source << "__global__ void " << getKernelName() << "(";
+  auto kernelName = getKernelName();
+  if (launches) {
+    // the last iv is x.
+    std::vector<int64_t> grid(gridDims.rbegin(), gridDims.rend()), block(blockDims.rbegin(), blockDims.rend());
+    launches->push_back({kernelName, node, inputVars, grid, block});
+  }
+  if (replay) {
+    // the cached source of the same kernel, only its name changes.
+    auto prototype = "__global__ void " + replay->name + "(";
+    auto pos = replay->source.find(prototype);
+    assert(pos != std::string::npos);
+    source << replay->source.substr(0, pos) << "__global__ void " << kernelName << "("
+           << replay->source.substr(pos + prototype.size());
+    return;
+  }
+  // Annotation
+  indent();
+  source << "// grid dims:(";
+  for (auto dim : gridDims) source << dim << ", ";
+  source << ")" << ", block dims:(";
+  for (auto dim : blockDims) source << dim << ", ";
+  source << ")\n";
+
+  // kernel prototype
+  indent();
+  source << "__global__ void " << kernelName << "(";
   varDeclear(inputVars[0]);
   for (int i = 1; i < inputVars.size(); i += 1) {
     source << ", ";
     varDeclear(inputVars[i]);
   }
+  if (profile.enable) {
+    source << ", long long* kcg_profile";
+  }
   source << ") {\n";
   {
     INDENT();
+    if (profile.enable) {
+      indent();
+      source << "long long kcg_start = clock64(), kcg_t = kcg_start;\n";
+      indent();
+      source << "long long kcg_phase[" << static_cast<int>(Phase::count) << "] = {0};\n";
+    }
     // kernel body.
     auto& ops = node.getBody()->getOperations();
     for (auto& op : ops) {
@@ -1100,6 +1397,8 @@ void CUDAGenerator::codegen(mlir::AffineParallelOp node) {
             this->codegen(mulOp);
           } else if (auto addOp = mlir::dyn_cast<mlir::arith::AddFOp>(&innerOp)) {
             this->codegen(addOp);
+          } else if (auto fmaOp = mlir::dyn_cast<mlir::math::FmaOp>(&innerOp)) {
+            this->codegen(fmaOp);
           } else if (auto divOp = mlir::dyn_cast<mlir::arith::DivFOp>(&innerOp)) {
             this->codegen(divOp);
           } else if (auto subOp = mlir::dyn_cast<mlir::arith::SubFOp>(&innerOp)) {
@@ -1112,6 +1411,8 @@ void CUDAGenerator::codegen(mlir::AffineParallelOp node) {
             this->codegen(tanhOp);
           } else if (auto sqrtop = mlir::dyn_cast<mlir::math::SqrtOp>(&innerOp)) {
             this->codegen(sqrtop);
+          } else if (auto rsqrtOp = mlir::dyn_cast<mlir::math::RsqrtOp>(&innerOp)) {
+            this->codegen(rsqrtOp);
           } else if (auto logop = mlir::dyn_cast<mlir::math::LogOp>(&innerOp)) {
             this->codegen(logop);
           } else if (auto castOp = mlir::dyn_cast<mlir::arith::BitcastOp>(&innerOp)) {
@@ -1131,16 +1432,87 @@ void CUDAGenerator::codegen(mlir::AffineParallelOp node) {
         assert(yieldOp);
       }
     }
+    if (profile.enable) {
+      codegenProfileRecord(blockDims);
+    }
+  }
+  indent();
+  source << "}\n";
+}
+
+/// @brief lane 0 of each sampled warp writes its record, the layout is the one of ProfileConfig::FIELDS.
+void CUDAGenerator::codegenProfileRecord(const std::vector<int64_t>& blockDims) {
+  KernelLaunch launch;
+  launch.block = blockDims;
+  auto warps = sampledWarps(launch, profile);
+  indent();
+  source << "{\n";
+  {
+    INDENT();
+    indent();
+    source << "int kcg_block = blockIdx.x + gridDim.x * (blockIdx.y + gridDim.y * blockIdx.z);\n";
+    indent();
+    source << "int kcg_thread = threadIdx.x + blockDim.x * (threadIdx.y + blockDim.y * threadIdx.z);\n";
+    indent();
+    source << "int kcg_warp = kcg_thread / 32;\n";
+    indent();
+    source << "if (kcg_block % " << profile.blockStride << " == 0 && kcg_warp % " << profile.warpStride
+           << " == 0 && kcg_thread % 32 == 0) {\n";
+    {
+      INDENT();
+      indent();
+      source << "long long* kcg_record = kcg_profile + ((kcg_block / " << profile.blockStride << ") * " << warps
+             << " + kcg_warp / " << profile.warpStride << ") * " << ProfileConfig::FIELDS << ";\n";
+      indent();
+      source << "kcg_record[0] = kcg_block;\n";
+      indent();
+      source << "kcg_record[1] = kcg_warp;\n";
+      indent();
+      source << "kcg_record[2] = clock64() - kcg_start;\n";
+      for (int i = 0; i < static_cast<int>(Phase::count); i++) {
+        indent();
+        source << "kcg_record[" << 3 + i << "] = kcg_phase[" << i << "];\n";
+      }
+    }
+    indent();
+    source << "}\n";
   }
   indent();
   source << "}\n";
 }
 
 void CUDAGenerator::codegen(mlir::func::FuncOp funcOp) {
+  // the kernels of a fingerprinted func are emitted once, then replayed from the cache.
+  std::vector<KernelCache::Kernel>* cached = nullptr;
+  bool hit = false;
+  if (cache && !profile.enable) {
+    if (auto fingerprint = funcOp->getAttrOfType<mlir::IntegerAttr>(std::string("func.fingerprint"))) {
+      hit = cache->funcs.count(fingerprint.getInt()) != 0;
+      cached = &cache->funcs[fingerprint.getInt()];
+    }
+  }
+  int index = 0;
   auto& kernels = funcOp.getBody().front().getOperations();
   for (auto& kernel : kernels) {
     if (auto parallelOp = mlir::dyn_cast<mlir::AffineParallelOp>(kernel)) {
-      this->codegen(parallelOp);
+      if (hit) {
+        assert(index < cached->size());
+        replay = &(*cached)[index++];
+        this->codegen(parallelOp);
+        replay = nullptr;
+      } else if (cached) {
+        // emitted into its own stream to keep a copy of the kernel source.
+        std::stringstream outer;
+        outer.swap(source);
+        auto name = std::string("kernel") + std::to_string(kernelCounter);
+        this->codegen(parallelOp);
+        auto text = source.str();
+        outer << text;
+        source.swap(outer);
+        cached->push_back({name, std::move(text)});
+      } else {
+        this->codegen(parallelOp);
+      }
     }
   }
 }
@@ -1155,12 +1527,12 @@ void CUDAGenerator::codegen(mlir::ModuleOp module) {
 
 
 // Public API
-std::string CUDAGen(mlir::ModuleOp &module) {
+std::string CUDAGen(mlir::ModuleOp &module, std::vector<KernelLaunch>* launches, const ProfileConfig& profile, KernelCache* cache) {
   source.clear();
   source.str("");
   source << "#include \"cuda_runtime.h\"\n";
   // source << "namespace " + module.getName().value().str() + " {\n";
-  CUDAGenerator().codegen(module); 
+  CUDAGenerator(launches, profile, cache).codegen(module); 
   // source << "}\n";
   std::string sourceStr = source.str();
   if (KCGLog::level == Log::Debug) {
@@ -0,0 +1,729 @@
+#include "Backend/Harness.h"
+#include "Backend/CUDA.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <sstream>
+#include <iomanip>
+
+namespace KernelCodeGen {
+
+/// @brief types of the host reference: index is int64_t in the scalars, int in the buffers (as on the device).
+std::string hostScalarType(mlir::Type type) {
+  if (type.isa<mlir::Float32Type>()) return {"float"};
+  if (type.isa<mlir::Float64Type>()) return {"double"};
+  if (type.isa<mlir::IndexType>()) return {"int64_t"};
+  if (type.isInteger(1)) return {"bool"};
+  if (type.isa<mlir::IntegerType>()) return {"int"};
+  llvm::errs() << "harness: unsupported type " << type << "\n";
+  assert(false);
+  return {""};
+}
+
+std::string hostBufferType(mlir::MemRefType type) {
+  auto elementType = type.getElementType();
+  if (elementType.isa<mlir::IntegerType, mlir::IndexType>()) return {"int"};
+  return hostScalarType(elementType);
+}
+
+/// @brief a graph buffer of the generated program: the graph inputs and the outputs of the funcs.
+struct HarnessBuffer {
+  std::string name;
+  mlir::MemRefType type;
+  /// the graph input (index in the reference inputs) the buffer is copied from, -1 for the func outputs.
+  int input = -1;
+  /// see indexBound, for the graph inputs.
+  int64_t bound = 1;
+};
+
+int64_t indexBound(mlir::memref::AllocOp allocOp) {
+  auto attr = allocOp->getAttrOfType<mlir::IntegerAttr>(std::string("index.bound"));
+  return attr ? std::max<int64_t>(attr.getInt(), 1) : 1;
+}
+
+bool isGraphOutput(mlir::Value value) {
+  for (auto user : value.getUsers()) {
+    if (mlir::isa<mlir::func::CallOp>(user)) return false;
+    if (mlir::isa<mlir::memref::SubViewOp, mlir::memref::ReinterpretCastOp>(user) && !isGraphOutput(user->getResult(0))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+class HarnessGenerator {
+public:
+  HarnessGenerator(mlir::ModuleOp& reference_, mlir::ModuleOp& optimized_) : reference(reference_), optimized(optimized_) {}
+  std::string generate();
+
+private:
+  bool flattenReference();
+  bool flattenOptimized();
+  void codegen(mlir::func::FuncOp);
+  void codegen(mlir::Operation*);
+  void codegen(mlir::AffineForOp);
+  void codegen(mlir::AffineIfOp);
+  std::string codegen(mlir::AffineExpr, unsigned numDims, mlir::ValueRange operands);
+  std::string codegenBound(mlir::AffineMap, mlir::ValueRange operands, const std::string& reduce);
+  std::string codegenIndex(mlir::MemRefType, const std::vector<std::string>& indices);
+  void freeAllocs(mlir::Block* block, mlir::Value keep = nullptr);
+  std::string getName(mlir::Value);
+  std::string newName(mlir::Value);
+  void indent() { for (int i = 0; i < indentLevel; i++) source << "  "; }
+
+  mlir::ModuleOp& reference;
+  mlir::ModuleOp& optimized;
+  std::stringstream source;
+  int indentLevel = 0;
+  int varCounter = 0;
+  llvm::DenseMap<mlir::Value, std::string> valueNames;
+  /// the graph buffer a top level value lives in (views share the buffer of their source).
+  llvm::DenseMap<mlir::Value, int> bufferOf;
+  std::vector<HarnessBuffer> inputs;
+  std::vector<int> referenceOutputs;
+  std::vector<HarnessBuffer> referenceBuffers;
+  std::vector<int> deviceOutputs;
+  std::vector<HarnessBuffer> deviceBuffers;
+  std::vector<KernelLaunch> launches;
+  /// host code of each launch, in graph order.
+  std::vector<std::string> launchCalls;
+  std::vector<std::string> launchNames;
+  std::string kernelSource;
+};
+
+std::string HarnessGenerator::getName(mlir::Value value) {
+  if (valueNames.count(value) == 0) {
+    llvm::errs() << "harness: value used before defined\n";
+    assert(false);
+  }
+  return valueNames[value];
+}
+
+std::string HarnessGenerator::newName(mlir::Value value) {
+  auto name = std::string("v") + std::to_string(varCounter++);
+  valueNames[value] = name;
+  return name;
+}
+
+std::string HarnessGenerator::codegen(mlir::AffineExpr expr, unsigned numDims, mlir::ValueRange operands) {
+  if (auto dimExpr = expr.dyn_cast<mlir::AffineDimExpr>()) {
+    return getName(operands[dimExpr.getPosition()]);
+  } else if (auto symbolExpr = expr.dyn_cast<mlir::AffineSymbolExpr>()) {
+    return getName(operands[numDims + symbolExpr.getPosition()]);
+  } else if (auto constExpr = expr.dyn_cast<mlir::AffineConstantExpr>()) {
+    return std::to_string(constExpr.getValue());
+  }
+  auto binaryExpr = expr.cast<mlir::AffineBinaryOpExpr>();
+  auto lhs = codegen(binaryExpr.getLHS(), numDims, operands);
+  auto rhs = codegen(binaryExpr.getRHS(), numDims, operands);
+  switch (expr.getKind()) {
+    case mlir::AffineExprKind::Add: return "(" + lhs + " + " + rhs + ")";
+    case mlir::AffineExprKind::Mul: return "(" + lhs + " * " + rhs + ")";
+    case mlir::AffineExprKind::FloorDiv: return "host_floordiv(" + lhs + ", " + rhs + ")";
+    case mlir::AffineExprKind::CeilDiv: return "host_ceildiv(" + lhs + ", " + rhs + ")";
+    case mlir::AffineExprKind::Mod: return "host_mod(" + lhs + ", " + rhs + ")";
+    default: break;
+  }
+  llvm::errs() << "harness: unsupported affine expr\n";
+  assert(false);
+  return {""};
+}
+
+std::string HarnessGenerator::codegenBound(mlir::AffineMap map, mlir::ValueRange operands, const std::string& reduce) {
+  std::string bound;
+  for (auto expr : map.getResults()) {
+    auto str = codegen(expr, map.getNumDims(), operands);
+    bound = bound.empty() ? str : reduce + "(" + bound + ", " + str + ")";
+  }
+  return bound;
+}
+
+/// @brief linear index into the base pointer, the views are addressed with their layout.
+std::string HarnessGenerator::codegenIndex(mlir::MemRefType type, const std::vector<std::string>& indices) {
+  llvm::SmallVector<int64_t> strides;
+  int64_t offset;
+  if (mlir::failed(mlir::getStridesAndOffset(type, strides, offset)) || mlir::ShapedType::isDynamicStrideOrOffset(offset)) {
+    llvm::errs() << "harness: unsupported layout " << type << "\n";
+    assert(false);
+  }
+  std::string index = std::to_string(offset);
+  for (int i = 0; i < indices.size(); i++) {
+    index += " + " + std::to_string(strides[i]) + " * " + indices[i];
+  }
+  return index;
+}
+
+/// @brief frees the buffers allocated in `block` (but `keep`, the returned one) at its end.
+void HarnessGenerator::freeAllocs(mlir::Block* block, mlir::Value keep) {
+  for (auto allocOp : block->getOps<mlir::memref::AllocOp>()) {
+    if (allocOp.getResult() == keep) continue;
+    indent();
+    source << "delete[] " << getName(allocOp.getResult()) << ";\n";
+  }
+}
+
+void HarnessGenerator::codegen(mlir::AffineForOp forOp) {
+  auto results = forOp.getResults();
+  auto iterArgs = forOp.getRegionIterArgs();
+  auto inits = forOp.getIterOperands();
+  for (int i = 0; i < results.size(); i++) {
+    auto name = newName(results[i]);
+    valueNames[iterArgs[i]] = name;
+    indent();
+    source << hostScalarType(results[i].getType()) << " " << name << " = " << getName(inits[i]) << ";\n";
+  }
+  auto lb = codegenBound(forOp.getLowerBoundMap(), forOp.getLowerBoundOperands(), "std::max<int64_t>");
+  auto ub = codegenBound(forOp.getUpperBoundMap(), forOp.getUpperBoundOperands(), "std::min<int64_t>");
+  auto iv = newName(forOp.getInductionVar());
+  indent();
+  source << "for (int64_t " << iv << " = " << lb << "; " << iv << " < " << ub << "; " << iv << " += " << forOp.getStep() << ") {\n";
+  indentLevel++;
+  for (auto& op : forOp.getBody()->without_terminator()) {
+    this->codegen(&op);
+  }
+  freeAllocs(forOp.getBody());
+  // the yielded values may read the iter args, they are all read before any is written.
+  auto yieldOp = mlir::cast<mlir::AffineYieldOp>(forOp.getBody()->getTerminator());
+  std::vector<std::string> yielded;
+  for (int i = 0; i < yieldOp.getNumOperands(); i++) {
+    auto value = getName(yieldOp.getOperand(i));
+    if (yieldOp.getNumOperands() > 1) {
+      auto temp = std::string("y") + std::to_string(varCounter++);
+      indent();
+      source << "auto " << temp << " = " << value << ";\n";
+      value = temp;
+    }
+    yielded.push_back(value);
+  }
+  for (int i = 0; i < yielded.size(); i++) {
+    indent();
+    source << getName(results[i]) << " = " << yielded[i] << ";\n";
+  }
+  indentLevel--;
+  indent();
+  source << "}\n";
+}
+
+void HarnessGenerator::codegen(mlir::AffineIfOp ifOp) {
+  if (ifOp.getNumResults() != 0) {
+    llvm::errs() << "harness: affine.if with results is unsupported\n";
+    assert(false);
+  }
+  auto set = ifOp.getIntegerSet();
+  std::string cond;
+  for (int i = 0; i < set.getNumConstraints(); i++) {
+    auto expr = codegen(set.getConstraint(i), set.getNumDims(), ifOp.getOperands());
+    cond += (i == 0 ? "" : " && ") + expr + (set.isEq(i) ? " == 0" : " >= 0");
+  }
+  indent();
+  source << "if (" << (cond.empty() ? "true" : cond) << ") {\n";
+  indentLevel++;
+  for (auto& op : ifOp.getThenBlock()->without_terminator()) {
+    this->codegen(&op);
+  }
+  freeAllocs(ifOp.getThenBlock());
+  indentLevel--;
+  if (ifOp.hasElse()) {
+    indent();
+    source << "} else {\n";
+    indentLevel++;
+    for (auto& op : ifOp.getElseBlock()->without_terminator()) {
+      this->codegen(&op);
+    }
+    freeAllocs(ifOp.getElseBlock());
+    indentLevel--;
+  }
+  indent();
+  source << "}\n";
+}
+
+void HarnessGenerator::codegen(mlir::Operation* op) {
+  auto assign = [&](mlir::Value result, const std::string& expr) {
+    indent();
+    source << hostScalarType(result.getType()) << " " << newName(result) << " = " << expr << ";\n";
+  };
+  auto binary = [&](const std::string& symbol) {
+    assign(op->getResult(0), getName(op->getOperand(0)) + " " + symbol + " " + getName(op->getOperand(1)));
+  };
+  auto call = [&](const std::string& func) {
+    std::string args;
+    for (auto operand : op->getOperands()) {
+      args += (args.empty() ? "" : ", ") + getName(operand);
+    }
+    assign(op->getResult(0), func + "(" + args + ")");
+  };
+
+  if (auto forOp = mlir::dyn_cast<mlir::AffineForOp>(op)) {
+    this->codegen(forOp);
+  } else if (auto ifOp = mlir::dyn_cast<mlir::AffineIfOp>(op)) {
+    this->codegen(ifOp);
+  } else if (auto allocOp = mlir::dyn_cast<mlir::memref::AllocOp>(op)) {
+    auto type = allocOp.getType();
+    indent();
+    source << hostBufferType(type) << "* " << newName(allocOp.getResult()) << " = new " << hostBufferType(type)
+           << "[" << type.getNumElements() << "]();\n";
+  } else if (mlir::isa<mlir::memref::SubViewOp, mlir::memref::ReinterpretCastOp>(op)) {
+    // views keep the base pointer, their layout is applied by the accesses.
+    valueNames[op->getResult(0)] = getName(op->getOperand(0));
+  } else if (auto loadOp = mlir::dyn_cast<mlir::AffineLoadOp>(op)) {
+    auto map = loadOp.getAffineMap();
+    std::vector<std::string> indices;
+    for (auto expr : map.getResults()) indices.push_back(codegen(expr, map.getNumDims(), loadOp.getMapOperands()));
+    assign(loadOp.getResult(), getName(loadOp.getMemref()) + "[" + codegenIndex(loadOp.getMemRefType(), indices) + "]");
+  } else if (auto storeOp = mlir::dyn_cast<mlir::AffineStoreOp>(op)) {
+    auto map = storeOp.getAffineMap();
+    std::vector<std::string> indices;
+    for (auto expr : map.getResults()) indices.push_back(codegen(expr, map.getNumDims(), storeOp.getMapOperands()));
+    indent();
+    source << getName(storeOp.getMemref()) << "[" << codegenIndex(storeOp.getMemRefType(), indices) << "] = "
+           << getName(storeOp.getValue()) << ";\n";
+  } else if (auto loadOp = mlir::dyn_cast<mlir::memref::LoadOp>(op)) {
+    std::vector<std::string> indices;
+    for (auto index : loadOp.getIndices()) indices.push_back(getName(index));
+    assign(loadOp.getResult(), getName(loadOp.getMemref()) + "[" + codegenIndex(loadOp.getMemRefType(), indices) + "]");
+  } else if (auto storeOp = mlir::dyn_cast<mlir::memref::StoreOp>(op)) {
+    std::vector<std::string> indices;
+    for (auto index : storeOp.getIndices()) indices.push_back(getName(index));
+    indent();
+    source << getName(storeOp.getMemref()) << "[" << codegenIndex(storeOp.getMemRefType(), indices) << "] = "
+           << getName(storeOp.getValue()) << ";\n";
+  } else if (auto applyOp = mlir::dyn_cast<mlir::AffineApplyOp>(op)) {
+    auto map = applyOp.getAffineMap();
+    assign(applyOp.getResult(), codegen(map.getResult(0), map.getNumDims(), applyOp.getMapOperands()));
+  } else if (auto constOp = mlir::dyn_cast<mlir::arith::ConstantOp>(op)) {
+    std::stringstream value;
+    if (auto floatAttr = constOp.getValue().dyn_cast<mlir::FloatAttr>()) {
+      value << std::setprecision(17) << floatAttr.getValueAsDouble();
+    } else if (auto intAttr = constOp.getValue().dyn_cast<mlir::IntegerAttr>()) {
+      value << intAttr.getValue().getSExtValue();
+    } else {
+      llvm::errs() << "harness: unsupported constant " << constOp.getValue() << "\n";
+      assert(false);
+    }
+    assign(constOp.getResult(), value.str());
+  } else if (mlir::isa<mlir::arith::AddFOp>(op)) {
+    binary("+");
+  } else if (mlir::isa<mlir::arith::SubFOp>(op)) {
+    binary("-");
+  } else if (mlir::isa<mlir::arith::MulFOp>(op)) {
+    binary("*");
+  } else if (mlir::isa<mlir::arith::DivFOp>(op)) {
+    binary("/");
+  } else if (mlir::isa<mlir::arith::MaxFOp>(op)) {
+    call("std::max");
+  } else if (mlir::isa<mlir::math::FmaOp>(op)) {
+    call("std::fma");
+  } else if (mlir::isa<mlir::math::ExpOp>(op)) {
+    call("std::exp");
+  } else if (mlir::isa<mlir::math::LogOp>(op)) {
+    call("std::log");
+  } else if (mlir::isa<mlir::math::SqrtOp>(op)) {
+    call("std::sqrt");
+  } else if (mlir::isa<mlir::math::RsqrtOp>(op)) {
+    call("host_rsqrt");
+  } else if (mlir::isa<mlir::math::TanhOp>(op)) {
+    call("std::tanh");
+  } else if (mlir::isa<mlir::math::PowFOp>(op)) {
+    call("std::pow");
+  } else if (auto cmpOp = mlir::dyn_cast<mlir::arith::CmpFOp>(op)) {
+    using Predicate = mlir::arith::CmpFPredicate;
+    switch (cmpOp.getPredicate()) {
+      case Predicate::OEQ: case Predicate::UEQ: binary("=="); break;
+      case Predicate::ONE: case Predicate::UNE: binary("!="); break;
+      case Predicate::OGT: case Predicate::UGT: binary(">"); break;
+      case Predicate::OGE: case Predicate::UGE: binary(">="); break;
+      case Predicate::OLT: case Predicate::ULT: binary("<"); break;
+      case Predicate::OLE: case Predicate::ULE: binary("<="); break;
+      default:
+        llvm::errs() << "harness: unsupported cmpf predicate\n";
+        assert(false);
+    }
+  } else if (auto selectOp = mlir::dyn_cast<mlir::arith::SelectOp>(op)) {
+    assign(selectOp.getResult(), getName(selectOp.getCondition()) + " ? " + getName(selectOp.getTrueValue()) +
+                                 " : " + getName(selectOp.getFalseValue()));
+  } else if (auto castOp = mlir::dyn_cast<mlir::arith::IndexCastOp>(op)) {
+    assign(castOp.getResult(), "(" + hostScalarType(castOp.getType()) + ")" + getName(castOp.getIn()));
+  } else if (auto castOp = mlir::dyn_cast<mlir::arith::BitcastOp>(op)) {
+    assign(castOp.getResult(), "host_bitcast<" + hostScalarType(castOp.getType()) + ">(" + getName(castOp.getIn()) + ")");
+  } else if (auto returnOp = mlir::dyn_cast<mlir::func::ReturnOp>(op)) {
+    auto returned = returnOp.getOperand(0);
+    while (mlir::isa_and_nonnull<mlir::memref::SubViewOp, mlir::memref::ReinterpretCastOp>(returned.getDefiningOp())) {
+      returned = returned.getDefiningOp()->getOperand(0);
+    }
+    freeAllocs(returnOp->getBlock(), returned);
+    indent();
+    source << "return " << getName(returnOp.getOperand(0)) << ";\n";
+  } else {
+    llvm::errs() << "harness: unsupported op " << op->getName() << "\n";
+    assert(false);
+  }
+}
+
+/// @brief the naive func as a host function, the output buffer is returned.
+void HarnessGenerator::codegen(mlir::func::FuncOp funcOp) {
+  auto funcType = funcOp.getFunctionType();
+  if (funcType.getNumResults() != 1 || !funcType.getResult(0).isa<mlir::MemRefType>()) {
+    llvm::errs() << "harness: " << funcOp.getSymName() << " must return one buffer\n";
+    assert(false);
+  }
+  source << "static " << hostBufferType(funcType.getResult(0).cast<mlir::MemRefType>()) << "* reference_"
+         << funcOp.getSymName().str() << "(";
+  for (auto arg : funcOp.getArguments()) {
+    auto type = arg.getType().cast<mlir::MemRefType>();
+    source << (arg.getArgNumber() == 0 ? "" : ", ") << hostBufferType(type) << "* " << newName(arg);
+  }
+  source << ") {\n";
+  indentLevel++;
+  for (auto& op : funcOp.getBody().front().getOperations()) {
+    this->codegen(&op);
+  }
+  indentLevel--;
+  source << "}\n\n";
+}
+
+/// @brief the reference graph: a host function per naive func, called in graph order on copies of the inputs.
+bool HarnessGenerator::flattenReference() {
+  llvm::SetVector<mlir::func::FuncOp> callees;
+  reference.walk([&](mlir::func::CallOp callOp) {
+    callees.insert(reference.lookupSymbol<mlir::func::FuncOp>(callOp.getCallee()));
+  });
+  for (auto funcOp : callees) {
+    this->codegen(funcOp);
+  }
+
+  std::stringstream body;
+  auto& ops = reference.getBody()->getOperations();
+  for (auto& op : ops) {
+    if (auto allocOp = mlir::dyn_cast<mlir::memref::AllocOp>(op)) {
+      auto type = allocOp.getType();
+      bufferOf[allocOp.getResult()] = referenceBuffers.size();
+      inputs.push_back({std::string("in") + std::to_string(inputs.size()), type, -1, indexBound(allocOp)});
+      referenceBuffers.push_back({newName(allocOp.getResult()), type, static_cast<int>(inputs.size()) - 1});
+      body << "  " << hostBufferType(type) << "* " << referenceBuffers.back().name << " = " << inputs.back().name << ".data();\n";
+    } else if (mlir::isa<mlir::memref::SubViewOp, mlir::memref::ReinterpretCastOp>(&op)) {
+      bufferOf[op.getResult(0)] = bufferOf[op.getOperand(0)];
+      valueNames[op.getResult(0)] = getName(op.getOperand(0));
+    } else if (auto callOp = mlir::dyn_cast<mlir::func::CallOp>(op)) {
+      auto funcOp = reference.lookupSymbol<mlir::func::FuncOp>(callOp.getCallee());
+      auto result = callOp.getResult(0);
+      auto type = result.getType().cast<mlir::MemRefType>();
+      body << "  " << hostBufferType(type) << "* " << newName(result) << " = reference_" << funcOp.getSymName().str() << "(";
+      for (int i = 0; i < callOp.getNumOperands(); i++) {
+        body << (i == 0 ? "" : ", ") << getName(callOp.getOperand(i));
+      }
+      body << ");\n";
+      // the inplace operators return their input.
+      auto returned = funcOp.getBody().front().getTerminator()->getOperand(0);
+      if (auto arg = returned.dyn_cast<mlir::BlockArgument>()) {
+        bufferOf[result] = bufferOf[callOp.getOperand(arg.getArgNumber())];
+      } else {
+        bufferOf[result] = referenceBuffers.size();
+        referenceBuffers.push_back({getName(result), type});
+      }
+      if (isGraphOutput(result)) referenceOutputs.push_back(bufferOf[result]);
+    }
+  }
+
+  source << "static std::vector<std::vector<double>> reference(";
+  for (int i = 0; i < inputs.size(); i++) {
+    source << (i == 0 ? "" : ", ") << "std::vector<" << hostBufferType(inputs[i].type) << "> " << inputs[i].name;
+  }
+  source << ") {\n" << body.str();
+  source << "  std::vector<std::vector<double>> outputs;\n";
+  for (auto index : referenceOutputs) {
+    auto& buffer = referenceBuffers[index];
+    source << "  outputs.emplace_back(" << buffer.name << ", " << buffer.name << " + " << buffer.type.getNumElements() << ");\n";
+  }
+  // the inputs are owned by their vectors, the func outputs are allocated by the funcs.
+  for (auto& buffer : referenceBuffers) {
+    if (buffer.input < 0) source << "  delete[] " << buffer.name << ";\n";
+  }
+  source << "  return outputs;\n";
+  source << "}\n\n";
+  return true;
+}
+
+/// @brief the optimized graph as a list of kernel launches: a func call turns into the launches of its kernels,
+///        the buffers the func allocates are allocated once on the device.
+bool HarnessGenerator::flattenOptimized() {
+  kernelSource = CUDAGen(optimized, &launches);
+  llvm::DenseMap<mlir::Operation*, int> launchOf;
+  for (int i = 0; i < launches.size(); i++) {
+    launchOf[launches[i].kernel] = i;
+  }
+
+  bufferOf.clear();
+  valueNames.clear();
+  int inputCounter = 0;
+  auto addBuffer = [&](mlir::Value value, const std::string& name, int input) {
+    bufferOf[value] = deviceBuffers.size();
+    valueNames[value] = name;
+    deviceBuffers.push_back({name, value.getType().cast<mlir::MemRefType>(), input});
+  };
+  auto alias = [&](mlir::Value value, mlir::Value source) {
+    bufferOf[value] = bufferOf[source];
+    valueNames[value] = getName(source);
+  };
+
+  auto& ops = optimized.getBody()->getOperations();
+  for (auto& op : ops) {
+    if (auto allocOp = mlir::dyn_cast<mlir::memref::AllocOp>(op)) {
+      // the graph inputs are the top level allocs of both modules, in the same order.
+      auto input = inputCounter++;
+      addBuffer(allocOp.getResult(), std::string("d_in") + std::to_string(input), input);
+    } else if (mlir::isa<mlir::memref::SubViewOp, mlir::memref::ReinterpretCastOp>(&op)) {
+      alias(op.getResult(0), op.getOperand(0));
+    } else if (auto callOp = mlir::dyn_cast<mlir::func::CallOp>(op)) {
+      auto funcOp = optimized.lookupSymbol<mlir::func::FuncOp>(callOp.getCallee());
+      for (auto arg : funcOp.getArguments()) {
+        alias(arg, callOp.getOperand(arg.getArgNumber()));
+      }
+      for (auto& innerOp : funcOp.getBody().front().getOperations()) {
+        if (auto allocOp = mlir::dyn_cast<mlir::memref::AllocOp>(innerOp)) {
+          addBuffer(allocOp.getResult(), std::string("d_buf") + std::to_string(deviceBuffers.size()), -1);
+        } else if (mlir::isa<mlir::memref::SubViewOp, mlir::memref::ReinterpretCastOp>(&innerOp)) {
+          alias(innerOp.getResult(0), innerOp.getOperand(0));
+        } else if (auto constOp = mlir::dyn_cast<mlir::arith::ConstantIndexOp>(innerOp)) {
+          valueNames[constOp.getResult()] = std::to_string(constOp.value());
+        } else if (auto parallelOp = mlir::dyn_cast<mlir::AffineParallelOp>(innerOp)) {
+          auto& launch = launches[launchOf[parallelOp]];
+          std::stringstream call;
+          call << launch.name << "<<<dim3(";
+          for (int i = 0; i < launch.grid.size(); i++) call << (i == 0 ? "" : ", ") << launch.grid[i];
+          call << "), dim3(";
+          for (int i = 0; i < launch.block.size(); i++) call << (i == 0 ? "" : ", ") << launch.block[i];
+          call << ")>>>(";
+          for (int i = 0; i < launch.params.size(); i++) {
+            if (valueNames.count(launch.params[i]) == 0) {
+              llvm::errs() << "harness: an argument of " << launch.name << " isn't a graph buffer\n";
+              return false;
+            }
+            call << (i == 0 ? "" : ", ") << getName(launch.params[i]);
+          }
+          call << ");";
+          launchCalls.push_back(call.str());
+          launchNames.push_back(launch.name);
+        } else if (auto returnOp = mlir::dyn_cast<mlir::func::ReturnOp>(innerOp)) {
+          alias(callOp.getResult(0), returnOp.getOperand(0));
+        } else {
+          llvm::errs() << "harness: " << innerOp.getName() << " out of the kernels of " << funcOp.getSymName() << "\n";
+          return false;
+        }
+      }
+      if (isGraphOutput(callOp.getResult(0))) deviceOutputs.push_back(bufferOf[callOp.getResult(0)]);
+    }
+  }
+  if (inputCounter != inputs.size() || deviceOutputs.size() != referenceOutputs.size()) {
+    llvm::errs() << "harness: the optimized graph doesn't match the naive one (" << inputCounter << " inputs, "
+                 << deviceOutputs.size() << " outputs)\n";
+    return false;
+  }
+  return true;
+}
+
+const char* harnessPrelude = R"(// generated by KernelCodeGen, build with
+//   nvcc -O3 -arch=sm_80 bench.cu -o bench            (gpu: check + timing)
+//   g++ -O2 -x c++ -DKCG_HOST_ONLY bench.cu -o bench  (host reference only)
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+static inline int64_t host_floordiv(int64_t a, int64_t b) { return a / b - ((a % b != 0) && ((a < 0) != (b < 0))); }
+static inline int64_t host_ceildiv(int64_t a, int64_t b) { return -host_floordiv(-a, b); }
+static inline int64_t host_mod(int64_t a, int64_t b) { int64_t r = a % b; return r < 0 ? r + b : r; }
+template <typename T> static inline T host_rsqrt(T x) { return T(1) / std::sqrt(x); }
+template <typename To, typename From> static inline To host_bitcast(From x) {
+  static_assert(sizeof(To) == sizeof(From), "bitcast between different widths");
+  To y;
+  std::memcpy(&y, &x, sizeof(To));
+  return y;
+}
+
+/// deterministic inputs in [-1, 1], the integer (index) inputs in [0, bound).
+template <typename T> static void fill(std::vector<T>& data, unsigned seed, int64_t bound) {
+  unsigned state = seed * 2654435761u + 1u;
+  for (auto& x : data) {
+    state = state * 1664525u + 1013904223u;
+    x = std::is_floating_point<T>::value ? T(((state >> 8) % 2001) / 1000.0 - 1.0) : T((state >> 8) % bound);
+  }
+}
+
+struct CheckStats {
+  double maxAbsErr = 0.0;
+  double maxRelErr = 0.0;
+  int64_t mismatches = 0;
+};
+
+template <typename T>
+static void compare(const std::vector<T>& out, const std::vector<double>& ref, double atol, double rtol, CheckStats& stats) {
+  for (size_t i = 0; i < ref.size(); i++) {
+    double err = std::fabs(double(out[i]) - ref[i]);
+    stats.maxAbsErr = std::max(stats.maxAbsErr, err);
+    if (ref[i] != 0.0) stats.maxRelErr = std::max(stats.maxRelErr, err / std::fabs(ref[i]));
+    // written so that a nan is a mismatch.
+    if (!(err <= atol + rtol * std::fabs(ref[i]))) stats.mismatches++;
+  }
+}
+
+)";
+
+std::string HarnessGenerator::generate() {
+  source << harnessPrelude;
+  if (!flattenReference()) return {""};
+  if (!flattenOptimized()) return {""};
+
+  bool fastMath = false;
+  optimized.walk([&](mlir::Operation* op) {
+    if (op->hasAttr(std::string("fast.math"))) fastMath = true;
+  });
+  auto tolerance = [&](mlir::MemRefType type) {
+    auto elementType = type.getElementType();
+    if (elementType.isa<mlir::Float64Type>()) return std::string("1e-9, 1e-9");
+    if (elementType.isa<mlir::FloatType>()) return std::string(fastMath ? "1e-2, 1e-2" : "1e-3, 1e-3");
+    return std::string("0.0, 0.0");
+  };
+  auto graphName = optimized.getName() ? optimized.getName()->str() : std::string("graph");
+
+  source << "#ifndef KCG_HOST_ONLY\n";
+  source << kernelSource << "\n";
+  source << "#define KCG_CHECK(call) do { cudaError_t err = (call); if (err != cudaSuccess) { \\\n";
+  source << "  std::fprintf(stderr, \"%s:%d %s\\n\", __FILE__, __LINE__, cudaGetErrorString(err)); std::exit(1); } } while (0)\n";
+  source << "#endif\n\n";
+
+  source << "int main(int argc, char** argv) {\n";
+  source << "  int warmup = 10, iters = 100;\n";
+  source << "  bool check = true;\n";
+  source << "  for (int i = 1; i < argc; i++) {\n";
+  source << "    std::string arg = argv[i];\n";
+  source << "    if (arg == \"--warmup\" && i + 1 < argc) warmup = std::atoi(argv[++i]);\n";
+  source << "    else if (arg == \"--iters\" && i + 1 < argc) iters = std::atoi(argv[++i]);\n";
+  source << "    else if (arg == \"--no-check\") check = false;\n";
+  source << "  }\n";
+  for (int i = 0; i < inputs.size(); i++) {
+    auto& input = inputs[i];
+    source << "  std::vector<" << hostBufferType(input.type) << "> " << input.name << "(" << input.type.getNumElements() << ");\n";
+    source << "  fill(" << input.name << ", " << i << ", " << input.bound << ");\n";
+  }
+  std::string inputArgs;
+  for (auto& input : inputs) inputArgs += (inputArgs.empty() ? "" : ", ") + input.name;
+  source << "#ifdef KCG_HOST_ONLY\n";
+  source << "  check = true;\n";
+  source << "#endif\n";
+  source << "  std::vector<std::vector<double>> ref;\n";
+  source << "  if (check) ref = reference(" << inputArgs << ");\n";
+
+  // ---------------------------------- host only ----------------------------------
+  source << "#ifdef KCG_HOST_ONLY\n";
+  source << "  std::printf(\"{\\n  \\\"graph\\\": \\\"" << graphName << "\\\", \\\"mode\\\": \\\"host\\\",\\n  \\\"outputs\\\": [\");\n";
+  source << "  for (size_t i = 0; i < ref.size(); i++) {\n";
+  source << "    double sum = 0.0, absSum = 0.0;\n";
+  source << "    for (auto x : ref[i]) { sum += x; absSum += std::fabs(x); }\n";
+  source << "    std::printf(\"%s\\n    {\\\"size\\\": %zu, \\\"checksum\\\": %.9g, \\\"abs_sum\\\": %.9g}\", i == 0 ? \"\" : \",\", ref[i].size(), sum, absSum);\n";
+  source << "  }\n";
+  source << "  std::printf(\"\\n  ]\\n}\\n\");\n";
+  source << "  return 0;\n";
+
+  // ------------------------------------- gpu -------------------------------------
+  source << "#else\n";
+  for (int i = 0; i < deviceBuffers.size(); i++) {
+    auto& buffer = deviceBuffers[i];
+    auto type = hostBufferType(buffer.type);
+    auto bytes = std::to_string(buffer.type.getNumElements()) + " * sizeof(" + type + ")";
+    source << "  " << type << "* " << buffer.name << ";\n";
+    source << "  KCG_CHECK(cudaMalloc(&" << buffer.name << ", " << bytes << "));\n";
+    if (buffer.input >= 0) {
+      // the device buffers are in walk order, the inputs and the func outputs are mixed.
+      auto& input = inputs[buffer.input];
+      auto hostBytes = "std::min<size_t>(" + input.name + ".size(), " + std::to_string(buffer.type.getNumElements()) + ") * sizeof(" + type + ")";
+      source << "  KCG_CHECK(cudaMemcpy(" << buffer.name << ", " << input.name << ".data(), " << hostBytes << ", cudaMemcpyHostToDevice));\n";
+    } else {
+      source << "  KCG_CHECK(cudaMemset(" << buffer.name << ", 0, " << bytes << "));\n";
+    }
+  }
+  source << "  const char* names[] = {";
+  for (int i = 0; i < launchNames.size(); i++) source << (i == 0 ? "\"" : ", \"") << launchNames[i] << "\"";
+  source << (launchNames.empty() ? "nullptr};\n" : "};\n");
+  source << "  auto launch = [&](int kernel) {\n";
+  source << "    switch (kernel) {\n";
+  for (int i = 0; i < launchCalls.size(); i++) {
+    source << "      case " << i << ": " << launchCalls[i] << " break;\n";
+  }
+  source << "    }\n";
+  source << "  };\n";
+  source << "  const int numKernels = " << launchCalls.size() << ";\n";
+  source << "  auto runGraph = [&]() { for (int k = 0; k < numKernels; k++) launch(k); };\n\n";
+
+  // the first run is checked, the inplace operators change their inputs on the next ones.
+  source << "  runGraph();\n";
+  source << "  KCG_CHECK(cudaGetLastError());\n";
+  source << "  KCG_CHECK(cudaDeviceSynchronize());\n";
+  source << "  CheckStats stats;\n";
+  source << "  if (check) {\n";
+  for (int i = 0; i < deviceOutputs.size(); i++) {
+    auto& buffer = deviceBuffers[deviceOutputs[i]];
+    auto type = hostBufferType(buffer.type);
+    auto out = std::string("out") + std::to_string(i);
+    source << "    std::vector<" << type << "> " << out << "(" << buffer.type.getNumElements() << ");\n";
+    source << "    KCG_CHECK(cudaMemcpy(" << out << ".data(), " << buffer.name << ", " << out << ".size() * sizeof(" << type
+           << "), cudaMemcpyDeviceToHost));\n";
+    source << "    compare(" << out << ", ref[" << i << "], " << tolerance(buffer.type) << ", stats);\n";
+  }
+  source << "  }\n\n";
+
+  source << "  cudaEvent_t start, stop;\n";
+  source << "  KCG_CHECK(cudaEventCreate(&start));\n";
+  source << "  KCG_CHECK(cudaEventCreate(&stop));\n";
+  source << "  float ms = 0.0f;\n";
+  source << "  std::vector<double> kernelUs(numKernels);\n";
+  source << "  for (int k = 0; k < numKernels; k++) {\n";
+  source << "    for (int i = 0; i < warmup; i++) launch(k);\n";
+  source << "    KCG_CHECK(cudaEventRecord(start));\n";
+  source << "    for (int i = 0; i < iters; i++) launch(k);\n";
+  source << "    KCG_CHECK(cudaEventRecord(stop));\n";
+  source << "    KCG_CHECK(cudaEventSynchronize(stop));\n";
+  source << "    KCG_CHECK(cudaEventElapsedTime(&ms, start, stop));\n";
+  source << "    kernelUs[k] = ms * 1e3 / iters;\n";
+  source << "  }\n";
+  source << "  for (int i = 0; i < warmup; i++) runGraph();\n";
+  source << "  KCG_CHECK(cudaEventRecord(start));\n";
+  source << "  for (int i = 0; i < iters; i++) runGraph();\n";
+  source << "  KCG_CHECK(cudaEventRecord(stop));\n";
+  source << "  KCG_CHECK(cudaEventSynchronize(stop));\n";
+  source << "  KCG_CHECK(cudaEventElapsedTime(&ms, start, stop));\n";
+  source << "  KCG_CHECK(cudaGetLastError());\n";
+  source << "  double graphUs = ms * 1e3 / iters;\n\n";
+
+  source << "  std::printf(\"{\\n  \\\"graph\\\": \\\"" << graphName << "\\\", \\\"mode\\\": \\\"gpu\\\", \\\"warmup\\\": %d, \\\"iters\\\": %d,\\n\", warmup, iters);\n";
+  source << "  if (check) {\n";
+  source << "    std::printf(\"  \\\"check\\\": {\\\"reference\\\": \\\"host\\\", \\\"passed\\\": %s, \\\"max_abs_err\\\": %.9g, \\\"max_rel_err\\\": %.9g, \\\"mismatches\\\": %lld},\\n\",\n";
+  source << "                stats.mismatches == 0 ? \"true\" : \"false\", stats.maxAbsErr, stats.maxRelErr, (long long)stats.mismatches);\n";
+  source << "  } else {\n";
+  source << "    std::printf(\"  \\\"check\\\": null,\\n\");\n";
+  source << "  }\n";
+  source << "  std::printf(\"  \\\"kernels\\\": [\");\n";
+  source << "  for (int k = 0; k < numKernels; k++) {\n";
+  source << "    std::printf(\"%s\\n    {\\\"name\\\": \\\"%s\\\", \\\"avg_us\\\": %.3f}\", k == 0 ? \"\" : \",\", names[k], kernelUs[k]);\n";
+  source << "  }\n";
+  source << "  std::printf(\"\\n  ],\\n  \\\"graph_us\\\": %.3f\\n}\\n\", graphUs);\n";
+  for (auto& buffer : deviceBuffers) {
+    source << "  KCG_CHECK(cudaFree(" << buffer.name << "));\n";
+  }
+  source << "  return check && stats.mismatches != 0 ? 1 : 0;\n";
+  source << "#endif\n";
+  source << "}\n";
+  return source.str();
+}
+
+std::string BenchmarkHarness(mlir::ModuleOp& reference, mlir::ModuleOp& optimized) {
+  return HarnessGenerator(reference, optimized).generate();
+}
+
+}
@@ -0,0 +1,910 @@
+#include "Backend/Interpreter.h"
+#include "Backend/Harness.h"
+#include "enum.h"
+
+#include "mlir/IR/TypeUtilities.h"
+#include "mlir/Support/MathExtras.h"
+#include "llvm/ADT/DenseMap.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+namespace KernelCodeGen {
+
+/// @brief strides and bounds of a memref type, every access is checked against them.
+struct HostLayout {
+  llvm::SmallVector<int64_t> shape;
+  llvm::SmallVector<int64_t> strides;
+  int64_t offset = 0;
+  /// elements spanned from the base of the buffer.
+  int64_t extent = 0;
+  bool f32 = false;
+};
+
+struct HostSync;
+
+/// @brief a barrier of host threads. a thread leaving the kernel drops out of it, nobody waits for a finished thread.
+class HostBarrier {
+public:
+  HostBarrier(HostSync& sync_, int count_) : sync(sync_), count(count_) {}
+
+  /// @brief false if the block deadlocked: every live thread waits and none of the barriers can release.
+  bool wait();
+
+  /// @brief the caller holds the lock of `sync`.
+  void drop();
+
+private:
+  void release(int blocked);
+
+  HostSync& sync;
+  int count;
+  int waiting = 0;
+  int64_t generation = 0;
+};
+
+/// @brief the lock of all the barriers of a block, so a thread arriving at one of them sees the waiters of the others.
+struct HostSync {
+  explicit HostSync(int live_) : live(live_) {}
+  std::mutex mutex;
+  std::condition_variable cv;
+  /// threads not finished yet, and those of them waiting at a barrier.
+  int live;
+  int blocked = 0;
+  bool deadlocked = false;
+
+  void checkDeadlock() {
+    if (live > 0 && blocked >= live) {
+      deadlocked = true;
+      cv.notify_all();
+    }
+  }
+};
+
+bool HostBarrier::wait() {
+  std::unique_lock<std::mutex> lock(sync.mutex);
+  if (sync.deadlocked) return false;
+  auto current = generation;
+  if (++waiting >= count) {
+    // the waiters before this thread are blocked, this one isn't.
+    release(waiting - 1);
+    return true;
+  }
+  sync.blocked++;
+  sync.checkDeadlock();
+  sync.cv.wait(lock, [&] { return generation != current || sync.deadlocked; });
+  return generation != current;
+}
+
+void HostBarrier::drop() {
+  count--;
+  if (waiting > 0 && waiting >= count) release(waiting);
+}
+
+void HostBarrier::release(int blocked) {
+  sync.blocked -= blocked;
+  waiting = 0;
+  generation++;
+  sync.cv.notify_all();
+}
+
+/// @brief the shared memory of the block being run, allocated by the first thread reaching each alloc.
+struct HostBlock {
+  std::mutex mutex;
+  llvm::DenseMap<mlir::Operation*, std::vector<double>*> shared;
+};
+
+/// @brief the threads of a block whose body synchronizes: one barrier for the block, one per warp for the shuffles,
+///        which exchange their values through `lanes`.
+struct HostThreads {
+  explicit HostThreads(int count) : sync(count), block(sync, count), lanes(count, 0.0) {
+    for (int base = 0; base < count; base += 32) warps.emplace_back(sync, std::min(32, count - base));
+  }
+
+  /// @brief thread `id` left the kernel, the others may all be waiting for each other now.
+  void finish(int id) {
+    std::lock_guard<std::mutex> lock(sync.mutex);
+    block.drop();
+    warps[id / 32].drop();
+    sync.live--;
+    sync.checkDeadlock();
+  }
+
+  HostSync sync;
+  HostBarrier block;
+  std::deque<HostBarrier> warps;
+  std::vector<double> lanes;
+};
+
+/// @brief a scalar, or the lanes of a vector.
+using HostValue = llvm::SmallVector<double, 4>;
+
+/// @brief what the code of one thread sees, the func and the block level code have one too.
+struct HostFrame {
+  llvm::DenseMap<mlir::Value, HostValue> values;
+  llvm::DenseMap<mlir::Value, std::vector<double>*> buffers;
+  /// the registers allocated by this frame.
+  std::deque<std::vector<double>> local;
+  HostBlock* block = nullptr;
+  HostThreads* threads = nullptr;
+  /// linear id in the block, x is the fastest.
+  int thread = 0;
+  /// not added to the shared counter yet.
+  int64_t ops = 0;
+};
+
+/// @brief a frame for the code nested in `parent`, it sees the values and buffers defined so far.
+HostFrame forkFrame(const HostFrame& parent) {
+  HostFrame frame;
+  frame.values = parent.values;
+  frame.buffers = parent.buffers;
+  frame.block = parent.block;
+  frame.threads = parent.threads;
+  frame.thread = parent.thread;
+  return frame;
+}
+
+std::string printed(mlir::Type type) {
+  std::string text;
+  llvm::raw_string_ostream os(text);
+  type.print(os);
+  return os.str();
+}
+
+int64_t evalAffine(mlir::AffineExpr expr, llvm::ArrayRef<int64_t> operands, unsigned numDims) {
+  if (auto dimExpr = expr.dyn_cast<mlir::AffineDimExpr>()) {
+    return operands[dimExpr.getPosition()];
+  } else if (auto symbolExpr = expr.dyn_cast<mlir::AffineSymbolExpr>()) {
+    return operands[numDims + symbolExpr.getPosition()];
+  } else if (auto constExpr = expr.dyn_cast<mlir::AffineConstantExpr>()) {
+    return constExpr.getValue();
+  }
+  auto binaryExpr = expr.cast<mlir::AffineBinaryOpExpr>();
+  auto lhs = evalAffine(binaryExpr.getLHS(), operands, numDims);
+  auto rhs = evalAffine(binaryExpr.getRHS(), operands, numDims);
+  switch (expr.getKind()) {
+    case mlir::AffineExprKind::Add: return lhs + rhs;
+    case mlir::AffineExprKind::Mul: return lhs * rhs;
+    case mlir::AffineExprKind::FloorDiv: return mlir::floorDiv(lhs, rhs);
+    case mlir::AffineExprKind::CeilDiv: return mlir::ceilDiv(lhs, rhs);
+    case mlir::AffineExprKind::Mod: return mlir::mod(lhs, rhs);
+    default: break;
+  }
+  return 0;
+}
+
+double hostBitcast(double x, mlir::Type from, mlir::Type to) {
+  uint64_t bits = 0;
+  if (from.isF32()) {
+    float value = x;
+    uint32_t word;
+    std::memcpy(&word, &value, sizeof(word));
+    bits = word;
+  } else if (from.isF64()) {
+    std::memcpy(&bits, &x, sizeof(bits));
+  } else {
+    bits = static_cast<uint64_t>(static_cast<int64_t>(x));
+  }
+  if (to.isF32()) {
+    uint32_t word = bits;
+    float value;
+    std::memcpy(&value, &word, sizeof(value));
+    return value;
+  } else if (to.isF64()) {
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+  } else if (to.getIntOrFloatBitWidth() == 32) {
+    return static_cast<int32_t>(bits);
+  }
+  return static_cast<double>(static_cast<int64_t>(bits));
+}
+
+/// @brief the inputs of BenchmarkHarness: deterministic values in [-1, 1], the integer (index) inputs in [0, `bound`).
+void fillInput(std::vector<double>& data, mlir::Type elementType, unsigned seed, int64_t bound) {
+  unsigned state = seed * 2654435761u + 1u;
+  for (auto& x : data) {
+    state = state * 1664525u + 1013904223u;
+    x = elementType.isa<mlir::FloatType>() ? ((state >> 8) % 2001) / 1000.0 - 1.0 : double((state >> 8) % bound);
+    if (elementType.isF32()) x = static_cast<float>(x);
+  }
+}
+
+class HostInterpreter {
+public:
+  HostInterpreter(mlir::ModuleOp module_, int64_t maxOps_) : module(module_), maxOps(maxOps_) {}
+  HostRun run();
+
+private:
+  bool prepare();
+  bool run(mlir::Block* block, HostFrame& frame);
+  bool run(mlir::Operation* op, HostFrame& frame);
+  bool run(mlir::AffineForOp forOp, HostFrame& frame);
+  bool run(mlir::AffineIfOp ifOp, HostFrame& frame);
+  bool run(mlir::func::CallOp callOp, HostFrame& frame);
+  bool runGrid(mlir::AffineParallelOp parallelOp, HostFrame& frame);
+  bool runThreads(mlir::AffineParallelOp parallelOp, HostFrame& frame);
+  bool points(mlir::AffineParallelOp parallelOp, HostFrame& frame, std::vector<llvm::SmallVector<int64_t>>& result);
+  bool indices(mlir::ValueRange values, HostFrame& frame, llvm::SmallVector<int64_t>& result);
+  bool apply(mlir::AffineMap map, mlir::ValueRange operands, HostFrame& frame, llvm::SmallVector<int64_t>& result);
+  double* address(mlir::Value memref, llvm::ArrayRef<int64_t> index, int64_t width, HostFrame& frame);
+  bool load(mlir::Value memref, llvm::ArrayRef<int64_t> index, int64_t width, mlir::Value result, HostFrame& frame);
+  bool store(mlir::Value memref, llvm::ArrayRef<int64_t> index, mlir::Value value, HostFrame& frame);
+  bool read(mlir::Value memref, HostFrame& frame, std::vector<double>& data);
+  std::vector<double>* allocate(int64_t size);
+  const HostLayout& layoutOf(mlir::Type type) { return layouts.find(type)->second; }
+  bool count(HostFrame& frame);
+  bool fail(const std::string& why, bool scheduleError_ = false);
+
+  mlir::ModuleOp module;
+  int64_t maxOps;
+  std::atomic<int64_t> ops{0};
+  std::atomic<bool> failed{false};
+  bool scheduleError = false;
+  std::string reason;
+  /// guards the reason and the heap.
+  std::mutex mutex;
+  std::deque<std::vector<double>> heap;
+  /// built before the run, only read by the threads.
+  llvm::DenseMap<mlir::Type, HostLayout> layouts;
+};
+
+bool HostInterpreter::fail(const std::string& why, bool scheduleError_) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!failed) {
+    reason = why;
+    scheduleError = scheduleError_;
+  }
+  failed = true;
+  return false;
+}
+
+// the ops are added to the shared counter in batches, the threads would contend on it otherwise.
+bool HostInterpreter::count(HostFrame& frame) {
+  if (++frame.ops >= 1024) {
+    ops += frame.ops;
+    frame.ops = 0;
+    if (ops > maxOps) return fail("more than " + std::to_string(maxOps) + " ops to interpret");
+  }
+  return !failed;
+}
+
+std::vector<double>* HostInterpreter::allocate(int64_t size) {
+  std::lock_guard<std::mutex> lock(mutex);
+  heap.emplace_back(size, 0.0);
+  return &heap.back();
+}
+
+bool HostInterpreter::prepare() {
+  bool ok = true;
+  auto addLayout = [&](mlir::Type type) {
+    auto memrefType = type.dyn_cast<mlir::MemRefType>();
+    if (!memrefType || layouts.count(type) != 0) return;
+    HostLayout layout;
+    if (!memrefType.hasStaticShape() || mlir::failed(mlir::getStridesAndOffset(memrefType, layout.strides, layout.offset)) ||
+        mlir::ShapedType::isDynamicStrideOrOffset(layout.offset) ||
+        llvm::any_of(layout.strides, [](int64_t stride) { return mlir::ShapedType::isDynamicStrideOrOffset(stride); })) {
+      ok = fail("unsupported layout " + printed(type));
+      return;
+    }
+    auto shape = memrefType.getShape();
+    layout.shape.assign(shape.begin(), shape.end());
+    layout.extent = layout.offset + 1;
+    for (int i = 0; i < shape.size(); i++) {
+      layout.extent += (shape[i] - 1) * layout.strides[i];
+    }
+    if (memrefType.getNumElements() == 0) layout.extent = 0;
+    layout.f32 = memrefType.getElementType().isF32();
+    layouts[type] = layout;
+  };
+  module.walk([&](mlir::Operation* op) {
+    for (auto result : op->getResults()) addLayout(result.getType());
+    for (auto& region : op->getRegions()) {
+      for (auto& block : region) {
+        for (auto arg : block.getArguments()) addLayout(arg.getType());
+      }
+    }
+  });
+  return ok;
+}
+
+bool HostInterpreter::indices(mlir::ValueRange values, HostFrame& frame, llvm::SmallVector<int64_t>& result) {
+  result.clear();
+  for (auto value : values) {
+    auto found = frame.values.find(value);
+    if (found == frame.values.end()) return fail("an index is used before it is defined");
+    result.push_back(static_cast<int64_t>(found->second[0]));
+  }
+  return true;
+}
+
+bool HostInterpreter::apply(mlir::AffineMap map, mlir::ValueRange operands, HostFrame& frame, llvm::SmallVector<int64_t>& result) {
+  llvm::SmallVector<int64_t> args;
+  if (!indices(operands, frame, args)) return false;
+  result.clear();
+  for (auto expr : map.getResults()) {
+    result.push_back(evalAffine(expr, args, map.getNumDims()));
+  }
+  return true;
+}
+
+double* HostInterpreter::address(mlir::Value memref, llvm::ArrayRef<int64_t> index, int64_t width, HostFrame& frame) {
+  auto buffer = frame.buffers.find(memref);
+  if (buffer == frame.buffers.end()) {
+    fail("a buffer is used before it is allocated");
+    return nullptr;
+  }
+  auto& layout = layoutOf(memref.getType());
+  if (width > 1 && (layout.strides.empty() || layout.strides.back() != 1)) {
+    fail("vector access to " + printed(memref.getType()) + " with a non-unit innermost stride");
+    return nullptr;
+  }
+  int64_t linear = layout.offset;
+  for (int i = 0; i < index.size(); i++) {
+    // a vector covers `width` elements of the innermost dim.
+    auto last = index[i] + (i + 1 == index.size() ? width - 1 : 0);
+    if (index[i] < 0 || last >= layout.shape[i]) {
+      fail("out of bounds access to " + printed(memref.getType()) + " at dim " + std::to_string(i) + ": " + std::to_string(index[i]), true);
+      return nullptr;
+    }
+    linear += index[i] * layout.strides[i];
+  }
+  if (linear < 0 || linear + width > buffer->second->size()) {
+    fail("out of bounds access to " + printed(memref.getType()) + ": element " + std::to_string(linear), true);
+    return nullptr;
+  }
+  return buffer->second->data() + linear;
+}
+
+bool HostInterpreter::load(mlir::Value memref, llvm::ArrayRef<int64_t> index, int64_t width, mlir::Value result, HostFrame& frame) {
+  auto element = address(memref, index, width, frame);
+  if (!element) return false;
+  frame.values[result] = HostValue(element, element + width);
+  return true;
+}
+
+bool HostInterpreter::store(mlir::Value memref, llvm::ArrayRef<int64_t> index, mlir::Value value, HostFrame& frame) {
+  auto found = frame.values.find(value);
+  if (found == frame.values.end()) return fail("a value is stored before it is defined");
+  auto element = address(memref, index, found->second.size(), frame);
+  if (!element) return false;
+  // the buffers hold what the device would, f32 is rounded.
+  bool f32 = layoutOf(memref.getType()).f32;
+  for (auto x : found->second) {
+    *element++ = f32 ? static_cast<float>(x) : x;
+  }
+  return true;
+}
+
+/// @brief the elements of `memref` in row major order, through its layout.
+bool HostInterpreter::read(mlir::Value memref, HostFrame& frame, std::vector<double>& data) {
+  auto buffer = frame.buffers.lookup(memref);
+  if (!buffer) return fail("an output isn't a buffer");
+  auto& layout = layoutOf(memref.getType());
+  auto total = memref.getType().cast<mlir::MemRefType>().getNumElements();
+  llvm::SmallVector<int64_t> index(layout.shape.size(), 0);
+  for (int64_t n = 0; n < total; n++) {
+    int64_t linear = layout.offset;
+    for (int i = 0; i < index.size(); i++) linear += index[i] * layout.strides[i];
+    if (linear < 0 || linear >= buffer->size()) return fail("an output is out of its buffer", true);
+    data.push_back((*buffer)[linear]);
+    for (int i = index.size() - 1; i >= 0; i--) {
+      if (++index[i] < layout.shape[i]) break;
+      index[i] = 0;
+    }
+  }
+  return true;
+}
+
+bool HostInterpreter::run(mlir::Block* block, HostFrame& frame) {
+  for (auto& op : block->without_terminator()) {
+    if (!count(frame) || !run(&op, frame)) return false;
+  }
+  return true;
+}
+
+bool HostInterpreter::run(mlir::AffineForOp forOp, HostFrame& frame) {
+  llvm::SmallVector<int64_t> lbs, ubs;
+  if (!apply(forOp.getLowerBoundMap(), forOp.getLowerBoundOperands(), frame, lbs) ||
+      !apply(forOp.getUpperBoundMap(), forOp.getUpperBoundOperands(), frame, ubs)) {
+    return false;
+  }
+  auto lb = *std::max_element(lbs.begin(), lbs.end());
+  auto ub = *std::min_element(ubs.begin(), ubs.end());
+  auto iterArgs = forOp.getRegionIterArgs();
+  llvm::SmallVector<HostValue> carried;
+  for (auto init : forOp.getIterOperands()) {
+    auto found = frame.values.find(init);
+    if (found == frame.values.end()) return fail("an iter arg is used before it is defined");
+    carried.push_back(found->second);
+  }
+  auto yieldOp = forOp.getBody()->getTerminator();
+  for (int64_t iv = lb; iv < ub; iv += forOp.getStep()) {
+    frame.values[forOp.getInductionVar()] = HostValue{static_cast<double>(iv)};
+    for (int i = 0; i < iterArgs.size(); i++) {
+      frame.values[iterArgs[i]] = carried[i];
+    }
+    if (!run(forOp.getBody(), frame)) return false;
+    for (int i = 0; i < carried.size(); i++) {
+      auto found = frame.values.find(yieldOp->getOperand(i));
+      if (found == frame.values.end()) return fail("a yielded value isn't defined");
+      carried[i] = found->second;
+    }
+  }
+  for (int i = 0; i < carried.size(); i++) {
+    frame.values[forOp.getResult(i)] = carried[i];
+  }
+  return true;
+}
+
+bool HostInterpreter::run(mlir::AffineIfOp ifOp, HostFrame& frame) {
+  if (ifOp.getNumResults() != 0) return fail("affine.if with results is unsupported");
+  auto set = ifOp.getIntegerSet();
+  llvm::SmallVector<int64_t> operands;
+  if (!indices(ifOp.getOperands(), frame, operands)) return false;
+  bool holds = true;
+  for (int i = 0; i < set.getNumConstraints(); i++) {
+    auto value = evalAffine(set.getConstraint(i), operands, set.getNumDims());
+    holds = holds && (set.isEq(i) ? value == 0 : value >= 0);
+  }
+  if (holds) return run(ifOp.getThenBlock(), frame);
+  return ifOp.hasElse() ? run(ifOp.getElseBlock(), frame) : true;
+}
+
+bool HostInterpreter::run(mlir::func::CallOp callOp, HostFrame& frame) {
+  auto funcOp = module.lookupSymbol<mlir::func::FuncOp>(callOp.getCallee());
+  if (!funcOp || funcOp.isDeclaration()) return fail("call of the undefined func " + callOp.getCallee().str());
+  HostFrame callee;
+  for (auto arg : funcOp.getArguments()) {
+    auto operand = callOp.getOperand(arg.getArgNumber());
+    if (auto buffer = frame.buffers.lookup(operand)) {
+      callee.buffers[arg] = buffer;
+    } else if (frame.values.count(operand) != 0) {
+      callee.values[arg] = frame.values[operand];
+    } else {
+      return fail("an argument of " + callOp.getCallee().str() + " isn't defined");
+    }
+  }
+  auto& body = funcOp.getBody().front();
+  if (!run(&body, callee)) return false;
+  ops += callee.ops;
+  auto returnOp = body.getTerminator();
+  for (int i = 0; i < callOp.getNumResults(); i++) {
+    auto buffer = callee.buffers.lookup(returnOp->getOperand(i));
+    if (!buffer) return fail(callOp.getCallee().str() + " doesn't return a buffer");
+    frame.buffers[callOp.getResult(i)] = buffer;
+  }
+  return true;
+}
+
+bool HostInterpreter::points(mlir::AffineParallelOp parallelOp, HostFrame& frame,
+                             std::vector<llvm::SmallVector<int64_t>>& result) {
+  auto steps = parallelOp.getSteps();
+  llvm::SmallVector<int64_t> lbs, ubs;
+  for (int i = 0; i < parallelOp.getNumDims(); i++) {
+    llvm::SmallVector<int64_t> lb, ub;
+    if (!apply(parallelOp.getLowerBoundMap(i), parallelOp.getLowerBoundsOperands(), frame, lb) ||
+        !apply(parallelOp.getUpperBoundMap(i), parallelOp.getUpperBoundsOperands(), frame, ub)) {
+      return false;
+    }
+    lbs.push_back(*std::max_element(lb.begin(), lb.end()));
+    ubs.push_back(*std::min_element(ub.begin(), ub.end()));
+    if (lbs.back() >= ubs.back()) return true;
+  }
+  // row major: the last iv is x, the fastest as in the thread ids of the device.
+  auto point = lbs;
+  while (true) {
+    result.push_back(point);
+    int i = point.size() - 1;
+    for (; i >= 0; i--) {
+      point[i] += steps[i];
+      if (point[i] < ubs[i]) break;
+      point[i] = lbs[i];
+    }
+    if (i < 0) break;
+  }
+  return true;
+}
+
+bool HostInterpreter::runGrid(mlir::AffineParallelOp parallelOp, HostFrame& frame) {
+  std::vector<llvm::SmallVector<int64_t>> blocks;
+  if (!points(parallelOp, frame, blocks)) return false;
+  auto ivs = parallelOp.getIVs();
+  for (auto& point : blocks) {
+    HostBlock block;
+    auto blockFrame = forkFrame(frame);
+    blockFrame.block = &block;
+    for (int i = 0; i < ivs.size(); i++) {
+      blockFrame.values[ivs[i]] = HostValue{static_cast<double>(point[i])};
+    }
+    if (!run(parallelOp.getBody(), blockFrame)) return false;
+    ops += blockFrame.ops;
+  }
+  return true;
+}
+
+bool HostInterpreter::runThreads(mlir::AffineParallelOp parallelOp, HostFrame& frame) {
+  std::vector<llvm::SmallVector<int64_t>> threadIds;
+  if (!points(parallelOp, frame, threadIds)) return false;
+  auto ivs = parallelOp.getIVs();
+  auto runThread = [&](int id, HostFrame& thread) {
+    thread.thread = id;
+    for (int i = 0; i < ivs.size(); i++) {
+      thread.values[ivs[i]] = HostValue{static_cast<double>(threadIds[id][i])};
+    }
+    run(parallelOp.getBody(), thread);
+    ops += thread.ops;
+  };
+  bool sync = false;
+  parallelOp.walk([&](mlir::Operation* op) {
+    if (mlir::isa<mlir::gpu::BarrierOp, mlir::gpu::ShuffleOp>(op)) sync = true;
+  });
+  if (!sync) {
+    // nothing to wait for, the threads run one after the other.
+    for (int id = 0; id < threadIds.size() && !failed; id++) {
+      auto thread = forkFrame(frame);
+      runThread(id, thread);
+    }
+    return !failed;
+  }
+  HostThreads threads(threadIds.size());
+  std::vector<std::thread> workers;
+  for (int id = 0; id < threadIds.size(); id++) {
+    workers.emplace_back([&, id] {
+      auto thread = forkFrame(frame);
+      thread.threads = &threads;
+      runThread(id, thread);
+      threads.finish(id);
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  return !failed;
+}
+
+bool HostInterpreter::run(mlir::Operation* op, HostFrame& frame) {
+  // applies `fn` lane by lane, a scalar operand is broadcast to the lanes of the others.
+  auto elementwise = [&](auto fn) {
+    llvm::SmallVector<const HostValue*, 3> args;
+    size_t lanes = 1;
+    for (auto operand : op->getOperands()) {
+      auto found = frame.values.find(operand);
+      if (found == frame.values.end()) return fail("an operand of " + op->getName().getStringRef().str() + " isn't defined");
+      args.push_back(&found->second);
+      lanes = std::max(lanes, found->second.size());
+    }
+    HostValue result;
+    for (size_t lane = 0; lane < lanes; lane++) {
+      double x[3] = {0.0, 0.0, 0.0};
+      for (int i = 0; i < args.size() && i < 3; i++) {
+        x[i] = (*args[i])[args[i]->size() == 1 ? 0 : lane];
+      }
+      result.push_back(fn(x));
+    }
+    frame.values[op->getResult(0)] = std::move(result);
+    return true;
+  };
+
+  if (auto forOp = mlir::dyn_cast<mlir::AffineForOp>(op)) {
+    return run(forOp, frame);
+  } else if (auto ifOp = mlir::dyn_cast<mlir::AffineIfOp>(op)) {
+    return run(ifOp, frame);
+  } else if (auto parallelOp = mlir::dyn_cast<mlir::AffineParallelOp>(op)) {
+    // the outermost parallel is the grid, the nested one the threads of a block.
+    if (parallelOp->getParentOfType<mlir::AffineParallelOp>()) return runThreads(parallelOp, frame);
+    return runGrid(parallelOp, frame);
+  } else if (auto callOp = mlir::dyn_cast<mlir::func::CallOp>(op)) {
+    return run(callOp, frame);
+  } else if (auto allocOp = mlir::dyn_cast<mlir::memref::AllocOp>(op)) {
+    auto type = allocOp.getType();
+    auto extent = layoutOf(type).extent;
+    auto memorySpace = type.getMemorySpaceAsInt();
+    if (memorySpace == static_cast<int>(MemorySpace::shared) && frame.block) {
+      std::lock_guard<std::mutex> lock(frame.block->mutex);
+      auto& buffer = frame.block->shared[op];
+      if (!buffer) buffer = allocate(extent);
+      frame.buffers[allocOp.getResult()] = buffer;
+    } else if (memorySpace == static_cast<int>(MemorySpace::local)) {
+      frame.local.emplace_back(extent, 0.0);
+      frame.buffers[allocOp.getResult()] = &frame.local.back();
+    } else {
+      frame.buffers[allocOp.getResult()] = allocate(extent);
+    }
+    return true;
+  } else if (mlir::isa<mlir::memref::DeallocOp>(op)) {
+    return true;
+  } else if (mlir::isa<mlir::memref::SubViewOp, mlir::memref::ReinterpretCastOp>(op)) {
+    // a view shares the buffer of its source, its layout addresses it.
+    auto buffer = frame.buffers.lookup(op->getOperand(0));
+    if (!buffer) return fail("a view of an undefined buffer");
+    frame.buffers[op->getResult(0)] = buffer;
+    return true;
+  } else if (auto loadOp = mlir::dyn_cast<mlir::AffineLoadOp>(op)) {
+    llvm::SmallVector<int64_t> index;
+    return apply(loadOp.getAffineMap(), loadOp.getMapOperands(), frame, index) &&
+           load(loadOp.getMemref(), index, 1, loadOp.getResult(), frame);
+  } else if (auto storeOp = mlir::dyn_cast<mlir::AffineStoreOp>(op)) {
+    llvm::SmallVector<int64_t> index;
+    return apply(storeOp.getAffineMap(), storeOp.getMapOperands(), frame, index) &&
+           store(storeOp.getMemref(), index, storeOp.getValue(), frame);
+  } else if (auto loadOp = mlir::dyn_cast<mlir::AffineVectorLoadOp>(op)) {
+    // a cp.async source, the copy completes at once.
+    llvm::SmallVector<int64_t> index;
+    return apply(loadOp.getAffineMap(), loadOp.getMapOperands(), frame, index) &&
+           load(loadOp.getMemref(), index, loadOp.getVectorType().getNumElements(), loadOp.getResult(), frame);
+  } else if (auto storeOp = mlir::dyn_cast<mlir::AffineVectorStoreOp>(op)) {
+    llvm::SmallVector<int64_t> index;
+    return apply(storeOp.getAffineMap(), storeOp.getMapOperands(), frame, index) &&
+           store(storeOp.getMemref(), index, storeOp.getValue(), frame);
+  } else if (auto loadOp = mlir::dyn_cast<mlir::memref::LoadOp>(op)) {
+    llvm::SmallVector<int64_t> index;
+    return indices(loadOp.getIndices(), frame, index) && load(loadOp.getMemref(), index, 1, loadOp.getResult(), frame);
+  } else if (auto storeOp = mlir::dyn_cast<mlir::memref::StoreOp>(op)) {
+    llvm::SmallVector<int64_t> index;
+    return indices(storeOp.getIndices(), frame, index) && store(storeOp.getMemref(), index, storeOp.getValue(), frame);
+  } else if (auto applyOp = mlir::dyn_cast<mlir::AffineApplyOp>(op)) {
+    llvm::SmallVector<int64_t> result;
+    if (!apply(applyOp.getAffineMap(), applyOp.getMapOperands(), frame, result)) return false;
+    frame.values[applyOp.getResult()] = HostValue{static_cast<double>(result[0])};
+    return true;
+  } else if (auto constOp = mlir::dyn_cast<mlir::arith::ConstantOp>(op)) {
+    auto attr = constOp.getValue();
+    int64_t lanes = 1;
+    if (auto splatAttr = attr.dyn_cast<mlir::SplatElementsAttr>()) {
+      lanes = splatAttr.getType().getNumElements();
+      attr = splatAttr.getSplatValue<mlir::Attribute>();
+    }
+    double value;
+    if (auto floatAttr = attr.dyn_cast<mlir::FloatAttr>()) {
+      value = floatAttr.getValueAsDouble();
+    } else if (auto intAttr = attr.dyn_cast<mlir::IntegerAttr>()) {
+      // i1 true is 1, not -1.
+      value = intAttr.getType().isInteger(1) ? intAttr.getValue().getZExtValue() : intAttr.getValue().getSExtValue();
+    } else {
+      return fail("unsupported constant " + printed(constOp.getType()));
+    }
+    frame.values[constOp.getResult()] = HostValue(lanes, value);
+    return true;
+  } else if (mlir::isa<mlir::arith::AddFOp, mlir::arith::AddIOp>(op)) {
+    return elementwise([](const double* x) { return x[0] + x[1]; });
+  } else if (mlir::isa<mlir::arith::SubFOp, mlir::arith::SubIOp>(op)) {
+    return elementwise([](const double* x) { return x[0] - x[1]; });
+  } else if (mlir::isa<mlir::arith::MulFOp, mlir::arith::MulIOp>(op)) {
+    return elementwise([](const double* x) { return x[0] * x[1]; });
+  } else if (mlir::isa<mlir::arith::DivFOp>(op)) {
+    return elementwise([](const double* x) { return x[0] / x[1]; });
+  } else if (mlir::isa<mlir::arith::MaxFOp>(op)) {
+    return elementwise([](const double* x) { return std::max(x[0], x[1]); });
+  } else if (mlir::isa<mlir::arith::MinFOp>(op)) {
+    return elementwise([](const double* x) { return std::min(x[0], x[1]); });
+  } else if (mlir::isa<mlir::arith::NegFOp>(op)) {
+    return elementwise([](const double* x) { return -x[0]; });
+  } else if (mlir::isa<mlir::math::FmaOp>(op)) {
+    return elementwise([](const double* x) { return std::fma(x[0], x[1], x[2]); });
+  } else if (mlir::isa<mlir::math::ExpOp>(op)) {
+    return elementwise([](const double* x) { return std::exp(x[0]); });
+  } else if (mlir::isa<mlir::math::LogOp>(op)) {
+    return elementwise([](const double* x) { return std::log(x[0]); });
+  } else if (mlir::isa<mlir::math::SqrtOp>(op)) {
+    return elementwise([](const double* x) { return std::sqrt(x[0]); });
+  } else if (mlir::isa<mlir::math::RsqrtOp>(op)) {
+    return elementwise([](const double* x) { return 1.0 / std::sqrt(x[0]); });
+  } else if (mlir::isa<mlir::math::TanhOp>(op)) {
+    return elementwise([](const double* x) { return std::tanh(x[0]); });
+  } else if (mlir::isa<mlir::math::PowFOp>(op)) {
+    return elementwise([](const double* x) { return std::pow(x[0], x[1]); });
+  } else if (auto cmpOp = mlir::dyn_cast<mlir::arith::CmpFOp>(op)) {
+    using Predicate = mlir::arith::CmpFPredicate;
+    switch (cmpOp.getPredicate()) {
+      case Predicate::OEQ: case Predicate::UEQ: return elementwise([](const double* x) { return double(x[0] == x[1]); });
+      case Predicate::ONE: case Predicate::UNE: return elementwise([](const double* x) { return double(x[0] != x[1]); });
+      case Predicate::OGT: case Predicate::UGT: return elementwise([](const double* x) { return double(x[0] > x[1]); });
+      case Predicate::OGE: case Predicate::UGE: return elementwise([](const double* x) { return double(x[0] >= x[1]); });
+      case Predicate::OLT: case Predicate::ULT: return elementwise([](const double* x) { return double(x[0] < x[1]); });
+      case Predicate::OLE: case Predicate::ULE: return elementwise([](const double* x) { return double(x[0] <= x[1]); });
+      default: break;
+    }
+    return fail("unsupported cmpf predicate");
+  } else if (mlir::isa<mlir::arith::SelectOp>(op)) {
+    return elementwise([](const double* x) { return x[0] != 0.0 ? x[1] : x[2]; });
+  } else if (mlir::isa<mlir::arith::IndexCastOp>(op)) {
+    return elementwise([](const double* x) { return x[0]; });
+  } else if (auto castOp = mlir::dyn_cast<mlir::arith::BitcastOp>(op)) {
+    auto from = mlir::getElementTypeOrSelf(castOp.getIn().getType());
+    auto to = mlir::getElementTypeOrSelf(castOp.getType());
+    return elementwise([&](const double* x) { return hostBitcast(x[0], from, to); });
+  } else if (auto barrierOp = mlir::dyn_cast<mlir::gpu::BarrierOp>(op)) {
+    if (barrierOp->hasAttr(std::string("barrier.id"))) return fail("named barriers are unsupported");
+    if (frame.threads && !frame.threads->block.wait()) return fail("the threads of a block deadlocked at a barrier", true);
+    return !failed;
+  } else if (auto shflOp = mlir::dyn_cast<mlir::gpu::ShuffleOp>(op)) {
+    auto value = frame.values.find(shflOp.value());
+    auto offset = frame.values.find(shflOp.offset());
+    auto width = frame.values.find(shflOp.width());
+    if (value == frame.values.end() || offset == frame.values.end() || width == frame.values.end()) {
+      return fail("an operand of a shuffle isn't defined");
+    }
+    auto mode = shflOp.mode();
+    if (!frame.threads || value->second.size() != 1 ||
+        (mode != mlir::gpu::ShuffleMode::DOWN && mode != mlir::gpu::ShuffleMode::IDX)) {
+      return fail("unsupported shuffle");
+    }
+    auto& threads = *frame.threads;
+    auto& warp = threads.warps[frame.thread / 32];
+    int lane = frame.thread % 32, base = frame.thread - lane;
+    int delta = offset->second[0], segment = std::max<int>(1, width->second[0]);
+    auto own = value->second[0];
+    threads.lanes[frame.thread] = own;
+    if (!warp.wait()) return fail("the threads of a block deadlocked at a shuffle", true);
+    // __shfl_down_sync keeps its own value past the end of the segment, __shfl_sync reads a lane of its segment.
+    int source = frame.thread;
+    if (mode == mlir::gpu::ShuffleMode::DOWN) {
+      if (lane % segment + delta < segment) source = frame.thread + delta;
+    } else {
+      source = base + lane / segment * segment + delta % segment;
+    }
+    auto result = source < threads.lanes.size() ? threads.lanes[source] : own;
+    if (!warp.wait()) return fail("the threads of a block deadlocked at a shuffle", true);
+    frame.values[shflOp.getResult(0)] = HostValue{result};
+    frame.values[shflOp.getResult(1)] = HostValue{1.0};
+    return !failed;
+  }
+  return fail("unsupported op " + op->getName().getStringRef().str());
+}
+
+HostRun HostInterpreter::run() {
+  HostRun result;
+  HostFrame frame;
+  if (prepare()) {
+    unsigned input = 0;
+    for (auto& op : module.getBody()->getOperations()) {
+      if (failed) break;
+      if (mlir::isa<mlir::func::FuncOp>(op)) continue;
+      if (auto allocOp = mlir::dyn_cast<mlir::memref::AllocOp>(op)) {
+        auto buffer = allocate(layoutOf(allocOp.getType()).extent);
+        fillInput(*buffer, allocOp.getType().getElementType(), input++, indexBound(allocOp));
+        frame.buffers[allocOp.getResult()] = buffer;
+        continue;
+      }
+      if (!run(&op, frame)) break;
+      auto callOp = mlir::dyn_cast<mlir::func::CallOp>(op);
+      if (!callOp) continue;
+      for (auto value : callOp.getResults()) {
+        if (!isGraphOutput(value)) continue;
+        result.outputs.emplace_back();
+        result.elementTypes.push_back(value.getType().cast<mlir::MemRefType>().getElementType());
+        if (!read(value, frame, result.outputs.back())) break;
+      }
+    }
+  }
+  result.ok = !failed;
+  result.scheduleError = scheduleError;
+  result.reason = reason;
+  return result;
+}
+
+HostRun InterpretGraph(mlir::ModuleOp module, int64_t maxOps) {
+  HostInterpreter interpreter(module, maxOps);
+  return interpreter.run();
+}
+
+bool CompareRuns(const HostRun& reference, const HostRun& candidate, std::string& reason) {
+  if (reference.outputs.size() != candidate.outputs.size()) {
+    reason = std::to_string(candidate.outputs.size()) + " outputs instead of " + std::to_string(reference.outputs.size());
+    return false;
+  }
+  for (int i = 0; i < reference.outputs.size(); i++) {
+    auto& expected = reference.outputs[i];
+    auto& actual = candidate.outputs[i];
+    if (expected.size() != actual.size()) {
+      reason = "output " + std::to_string(i) + " has " + std::to_string(actual.size()) + " elements instead of " +
+               std::to_string(expected.size());
+      return false;
+    }
+    auto elementType = reference.elementTypes[i];
+    double tolerance = elementType.isF64() ? 1e-9 : elementType.isa<mlir::FloatType>() ? 1e-3 : 0.0;
+    int64_t mismatches = 0, first = -1;
+    for (int64_t j = 0; j < expected.size(); j++) {
+      auto err = std::fabs(actual[j] - expected[j]);
+      // negated, a nan never passes.
+      if (!(err <= tolerance + tolerance * std::fabs(expected[j]))) {
+        if (first < 0) first = j;
+        mismatches++;
+      }
+    }
+    if (mismatches != 0) {
+      std::stringstream str;
+      str << mismatches << " of " << expected.size() << " elements of output " << i << " differ, the first at " << first
+          << ": " << actual[first] << " instead of " << expected[first];
+      reason = str.str();
+      return false;
+    }
+  }
+  return true;
+}
+
+/// @brief `dim` halved while it stays at least `minDim` and keeps its power-of-two factor (up to `minDim`).
+int64_t shrinkDim(int64_t dim, int64_t minDim) {
+  int64_t keep = 1;
+  while (keep < minDim && dim % (keep * 2) == 0) keep *= 2;
+  while (dim % 2 == 0 && dim / 2 >= minDim && (dim / 2) % keep == 0) dim /= 2;
+  return dim;
+}
+
+bool ShrinkShapes(mlir::ModuleOp module, int64_t minDim, std::string& reason) {
+  llvm::DenseMap<int64_t, int64_t> dims;
+  auto shrink = [&](mlir::Type type) -> mlir::Type {
+    auto memrefType = type.dyn_cast<mlir::MemRefType>();
+    if (!memrefType) return type;
+    llvm::SmallVector<int64_t> shape;
+    for (auto dim : memrefType.getShape()) {
+      shape.push_back(mlir::ShapedType::isDynamic(dim) ? dim : shrinkDim(dim, minDim));
+      if (shape.back() != dim) dims[dim] = shape.back();
+    }
+    if (llvm::ArrayRef<int64_t>(shape) == memrefType.getShape()) return type;
+    return static_cast<mlir::MemRefType>(mlir::MemRefType::Builder(memrefType).setShape(shape));
+  };
+
+  // the layout maps of views are tied to the shapes of their sources, only dense buffers are shrunk.
+  bool ok = true;
+  module.walk([&](mlir::Operation* op) {
+    for (auto result : op->getResults()) {
+      auto memrefType = result.getType().dyn_cast<mlir::MemRefType>();
+      if (!memrefType || shrink(memrefType) == memrefType) continue;
+      if (!memrefType.getLayout().isIdentity() || mlir::isa<mlir::memref::SubViewOp, mlir::memref::ReinterpretCastOp>(op)) {
+        reason = "views of shrunk buffers, " + printed(memrefType);
+        ok = false;
+      }
+    }
+    if (mlir::isa<mlir::memref::SubViewOp, mlir::memref::ReinterpretCastOp>(op) &&
+        shrink(op->getOperand(0).getType()) != op->getOperand(0).getType()) {
+      reason = "views of shrunk buffers, " + printed(op->getOperand(0).getType());
+      ok = false;
+    }
+    // every shrunk dim is known before the loop bounds are rewritten.
+    for (auto& region : op->getRegions()) {
+      for (auto& block : region) {
+        for (auto arg : block.getArguments()) shrink(arg.getType());
+      }
+    }
+  });
+  if (!ok) return false;
+
+  module.walk([&](mlir::Operation* op) {
+    for (auto result : op->getResults()) {
+      result.setType(shrink(result.getType()));
+    }
+    for (auto& region : op->getRegions()) {
+      for (auto& block : region) {
+        for (auto arg : block.getArguments()) arg.setType(shrink(arg.getType()));
+      }
+    }
+    if (auto funcOp = mlir::dyn_cast<mlir::func::FuncOp>(op)) {
+      llvm::SmallVector<mlir::Type> inputs, results;
+      for (auto type : funcOp.getFunctionType().getInputs()) inputs.push_back(shrink(type));
+      for (auto type : funcOp.getFunctionType().getResults()) results.push_back(shrink(type));
+      funcOp.setType(mlir::FunctionType::get(op->getContext(), inputs, results));
+    } else if (auto forOp = mlir::dyn_cast<mlir::AffineForOp>(op)) {
+      // the loops of the naive funcs run over whole dims.
+      if (forOp.hasConstantUpperBound() && dims.count(forOp.getConstantUpperBound()) != 0) {
+        forOp.setConstantUpperBound(dims[forOp.getConstantUpperBound()]);
+      }
+    } else if (auto allocOp = mlir::dyn_cast<mlir::memref::AllocOp>(op)) {
+      // the indices stay in the shrunk dim they index.
+      auto bound = indexBound(allocOp);
+      if (dims.count(bound) != 0) {
+        allocOp->setAttr(std::string("index.bound"), mlir::Builder(op->getContext()).getI64IntegerAttr(dims[bound]));
+      }
+    }
+  });
+  return true;
+}
+
+}
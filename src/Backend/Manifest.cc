@@ -0,0 +1,346 @@
+#include "Backend/Manifest.h"
+#include "Optimizer/Analyzer.h"
+#include "enum.h"
+
+#include "mlir/Support/MathExtras.h"
+
+#include <sstream>
+#include <set>
+#include <algorithm>
+#include <cctype>
+
+namespace KernelCodeGen {
+
+int64_t elementBytes(mlir::Type type) {
+  // index is emitted as int.
+  if (type.isa<mlir::IndexType>()) return 4;
+  return std::max<int64_t>(type.getIntOrFloatBitWidth() / 8, 1);
+}
+
+int64_t valueBytes(mlir::Type type) {
+  if (auto vectorType = type.dyn_cast<mlir::VectorType>()) {
+    return vectorType.getNumElements() * elementBytes(vectorType.getElementType());
+  }
+  return elementBytes(type);
+}
+
+bool isGlobal(mlir::Value mem) {
+  auto type = mem.getType().dyn_cast<mlir::MemRefType>();
+  if (!type) return false;
+  auto memorySpace = type.getMemorySpaceAsInt();
+  return memorySpace != static_cast<int>(MemorySpace::shared) && memorySpace != static_cast<int>(MemorySpace::local);
+}
+
+/// @brief how many times `op` runs per thread: the product of the trip counts of the loops around it in `kernel`.
+int64_t countPerThread(mlir::Operation* op, mlir::AffineParallelOp kernel) {
+  int64_t count = 1;
+  for (auto forOp = op->getParentOfType<mlir::AffineForOp>(); forOp && kernel->isProperAncestor(forOp);
+       forOp = forOp->getParentOfType<mlir::AffineForOp>()) {
+    if (!forOp.hasConstantBounds()) continue;
+    auto step = forOp.getStep();
+    count *= (forOp.getConstantUpperBound() - forOp.getConstantLowerBound() + step - 1) / step;
+  }
+  return count;
+}
+
+int64_t evalExpr(mlir::AffineExpr expr, const std::vector<int64_t>& values) {
+  if (auto dimExpr = expr.dyn_cast<mlir::AffineDimExpr>()) return values[dimExpr.getPosition()];
+  if (auto constExpr = expr.dyn_cast<mlir::AffineConstantExpr>()) return constExpr.getValue();
+  auto binaryExpr = expr.cast<mlir::AffineBinaryOpExpr>();
+  auto lhs = evalExpr(binaryExpr.getLHS(), values);
+  auto rhs = evalExpr(binaryExpr.getRHS(), values);
+  switch (binaryExpr.getKind()) {
+    case mlir::AffineExprKind::Add: return lhs + rhs;
+    case mlir::AffineExprKind::Mul: return lhs * rhs;
+    case mlir::AffineExprKind::FloorDiv: return mlir::floorDiv(lhs, rhs);
+    case mlir::AffineExprKind::CeilDiv: return mlir::ceilDiv(lhs, rhs);
+    case mlir::AffineExprKind::Mod: return mlir::mod(lhs, rhs);
+    default: assert(false);
+  }
+  return 0;
+}
+
+mlir::AffineParallelOp getParallelOwner(mlir::Value value) {
+  auto blockArgument = value.dyn_cast<mlir::BlockArgument>();
+  if (!blockArgument) return nullptr;
+  return mlir::dyn_cast<mlir::AffineParallelOp>(blockArgument.getOwner()->getParentOp());
+}
+
+/// @brief the share of the points of its operands for which the condition of `ifOp` holds. the operands are
+///        the ivs of the kernel (grid and block levels, normalized to start at 0) and of its loops, and constants;
+///        an if on other values (or over more than 2^20 points) is taken as always true.
+double thenFraction(mlir::AffineIfOp ifOp) {
+  std::vector<int64_t> lower, extent;
+  int64_t points = 1;
+  for (auto operand : ifOp->getOperands()) {
+    int64_t lb = 0, ub = 0;
+    if (auto constOp = operand.getDefiningOp<mlir::arith::ConstantIndexOp>()) {
+      lb = constOp.value();
+      ub = lb + 1;
+    } else if (auto forOp = mlir::getForInductionVarOwner(operand)) {
+      if (!forOp.hasConstantBounds() || forOp.getStep() != 1) return 1.0;
+      lb = forOp.getConstantLowerBound();
+      ub = forOp.getConstantUpperBound();
+    } else if (auto parallelOp = getParallelOwner(operand)) {
+      int64_t totalNumber;
+      auto dims = Analyzer::getParallelNumber(parallelOp, totalNumber);
+      ub = dims[operand.cast<mlir::BlockArgument>().getArgNumber()];
+    } else {
+      return 1.0;
+    }
+    if (ub <= lb) return 0.0;
+    lower.push_back(lb);
+    extent.push_back(ub - lb);
+    points *= ub - lb;
+    if (points > (1 << 20)) return 1.0;
+  }
+  auto iset = ifOp.getIntegerSet();
+  int64_t holds = 0;
+  std::vector<int64_t> values(lower.size());
+  for (int64_t point = 0; point < points; point++) {
+    auto rest = point;
+    for (int i = 0; i < values.size(); i++) {
+      values[i] = lower[i] + rest % extent[i];
+      rest /= extent[i];
+    }
+    bool satisfied = true;
+    for (int i = 0; i < iset.getNumConstraints() && satisfied; i++) {
+      auto value = evalExpr(iset.getConstraint(i), values);
+      satisfied = iset.isEq(i) ? value == 0 : value >= 0;
+    }
+    holds += satisfied;
+  }
+  return double(holds) / points;
+}
+
+/// @brief the share of the runs of the loops around `op` in `kernel` which reach it through the ifs around it
+///        (the tail guards, the producer/consumer roles), each if weighted by thenFraction.
+double activeFraction(mlir::Operation* op, mlir::AffineParallelOp kernel, llvm::DenseMap<mlir::Operation*, double>& fractions) {
+  double fraction = 1.0;
+  for (auto parent = op->getParentOp(); parent && parent != kernel.getOperation(); parent = parent->getParentOp()) {
+    auto ifOp = mlir::dyn_cast<mlir::AffineIfOp>(parent);
+    if (!ifOp) continue;
+    if (!fractions.count(parent)) fractions[parent] = thenFraction(ifOp);
+    bool inThen = ifOp.getThenRegion().isAncestor(op->getParentRegion());
+    fraction *= inThen ? fractions[parent] : 1.0 - fractions[parent];
+  }
+  return fraction;
+}
+
+/// @brief floating point operations of one run of `op`.
+int64_t flopsOf(mlir::Operation* op) {
+  int64_t flops = 0;
+  if (mlir::isa<mlir::math::FmaOp>(op)) {
+    flops = 2;
+  } else if (mlir::isa<mlir::arith::AddFOp, mlir::arith::SubFOp, mlir::arith::MulFOp, mlir::arith::DivFOp,
+                       mlir::arith::MaxFOp, mlir::arith::CmpFOp, mlir::math::ExpOp, mlir::math::LogOp,
+                       mlir::math::TanhOp, mlir::math::SqrtOp, mlir::math::RsqrtOp, mlir::math::PowFOp>(op)) {
+    flops = 1;
+  }
+  if (flops == 0 || op->getNumOperands() == 0) return flops;
+  if (auto vectorType = op->getOperand(0).getType().dyn_cast<mlir::VectorType>()) {
+    flops *= vectorType.getNumElements();
+  }
+  return flops;
+}
+
+KernelProfile profileKernel(mlir::AffineParallelOp kernel) {
+  KernelProfile profile;
+  int64_t gridSize = 1, blockSize = 1;
+  profile.grid = Analyzer::getParallelNumber(kernel, gridSize);
+  kernel.walk<mlir::WalkOrder::PreOrder>([&](mlir::AffineParallelOp parallelOp) {
+    if (parallelOp != kernel) profile.block = Analyzer::getParallelNumber(parallelOp, blockSize);
+  });
+  // the last iv is x.
+  std::reverse(profile.grid.begin(), profile.grid.end());
+  std::reverse(profile.block.begin(), profile.block.end());
+  auto threads = gridSize * blockSize;
+
+  // registers: the local buffers, plus indices, addresses and temporaries. nvcc (-Xptxas -v) has the last word.
+  int64_t registers = 32;
+  kernel.walk([&](mlir::memref::AllocOp allocOp) {
+    auto type = allocOp.getType();
+    auto bytes = type.getNumElements() * elementBytes(type.getElementType());
+    if (type.getMemorySpaceAsInt() == static_cast<int>(MemorySpace::shared)) {
+      profile.sharedBytes += bytes;
+    } else {
+      registers += (bytes + 3) / 4;
+    }
+  });
+  profile.registers = std::min<int64_t>(registers, 255);
+
+  llvm::DenseMap<mlir::Operation*, double> fractions;
+  auto runs = [&](mlir::Operation* op) {
+    return static_cast<int64_t>(countPerThread(op, kernel) * threads * activeFraction(op, kernel, fractions));
+  };
+  std::set<void*> readBuffers, writtenBuffers;
+  auto access = [&](mlir::Operation* op, mlir::Value mem, mlir::Type type, bool write) {
+    if (!isGlobal(mem)) return;
+    profile.globalBytes += runs(op) * valueBytes(type);
+    auto& buffers = write ? writtenBuffers : readBuffers;
+    if (buffers.insert(mem.getAsOpaquePointer()).second) {
+      auto memType = mem.getType().cast<mlir::MemRefType>();
+      profile.minGlobalBytes += memType.getNumElements() * elementBytes(memType.getElementType());
+    }
+  };
+  kernel.walk([&](mlir::Operation* op) {
+    if (auto forOp = mlir::dyn_cast<mlir::AffineForOp>(op)) {
+      if (forOp->hasAttr(std::string("affine.mma"))) profile.mma = true;
+    } else if (auto loadOp = mlir::dyn_cast<mlir::AffineLoadOp>(op)) {
+      access(op, loadOp.getMemref(), loadOp.getType(), false);
+    } else if (auto loadOp = mlir::dyn_cast<mlir::memref::LoadOp>(op)) {
+      access(op, loadOp.getMemref(), loadOp.getType(), false);
+    } else if (auto vecLoadOp = mlir::dyn_cast<mlir::AffineVectorLoadOp>(op)) {
+      access(op, vecLoadOp.getMemref(), vecLoadOp.getType(), false);
+    } else if (auto storeOp = mlir::dyn_cast<mlir::AffineStoreOp>(op)) {
+      access(op, storeOp.getMemref(), storeOp.getValue().getType(), true);
+    } else if (auto vecStoreOp = mlir::dyn_cast<mlir::AffineVectorStoreOp>(op)) {
+      access(op, vecStoreOp.getMemref(), vecStoreOp.getValue().getType(), true);
+    } else if (auto flops = flopsOf(op)) {
+      profile.flops += runs(op) * flops;
+    }
+  });
+  return profile;
+}
+
+std::vector<KernelProfile> profileKernels(mlir::ModuleOp& module) {
+  std::vector<KernelProfile> profiles;
+  // same walk as CUDAGen, which names the kernels kernel0, kernel1, ...
+  module.walk<mlir::WalkOrder::PreOrder>([&](mlir::func::FuncOp funcOp) {
+    if (funcOp.isDeclaration()) return;
+    auto funcName = funcOp.getSymName().str();
+    // the operator is the name without the shape fields: "Matmul_m1024n1024k512" -> "Matmul".
+    std::string op;
+    std::stringstream fields(funcName);
+    std::string field;
+    while (std::getline(fields, field, '_')) {
+      if (std::any_of(field.begin(), field.end(), ::isdigit)) break;
+      op += (op.empty() ? "" : "_") + field;
+    }
+    for (auto& kernel : funcOp.getBody().front().getOperations()) {
+      auto parallelOp = mlir::dyn_cast<mlir::AffineParallelOp>(kernel);
+      if (!parallelOp) continue;
+      auto profile = profileKernel(parallelOp);
+      profile.kernel = "kernel" + std::to_string(profiles.size());
+      profile.func = funcName;
+      profile.op = op;
+      profiles.push_back(profile);
+    }
+  });
+  return profiles;
+}
+
+KernelProfile profileWork(mlir::func::FuncOp funcOp) {
+  KernelProfile profile;
+  profile.func = funcOp.getSymName().str();
+  // the loops of the func around `op`, the naive funcs have no kernel yet.
+  auto countInFunc = [&](mlir::Operation* op) {
+    int64_t count = 1;
+    for (auto parent = op->getParentOp(); parent && parent != funcOp.getOperation(); parent = parent->getParentOp()) {
+      if (auto forOp = mlir::dyn_cast<mlir::AffineForOp>(parent)) {
+        if (!forOp.hasConstantBounds()) continue;
+        auto step = forOp.getStep();
+        count *= (forOp.getConstantUpperBound() - forOp.getConstantLowerBound() + step - 1) / step;
+      } else if (auto parallelOp = mlir::dyn_cast<mlir::AffineParallelOp>(parent)) {
+        int64_t totalNumber;
+        Analyzer::getParallelNumber(parallelOp, totalNumber);
+        count *= totalNumber;
+      }
+    }
+    return count;
+  };
+  // only the arguments and the results must be moved, the temporaries of the naive loops may stay on chip.
+  std::vector<mlir::Value> interface(funcOp.getArguments().begin(), funcOp.getArguments().end());
+  funcOp.walk([&](mlir::func::ReturnOp returnOp) {
+    interface.insert(interface.end(), returnOp.getOperands().begin(), returnOp.getOperands().end());
+  });
+  // a buffer both read and written (an accumulator, an inplace op) may be kept in registers, only its write counts.
+  std::vector<mlir::Value> readBuffers, writtenBuffers;
+  auto access = [&](mlir::Value mem, bool write) {
+    if (!isGlobal(mem) || std::find(interface.begin(), interface.end(), mem) == interface.end()) return;
+    auto& buffers = write ? writtenBuffers : readBuffers;
+    if (std::find(buffers.begin(), buffers.end(), mem) == buffers.end()) buffers.push_back(mem);
+  };
+  funcOp.walk([&](mlir::Operation* op) {
+    if (auto loadOp = mlir::dyn_cast<mlir::AffineLoadOp>(op)) {
+      access(loadOp.getMemref(), false);
+    } else if (auto loadOp = mlir::dyn_cast<mlir::memref::LoadOp>(op)) {
+      access(loadOp.getMemref(), false);
+    } else if (auto storeOp = mlir::dyn_cast<mlir::AffineStoreOp>(op)) {
+      access(storeOp.getMemref(), true);
+    } else if (auto storeOp = mlir::dyn_cast<mlir::memref::StoreOp>(op)) {
+      access(storeOp.getMemref(), true);
+    } else if (auto flops = flopsOf(op)) {
+      profile.flops += countInFunc(op) * flops;
+    }
+  });
+  auto bytesOf = [](mlir::Value mem) {
+    auto memType = mem.getType().cast<mlir::MemRefType>();
+    return memType.getNumElements() * elementBytes(memType.getElementType());
+  };
+  for (auto mem : writtenBuffers) profile.minGlobalBytes += bytesOf(mem);
+  for (auto mem : readBuffers) {
+    if (std::find(writtenBuffers.begin(), writtenBuffers.end(), mem) == writtenBuffers.end()) profile.minGlobalBytes += bytesOf(mem);
+  }
+  profile.globalBytes = profile.minGlobalBytes;
+  return profile;
+}
+
+double rooflineUs(int64_t flops, int64_t bytes, double peakGFlops, double bandwidthGBs) {
+  // GFLOP/s and GB/s are flops and bytes per ns.
+  return std::max(flops / peakGFlops, bytes / bandwidthGBs) / 1e3;
+}
+
+RooflineEstimate estimateRoofline(mlir::ModuleOp& module, const DeviceSpec& device) {
+  RooflineEstimate estimate;
+  for (auto& profile : profileKernels(module)) {
+    auto peak = profile.mma ? device.peakMMAGFlops : device.peakGFlops;
+    estimate.latencyUs += rooflineUs(profile.flops, profile.globalBytes, peak, device.bandwidthGBs);
+    estimate.boundUs += rooflineUs(profile.flops, profile.minGlobalBytes, peak, device.bandwidthGBs);
+    estimate.flops += profile.flops;
+    estimate.minGlobalBytes += profile.minGlobalBytes;
+  }
+  return estimate;
+}
+
+std::string KernelManifest(mlir::ModuleOp& module, const DeviceSpec& device) {
+  auto toJson = [](const std::vector<int64_t>& dims) {
+    std::string str = "[";
+    for (int i = 0; i < dims.size(); i++) {
+      str += (i == 0 ? "" : ", ") + std::to_string(dims[i]);
+    }
+    return str + "]";
+  };
+
+  std::stringstream json;
+  json << "{\n";
+  json << "  \"device\": {\"name\": \"" << device.name << "\", \"peak_gflops\": " << device.peakGFlops
+       << ", \"peak_mma_gflops\": " << device.peakMMAGFlops << ", \"bandwidth_gbs\": " << device.bandwidthGBs << "},\n";
+  json << "  \"kernels\": [";
+  auto profiles = profileKernels(module);
+  for (int i = 0; i < profiles.size(); i++) {
+    auto& profile = profiles[i];
+    auto peak = profile.mma ? device.peakMMAGFlops : device.peakGFlops;
+    double intensity = profile.minGlobalBytes ? double(profile.flops) / profile.minGlobalBytes : 0.0;
+    double estIntensity = profile.globalBytes ? double(profile.flops) / profile.globalBytes : 0.0;
+    double computeUs = rooflineUs(profile.flops, 0, peak, device.bandwidthGBs);
+    double memoryUs = rooflineUs(0, profile.minGlobalBytes, peak, device.bandwidthGBs);
+    // same as estimateRoofline: the predicted latency moves every access, the bound every buffer once.
+    double latencyUs = rooflineUs(profile.flops, profile.globalBytes, peak, device.bandwidthGBs);
+    json << (i == 0 ? "\n" : ",\n");
+    json << "    {\"kernel\": \"" << profile.kernel << "\", \"func\": \"" << profile.func << "\", \"operator\": \"" << profile.op << "\",\n";
+    json << "     \"grid\": " << toJson(profile.grid) << ", \"block\": " << toJson(profile.block)
+         << ", \"shared_bytes\": " << profile.sharedBytes << ", \"registers\": " << profile.registers
+         << ", \"mma\": " << (profile.mma ? "true" : "false") << ",\n";
+    json << "     \"flops\": " << profile.flops << ", \"min_global_bytes\": " << profile.minGlobalBytes
+         << ", \"global_bytes\": " << profile.globalBytes << ",\n";
+    json << "     \"arithmetic_intensity\": " << intensity << ", \"estimated_arithmetic_intensity\": " << estIntensity
+         << ", \"ridge_point\": " << peak / device.bandwidthGBs << ", \"bound\": \"" << (computeUs >= memoryUs ? "compute" : "memory")
+         << "\", \"predicted_latency_us\": " << latencyUs << ", \"bound_us\": " << std::max(computeUs, memoryUs) << "}";
+  }
+  json << (profiles.empty() ? "" : "\n  ") << "]\n";
+  json << "}\n";
+  return json.str();
+}
+
+}
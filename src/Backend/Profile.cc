@@ -0,0 +1,73 @@
+#include "Backend/Profile.h"
+#include "Backend/CUDA.h"
+
+#include <sstream>
+#include <algorithm>
+
+namespace KernelCodeGen {
+
+const char* phaseName(Phase phase) {
+  switch (phase) {
+    case Phase::stage: return "stage";
+    case Phase::barrier: return "barrier";
+    case Phase::compute: return "compute";
+    case Phase::epilogue: return "epilogue";
+    case Phase::softmax: return "softmax";
+    default: return "other";
+  }
+}
+
+int64_t sampledWarps(const KernelLaunch& launch, const ProfileConfig& config) {
+  int64_t threads = 1;
+  for (auto dim : launch.block) threads *= dim;
+  auto warps = (threads + 31) / 32;
+  return (warps + config.warpStride - 1) / config.warpStride;
+}
+
+int64_t profileBufferSize(const KernelLaunch& launch, const ProfileConfig& config) {
+  int64_t blocks = 1;
+  for (auto dim : launch.grid) blocks *= dim;
+  auto sampledBlocks = (blocks + config.blockStride - 1) / config.blockStride;
+  return sampledBlocks * sampledWarps(launch, config) * ProfileConfig::FIELDS;
+}
+
+std::string ProfileReport(const KernelLaunch& launch, const ProfileConfig& config, const std::vector<int64_t>& buffer) {
+  constexpr int phases = static_cast<int>(Phase::count);
+  // the last slot is "other": the kernel cycles out of every phase.
+  std::vector<double> sum(phases + 1, 0.0);
+  std::vector<int64_t> max(phases + 1, 0);
+  double totalSum = 0.0;
+  int64_t totalMax = 0, samples = 0;
+  for (int64_t i = 0; i + ProfileConfig::FIELDS <= buffer.size(); i += ProfileConfig::FIELDS) {
+    auto record = buffer.data() + i;
+    auto total = record[2];
+    // warps that didn't run (or weren't sampled) leave a zero record.
+    if (total <= 0) continue;
+    samples++;
+    totalSum += total;
+    totalMax = std::max(totalMax, total);
+    int64_t timed = 0;
+    for (int p = 0; p < phases; p++) {
+      sum[p] += record[3 + p];
+      max[p] = std::max(max[p], record[3 + p]);
+      timed += record[3 + p];
+    }
+    sum[phases] += total - timed;
+    max[phases] = std::max(max[phases], total - timed);
+  }
+
+  std::stringstream json;
+  json << "{\"kernel\": \"" << launch.name << "\", \"samples\": " << samples << ", \"block_stride\": " << config.blockStride
+       << ", \"warp_stride\": " << config.warpStride << ",\n";
+  json << " \"total_cycles\": {\"mean\": " << (samples ? totalSum / samples : 0.0) << ", \"max\": " << totalMax << "},\n";
+  json << " \"phases\": [";
+  for (int p = 0; p <= phases; p++) {
+    json << (p == 0 ? "\n" : ",\n");
+    json << "   {\"phase\": \"" << phaseName(static_cast<Phase>(p)) << "\", \"mean_cycles\": " << (samples ? sum[p] / samples : 0.0)
+         << ", \"max_cycles\": " << max[p] << ", \"share\": " << (totalSum > 0 ? sum[p] / totalSum : 0.0) << "}";
+  }
+  json << "\n ]}\n";
+  return json.str();
+}
+
+}
@@ -27,6 +27,22 @@ std::string toStr(mlir::Type type) {
   return nullptr;
 }
 
+void ComputeDAG::setFastMath(mlir::Value output, bool enable) {
+  auto callOp = output.getDefiningOp<mlir::func::CallOp>();
+  if (!callOp) {
+    llvm::errs() << "Fast-math is set on operators, the value isn't produced by one\n";
+    return;
+  }
+  // operators of the same name and signature share their func.
+  auto funcOp = module.lookupSymbol<mlir::func::FuncOp>(callOp.getCallee());
+  assert(funcOp);
+  if (enable) {
+    funcOp->setAttr(std::string("func.fast_math"), builder.getUnitAttr());
+  } else {
+    funcOp->removeAttr(std::string("func.fast_math"));
+  }
+}
+
 mlir::AffineForOp buildAffineLoopNest_(mlir::OpBuilder &builder, mlir::Location loc, llvm::ArrayRef<int64_t> lbs, llvm::ArrayRef<int64_t> ubs, 
                                         llvm::ArrayRef<int64_t> steps, mlir::ValueRange iterArgs, loopfunc bodyBuilderFn) {
 
@@ -67,31 +83,28 @@ mlir::AffineForOp buildAffineLoopNest_(mlir::OpBuilder &builder, mlir::Location
 
 mlir::func::FuncOp buildFuction(mlir::ModuleOp module, mlir::OpBuilder& builder, const std::string& funcName, 
                                 const std::vector<mlir::Type>& inputsTypes, const std::vector<mlir::Type>& outputsTypes) {
-  mlir::func::FuncOp result;
-  bool break_ = false;
-  
-  module.walk<mlir::WalkOrder::PreOrder>([&](mlir::func::FuncOp func) {
-    if (break_) return;
-    // auto otherName = func.getFunctionTypeAttrName();
-    auto otherName = func.getSymName();
-    if (otherName == funcName) {
-      // Function already exists;
-      result = func;
-      break_ = true;
-    }
-  });
-  if (break_) return result;
-
-
-  builder.setInsertionPointToStart(module.getBody());
-  
   llvm::ArrayRef<mlir::Type> inputsTypesArray(inputsTypes);
   llvm::ArrayRef<mlir::Type> outputsTypesArray(outputsTypes);
   auto functionType = builder.getFunctionType(mlir::TypeRange(inputsTypesArray), 
     mlir::TypeRange(outputsTypesArray));
 
+  // Views share the shape (and so the name) of a contiguous buffer but not its layout,
+  // a function with the same name but another signature gets a versioned name.
+  auto uniqueName = funcName;
+  int version = 0;
+  // symbol lookup scans the funcs only, not their bodies.
+  while (auto func = module.lookupSymbol<mlir::func::FuncOp>(uniqueName)) {
+    if (func.getFunctionType() == functionType) {
+      // Function already exists;
+      return func;
+    }
+    uniqueName = funcName + "_v" + std::to_string(++version);
+  }
+
+  builder.setInsertionPointToStart(module.getBody());
+
   auto funcOp = builder.create<mlir::func::FuncOp>(
-    builder.getUnknownLoc(), llvm::StringRef(funcName), functionType);
+    builder.getUnknownLoc(), llvm::StringRef(uniqueName), functionType);
 
   auto& region = funcOp->getRegion(0);
   if (!region.hasOneBlock()) {
@@ -1283,6 +1296,13 @@ mlir::Value Gather::build(ComputeDAG* graph, mlir::Value input, mlir::Value indi
   auto dtype = dtype_ != ""  ? dtype_ : toStr(elementType);
   auto emType = getDType(builder, dtype);
 
+  // the graph inputs of indices are filled in the bounds of the dim they index (see indexBound).
+  if (auto allocOp = indices.getDefiningOp<mlir::memref::AllocOp>()) {
+    auto bound = input_shape[axis];
+    if (auto attr = allocOp->getAttrOfType<mlir::IntegerAttr>(std::string("index.bound"))) bound = std::min(bound, attr.getInt());
+    allocOp->setAttr(std::string("index.bound"), builder.getI64IntegerAttr(bound));
+  }
+
   std::vector<int64_t> new_shape = input_shape;
   new_shape.erase(new_shape.begin() + axis);
   if (!(indices_shape.size() == 1 && indices_shape[0] == 1)) {
@@ -1416,4 +1436,277 @@ mlir::Value Gather::build(ComputeDAG* graph, mlir::Value input, mlir::Value indi
 //   return callOp.getResult(0);
 // }
 
+/*----------------------------views---------------------------------*/
+
+mlir::func::FuncOp getFunction(mlir::ModuleOp module, const std::string& funcName) {
+  mlir::func::FuncOp result;
+  module.walk<mlir::WalkOrder::PreOrder>([&](mlir::func::FuncOp func) {
+    if (func.getSymName() == funcName) result = func;
+  });
+  return result;
+}
+
+/// @brief return the callee of `callOp`, it is cloned first if other calls share it,
+///        so its signature can be changed without touching the other calls.
+mlir::func::FuncOp getPrivateCallee(ComputeDAG* graph, mlir::func::CallOp callOp) {
+  auto module = graph->module;
+  auto calleeName = callOp.getCallee().str();
+  auto funcOp = getFunction(module, calleeName);
+  int callers = 0;
+  module.walk<mlir::WalkOrder::PreOrder>([&](mlir::func::CallOp other) {
+    if (other.getCallee() == calleeName) callers += 1;
+  });
+  if (callers <= 1) return funcOp;
+
+  auto newName = calleeName;
+  int version = 0;
+  while (getFunction(module, newName)) {
+    newName = calleeName + "_v" + std::to_string(++version);
+  }
+  auto cloned = funcOp.clone();
+  cloned.setSymName(newName);
+  module.getBody()->getOperations().insert(mlir::Block::iterator(funcOp), cloned);
+  callOp.setCalleeAttr(mlir::FlatSymbolRefAttr::get(module.getContext(), newName));
+  return cloned;
+}
+
+bool updateCall(ComputeDAG* graph, mlir::func::CallOp callOp, mlir::func::FuncOp funcOp);
+
+/// @brief replace `oldValue` by `newValue`, they have the same shape but maybe a different layout,
+///        in that case the functions consuming it are retyped.
+bool replaceWithView(ComputeDAG* graph, mlir::Value oldValue, mlir::Value newValue) {
+  if (oldValue.getType() == newValue.getType()) {
+    oldValue.replaceAllUsesWith(newValue);
+    return true;
+  }
+  for (auto& use : llvm::make_early_inc_range(oldValue.getUses())) {
+    auto callOp = mlir::dyn_cast<mlir::func::CallOp>(use.getOwner());
+    if (!callOp) {
+      llvm::errs() << "Only function calls can consume a view, but got " << use.getOwner()->getName() << ".\n";
+      return false;
+    }
+    auto funcOp = getPrivateCallee(graph, callOp);
+    funcOp.front().getArgument(use.getOperandNumber()).setType(newValue.getType());
+    use.set(newValue);
+    if (!updateCall(graph, callOp, funcOp)) return false;
+  }
+  return true;
+}
+
+/// @brief sync the signature of `funcOp` with its arguments and returned values,
+///        and rebuild `callOp` if its results are retyped.
+bool updateCall(ComputeDAG* graph, mlir::func::CallOp callOp, mlir::func::FuncOp funcOp) {
+  auto& block = funcOp.front();
+  auto returnOp = mlir::dyn_cast<mlir::func::ReturnOp>(block.back());
+  std::vector<mlir::Type> inputsTypes, outputsTypes;
+  for (auto arg : block.getArguments()) inputsTypes.push_back(arg.getType());
+  for (auto result : returnOp.getOperands()) outputsTypes.push_back(result.getType());
+  mlir::OpBuilder builder(callOp);
+  funcOp.setType(builder.getFunctionType(inputsTypes, outputsTypes));
+
+  bool retyped = false;
+  for (int i = 0; i < outputsTypes.size(); i++) {
+    if (callOp.getResult(i).getType() != outputsTypes[i]) retyped = true;
+  }
+  if (!retyped) return true;
+
+  auto newCallOp = builder.create<mlir::func::CallOp>(callOp.getLoc(), funcOp, callOp.getOperands());
+  for (int i = 0; i < outputsTypes.size(); i++) {
+    if (!replaceWithView(graph, callOp.getResult(i), newCallOp.getResult(i))) return false;
+  }
+  callOp.erase();
+  return true;
+}
+
+/// @brief let the producer of `value` write into `view` directly.
+bool placeInto(ComputeDAG* graph, mlir::Value value, mlir::Value view) {
+  if (auto allocOp = value.getDefiningOp<mlir::memref::AllocOp>()) {
+    // PlaceHolder, the data is provided in the view.
+    if (!replaceWithView(graph, value, view)) return false;
+    allocOp.erase();
+    return true;
+  }
+  auto callOp = value.getDefiningOp<mlir::func::CallOp>();
+  if (!callOp) {
+    llvm::errs() << "Can't place the value into a view, it is neither a placeholder nor a function result.\n";
+    return false;
+  }
+  auto funcOp = getPrivateCallee(graph, callOp);
+  auto& block = funcOp.front();
+  auto returnOp = mlir::dyn_cast<mlir::func::ReturnOp>(block.back());
+  auto index = value.cast<mlir::OpResult>().getResultNumber();
+  auto returned = returnOp.getOperand(index);
+
+  if (auto arg = returned.dyn_cast<mlir::BlockArgument>()) {
+    // inplace function, place its operand instead.
+    return placeInto(graph, callOp.getOperand(arg.getArgNumber()), view);
+  }
+  auto allocOp = returned.getDefiningOp<mlir::memref::AllocOp>();
+  if (!allocOp) {
+    llvm::errs() << "Can't place the result of " << funcOp.getSymName() << " into a view.\n";
+    return false;
+  }
+  // The output buffer is passed by the caller instead of allocated in the function.
+  auto newArg = block.addArgument(view.getType(), allocOp.getLoc());
+  allocOp.getResult().replaceAllUsesWith(newArg);
+  allocOp.erase();
+  llvm::SmallVector<mlir::Value> operands(callOp.getOperands());
+  operands.push_back(view);
+  callOp->setOperands(operands);
+  return updateCall(graph, callOp, funcOp);
+}
+
+mlir::Value Slice::build(ComputeDAG* graph, mlir::Value input, const std::vector<int64_t>& offsets,
+                         const std::vector<int64_t>& sizes, const std::vector<int64_t>& strides_) {
+  auto builder = graph->builder;
+  auto type = input.getType().dyn_cast<mlir::MemRefType>();
+  if (!type) {
+    llvm::errs() << "Type of input of Slice is not Memref.\n";
+    return nullptr;
+  }
+  auto shape = type.getShape();
+  int64_t rank = shape.size();
+  auto strides = strides_.size() != 0 ? strides_ : std::vector<int64_t>(rank, 1);
+  if (offsets.size() != rank || sizes.size() != rank || strides.size() != rank) {
+    llvm::errs() << "Slice needs offsets, sizes and strides for all the " << rank << " dims.\n";
+    return nullptr;
+  }
+  for (int i = 0; i < rank; i++) {
+    if (sizes[i] <= 0 || strides[i] <= 0 || offsets[i] < 0 || offsets[i] + (sizes[i] - 1) * strides[i] >= shape[i]) {
+      llvm::errs() << "Slice is out of the bound of dim " << i << ".\n";
+      return nullptr;
+    }
+  }
+  auto subViewOp = builder.create<mlir::memref::SubViewOp>(builder.getUnknownLoc(), input,
+    llvm::ArrayRef<int64_t>(offsets), llvm::ArrayRef<int64_t>(sizes), llvm::ArrayRef<int64_t>(strides));
+  return subViewOp.getResult();
+}
+
+std::vector<mlir::Value> Split::build(ComputeDAG* graph, mlir::Value input, const std::vector<int64_t>& sections, int64_t axis) {
+  std::vector<mlir::Value> result;
+  auto type = input.getType().dyn_cast<mlir::MemRefType>();
+  if (!type) {
+    llvm::errs() << "Type of input of Split is not Memref.\n";
+    return result;
+  }
+  auto shape = type.getShape();
+  if (axis < 0) axis += shape.size();
+  int64_t total = 0;
+  for (auto section : sections) total += section;
+  if (axis < 0 || axis >= shape.size() || total != shape[axis]) {
+    llvm::errs() << "Can't apply Split Operation due to the sections don't match the dim " << axis << ".\n";
+    return result;
+  }
+  std::vector<int64_t> offsets(shape.size(), 0);
+  std::vector<int64_t> sizes(shape.begin(), shape.end());
+  int64_t start = 0;
+  for (auto section : sections) {
+    offsets[axis] = start;
+    sizes[axis] = section;
+    result.push_back(Slice::build(graph, input, offsets, sizes));
+    start += section;
+  }
+  return result;
+}
+
+mlir::Value Reshape::build(ComputeDAG* graph, mlir::Value input, const std::vector<int64_t>& shape) {
+  auto builder = graph->builder;
+  auto type = input.getType().dyn_cast<mlir::MemRefType>();
+  if (!type) {
+    llvm::errs() << "Type of input of Reshape is not Memref.\n";
+    return nullptr;
+  }
+  llvm::SmallVector<int64_t> strides;
+  int64_t offset;
+  if (mlir::failed(mlir::getStridesAndOffset(type, strides, offset))) {
+    llvm::errs() << "Reshape only supports strided layouts.\n";
+    return nullptr;
+  }
+  auto oldShape = type.getShape();
+  int64_t elements = 1;
+  for (int i = oldShape.size() - 1; i >= 0; i--) {
+    if (oldShape[i] != 1 && strides[i] != elements) {
+      llvm::errs() << "Can't Reshape a non-contiguous view without copy.\n";
+      return nullptr;
+    }
+    elements *= oldShape[i];
+  }
+
+  std::vector<int64_t> newStrides(shape.size(), 1);
+  int64_t newElements = 1;
+  for (int i = shape.size() - 1; i >= 0; i--) {
+    newStrides[i] = newElements;
+    newElements *= shape[i];
+  }
+  if (elements != newElements) {
+    llvm::errs() << "Can't apply Reshape Operation due to imcompatible number of elements.\n";
+    return nullptr;
+  }
+  auto layout = offset == 0 ? mlir::AffineMap() :
+    mlir::makeStridedLinearLayoutMap(newStrides, offset, builder.getContext());
+  auto resultType = mlir::MemRefType::get(llvm::ArrayRef<int64_t>(shape), type.getElementType(), layout, type.getMemorySpace());
+  auto castOp = builder.create<mlir::memref::ReinterpretCastOp>(builder.getUnknownLoc(), resultType, input, offset,
+    llvm::ArrayRef<int64_t>(shape), llvm::ArrayRef<int64_t>(newStrides));
+  return castOp.getResult();
+}
+
+mlir::Value Concat::build(ComputeDAG* graph, const std::vector<mlir::Value>& inputs, int64_t axis) {
+  auto builder = graph->builder;
+  if (inputs.size() == 0) {
+    llvm::errs() << "Concat needs at least one input.\n";
+    return nullptr;
+  }
+  auto type = inputs[0].getType().dyn_cast<mlir::MemRefType>();
+  if (!type) {
+    llvm::errs() << "Type of input of Concat is not Memref.\n";
+    return nullptr;
+  }
+  auto elementType = type.getElementType();
+  std::vector<int64_t> shape(type.getShape().begin(), type.getShape().end());
+  if (axis < 0) axis += shape.size();
+  if (axis < 0 || axis >= shape.size()) {
+    llvm::errs() << "Can't apply Concat Operation due to axis is greater than shape of input.\n";
+    return nullptr;
+  }
+
+  // The concatenated buffer must be allocated before all the producers.
+  mlir::Operation* firstDef = nullptr;
+  shape[axis] = 0;
+  for (auto input : inputs) {
+    auto type_ = input.getType().dyn_cast<mlir::MemRefType>();
+    if (!type_ || type_.getRank() != shape.size() || type_.getElementType() != elementType) {
+      llvm::errs() << "Can't apply Concat Operation due to imcompatible inputs.\n";
+      return nullptr;
+    }
+    for (int i = 0; i < shape.size(); i++) {
+      if (i != axis && type_.getShape()[i] != shape[i]) {
+        llvm::errs() << "Can't apply Concat Operation due to imcompatible dim " << i << ".\n";
+        return nullptr;
+      }
+    }
+    shape[axis] += type_.getShape()[axis];
+    auto def = input.getDefiningOp();
+    if (!def || def->getBlock() != graph->module.getBody()) {
+      llvm::errs() << "Concat only supports the inputs defined in the graph.\n";
+      return nullptr;
+    }
+    if (!firstDef || def->isBeforeInBlock(firstDef)) firstDef = def;
+  }
+  builder.setInsertionPoint(firstDef);
+  auto outType = mlir::MemRefType::get(llvm::ArrayRef<int64_t>(shape), elementType, {}, static_cast<int>(MemorySpace::global));
+  auto output = builder.create<mlir::memref::AllocOp>(builder.getUnknownLoc(), outType).getResult();
+
+  std::vector<int64_t> offsets(shape.size(), 0);
+  std::vector<int64_t> strides(shape.size(), 1);
+  for (auto input : inputs) {
+    auto type_ = input.getType().dyn_cast<mlir::MemRefType>();
+    std::vector<int64_t> sizes(type_.getShape().begin(), type_.getShape().end());
+    auto view = builder.create<mlir::memref::SubViewOp>(builder.getUnknownLoc(), output,
+      llvm::ArrayRef<int64_t>(offsets), llvm::ArrayRef<int64_t>(sizes), llvm::ArrayRef<int64_t>(strides)).getResult();
+    if (!placeInto(graph, input, view)) return nullptr;
+    offsets[axis] += sizes[axis];
+  }
+  return output;
+}
+
 }
@@ -1,121 +1,464 @@
 #include "KernelCodeGen.h"
 #include "log.h"
 
+#include <chrono>
+
 namespace KernelCodeGen {
 
 Log KCGLog::level = Log::Release;
 
+mlir::MLIRContext& sharedContext() {
+  // built once per process and never destroyed. no pass pipeline is parsed by name, so no pass is registered.
+  static mlir::MLIRContext* context = [] {
+    mlir::DialectRegistry registry;
+    registry.insert<mlir::AffineDialect, mlir::memref::MemRefDialect, mlir::func::FuncDialect, mlir::arith::ArithmeticDialect,
+                    mlir::gpu::GPUDialect, mlir::vector::VectorDialect, mlir::scf::SCFDialect, mlir::math::MathDialect>();
+    auto context = new mlir::MLIRContext(registry);
+    context->loadAllAvailableDialects();
+    return context;
+  }();
+  return *context;
+}
+
+double elapsedMs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// in debug mode a broken trial prints the snapshots of the steps that led to it.
+void verifyTrial(Optimizer& opt, mlir::ModuleOp& module) {
+  if (KCGLog::level != Log::Debug || mlir::succeeded(mlir::verify(module))) return;
+  llvm::errs() << opt.name << " produced an invalid module, last snapshots:\n";
+  KCGSnapshot::print(llvm::errs());
+  assert(false);
+}
+
+// registers indexed dynamically are spilled to local memory.
+int countSpills(const std::vector<mlir::func::FuncOp>& funcOps) {
+  int spills = 0;
+  for (auto funcOp : funcOps) {
+    funcOp.walk([&](mlir::memref::AllocOp allocOp) {
+      if (allocOp->hasAttr(std::string("memory.dynamic"))) spills++;
+    });
+  }
+  return spills;
+}
+
+// the funcs `module` lowered to kernels that `before` hadn't lowered: the ones of the optimizer tried.
+std::vector<mlir::func::FuncOp> tunedFuncs(mlir::ModuleOp before, mlir::ModuleOp module) {
+  std::vector<mlir::func::FuncOp> funcOps;
+  auto lowered = [](mlir::func::FuncOp funcOp) {
+    auto state = funcOp->getAttrOfType<mlir::StringAttr>(std::string("func.state"));
+    return state && state.getValue() == "gpu";
+  };
+  for (auto funcOp : module.getOps<mlir::func::FuncOp>()) {
+    if (!lowered(funcOp)) continue;
+    auto old = before.lookupSymbol<mlir::func::FuncOp>(funcOp.getSymName());
+    if (!old || !lowered(old)) funcOps.push_back(funcOp);
+  }
+  return funcOps;
+}
+
+// the least work of the naive funcs in `before` of the funcs `tuned` lowered, -1 if one of them is new (a fused func).
+void opWork(mlir::ModuleOp before, const std::vector<mlir::func::FuncOp>& tuned, int64_t& flops, int64_t& bytes) {
+  flops = 0, bytes = 0;
+  for (auto funcOp : tuned) {
+    auto naive = before.lookupSymbol<mlir::func::FuncOp>(funcOp.getSymName());
+    if (!naive) {
+      flops = -1, bytes = -1;
+      return;
+    }
+    auto work = profileWork(naive);
+    flops += work.flops;
+    bytes += work.minGlobalBytes;
+  }
+}
+
+float KernelCodeGenerator::evaluate(mlir::ModuleOp& module, const std::vector<mlir::func::FuncOp>& funcOps) {
+  auto checked = funcOps;
+  if (checked.empty()) {
+    for (auto funcOp : module.getOps<mlir::func::FuncOp>()) checked.push_back(funcOp);
+  }
+  if (countSpills(checked) != 0) return FLT_MAX;
+  return estimateRoofline(module, device).latencyUs;
+}
+
+bool KernelCodeGenerator::outOfBudget(const TuneBudget& budget, int trials, std::chrono::steady_clock::time_point start,
+                                      std::string& reason) {
+  if (budget.trials > 0 && trials >= budget.trials) {
+    reason = "trials";
+  } else if (budget.ms > 0 && elapsedMs(start) >= budget.ms) {
+    reason = "time";
+  }
+  return !reason.empty();
+}
+
+template<typename OptType>
+std::string KernelCodeGenerator::validate(const std::map<std::string, int>& config, std::map<int64_t, HostRun>& references,
+                                          std::string& detail) {
+  // the shrunk dims stay multiples of the block tiles, of this config and of the ones applied before.
+  auto minDim = validation.minDim;
+  auto fitTiles = [&](const std::map<std::string, int>& cfg) {
+    for (auto& item : cfg) {
+      if (item.first.rfind("BLOCK_SIZE", 0) == 0) minDim = std::max<int64_t>(minDim, item.second);
+    }
+  };
+  fitTiles(config);
+  for (auto& applied : appliedOpts) fitTiles(applied.second);
+  auto shrunk = mlir::dyn_cast<mlir::ModuleOp>(graph.module->clone());
+  std::string status = "unvalidated";
+  if (!ShrinkShapes(shrunk, minDim, detail)) {
+    shrunk->erase();
+    return status;
+  }
+  if (references.count(minDim) == 0) {
+    references[minDim] = InterpretGraph(shrunk, validation.maxOps);
+  }
+  auto& reference = references[minDim];
+  // the matches of OptType are the ones of the module being tuned.
+  for (auto& applied : appliedOpts) {
+    if (!reference.ok) break;
+    if (!applied.first->applicable(shrunk)) {
+      detail = applied.first->name + " doesn't match at the reduced shapes";
+      shrunk->erase();
+      return status;
+    }
+    applied.first->applyOptimzer(shrunk, builder);
+  }
+  OptType checked;
+  if (!reference.ok) {
+    detail = "naive funcs: " + reference.reason;
+  } else if (!checked.applicable(shrunk)) {
+    detail = "no match at the reduced shapes";
+  } else {
+    checked.applyOptimzer(shrunk, builder);
+    auto candidate = InterpretGraph(shrunk, validation.maxOps);
+    if (candidate.ok) {
+      status = CompareRuns(reference, candidate, detail) ? "passed" : "mismatch";
+    } else {
+      // an out of bounds access or a deadlock is a bug of the schedule, an unsupported op or too many ops only a limit
+      // of the interpreter.
+      status = candidate.scheduleError ? "mismatch" : "unvalidated";
+      detail = candidate.reason;
+    }
+  }
+  shrunk->erase();
+  return status;
+}
+
+template<typename OptType>
+void KernelCodeGenerator::tune(OptType& opt, mlir::ModuleOp& module, std::vector<std::map<std::string, int>>& configs,
+                               std::map<std::string, int>& config) {
+  OptimizerTiming timing;
+  timing.optimizer = opt.name;
+  auto begin = std::chrono::steady_clock::now();
+  backupModule(module);
+  // the matches only depend on the module, not on the config.
+  OptType analysis;
+  bool matched = analysis.applicable(backupModule_);
+  timing.matchMs = elapsedMs(begin);
+  auto record = [&](int index, const std::string& status, const std::string& reason) -> TuneTrial& {
+    TuneTrial trial;
+    trial.optimizer = opt.name;
+    trial.index = index;
+    trial.config = configs[index];
+    trial.applicable = matched;
+    trial.status = status;
+    trial.reason = reason;
+    trial.startMs = elapsedMs(tuneStart);
+    // the match runs once, before the first config.
+    if (index == 0) trial.matchMs = timing.matchMs;
+    tuneTrace.push_back(trial);
+    return tuneTrace.back();
+  };
+  if (!matched) {
+    if (!configs.empty()) record(0, "not_applicable", "no match in the module");
+    optimizerTimings.push_back(timing);
+    return;
+  }
+  // every trial starts from the backup, `module` is the last trial from here on.
+  drop(module);
+
+  auto budget = opBudgets.count(opt.name) ? opBudgets[opt.name] : TuneBudget();
+  auto tolerance = budget.boundTolerance > 0 ? budget.boundTolerance : graphBudget.boundTolerance;
+  // the kernels of the other operators are in every trial, the configs only change the ones of `opt`.
+  auto others = estimateRoofline(backupModule_, device);
+  // the work of the naive funcs `opt` lowers, known after the first trial: the kernels of no config compute
+  // fewer flops or move fewer bytes, so each config is bounded by it at the peak that config runs at.
+  int64_t opFlops = -1, opBytes = -1;
+  bool workKnown = false;
+  auto opBound = [&](const std::map<std::string, int>& cfg) {
+    if (opFlops < 0) return -1.0;
+    auto mma = cfg.count("MMA") != 0 && cfg.at("MMA") != 0;
+    return rooflineUs(opFlops, opBytes, mma ? device.peakMMAGFlops : device.peakGFlops, device.bandwidthGBs);
+  };
+  double best = FLT_MAX;
+  mlir::ModuleOp bestTrial, spilledTrial;
+  std::map<int64_t, HostRun> references;
+  const std::map<std::string, int>* bestConfig = nullptr;
+  const std::map<std::string, int>* spilledConfig = nullptr;
+  int spilledRecord = -1;
+  for (int i = 0; i < configs.size(); i++) {
+    auto& curConfig = configs[i];
+    if (!timing.stop.empty()) {
+      record(i, "skipped", timing.stop == "bound" ? "best within the bound tolerance" : timing.stop + " budget used up");
+      continue;
+    }
+    // the first config always runs, so every matched operator is lowered.
+    if (!timing.trialMs.empty()) {
+      if (outOfBudget(budget, timing.trialMs.size(), begin, timing.stop) ||
+          outOfBudget(graphBudget, tuneTrials, tuneStart, timing.stop)) {
+        record(i, "skipped", timing.stop + " budget used up");
+        continue;
+      }
+      // branch and bound: even on its roofline this config can't beat the best one.
+      if (opFlops >= 0 && others.latencyUs + opBound(curConfig) >= best) {
+        timing.pruned++;
+        record(i, "pruned", "roofline bound can't beat the best").boundUs = opBound(curConfig);
+        continue;
+      }
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto& trial = record(i, "ok", "");
+    config = curConfig;
+    // the previous trial is only kept as the best or the spilled one.
+    if (module != bestTrial && module != spilledTrial) drop(module);
+    CloneMapping mapping;
+    resetModule(module, mapping);
+    opt.remap(analysis, mapping);
+    opt.applyOptimzer(module, builder);
+    verifyTrial(opt, module);
+    tuneTrials++;
+    trial.transformMs = elapsedMs(start);
+    if (!workKnown) {
+      workKnown = true;
+      opWork(backupModule_, tunedFuncs(backupModule_, module), opFlops, opBytes);
+    }
+    auto evaluated = std::chrono::steady_clock::now();
+    // the configs spilling registers are dropped, only the funcs lowered by this trial are checked.
+    if (countSpills(tunedFuncs(backupModule_, module)) != 0) {
+      trial.status = "failed";
+      trial.reason = "registers indexed dynamically, spilled to local memory";
+      trial.evaluateMs = elapsedMs(evaluated);
+      trial.bestUs = bestConfig ? best - others.latencyUs : -1.0;
+      timing.trialMs.push_back(elapsedMs(start));
+      drop(spilledTrial);
+      spilledTrial = module;
+      spilledConfig = &curConfig;
+      spilledRecord = tuneTrace.size() - 1;
+      continue;
+    }
+    auto roofline = estimateRoofline(module, device);
+    trial.evaluateMs = elapsedMs(evaluated);
+    // only a config about to become the best is interpreted, it is far slower than the estimate.
+    if (validation.enable && roofline.latencyUs < best) {
+      auto validated = std::chrono::steady_clock::now();
+      std::string detail;
+      trial.validation = validate<OptType>(curConfig, references, detail);
+      if (trial.validation == "mismatch") {
+        trial.status = "failed";
+        trial.reason = "wrong results at reduced shapes: " + detail;
+      } else if (trial.validation == "unvalidated") {
+        trial.validation += ": " + detail;
+      }
+      trial.validateMs = elapsedMs(validated);
+    }
+    if (trial.status == "ok" && roofline.latencyUs < best) {
+      best = roofline.latencyUs;
+      drop(bestTrial);
+      bestTrial = module;
+      bestConfig = &curConfig;
+    }
+    trial.latencyUs = roofline.latencyUs - others.latencyUs;
+    trial.bestUs = bestConfig ? best - others.latencyUs : -1.0;
+    trial.boundUs = opBound(curConfig);
+    timing.trialMs.push_back(elapsedMs(start));
+    if (tolerance > 0 && bestConfig && opFlops >= 0 && best - others.latencyUs <= (1.0 + tolerance) * opBound(*bestConfig)) {
+      timing.stop = "bound";
+    }
+  }
+  if (module != bestTrial && module != spilledTrial) drop(module);
+  // the last trial, if kept, is the best or the spilled one: the choice below takes it.
+  module = mlir::ModuleOp();
+  if (bestTrial) {
+    module = bestTrial;
+    config = *bestConfig;
+    timing.bestUs = best - others.latencyUs;
+    timing.boundUs = opBound(*bestConfig);
+    drop(spilledTrial);
+  } else if (spilledTrial) {
+    // every config spilled or was wrong: a spilling one is still better than the naive loops, which have no kernel.
+    config = *spilledConfig;
+    if (validation.enable) {
+      auto validated = std::chrono::steady_clock::now();
+      auto& trial = tuneTrace[spilledRecord];
+      std::string detail;
+      trial.validation = validate<OptType>(config, references, detail);
+      if (trial.validation == "mismatch") {
+        trial.reason += ", wrong results at reduced shapes: " + detail;
+        drop(spilledTrial);
+      } else if (trial.validation == "unvalidated") {
+        trial.validation += ": " + detail;
+      }
+      trial.validateMs = elapsedMs(validated);
+    }
+    if (spilledTrial) module = spilledTrial;
+  }
+  if (!module) {
+    // every config computed wrong results, the operator is left on its naive loops.
+    if (!timing.trialMs.empty()) llvm::errs() << opt.name << ": every config computes wrong results, left unoptimized\n";
+    resetModule(module);
+  } else {
+    appliedOpts.push_back({&opt, config});
+  }
+  saveBestModule(module);
+  optimizerTimings.push_back(timing);
+}
+
 mlir::ModuleOp& KernelCodeGenerator::optimize(ComputeDAG& graph_) {
   graph = graph_;
+  KCGSnapshot::owner = this;
   mlir::Operation *cloned = graph.module->clone();
-  auto module = mlir::dyn_cast<mlir::ModuleOp>(cloned);
+  auto module = own(mlir::dyn_cast<mlir::ModuleOp>(cloned));
+  std::map<std::string, int64_t> funcIds;
+  reusedFuncs = 0;
+  if (incremental) {
+    // the cached funcs were tuned under other settings, they may have picked other configs.
+    auto key = tuningKey();
+    if (key != cachedTuningKey) clearIncremental();
+    cachedTuningKey = key;
+    reuseOptimizedFuncs(module, funcIds);
+  }
 
   saveBestModule(module);
+  optimizerTimings.clear();
+  tuneTrace.clear();
+  appliedOpts.clear();
+  tuneStart = std::chrono::steady_clock::now();
+  tuneTrials = 0;
 
   for (auto& opt : opts) {
-    backupModule(module);
     if (*opt == FMHAOptimizer()) {
-      for (auto& fmhaConfig : fmhaConfigs) {
-        FMHAOptimizer::fmhaConfig = fmhaConfig;
-        resetModule(module);
-        if (opt->applicable(module)) {
-          opt->applyOptimzer(module, builder);
-          auto curLatency = evaluate(module);
-          if (curLatency < minLatency) {
-            minLatency = curLatency;
-            saveBestModule(module);
-          }
-        }
-      }
+      tune(static_cast<FMHAOptimizer&>(*opt), module, fmhaConfigs, FMHAOptimizer::fmhaConfig);
     } else if (*opt == MatmulOptimizer()) {
-      for (auto& matmulConfig : matmulConfigs) {
-        MatmulOptimizer::matmulConfig = matmulConfig;
-        resetModule(module);
-        if (opt->applicable(module)) {
-          opt->applyOptimzer(module, builder);
-          auto curLatency = evaluate(module);
-          if (curLatency < minLatency) {
-            minLatency = curLatency;
-            saveBestModule(module);
-          }
-        }
-      }
+      tune(static_cast<MatmulOptimizer&>(*opt), module, matmulConfigs, MatmulOptimizer::matmulConfig);
     } else if (*opt == BinaryOptimizer()) {
-      for (auto& binaryConfig : binaryConfigs) {
-        BinaryOptimizer::binaryConfig = binaryConfig;
-        resetModule(module);
-        if (opt->applicable(module)) {
-          opt->applyOptimzer(module, builder);
-          auto curLatency = evaluate(module);
-          if (curLatency < minLatency) {
-            minLatency = curLatency;
-            saveBestModule(module);
-          }
-        }
-      }
+      tune(static_cast<BinaryOptimizer&>(*opt), module, binaryConfigs, BinaryOptimizer::binaryConfig);
     } else if (*opt == ElementWiseOptimizer()) {
-      for (auto& elementWiseConfig : elementWiseConfigs) {
-        ElementWiseOptimizer::elementWiseConfig = elementWiseConfig;
-        resetModule(module);
-        if (opt->applicable(module)) {
-          opt->applyOptimzer(module, builder);
-          auto curLatency = evaluate(module);
-          if (curLatency < minLatency) {
-            minLatency = curLatency;
-            saveBestModule(module);
-          }
-        }
-      }
+      tune(static_cast<ElementWiseOptimizer&>(*opt), module, elementWiseConfigs, ElementWiseOptimizer::elementWiseConfig);
     } else if (*opt == LayerNormOptimizer()) {
-      for (auto& layerNormConfig : layerNormConfigs) {
-        LayerNormOptimizer::layerNormConfig = layerNormConfig;
-        resetModule(module);
-        if (opt->applicable(module)) {
-          opt->applyOptimzer(module, builder);
-          auto curLatency = evaluate(module);
-          if (curLatency < minLatency) {
-            minLatency = curLatency;
-            saveBestModule(module);
-          }
-        }
-      }
+      tune(static_cast<LayerNormOptimizer&>(*opt), module, layerNormConfigs, LayerNormOptimizer::layerNormConfig);
     } else if (*opt == GatherOptimizer()) {
-      for (auto& gatherConfig : gatherConfigs) {
-        GatherOptimizer::gatherConfig = gatherConfig;
-        resetModule(module);
-        if (opt->applicable(module)) {
-          opt->applyOptimzer(module, builder);
-          // bestModule->dump();
-          auto curLatency = evaluate(module);
-          if (curLatency < minLatency) {
-            minLatency = curLatency;
-            saveBestModule(module);
-          }
-        }
-      }
+      tune(static_cast<GatherOptimizer&>(*opt), module, gatherConfigs, GatherOptimizer::gatherConfig);
     } else if (*opt == BatchMatmulOptimizer()) {
-      for (auto& batchMatmulConfig : batchMatmulConfigs) {
-        BatchMatmulOptimizer::batchMatmulConfig = batchMatmulConfig;
-        resetModule(module);
-        if (opt->applicable(module)) {
-          opt->applyOptimzer(module, builder);
-          // bestModule->dump();
-          auto curLatency = evaluate(module);
-          if (curLatency < minLatency) {
-            minLatency = curLatency;
-            saveBestModule(module);
-          }
-        }
-      }
-    } else if (opt->applicable(module)) {
-      opt->applyOptimzer(module, builder);
-      auto curLatency = evaluate(module);
-      if (curLatency < minLatency) {
-        minLatency = curLatency;
+      tune(static_cast<BatchMatmulOptimizer&>(*opt), module, batchMatmulConfigs, BatchMatmulOptimizer::batchMatmulConfig);
+    } else {
+      OptimizerTiming timing;
+      timing.optimizer = opt->name;
+      auto start = std::chrono::steady_clock::now();
+      bool matched = opt->applicable(module);
+      timing.matchMs = elapsedMs(start);
+      TuneTrial trial;
+      trial.optimizer = opt->name;
+      trial.applicable = matched;
+      trial.status = matched ? "ok" : "not_applicable";
+      trial.reason = matched ? "" : "no match in the module";
+      trial.startMs = elapsedMs(tuneStart);
+      trial.matchMs = timing.matchMs;
+      if (matched) {
+        start = std::chrono::steady_clock::now();
+        opt->applyOptimzer(module, builder);
+        verifyTrial(*opt, module);
+        tuneTrials++;
         saveBestModule(module);
+        appliedOpts.push_back({opt.get(), {}});
+        trial.transformMs = elapsedMs(start);
+        timing.trialMs.push_back(trial.transformMs);
       }
+      tuneTrace.push_back(trial);
+      optimizerTimings.push_back(timing);
     }
   }
+  auto start = std::chrono::steady_clock::now();
+  Rewriter::fast_math(bestModule);
+  // repeated layers lower to identical kernels, keep one copy of each.
+  Rewriter::deduplicate_kernels(bestModule);
+  finalizeMs = elapsedMs(start);
+  // the funcs are cached as they are emitted, a reused func is left as is by the finalization above.
+  if (incremental) {
+    cacheOptimizedFuncs(bestModule, funcIds);
+  }
+  minLatency = evaluate(bestModule);
+  // only the best module is returned, the working copies are freed.
+  drop(module);
+  drop(backupModule_);
   return bestModule;
 }
+
+std::string KernelCodeGenerator::tuningKey() const {
+  std::stringstream key;
+  auto configsKey = [&](const std::string& name, const std::vector<std::map<std::string, int>>& configs) {
+    key << name << ":";
+    for (auto& config : configs) {
+      for (auto& item : config) key << item.first << "=" << item.second << ",";
+      key << ";";
+    }
+    key << "\n";
+  };
+  key << "opts:";
+  for (auto& opt : opts) key << opt->name << ",";
+  key << "\n";
+  configsKey("Matmul", matmulConfigs);
+  configsKey("FMHA", fmhaConfigs);
+  configsKey("Binary", binaryConfigs);
+  configsKey("ElementWise", elementWiseConfigs);
+  configsKey("Gather", gatherConfigs);
+  configsKey("LayerNorm", layerNormConfigs);
+  configsKey("BatchMatmul", batchMatmulConfigs);
+  key << "device:" << device.name << "," << device.peakGFlops << "," << device.peakMMAGFlops << "," << device.bandwidthGBs << "\n";
+  auto budgetKey = [&](const TuneBudget& budget) {
+    key << budget.ms << "," << budget.trials << "," << budget.boundTolerance << ";";
+  };
+  key << "budget:";
+  budgetKey(graphBudget);
+  for (auto& item : opBudgets) {
+    key << item.first << "=";
+    budgetKey(item.second);
+  }
+  key << "\nvalidation:" << validation.enable << "," << validation.minDim << "," << validation.maxOps << "\n";
+  return key.str();
+}
+
+void KernelCodeGenerator::reuseOptimizedFuncs(mlir::ModuleOp& module, std::map<std::string, int64_t>& funcIds) {
+  // the graph-level fast math isn't part of the funcs, but changes their kernels.
+  std::string graphFlags = module->hasAttr(std::string("compute_dag.fast_math")) ? "fast_math" : "";
+  auto funcOps = Analyzer::collectFunctions(module);
+  for (auto funcOp : funcOps) {
+    if (funcOp.isDeclaration()) continue;
+    auto key = Analyzer::getStructuralKey(funcOp) + graphFlags;
+    auto id = fingerprints.emplace(std::move(key), fingerprints.size()).first->second;
+    auto name = funcOp.getSymName().str();
+    funcIds[name] = id;
+    if (optimizedFuncs.count(id) == 0) continue;
+    // same signature, so the calls stay valid.
+    auto reused = mlir::dyn_cast<mlir::func::FuncOp>(optimizedFuncs[id]->clone());
+    reused.setSymName(name);
+    mlir::OpBuilder(funcOp).insert(reused);
+    funcOp.erase();
+    reusedFuncs++;
+  }
+}
+
+void KernelCodeGenerator::cacheOptimizedFuncs(mlir::ModuleOp& module, const std::map<std::string, int64_t>& funcIds) {
+  for (auto& item : funcIds) {
+    if (optimizedFuncs.count(item.second) != 0) continue;
+    // a func fused into another one (fmha) is left unlowered, only funcs lowered in place are cached.
+    auto funcOp = module.lookupSymbol<mlir::func::FuncOp>(item.first);
+    if (!funcOp) continue;
+    auto state = funcOp->getAttrOfType<mlir::StringAttr>(std::string("func.state"));
+    if (!state || state.getValue() != "gpu") continue;
+    funcOp->setAttr(std::string("func.fingerprint"), builder.getI64IntegerAttr(item.second));
+    optimizedFuncs[item.second] = mlir::dyn_cast<mlir::func::FuncOp>(funcOp->clone());
+  }
+}
+
 }
@@ -1,42 +1,5 @@
 #include "Optimizer/Analyzer.h"
 
-struct ConstPassGuard {
-  ConstPassGuard() { visitor = 0;}
-  ~ConstPassGuard() { visitor = 1;}
-  void visit() { visitor = 1;}
-  bool visited() { return visitor; }
-  int visitor = 0;
-};
-
-struct CollectOutermostLoop : 
-  public mlir::PassWrapper<CollectOutermostLoop, mlir::OperationPass<mlir::ModuleOp>> {
-   MLIR_DEFINE_EXPLICIT_INTERNAL_INLINE_TYPE_ID(CollectOutermostLoop)
-   CollectOutermostLoop(ConstPassGuard* passGuard_, std::vector<mlir::AffineForOp>& res_) : 
-        passGuard(passGuard_), outermostForOps(res_) {}
-   void runOnOperation() override;
-   ConstPassGuard* passGuard;
-   std::vector<mlir::AffineForOp>& outermostForOps;
-};
-
-void CollectOutermostLoop::runOnOperation() {
-  mlir::ModuleOp module = getOperation();
-  
-  if (passGuard->visited()) return;
-  passGuard->visit();
-
-  module.walk<mlir::WalkOrder::PreOrder>([&](mlir::AffineForOp forOp) {
-    if (forOp->getParentOp() == module) {
-      outermostForOps.push_back(forOp);
-    }
-  });
-}
-
-
-std::unique_ptr<mlir::OperationPass<mlir::ModuleOp>> collectOutermostLoopPass(
-  ConstPassGuard* passGuard, std::vector<mlir::AffineForOp>& res) {
-   return std::make_unique<CollectOutermostLoop>(passGuard, res);
-}
-
 namespace KernelCodeGen {
 
 int Analyzer::getUsersNumber(mlir::Value::user_range users) {
@@ -49,42 +12,45 @@ int Analyzer::getUsersNumber(mlir::Value::user_range users) {
 
 
 std::vector<mlir::AffineForOp> Analyzer::collectOutermostLoop(mlir::ModuleOp& module) {
-  ConstPassGuard constPassGuard;
-  mlir::PassManager pm(module.getContext());
+  // only the direct children of the module, no need to walk the funcs.
   std::vector<mlir::AffineForOp> res;
-  pm.addPass(collectOutermostLoopPass(&constPassGuard, res));
-  if (failed(pm.run(module))) {
-    llvm::errs() << "Collects outermost loop failed.\n";
+  for (auto forOp : module.getBody()->getOps<mlir::AffineForOp>()) {
+    res.push_back(forOp);
   }
   return res;
 }
 
 std::vector<mlir::func::FuncOp> Analyzer::collectFunctions(mlir::ModuleOp& module, const std::string& targetFuncName) {
   std::vector<mlir::func::FuncOp> result;
-  module.walk<mlir::WalkOrder::PreOrder>([&](mlir::func::FuncOp funcOp) {
-    // auto funcAttrName = funcOp.getFunctionTypeAttrName(); ///<function_type
-    auto funcAttrName = funcOp.getSymName();
-    auto funcName = funcAttrName.str();
-    if (targetFuncName == "") result.push_back(funcOp);
-    else if (funcName.find(targetFuncName) != std::string::npos) {
+  // the funcs are the direct children of the module, no need to walk their bodies.
+  for (auto funcOp : module.getOps<mlir::func::FuncOp>()) {
+    if (targetFuncName == "") {
       result.push_back(funcOp);
+      continue;
     }
-  });
+    // a func already lowered to kernels (e.g. reused by the incremental mode) is not matched again.
+    auto state = funcOp->getAttrOfType<mlir::StringAttr>(std::string("func.state"));
+    if (state && state.getValue() == "gpu") continue;
+    llvm::SmallVector<llvm::StringRef> fields;
+    funcOp.getSymName().split(fields, '_');
+    if (llvm::is_contained(fields, targetFuncName)) {
+      result.push_back(funcOp);
+    }
+  }
   return std::move(result);
 }
 
 mlir::func::FuncOp Analyzer::getTargetFunction(mlir::ModuleOp& module, const std::string& targetFuncName) {
-  mlir::func::FuncOp res;
-  bool found = false;
-  module.walk<mlir::WalkOrder::PreOrder>([&](mlir::func::FuncOp funcOp) {
-    auto funcAttrName = funcOp.getSymName();
-    auto funcName = funcAttrName.str();
-    if (funcName == targetFuncName) {
-      res = funcOp;
-      found = true;
-    }
-  });
-  if (!found) {
+  auto res = module.lookupSymbol<mlir::func::FuncOp>(targetFuncName);
+  if (!res) {
+    llvm::errs() << "Failed get the function which name is " << targetFuncName << "\n";
+  }
+  return res;
+}
+
+mlir::func::FuncOp Analyzer::getTargetFunction(mlir::SymbolTable& symbolTable, const std::string& targetFuncName) {
+  auto res = symbolTable.lookup<mlir::func::FuncOp>(targetFuncName);
+  if (!res) {
     llvm::errs() << "Failed get the function which name is " << targetFuncName << "\n";
   }
   return res;
@@ -106,4 +72,56 @@ std::vector<mlir::func::CallOp> Analyzer::collectFuncCalls(mlir::ModuleOp& modul
   return std::move(res);
 }
 
+bool Analyzer::isVectorizable(mlir::Value buffer, int64_t width) {
+  if (width <= 1) return true;
+  auto type = buffer.getType().dyn_cast<mlir::MemRefType>();
+  if (!type || type.getRank() == 0) return false;
+  // the backend fetches at most a float4, a vector is aligned to its size only if that is a power of 2.
+  auto bytes = width * type.getElementTypeBitWidth() / 8;
+  if (bytes > 16 || !llvm::isPowerOf2_64(bytes)) return false;
+  llvm::SmallVector<int64_t> strides;
+  int64_t offset;
+  if (mlir::failed(mlir::getStridesAndOffset(type, strides, offset))) return false;
+  if (strides.back() != 1 || type.getShape().back() % width != 0) return false;
+  if (mlir::ShapedType::isDynamicStrideOrOffset(offset) || offset % width != 0) return false;
+  for (int i = 0; i < strides.size() - 1; i++) {
+    if (mlir::ShapedType::isDynamicStrideOrOffset(strides[i]) || strides[i] % width != 0) return false;
+  }
+  return true;
+}
+
+int64_t Analyzer::getVectorWidth(const std::vector<mlir::Value>& buffers, int64_t width) {
+  while (width > 1) {
+    bool vectorizable = true;
+    for (auto buffer : buffers) {
+      if (!isVectorizable(buffer, width)) vectorizable = false;
+    }
+    if (vectorizable) break;
+    width /= 2;
+  }
+  return std::max<int64_t>(width, 1);
+}
+
+std::string Analyzer::getStructuralKey(mlir::func::FuncOp funcOp) {
+  std::string key;
+  llvm::raw_string_ostream os(key);
+  // local scope numbers the SSA values from the func itself (%arg0, %0, ...),
+  // so the printed body does not depend on the surrounding module.
+  mlir::OpPrintingFlags flags;
+  flags.useLocalScope();
+  funcOp->print(os, flags);
+  os.flush();
+
+  auto symName = "@" + funcOp.getSymName().str();
+  auto pos = key.find(symName);
+  if (pos != std::string::npos) {
+    key.erase(pos, symName.size());
+  }
+  return key;
+}
+
+size_t Analyzer::getStructuralHash(mlir::func::FuncOp funcOp) {
+  return llvm::hash_value(getStructuralKey(funcOp));
+}
+
 }
\ No newline at end of file
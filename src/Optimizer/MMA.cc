@@ -0,0 +1,114 @@
+#include "Optimizer/MMA.h"
+
+#include <cmath>
+#include <cstring>
+#include <random>
+
+namespace KernelCodeGen {
+
+static float toTF32(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  // tensor cores only read the top 10 bits of the mantissa.
+  bits &= 0xffffe000u;
+  std::memcpy(&value, &bits, sizeof(bits));
+  return value;
+}
+
+std::vector<float> MMALayout::emulate(const std::vector<float>& A, const std::vector<float>& B, const std::vector<float>& C) {
+  assert(A.size() == M * K && B.size() == K * N && C.size() == M * N);
+  std::vector<std::vector<float>> fragA(WARP_SIZE, std::vector<float>(A_REGS));
+  std::vector<std::vector<float>> fragB(WARP_SIZE, std::vector<float>(B_REGS));
+  std::vector<std::vector<float>> fragC(WARP_SIZE, std::vector<float>(C_REGS));
+
+  // scatter.
+  for (int64_t lane = 0; lane < WARP_SIZE; lane++) {
+    for (int64_t r = 0; r < A_REGS; r++) {
+      auto a = A[rowA(lane, r) * K + colA(lane, r)];
+      fragA[lane][r] = toTF32(a);
+    }
+    for (int64_t r = 0; r < B_REGS; r++) {
+      auto b = B[rowB(lane, r) * N + colB(lane, r)];
+      fragB[lane][r] = toTF32(b);
+    }
+    for (int64_t r = 0; r < C_REGS; r++) {
+      fragC[lane][r] = C[rowC(lane, r) * N + colC(lane, r)];
+    }
+  }
+
+  // every lane reads the registers of the source lanes, as the shuffles of Rewriter::mma do.
+  auto fragD = fragC;
+  for (int64_t lane = 0; lane < WARP_SIZE; lane++) {
+    for (int64_t i = 0; i < C_REGS; i++) {
+      for (int64_t k = 0; k < K; k++) {
+        auto a = fragA[srcLaneA(lane, i, k)][regA(i, k)];
+        auto b = fragB[srcLaneB(lane, i, k)][regB(i, k)];
+        fragD[lane][i] += a * b;
+      }
+    }
+  }
+
+  // gather.
+  std::vector<float> D(M * N);
+  for (int64_t lane = 0; lane < WARP_SIZE; lane++) {
+    for (int64_t r = 0; r < C_REGS; r++) {
+      D[rowC(lane, r) * N + colC(lane, r)] = fragD[lane][r];
+    }
+  }
+  return D;
+}
+
+bool MMALayout::fits(int64_t blockM, int64_t blockN, int64_t blockK, int64_t warpM, int64_t warpN, int64_t threads,
+                     mlir::Type elementA, mlir::Type elementB, std::string& reason) {
+  reason.clear();
+  if (!supported(elementA, elementB)) {
+    reason = "the operands aren't f32";
+  } else if (blockK % K != 0) {
+    reason = "the k tile (" + std::to_string(blockK) + ") isn't a multiple of " + std::to_string(K);
+  } else if (warpM <= 0 || warpN <= 0 || warpM % M != 0 || warpN % N != 0) {
+    reason = "the warp tile (" + std::to_string(warpM) + "x" + std::to_string(warpN) + ") isn't made of 16x8 fragments";
+  } else if (blockM % warpM != 0 || blockN % warpN != 0) {
+    reason = "the block tile isn't made of warp tiles";
+  } else if ((blockM / warpM) * (blockN / warpN) * WARP_SIZE != threads) {
+    reason = "the block has " + std::to_string(threads) + " threads for " + std::to_string((blockM / warpM) * (blockN / warpN)) + " warp tiles";
+  }
+  return reason.empty();
+}
+
+float MMALayout::verify(int trials) {
+  // the lane computing C register i needs A(rowC, k) and B(k, colC), from the register its shuffles read.
+  for (int64_t lane = 0; lane < WARP_SIZE; lane++) {
+    for (int64_t i = 0; i < C_REGS; i++) {
+      for (int64_t k = 0; k < K; k++) {
+        auto srcA = srcLaneA(lane, i, k), srcB = srcLaneB(lane, i, k);
+        auto rA = regA(i, k), rB = regB(i, k);
+        if (rA >= A_REGS || rB >= B_REGS || srcA >= WARP_SIZE || srcB >= WARP_SIZE ||
+            rowA(srcA, rA) != rowC(lane, i) || colA(srcA, rA) != k || rowB(srcB, rB) != k || colB(srcB, rB) != colC(lane, i)) {
+          return INFINITY;
+        }
+      }
+    }
+  }
+  std::mt19937 gen(2023);
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+  float maxError = 0.0f;
+  for (int trial = 0; trial < trials; trial++) {
+    std::vector<float> A(M * K), B(K * N), C(M * N);
+    for (auto& a : A) a = dist(gen);
+    for (auto& b : B) b = dist(gen);
+    for (auto& c : C) c = dist(gen);
+    auto D = emulate(A, B, C);
+    for (int64_t m = 0; m < M; m++) {
+      for (int64_t n = 0; n < N; n++) {
+        double ref = C[m * N + n];
+        for (int64_t k = 0; k < K; k++) {
+          ref += static_cast<double>(toTF32(A[m * K + k])) * toTF32(B[k * N + n]);
+        }
+        maxError = std::max(maxError, static_cast<float>(std::abs(ref - D[m * N + n])));
+      }
+    }
+  }
+  return maxError;
+}
+
+}
@@ -1,13 +1,13 @@
 #include "Optimizer/Optimizer.h"
+#include "Optimizer/MMA.h"
+#include "Optimizer/UnrollPlanner.h"
+#include "Optimizer/Snapshot.h"
 #include "log.h"
 #include <cfloat>
+#include <algorithm>
 
-#define DUMP(module)                    \
-{                                       \
-  if (KCGLog::level == Log::Debug) {    \
-    module.dump();                      \
-  }                                     \
-}
+// snapshots only the transformed func after a rewriter step, see KCGSnapshot.
+#define DUMP(scope, step) KCGSnapshot::capture(scope, step)
 
 inline std::string toStr(mlir::Type type) {
   if(type.isa<mlir::Float16Type>()) return {"float16"};
@@ -271,6 +271,20 @@ bool MatmulOptimizer::applicable(mlir::ModuleOp& module) {
   return res;
 }
 
+void MatmulOptimizer::remap(const MatmulOptimizer& analysis, const CloneMapping& mapping) {
+  clear();
+  for (auto matmul : analysis.matmuls) {
+    auto cloned = mapping.map(matmul);
+    matmuls.insert(cloned);
+    matmulLoops[cloned] = mapping.map(analysis.matmulLoops.lookup(matmul));
+    auto buf = analysis.matmulBuffers.lookup(matmul);
+    buf.A = mapping.map(buf.A);
+    buf.B = mapping.map(buf.B);
+    buf.C = mapping.map(buf.C);
+    matmulBuffers[cloned] = buf;
+  }
+}
+
 int64_t smAReadSride(int64_t blockDim, int64_t warpSize) {
   int64_t warpNum = blockDim / warpSize;
   int64_t laneNum = warpSize;
@@ -398,6 +412,60 @@ mlir::AffineMap MatmulOptimizer::getAffineMap(const std::string& mapIdentifier,
     exprs.push_back(dim2 * matmulConfig["BLOCK_SIZE_M"] + M_offset * width + dim6);
     exprs.push_back(dim3 * matmulConfig["BLOCK_SIZE_N"] + N_offset * width + dim7);
     return mlir::AffineMap::get(/*dimCount*/8, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), builder.getContext());
+  } else if (mapIdentifier == "laneId") {
+    // dims are:[dim0, dim1]
+    // operands are: [threadIdx.y, threadIdx.x]
+    auto threadIdExpr = dim0 * blockDimX + dim1;
+    return mlir::AffineMap::get(/*dimCount*/2, 0, threadIdExpr % static_cast<uint64_t>(matmulConfig["WARP_SIZE"]));
+  }
+  // mma.sync: a warp computes (THREAD_SIZE_M / 2) x (THREAD_SIZE_N / 2) tiles of 16x8,
+  // tileC[2 * mi + r / 2][2 * ni + r % 2] is the register r of the tile (mi, ni).
+  int64_t mTiles = matmulConfig["THREAD_SIZE_M"] / 2, nTiles = matmulConfig["THREAD_SIZE_N"] / 2;
+  int64_t warpsN = matmulConfig["BLOCK_SIZE_N"] / (MMALayout::N * nTiles);
+  if (mapIdentifier == "loadFragAMMA") {
+    // dims are:[dim0, dim1, dim2, dim3]
+    // operands are: [threadIdx.y, threadIdx.x, k_inner, iv]
+    auto threadIdExpr = dim0 * blockDimX + dim1;
+    auto warpId = threadIdExpr.floorDiv(static_cast<uint64_t>(matmulConfig["WARP_SIZE"]));
+    auto laneId = threadIdExpr % static_cast<uint64_t>(matmulConfig["WARP_SIZE"]);
+    auto mi = dim3.floorDiv(MMALayout::A_REGS), r = dim3 % MMALayout::A_REGS;
+
+    auto M_offset = warpId.floorDiv(warpsN) * (MMALayout::M * mTiles) + mi * MMALayout::M + MMALayout::rowA(laneId, r);
+    auto K_offset = dim2 + MMALayout::colA(laneId, r);
+    llvm::SmallVector<mlir::AffineExpr> exprs;
+    exprs.push_back(K_offset);
+    exprs.push_back(M_offset);
+    return mlir::AffineMap::get(/*dimCount*/4, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), builder.getContext());
+  } else if (mapIdentifier == "loadFragBMMA") {
+    // dims are:[dim0, dim1, dim2, dim3]
+    // operands are: [threadIdx.y, threadIdx.x, k_inner, iv]
+    auto threadIdExpr = dim0 * blockDimX + dim1;
+    auto warpId = threadIdExpr.floorDiv(static_cast<uint64_t>(matmulConfig["WARP_SIZE"]));
+    auto laneId = threadIdExpr % static_cast<uint64_t>(matmulConfig["WARP_SIZE"]);
+    auto ni = dim3.floorDiv(MMALayout::B_REGS), r = dim3 % MMALayout::B_REGS;
+
+    auto N_offset = warpId % warpsN * (MMALayout::N * nTiles) + ni * MMALayout::N + MMALayout::colB(laneId, r);
+    auto K_offset = dim2 + MMALayout::rowB(laneId, r);
+    llvm::SmallVector<mlir::AffineExpr> exprs;
+    exprs.push_back(K_offset);
+    exprs.push_back(N_offset);
+    return mlir::AffineMap::get(/*dimCount*/4, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), builder.getContext());
+  } else if (mapIdentifier == "cacheWriteCMMA") {
+    // dims are:[dim0, dim1, dim2, dim3, dim4, dim5, dim6, dim7]
+    // operands are: [threadIdx.y, threadIdx.x, blockIdx.y, blockIdx.x, iv0, iv1, iv2, iv3]
+    // iv0 and iv1 step by 2, so (iv0 / 2, iv2) is (mi, r / 2) and (iv1 / 2, iv3) is (ni, r % 2).
+    auto threadIdExpr = dim0 * blockDimX + dim1;
+    auto warpId = threadIdExpr.floorDiv(static_cast<uint64_t>(matmulConfig["WARP_SIZE"]));
+    auto laneId = threadIdExpr % static_cast<uint64_t>(matmulConfig["WARP_SIZE"]);
+
+    auto M_offset = warpId.floorDiv(warpsN) * (MMALayout::M * mTiles) + dim4.floorDiv(2) * MMALayout::M + 
+                    MMALayout::rowC(laneId, dim6 * 2);
+    auto N_offset = warpId % warpsN * (MMALayout::N * nTiles) + dim5.floorDiv(2) * MMALayout::N + 
+                    MMALayout::colC(laneId, dim7);
+    llvm::SmallVector<mlir::AffineExpr> exprs;
+    exprs.push_back(dim2 * matmulConfig["BLOCK_SIZE_M"] + M_offset);
+    exprs.push_back(dim3 * matmulConfig["BLOCK_SIZE_N"] + N_offset);
+    return mlir::AffineMap::get(/*dimCount*/8, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), builder.getContext());
   } else {
     assert(false);
   }
@@ -410,35 +478,38 @@ void MatmulOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& bui
     auto loopM = loops[0], loopN = loops[1], loopK = loops[2];
     auto buffers = matmulBuffers[matmul];
     auto A = buffers.A, B = buffers.B, C = buffers.C;
+    // views with a non-unit innermost stride or a misaligned offset get narrower vectors, the maps read the width from the config.
+    auto vectorWidth = matmulConfig["VECTORIZE_WIDTH"];
+    matmulConfig["VECTORIZE_WIDTH"] = Analyzer::getVectorWidth({A, B, C}, vectorWidth);
     
     auto m_axes = Rewriter::split(loopM, 3, {matmulConfig["THREAD_SIZE_M"], matmulConfig["BLOCK_SIZE_M"]});
     auto n_axes = Rewriter::split(loopN, 3, {matmulConfig["THREAD_SIZE_N"], matmulConfig["BLOCK_SIZE_N"]});
 
-    DUMP(module);
+    DUMP(matmul, "split");
 
     auto m_outer = m_axes[0], m_mider = m_axes[1], m_inner = m_axes[2];
     auto n_outer = n_axes[0], n_mider = n_axes[1], n_inner = n_axes[2];
 
 
     Rewriter::reorder({m_outer, n_outer, m_mider, n_mider, m_inner, n_inner});
-    DUMP(module);
+    DUMP(matmul, "reorder");
 
     auto gridLevel = Rewriter::parallel({m_outer, n_outer});
     auto blockLevel = Rewriter::parallel({m_mider, n_mider});
-    DUMP(module);
+    DUMP(matmul, "parallel");
 
 
     std::vector<mlir::AffineForOp> kmn_axes{loopK, m_inner, n_inner};
     auto tileC = Rewriter::bufferizeLoopCarryVar(kmn_axes);
     loopK = kmn_axes[0], m_inner = kmn_axes[1], n_inner = kmn_axes[2];
-    DUMP(module);
+    DUMP(matmul, "bufferizeLoopCarryVar");
 
     Rewriter::reorder({loopK, m_inner, n_inner});
-    DUMP(module);
+    DUMP(matmul, "reorder");
 
     auto k_axes = Rewriter::split(loopK, 2, {matmulConfig["BLOCK_SIZE_K"]});
     auto k_outer = k_axes[0], k_inner = k_axes[1];
-    DUMP(module);
+    DUMP(matmul, "split");
 
     int64_t blockThreads;
     auto blockDim = Analyzer::getParallelNumber(blockLevel, blockThreads);
@@ -450,16 +521,31 @@ void MatmulOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& bui
     auto elementA = A.getType().dyn_cast<mlir::MemRefType>().getElementType();
     auto elementB = B.getType().dyn_cast<mlir::MemRefType>().getElementType();
 
+    bool mma = matmulConfig["MMA"];
+    std::string mmaReason;
+    if (mma && !MMALayout::fits(matmulConfig["BLOCK_SIZE_M"], matmulConfig["BLOCK_SIZE_N"], matmulConfig["BLOCK_SIZE_K"], 
+                                matmulConfig["THREAD_SIZE_M"] * MMALayout::M / 2, matmulConfig["THREAD_SIZE_N"] * MMALayout::N / 2, 
+                                blockThreads, elementA, elementB, mmaReason)) {
+      if (KCGLog::level == Log::Debug) llvm::errs() << "mma.sync is not generated, " << mmaReason << ", fall back to fma\n";
+      mma = false;
+    }
+    int64_t mTiles = matmulConfig["THREAD_SIZE_M"] / 2, nTiles = matmulConfig["THREAD_SIZE_N"] / 2;
+    int64_t skew = mma ? MMALayout::SMEM_SKEW : 0;
+    if (mma) {
+      fragASize = mTiles * MMALayout::A_REGS;
+      fragBSize = nTiles * MMALayout::B_REGS;
+    }
+
     auto fragB = Rewriter::alloc_buffer(/*parallelLevel*/blockLevel, MemorySpace::local, {fragBSize}, elementB);
     auto fragA = Rewriter::alloc_buffer(/*parallelLevel*/blockLevel, MemorySpace::local, {fragASize}, elementA);
 
     auto tileB = Rewriter::alloc_buffer(/*parallelLevel*/blockLevel, MemorySpace::local, {ldgBSize}, elementB);
     auto tileA = Rewriter::alloc_buffer(/*parallelLevel*/blockLevel, MemorySpace::local, {ldgASize}, elementA);
     auto smB = Rewriter::alloc_buffer(/*parallelLevel*/gridLevel, MemorySpace::shared,
-            {matmulConfig["BLOCK_SIZE_K"], matmulConfig["BLOCK_SIZE_N"]}, elementB);
+            {matmulConfig["BLOCK_SIZE_K"], matmulConfig["BLOCK_SIZE_N"] + skew}, elementB);
     auto smA = Rewriter::alloc_buffer(/*parallelLevel*/gridLevel, MemorySpace::shared,
-            {matmulConfig["BLOCK_SIZE_K"], matmulConfig["BLOCK_SIZE_M"]}, elementA);
-    DUMP(module);
+            {matmulConfig["BLOCK_SIZE_K"], matmulConfig["BLOCK_SIZE_M"] + skew}, elementA);
+    DUMP(matmul, "alloc_buffer");
     
     auto blockIdx = Rewriter::getParallelIdx(gridLevel);
     auto threadIdx = Rewriter::getParallelIdx(blockLevel);
@@ -471,7 +557,7 @@ void MatmulOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& bui
     auto loadTileB = Rewriter::read(B, tileB, loadTileBMap, 
                       {threadIdx[0], threadIdx[1], k_outer.getInductionVar(), blockIdx[1]}, 
                       matmulConfig["VECTORIZE_WIDTH"], loadTileA, Position::after);
-    DUMP(module);
+    DUMP(matmul, "read");
 
     auto storeTileAMap = getAffineMap("storeTileA", builder);
     auto storeTileA = Rewriter::write(tileA, smA, storeTileAMap, {threadIdx[0], threadIdx[1]}, 
@@ -482,90 +568,104 @@ void MatmulOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& bui
     auto gpuBarrierPrefix = Rewriter::barrier(loadTileA, Position::before);
     auto gpuBarrierSuffix = Rewriter::barrier(storeTileB, Position::after);
 
-    DUMP(module);
+    DUMP(matmul, "barrier");
 
-    auto loadFragAMap = getAffineMap("loadFragA", builder);
+    // the mma fragments are gathered element-wise, every register comes from a different row.
+    int64_t fragWidth = mma ? 1 : matmulConfig["VECTORIZE_WIDTH"];
+    auto loadFragAMap = getAffineMap(mma ? "loadFragAMMA" : "loadFragA", builder);
     auto loadFragA = Rewriter::read(smA, fragA, loadFragAMap, {threadIdx[0], threadIdx[1], k_inner.getInductionVar()}, 
-                      matmulConfig["VECTORIZE_WIDTH"], k_inner, Position::begin);
-    auto loadFragBMap = getAffineMap("loadFragB", builder);
+                      fragWidth, k_inner, Position::begin);
+    auto loadFragBMap = getAffineMap(mma ? "loadFragBMMA" : "loadFragB", builder);
     auto loadFragB = Rewriter::read(smB, fragB, loadFragBMap, {threadIdx[0], threadIdx[1], k_inner.getInductionVar()}, 
-                      matmulConfig["VECTORIZE_WIDTH"], loadFragA, Position::after);
-    DUMP(module);
-
-    Rewriter::cache_read(k_inner, A, fragA, getAffineMap("cacheReadA", builder), {m_inner.getInductionVar()});
-    Rewriter::cache_read(k_inner, B, fragB, getAffineMap("cacheReadB", builder), {n_inner.getInductionVar()});
-    DUMP(module);
+                      fragWidth, loadFragA, Position::after);
+    DUMP(matmul, "read");
+
+    if (mma) {
+      // the fma nest of m_inner and n_inner is replaced by the warp level mma of MMALayout::K steps.
+      m_inner.erase();
+      k_inner.setStep(MMALayout::K);
+      mlir::OpBuilder mmaBuilder(k_inner.getBody()->getTerminator());
+      Rewriter::mma(mmaBuilder, tileC, fragA, fragB, getAffineMap("laneId", builder), 
+                    {threadIdx[0], threadIdx[1]}, mTiles, nTiles);
+    } else {
+      Rewriter::cache_read(k_inner, A, fragA, getAffineMap("cacheReadA", builder), {m_inner.getInductionVar()});
+      Rewriter::cache_read(k_inner, B, fragB, getAffineMap("cacheReadB", builder), {n_inner.getInductionVar()});
+    }
+    DUMP(matmul, "cache_read");
 
+    // a lane of mma.sync holds 2 adjacent elements of C per row.
+    int64_t writeWidth = mma ? 2 : matmulConfig["VECTORIZE_WIDTH"];
     auto writeCbody = Rewriter::get_write(blockLevel, C);
     assert(writeCbody.size() == 1);
-    auto m_inner_axes = Rewriter::split(writeCbody[0][0], 2, {matmulConfig["VECTORIZE_WIDTH"]});
-    auto n_inner_axes = Rewriter::split(writeCbody[0][1], 2, {matmulConfig["VECTORIZE_WIDTH"]});
+    auto m_inner_axes = Rewriter::split(writeCbody[0][0], 2, {writeWidth});
+    auto n_inner_axes = Rewriter::split(writeCbody[0][1], 2, {writeWidth});
     auto m_inner_0 = m_inner_axes[0], m_inner_1 = m_inner_axes[1];
     auto n_inner_0 = n_inner_axes[0], n_inner_1 = n_inner_axes[1];
     Rewriter::reorder({m_inner_0, n_inner_0, m_inner_1, n_inner_1});
-    DUMP(module);
+    DUMP(matmul, "reorder");
 
-    Rewriter::cache_write(m_inner_0, C, C, getAffineMap("cacheWriteC", builder), 
+    Rewriter::cache_write(m_inner_0, C, C, getAffineMap(mma ? "cacheWriteCMMA" : "cacheWriteC", builder), 
                           {threadIdx[0], threadIdx[1], blockIdx[0], blockIdx[1], m_inner_0.getInductionVar(),
                           n_inner_0.getInductionVar(), m_inner_1.getInductionVar(), n_inner_1.getInductionVar()});
-    DUMP(module);
+    DUMP(matmul, "cache_write");
 
-    Rewriter::vectorize(n_inner_1, matmulConfig["VECTORIZE_WIDTH"]);
-    DUMP(module);
+    Rewriter::vectorize(n_inner_1, writeWidth);
+    DUMP(matmul, "vectorize");
     
-    auto doubleLoadTileB = Rewriter::pipeline({loadTileB, storeTileB}, smB, k_outer);
-    auto doubleLoadTileA = Rewriter::pipeline({loadTileA, storeTileA}, smA, k_outer);
-    auto doubleLoadFragB = Rewriter::pipeline({loadFragB}, fragB, k_inner);
-    auto doubleLoadFragA = Rewriter::pipeline({loadFragA}, fragA, k_inner);
-    DUMP(module);
-
-    Rewriter::detach_last_loop(k_inner);
-    DUMP(module);
-
-    Rewriter::schedule(doubleLoadTileA[0][0], doubleLoadTileB[0][0], Position::before);
-    Rewriter::schedule(doubleLoadTileA[0][1], doubleLoadTileB[0][1], Position::before); 
-    Rewriter::schedule(gpuBarrierPrefix, doubleLoadTileB[0][1], Position::after);
-    Rewriter::schedule(doubleLoadTileB[1][0], doubleLoadTileA[1][0], Position::after);
-    Rewriter::schedule(doubleLoadTileA[1][1], doubleLoadTileB[1][1], Position::before);
-    Rewriter::schedule(gpuBarrierSuffix, doubleLoadTileB[1][1], Position::after);
-    auto ifOp = doubleLoadTileA[1][1]->getParentOp();
-    Rewriter::schedule(ifOp, k_inner, Position::after); 
-    Rewriter::extract_loop(doubleLoadFragA[0][0], k_outer, /*iteration*/0);
-    Rewriter::extract_loop(doubleLoadFragB[0][0], k_outer, /*iteration*/0);
-    Rewriter::schedule(doubleLoadFragB[0][0], k_outer, Position::end);
-    Rewriter::schedule(doubleLoadFragA[0][0], k_outer, Position::end);
-    DUMP(module);
-
-    Rewriter::change_double_buffer(doubleLoadFragA[0][0], smA);
-    Rewriter::change_double_buffer(doubleLoadFragB[0][0], smB);;
-    DUMP(module);
-
-    Rewriter::take_off_true_if(module);
-    Rewriter::delete_false_if(module);
-    DUMP(module);
+    // the mma fragments are loaded right before their use, the warp scheduler hides the latency.
+    std::vector<std::vector<mlir::AffineForOp>> doubleLoadFragA, doubleLoadFragB;
+    if (!mma) {
+      doubleLoadFragB = Rewriter::pipeline({loadFragB}, fragB, k_inner);
+      doubleLoadFragA = Rewriter::pipeline({loadFragA}, fragA, k_inner);
+      DUMP(matmul, "pipeline");
+
+      Rewriter::detach_last_loop(k_inner);
+      DUMP(matmul, "detach_last_loop");
+    }
+
+    std::vector<mlir::Value> smems{smA, smB};
+    // producer warps stage the tiles, the fragments of the next tile can't be prefetched by the consumers.
+    int64_t producerWarps = matmulConfig["WARP_SPECIALIZE"];
+    if (producerWarps) {
+      std::vector<mlir::AffineForOp> copies{loadTileA, loadTileB, storeTileA, storeTileB};
+      if (matmulConfig["ASYNC_COPY"]) {
+        copies = {Rewriter::async_copy(loadTileA, storeTileA), Rewriter::async_copy(loadTileB, storeTileB)};
+      }
+      Rewriter::warp_specialize(blockLevel, k_outer, copies, smems, gpuBarrierPrefix, gpuBarrierSuffix, 
+                                matmulConfig["STAGES"], producerWarps, matmulConfig["WARP_SIZE"], matmulConfig["ASYNC_COPY"]);
+    } else if (matmulConfig["ASYNC_COPY"]) {
+      auto copyTileA = Rewriter::async_copy(loadTileA, storeTileA);
+      auto copyTileB = Rewriter::async_copy(loadTileB, storeTileB);
+      Rewriter::async_pipeline({copyTileA, copyTileB}, smems, k_outer, k_inner, 
+                               gpuBarrierPrefix, gpuBarrierSuffix, matmulConfig["STAGES"]);
+    } else {
+      Rewriter::pipeline({loadTileA, loadTileB}, {storeTileA, storeTileB}, smems, k_outer, k_inner, 
+                         gpuBarrierPrefix, gpuBarrierSuffix, matmulConfig["STAGES"]);
+    }
+    smA = smems[0], smB = smems[1];
+    if (!mma && !producerWarps) {
+      Rewriter::extract_loop(doubleLoadFragA[0][0], k_outer, /*iteration*/0);
+      Rewriter::extract_loop(doubleLoadFragB[0][0], k_outer, /*iteration*/0);
+      Rewriter::schedule(doubleLoadFragB[0][0], k_outer, Position::end);
+      Rewriter::schedule(doubleLoadFragA[0][0], k_outer, Position::end);
+      DUMP(matmul, "schedule");
+
+      Rewriter::change_double_buffer(doubleLoadFragA[0][0], smA);
+      Rewriter::change_double_buffer(doubleLoadFragB[0][0], smB);;
+      DUMP(matmul, "change_double_buffer");
+    }
+
+    Rewriter::simplify_if(matmul);
+    DUMP(matmul, "simplify_if");
 
     int64_t threshold = std::max(matmulConfig["BLOCK_SIZE_K"], std::max(matmulConfig["THREAD_SIZE_M"], matmulConfig["THREAD_SIZE_N"]));
-    Rewriter::unroll(module, [&](mlir::AffineForOp forOp)->bool {
-      if (!forOp.hasConstantBounds()) return false;
-      auto step = forOp.getStep();
-      auto ub = forOp.getConstantUpperBound();
-      auto lb = forOp.getConstantLowerBound();
-      auto times = (ub - lb) / step;
-      if (times >= std::min<int64_t>(threshold, matmulConfig["VECTORIZE_WIDTH"])) return false;
-      return true;
-    });
-    DUMP(module);
-
-    Rewriter::unrollAttribute(module, [&](mlir::AffineForOp forOp)->bool {
-      if (!forOp.hasConstantBounds()) return false;
-      auto step = forOp.getStep();
-      auto ub = forOp.getConstantUpperBound();
-      auto lb = forOp.getConstantLowerBound();
-      auto times = (ub - lb) / step;
-      if (times > threshold) return false;
-      return true;
-    });
-    DUMP(module);
+    UnrollPlanner::plan(matmul, /*fullLimit*/std::min<int64_t>(threshold, matmulConfig["VECTORIZE_WIDTH"]), /*pragmaLimit*/threshold, 
+                        matmulConfig["UNROLL_BUDGET"]);
+    DUMP(matmul, "unroll_plan");
+
+    Rewriter::scalar_replace(matmul);
+    DUMP(matmul, "scalar_replace");
+    matmulConfig["VECTORIZE_WIDTH"] = vectorWidth;
   }
 }
 
@@ -612,6 +712,20 @@ bool BinaryOptimizer::applicable(mlir::ModuleOp& module) {
   return res;
 }
 
+void BinaryOptimizer::remap(const BinaryOptimizer& analysis, const CloneMapping& mapping) {
+  clear();
+  for (auto binary : analysis.binarys) {
+    auto cloned = mapping.map(binary);
+    binarys.insert(cloned);
+    binaryLoops[cloned] = mapping.map(analysis.binaryLoops.lookup(binary));
+    auto buf = analysis.binaryBuffers.lookup(binary);
+    buf.A = mapping.map(buf.A);
+    buf.B = mapping.map(buf.B);
+    buf.C = mapping.map(buf.C);
+    binaryBuffers[cloned] = buf;
+  }
+}
+
 mlir::AffineMap BinaryOptimizer::getAffineMap(const std::string& mapIdentifier, mlir::OpBuilder& builder, 
                                               const std::vector<int64_t> &extras, const int needDimNums, const int oneDimNums) {
   auto dim0 = builder.getAffineDimExpr(0);
@@ -937,56 +1051,36 @@ void BinaryOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& bui
     auto dimY = new_loops[0].getUpperBoundMap().getSingleConstantResult();
     auto dimX = new_loops[1].getUpperBoundMap().getSingleConstantResult();
 
-    DUMP(module);
+    DUMP(binary, "combineToTowDim");
     // 循环切块大小
-    auto split_out_loops = Rewriter::split(new_loops[0], 3, {binaryConfig["THREAD_SIZE_M"], binaryConfig["BLOCK_SIZE_M"]});  // 第一个是一个thread计算的维度，第二个是一个block计算的多大的维度
-    auto split_in_loops = Rewriter::split(new_loops[1], 3, {binaryConfig["THREAD_SIZE_N"], binaryConfig["BLOCK_SIZE_N"]});   // 
-    DUMP(module);
+    auto split_out_loops = Rewriter::split(new_loops[0], 3, {binaryConfig["THREAD_SIZE_M"], binaryConfig["BLOCK_SIZE_M"]}, /*guardTail*/true);  // 第一个是一个thread计算的维度，第二个是一个block计算的多大的维度
+    auto split_in_loops = Rewriter::split(new_loops[1], 3, {binaryConfig["THREAD_SIZE_N"], binaryConfig["BLOCK_SIZE_N"]}, /*guardTail*/true);   // 
+    DUMP(binary, "split");
 
     auto out_outer = split_out_loops[0], out_mider = split_out_loops[1], out_inner = split_out_loops[2];
     auto in_outer = split_in_loops[0], in_mider = split_in_loops[1], in_inner = split_in_loops[2];
     Rewriter::reorder({out_outer, in_outer, out_mider, in_mider, out_inner, in_inner});
-    DUMP(module);
+    DUMP(binary, "reorder");
 
     auto gridLevel = Rewriter::parallel({out_outer, in_outer});
     auto blockLevel = Rewriter::parallel({out_mider, in_mider});
-    DUMP(module);
+    DUMP(binary, "parallel");
 
     // auto *op = gridLevel->getParentOp();
     // auto funcOp = mlir::dyn_cast<mlir::func::FuncOp>(op);
     // funcOp->setAttr(std::string("func.state"), builder.getStringAttr("gpu"));
 
-    auto blockElemIdx = Rewriter::getElementIdx(gridLevel);
-    auto ThreadElemIdx = Rewriter::getElementIdx(blockLevel);
-    
-    if (dimX % binaryConfig["THREAD_SIZE_N"] || dimY % binaryConfig["THREAD_SIZE_M"]) {
-      std::vector<int> range{dimY, dimX, binaryConfig["THREAD_SIZE_M"], binaryConfig["THREAD_SIZE_N"]};
-      llvm::SmallVector<mlir::Value> operands{blockElemIdx[0], blockElemIdx[1], ThreadElemIdx[0], ThreadElemIdx[1]};  // by bx ty tx
-      auto ifop = Rewriter::irregularMat(out_inner, range, operands);
-      DUMP(module);
-    }
-    Rewriter::unroll(module, [&](mlir::AffineForOp forOp)->bool {
-    if (!forOp.hasConstantBounds()) return false;  // 判断forop的上界和下界是否是已知量，这个可以直接手动去除循环结构
-    auto step = forOp.getStep();
-    auto ub = forOp.getConstantUpperBound();
-    auto lb = forOp.getConstantLowerBound();
-    auto times = (ub - lb) / step;
-    // if (times >= std::min<int64_t>(64, 4)) return false;
-    if (times >= 2) return false;
-    return true;
-    });
-    DUMP(module);
-
-    Rewriter::unrollAttribute(module, [&](mlir::AffineForOp forOp)->bool {   // 这种循环是可以添加pragma unroll的
-    if (!forOp.hasConstantBounds()) return false;
-    auto step = forOp.getStep();
-    auto ub = forOp.getConstantUpperBound();
-    auto lb = forOp.getConstantLowerBound();
-    auto times = (ub - lb) / step;
-    if (times > 64) return false;
-    return true;
-    });
-    DUMP(module);
+    // full tiles run without the tail guards.
+    Rewriter::version_tail(out_inner);
+    DUMP(binary, "version_tail");
+
+    Rewriter::coarsen(blockLevel, binaryConfig["BLOCK_COARSEN"]);
+    Rewriter::coarsen(gridLevel, binaryConfig["GRID_COARSEN"]);
+    Rewriter::grid_stride(gridLevel, binaryConfig["GRID_CAP"], binaryConfig["SM_COUNT"]);
+    DUMP(binary, "grid_stride");
+
+    UnrollPlanner::plan(binary, /*fullLimit*/2, /*pragmaLimit*/64, binaryConfig["UNROLL_BUDGET"]);
+    DUMP(binary, "unroll_plan");
   }
 }
 /*--------------------------------------------------------------------*/
@@ -1017,6 +1111,19 @@ bool ElementWiseOptimizer::applicable(mlir::ModuleOp& module) {
   return res;
 }
 
+void ElementWiseOptimizer::remap(const ElementWiseOptimizer& analysis, const CloneMapping& mapping) {
+  clear();
+  for (auto elementWise : analysis.elementWises) {
+    auto cloned = mapping.map(elementWise);
+    elementWises.insert(cloned);
+    elementWiseLoops[cloned] = mapping.map(analysis.elementWiseLoops.lookup(elementWise));
+    auto buf = analysis.elementWiseBuffers.lookup(elementWise);
+    buf.input = mapping.map(buf.input);
+    buf.output = mapping.map(buf.output);
+    elementWiseBuffers[cloned] = buf;
+  }
+}
+
 mlir::AffineMap ElementWiseOptimizer::getAffineMap(const std::string& mapIdentifier, mlir::OpBuilder& builder, const std::vector<int64_t> &extras) {
   auto dim0 = builder.getAffineDimExpr(0);
   auto dim1 = builder.getAffineDimExpr(1);
@@ -1088,20 +1195,20 @@ void ElementWiseOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder
     auto dimY = new_loops[0].getUpperBoundMap().getSingleConstantResult();
     auto dimX = new_loops[1].getUpperBoundMap().getSingleConstantResult();
 
-    DUMP(module);
+    DUMP(elementwise, "combineToTowDim");
     // 循环切块大小
-    auto split_out_loops = Rewriter::split(new_loops[0], 3, {elementWiseConfig["THREAD_SIZE_M"], elementWiseConfig["BLOCK_SIZE_M"]});
-    auto split_in_loops = Rewriter::split(new_loops[1], 3, {elementWiseConfig["THREAD_SIZE_M"], elementWiseConfig["BLOCK_SIZE_M"]});
-    DUMP(module);
+    auto split_out_loops = Rewriter::split(new_loops[0], 3, {elementWiseConfig["THREAD_SIZE_M"], elementWiseConfig["BLOCK_SIZE_M"]}, /*guardTail*/true);
+    auto split_in_loops = Rewriter::split(new_loops[1], 3, {elementWiseConfig["THREAD_SIZE_M"], elementWiseConfig["BLOCK_SIZE_M"]}, /*guardTail*/true);
+    DUMP(elementwise, "split");
 
     auto out_outer = split_out_loops[0], out_mider = split_out_loops[1], out_inner = split_out_loops[2];
     auto in_outer = split_in_loops[0], in_mider = split_in_loops[1], in_inner = split_in_loops[2];
     Rewriter::reorder({out_outer, in_outer, out_mider, in_mider, out_inner, in_inner});
-    DUMP(module);
+    DUMP(elementwise, "reorder");
 
     auto gridLevel = Rewriter::parallel({out_outer, in_outer});
     auto blockLevel = Rewriter::parallel({out_mider, in_mider});
-    DUMP(module);
+    DUMP(elementwise, "parallel");
 
     auto blockElemIdx = Rewriter::getElementIdx(gridLevel);
     auto ThreadElemIdx = Rewriter::getElementIdx(blockLevel);
@@ -1110,12 +1217,13 @@ void ElementWiseOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder
       Rewriter::schedule(cst, blockLevel, Position::begin);
     });
 
-    if (dimX % elementWiseConfig["THREAD_SIZE_N"] || dimY % elementWiseConfig["THREAD_SIZE_M"]) {
-      std::vector<int> range{dimY, dimX, elementWiseConfig["THREAD_SIZE_M"], elementWiseConfig["THREAD_SIZE_N"]};
-      llvm::SmallVector<mlir::Value> operands{blockElemIdx[0], blockElemIdx[1], ThreadElemIdx[0], ThreadElemIdx[1]};  // by bx ty tx
-      auto ifop = Rewriter::irregularMat(out_inner, range, operands);
-      DUMP(module);
-    } else {
+    // rows not aligned to the vector width, or strided views, keep the guarded scalar loops.
+    if (dimX % elementWiseConfig["VECTORIZE_WIDTH"] == 0 &&
+        Analyzer::getVectorWidth({input, output}, elementWiseConfig["VECTORIZE_WIDTH"]) == elementWiseConfig["VECTORIZE_WIDTH"]) {
+      out_inner = Rewriter::version_tail(out_inner);
+      in_inner = mlir::dyn_cast<mlir::AffineForOp>(out_inner.getBody()->front());
+      DUMP(elementwise, "version_tail");
+
       auto input_type = input.getType();
       auto element = input_type.dyn_cast<mlir::MemRefType>().getElementType();
 
@@ -1146,31 +1254,16 @@ void ElementWiseOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder
         Rewriter::cache_write(in_inner, input, frag, pointLoadOrStore, {in_inner.getInductionVar()});
       }
 
-      DUMP(module);
+      DUMP(elementwise, "cache_write");
     }
 
-    Rewriter::unroll(module, [&](mlir::AffineForOp forOp)->bool {
-    if (!forOp.hasConstantBounds()) return false;  // 判断forop的上界和下界是否是已知量，这个可以直接手动去除循环结构
-    auto step = forOp.getStep();
-    auto ub = forOp.getConstantUpperBound();
-    auto lb = forOp.getConstantLowerBound();
-    auto times = (ub - lb) / step;
-    // if (times >= std::min<int64_t>(64, 4)) return false;
-    if (times >= 2) return false;
-    return true;
-    });
-    DUMP(module);
-
-    Rewriter::unrollAttribute(module, [&](mlir::AffineForOp forOp)->bool {   // 这种循环是可以添加pragma unroll的
-    if (!forOp.hasConstantBounds()) return false;
-    auto step = forOp.getStep();
-    auto ub = forOp.getConstantUpperBound();
-    auto lb = forOp.getConstantLowerBound();
-    auto times = (ub - lb) / step;
-    if (times > 64) return false;
-    return true;
-    });
-    DUMP(module);
+    Rewriter::coarsen(blockLevel, elementWiseConfig["BLOCK_COARSEN"]);
+    Rewriter::coarsen(gridLevel, elementWiseConfig["GRID_COARSEN"]);
+    Rewriter::grid_stride(gridLevel, elementWiseConfig["GRID_CAP"], elementWiseConfig["SM_COUNT"]);
+    DUMP(elementwise, "grid_stride");
+
+    UnrollPlanner::plan(elementwise, /*fullLimit*/2, /*pragmaLimit*/64, elementWiseConfig["UNROLL_BUDGET"]);
+    DUMP(elementwise, "unroll_plan");
   }
 }
 /*--------------------------------------------------------------------*/
@@ -1203,6 +1296,21 @@ bool LayerNormOptimizer::applicable(mlir::ModuleOp& module) {
   return res;
 }
 
+void LayerNormOptimizer::remap(const LayerNormOptimizer& analysis, const CloneMapping& mapping) {
+  clear();
+  for (auto layerNorm : analysis.layerNorms) {
+    auto cloned = mapping.map(layerNorm);
+    layerNorms.insert(cloned);
+    layerNormLoops[cloned] = mapping.map(analysis.layerNormLoops.lookup(layerNorm));
+    auto buf = analysis.layerNormBuffers.lookup(layerNorm);
+    buf.input = mapping.map(buf.input);
+    buf.scale = mapping.map(buf.scale);
+    buf.bias = mapping.map(buf.bias);
+    buf.output = mapping.map(buf.output);
+    layerNormBuffers[cloned] = buf;
+  }
+}
+
 mlir::AffineMap LayerNormOptimizer::getAffineMap(const std::string& mapIdentifier, mlir::OpBuilder& builder, const std::vector<int64_t> &extras) {
   auto dim0 = builder.getAffineDimExpr(0);
   auto dim1 = builder.getAffineDimExpr(1);
@@ -1808,36 +1916,36 @@ void LayerNormOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder&
     auto sonLoop1 = Rewriter::combineToOneDim(sonLoops1);
     auto sonLoop2 = Rewriter::combineToOneDim(sonLoops2);
     auto sonLoop3 = Rewriter::combineToOneDim(sonLoops3);
-    DUMP(module);
+    DUMP(layerNorm, "combineToOneDim");
 
     auto iterBuffer1 = Rewriter::bufferizeLoopCarryVar(sonLoop1, loops[0].getBody());
     auto iterBuffer2 = Rewriter::bufferizeLoopCarryVar(sonLoop2, loops[0].getBody());
-    DUMP(module);
+    DUMP(layerNorm, "bufferizeLoopCarryVar");
 
     auto split_loops1 = Rewriter::split(sonLoop1, 3, {layerNormConfig["THREAD_SIZE"], layerNormConfig["BLOCK_SIZE"]});
     auto split_loops2 = Rewriter::split(sonLoop2, 3, {layerNormConfig["THREAD_SIZE"], layerNormConfig["BLOCK_SIZE"]});
     auto split_loops3 = Rewriter::split(sonLoop3, 3, {layerNormConfig["THREAD_SIZE"], layerNormConfig["BLOCK_SIZE"]});
-    DUMP(module);
+    DUMP(layerNorm, "split");
 
     // split_loops1[1]，split_loops2[1]，split_loops3[1] no exist
     Rewriter::swapLoops({{split_loops1[0], split_loops1[1]}, {split_loops2[0], split_loops2[1]}, {split_loops3[0], split_loops3[1]}});
-    DUMP(module);
+    DUMP(layerNorm, "swapLoops");
     
     auto gridLevel = Rewriter::parallel({loops[0]});
     auto blockLevel1 = Rewriter::parallel({split_loops1[1]});
     auto blockLevel2 = Rewriter::parallel({split_loops2[1]});
     auto blockLevel3 = Rewriter::parallel({split_loops3[1]});
-    DUMP(module);
+    DUMP(layerNorm, "parallel");
 
     Rewriter::bufferizeOpResult(blockLevel2->getPrevNode(), iterBuffer1);  // 将计算mean的过程的结果存入到iterBuffer1
     Rewriter::bufferizeOpResult(blockLevel3->getPrevNode(), iterBuffer2);  // 将计算std的过程的结果存入到iterBuffer2
-    DUMP(module);
+    DUMP(layerNorm, "bufferizeOpResult");
 
     // blockLevel2, blockLevel3 no exist
     auto blockLevel = combineParallel({blockLevel1, blockLevel2, blockLevel3});
     Rewriter::barrier(split_loops2[0], Position::before);
     Rewriter::barrier(split_loops3[0], Position::before);
-    DUMP(module);
+    DUMP(layerNorm, "barrier");
 
     auto input_type = input.getType();
     auto element = input_type.dyn_cast<mlir::MemRefType>().getElementType();
@@ -1850,18 +1958,18 @@ void LayerNormOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder&
 
     auto vecScaleLoop = read(split_loops3[2], {tempScaleArray, scale});
     auto vecBiasLoop = read(split_loops3[2], {tempBiasArray, bias});
-    DUMP(module);
+    DUMP(layerNorm, "alloc_buffer");
 
     for (auto frontLoop: frontLoops1) {Rewriter::barrier(frontLoop, Position::after);}
     for (auto frontLoop: frontLoops2) {Rewriter::barrier(frontLoop, Position::after);}
     for (auto frontLoop: vecBiasLoop) {Rewriter::barrier(frontLoop, Position::after);}
-    DUMP(module);
+    DUMP(layerNorm, "barrier");
 
     auto fristLoop1 = extractOpsFromLoop(frontLoops2[1], {tempArray, iterBuffer1});
     auto midLoop = write(frontLoops2[1], {tempArray, output});
     auto lastLoop = extractOpsFromLoop(frontLoops2[1], {tempArray});
     auto fristLoop2 = extractOpsFromLoop(frontLoops3[1], {tempArray, tempScaleArray, tempBiasArray, iterBuffer2});
-    DUMP(module);
+    DUMP(layerNorm, "extractOpsFromLoop");
 
     Rewriter::vectorize(midLoop, 4);
     Rewriter::vectorize(frontLoops3[1], 4);
@@ -1869,7 +1977,7 @@ void LayerNormOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder&
     Rewriter::barrier(midLoop, Position::after);
     Rewriter::barrier(lastLoop, Position::after);
     Rewriter::barrier(fristLoop2, Position::after);
-    DUMP(module);
+    DUMP(layerNorm, "barrier");
 
     auto ops1 = reduceUnrollOptimize(frontLoops1[1], blockLevel);
     auto ops2 = reduceUnrollOptimize(frontLoops2[1], blockLevel);
@@ -1881,40 +1989,19 @@ void LayerNormOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder&
       auto bar = Rewriter::barrier(split_loops2[0], Position::after);
       Rewriter::schedule(bar, op, Position::after);
     }
-    DUMP(module);
+    DUMP(layerNorm, "schedule");
 
     elementWiseUnrollOptimize(fristLoop1, blockLevel);
     elementWiseUnrollOptimize(lastLoop, blockLevel);
     elementWiseUnrollOptimize(fristLoop2, blockLevel);
-    DUMP(module);
+    DUMP(layerNorm, "elementWiseUnrollOptimize");
 
     Rewriter::scheduleOpGridToBlock(gridLevel, blockLevel);
 
-    Rewriter::unroll(module, [&](mlir::AffineForOp forOp)->bool {
-    if (!forOp.hasConstantBounds()) return false;
-    auto step = forOp.getStep();
-    auto ub = forOp.getConstantUpperBound();
-    auto lb = forOp.getConstantLowerBound();
-    auto times = (ub - lb) / step;
-    // if (times >= std::min<int64_t>(64, 4)) return false;
-    if (times >= 2) return false;
-    return true;
-    });
-    DUMP(module);
-
-    Rewriter::unrollAttribute(module, [&](mlir::AffineForOp forOp)->bool {
-    if (!forOp.hasConstantBounds()) return false;
-    auto step = forOp.getStep();
-    auto ub = forOp.getConstantUpperBound();
-    auto lb = forOp.getConstantLowerBound();
-    auto times = (ub - lb) / step;
-    // if (times >= 64) return false;
-    if (times >= 16) return false;
-    return true;
-    });
-    DUMP(module);
+    UnrollPlanner::plan(layerNorm, /*fullLimit*/2, /*pragmaLimit*/15, layerNormConfig["UNROLL_BUDGET"]);
+    DUMP(layerNorm, "unroll_plan");
     Rewriter::deleteExtraCstOp(blockLevel);
-    DUMP(module);
+    DUMP(layerNorm, "deleteExtraCstOp");
   }
 }
 /*--------------------------------------------------------------------*/
@@ -1946,6 +2033,20 @@ bool GatherOptimizer::applicable(mlir::ModuleOp& module) {
   return res;
 }
 
+void GatherOptimizer::remap(const GatherOptimizer& analysis, const CloneMapping& mapping) {
+  clear();
+  for (auto gather : analysis.gathers) {
+    auto cloned = mapping.map(gather);
+    gathers.insert(cloned);
+    gatherLoops[cloned] = mapping.map(analysis.gatherLoops.lookup(gather));
+    auto buf = analysis.gatherBuffers.lookup(gather);
+    buf.input = mapping.map(buf.input);
+    buf.indices = mapping.map(buf.indices);
+    buf.output = mapping.map(buf.output);
+    gatherBuffers[cloned] = buf;
+  }
+}
+
 mlir::AffineMap GatherOptimizer::getAffineMap(const std::string& mapIdentifier, mlir::OpBuilder& builder, const std::vector<int64_t> &extras) {
   auto dim0 = builder.getAffineDimExpr(0);
   auto dim1 = builder.getAffineDimExpr(1);
@@ -2006,20 +2107,20 @@ void GatherOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& bui
     auto extras = getCreateAffineMapArgs(loops);
     auto twoLoops = Rewriter::combineToTowDim(loops);
     extras.push_back(twoLoops[1].getUpperBoundMap().getSingleConstantResult());
-    DUMP(module);
+    DUMP(gather, "combineToTowDim");
 
-    auto split_out_loops = Rewriter::split(twoLoops[0], 3, {gatherConfig["THREAD_SIZE_M"], gatherConfig["BLOCK_SIZE_M"]});
-    auto split_in_loops = Rewriter::split(twoLoops[1], 3, {gatherConfig["THREAD_SIZE_M"], gatherConfig["BLOCK_SIZE_M"]});
-    DUMP(module);
+    auto split_out_loops = Rewriter::split(twoLoops[0], 3, {gatherConfig["THREAD_SIZE_M"], gatherConfig["BLOCK_SIZE_M"]}, /*guardTail*/true);
+    auto split_in_loops = Rewriter::split(twoLoops[1], 3, {gatherConfig["THREAD_SIZE_M"], gatherConfig["BLOCK_SIZE_M"]}, /*guardTail*/true);
+    DUMP(gather, "split");
 
     auto out_outer = split_out_loops[0], out_mider = split_out_loops[1], out_inner = split_out_loops[2];
     auto in_outer = split_in_loops[0], in_mider = split_in_loops[1], in_inner = split_in_loops[2];
     Rewriter::reorder({out_outer, in_outer, out_mider, in_mider, out_inner, in_inner});
-    DUMP(module);
+    DUMP(gather, "reorder");
 
     auto gridLevel = Rewriter::parallel({out_outer, in_outer});
     auto blockLevel = Rewriter::parallel({out_mider, in_mider});
-    DUMP(module);
+    DUMP(gather, "parallel");
 
     auto blockElemIdx = Rewriter::getElementIdx(gridLevel);
     auto ThreadElemIdx = Rewriter::getElementIdx(blockLevel);
@@ -2028,10 +2129,15 @@ void GatherOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& bui
     auto type_ = indicesType.dyn_cast<mlir::MemRefType>();
     auto shape = type_.getShape();
 
+    // full tiles are optimized, the partial ones keep the guarded loops.
+    out_inner = Rewriter::version_tail(out_inner);
+    in_inner = mlir::dyn_cast<mlir::AffineForOp>(out_inner.getBody()->front());
+    DUMP(gather, "version_tail");
+
     if (shape.size() == 1 && shape[0] == 1) {
       oneIndexLoad(in_inner, blockLevel);
-      DUMP(module);
-    } else {
+      DUMP(gather, "oneIndexLoad");
+    } else if (extras.back() % gatherConfig["VECTORIZE_WIDTH"] == 0 && Analyzer::isVectorizable(output, gatherConfig["VECTORIZE_WIDTH"])) {
       auto input_type = input.getType();
       auto element = input_type.dyn_cast<mlir::MemRefType>().getElementType();
       auto storeReg = Rewriter::alloc_buffer(blockLevel, MemorySpace::local, {gatherConfig["THREAD_SIZE_N"]}, element);  // 计算input -> reg
@@ -2043,6 +2149,11 @@ void GatherOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& bui
       Rewriter::cache_write(in_inner, output, storeReg, cacheWriteMap, {in_inner.getInductionVar()});
     }
 
+    Rewriter::coarsen(blockLevel, gatherConfig["BLOCK_COARSEN"]);
+    Rewriter::coarsen(gridLevel, gatherConfig["GRID_COARSEN"]);
+    Rewriter::grid_stride(gridLevel, gatherConfig["GRID_CAP"], gatherConfig["SM_COUNT"]);
+    DUMP(gather, "grid_stride");
+
     // if (!indices) {  // 按常数取
     //   in_inner.walk<mlir::WalkOrder::PreOrder>([&](mlir::arith::ConstantOp cstOp) {
     //     Rewriter::schedule(cstOp, blockLevel, Position::begin);
@@ -2101,6 +2212,8 @@ void identifyBatchMatmul(const std::string& name, BatchMatmulDescriptor& matmul)
 
 bool FMHAOptimizer::applicable(mlir::ModuleOp& module) {
   clear();
+  // built once, every callee below is a hash lookup.
+  mlir::SymbolTable symbolTable(module);
   auto funcCalls = Analyzer::collectFuncCalls(module);
   int funcNum = funcCalls.size();
   for (int i = 0; i < funcNum; i += 1) {
@@ -2108,7 +2221,7 @@ bool FMHAOptimizer::applicable(mlir::ModuleOp& module) {
     // auto func = call.getCalleeAttrName().str();
     auto funcName = call2Matmul.getCallee().str();
     if (funcName.find(std::string("BatchMatmul")) != std::string::npos) {
-      auto matmul = Analyzer::getTargetFunction(module, funcName);
+      auto matmul = Analyzer::getTargetFunction(symbolTable, funcName);
       auto attr = matmul->getAttr(std::string("func.state")).dyn_cast<mlir::StringAttr>();
       if (attr.str() != std::string("cpu")) continue;
       auto retValue = call2Matmul.getResult(0);
@@ -2123,7 +2236,7 @@ bool FMHAOptimizer::applicable(mlir::ModuleOp& module) {
       }
       auto funcName = call2Softmax.getCallee().str();
       if (funcName.find(std::string("Softmax")) != std::string::npos) {
-        auto softmax = Analyzer::getTargetFunction(module, funcName);
+        auto softmax = Analyzer::getTargetFunction(symbolTable, funcName);
         auto attr = softmax->getAttr(std::string("func.state")).dyn_cast<mlir::StringAttr>();
         if (attr.str() != std::string("cpu")) continue;
         auto retValue = call2Softmax->getResult(0);
@@ -2142,7 +2255,7 @@ bool FMHAOptimizer::applicable(mlir::ModuleOp& module) {
           && uniqueFuncCalls.count(call2Matmul2) == 0 && call2callsMap.count(call2Matmul) == 0
           && call2bufferMap.count(call2Matmul) == 0) {
 
-          auto matmul2 = Analyzer::getTargetFunction(module, funcName);
+          auto matmul2 = Analyzer::getTargetFunction(symbolTable, funcName);
           auto attr = matmul2->getAttr(std::string("func.state")).dyn_cast<mlir::StringAttr>();
           if (attr.str() != std::string("cpu")) continue;
 
@@ -2185,6 +2298,25 @@ bool FMHAOptimizer::applicable(mlir::ModuleOp& module) {
       }
     }
   }
+  return call2callsMap.size() != 0;
+}
+
+void FMHAOptimizer::remap(const FMHAOptimizer& analysis, const CloneMapping& mapping) {
+  clear();
+  for (auto call : analysis.uniqueFuncCalls) {
+    uniqueFuncCalls.insert(mapping.map(call));
+  }
+  for (auto& item : analysis.call2callsMap) {
+    auto cloned = mapping.map(item.first);
+    call2callsMap[cloned] = mapping.map(item.second);
+    auto buf = analysis.call2bufferMap.lookup(item.first);
+    buf.Q = mapping.map(buf.Q);
+    buf.K = mapping.map(buf.K);
+    buf.S = mapping.map(buf.S);
+    buf.V = mapping.map(buf.V);
+    buf.O = mapping.map(buf.O);
+    call2bufferMap[cloned] = buf;
+  }
 }
 
 mlir::AffineMap FMHAOptimizer::getAffineMap(const std::string& mapIdentifier, mlir::OpBuilder& builder) {
@@ -2414,6 +2546,76 @@ mlir::AffineMap FMHAOptimizer::getAffineMap(const std::string& mapIdentifier, ml
     auto Br_Offset = ywarp_o * LaneY_O * fmhaConfig["BrTileO"] + dim4.floorDiv(width) * width * LaneY_O + ylane_o * width + dim4 % width;
     auto Hd_Offset = xwarp_o * LaneX_O * fmhaConfig["HdTileO"] + dim5 * LaneX_O + xlane_o * width;
 
+    llvm::SmallVector<mlir::AffineExpr> exprs;
+    exprs.push_back(dim0);
+    exprs.push_back(dim1);
+    exprs.push_back(dim2 * fmhaConfig["Br"] + Br_Offset);
+    exprs.push_back(Hd_Offset);
+    return mlir::AffineMap::get(/*dimCount*/6, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), builder.getContext());
+  } else if (mapIdentifier == "laneId") {
+    // dims are:[dim0]
+    // operands are: [threadIdx.x]
+    return mlir::AffineMap::get(/*dimCount*/1, 0, dim0 % static_cast<uint64_t>(fmhaConfig["WARP_SIZE"]));
+  }
+  // mma.sync for O = PV: a warp computes (BrTileO / 2) x (HdTileO / 2) tiles of 16x8,
+  // tileO[2 * mi + r / 2][2 * ni + r % 2] is the register r of the tile (mi, ni).
+  const int MTiles_O = fmhaConfig["BrTileO"] / 2;
+  const int NTiles_O = fmhaConfig["HdTileO"] / 2;
+  if (mapIdentifier == "loadFragPMMA") {
+    // dims are:[dim0, dim1, dim2, dim3]
+    // operands are: [threadIdx.x, bc_outer, bc_inner, iv]
+    auto threadIdExpr = dim0;
+    auto warpId = threadIdExpr.floorDiv(static_cast<uint64_t>(fmhaConfig["WARP_SIZE"]));
+    auto laneId = threadIdExpr % static_cast<uint64_t>(fmhaConfig["WARP_SIZE"]);
+
+    auto ywarp_o = warpId.floorDiv(fmhaConfig["WarpX_O"]);
+    auto mi = dim3.floorDiv(MMALayout::A_REGS), r = dim3 % MMALayout::A_REGS;
+
+    llvm::SmallVector<mlir::AffineExpr> exprs;
+    exprs.push_back(dim1 + dim2 + MMALayout::colA(laneId, r));
+    exprs.push_back(ywarp_o * MTiles_O * MMALayout::M + mi * MMALayout::M + MMALayout::rowA(laneId, r));
+    return mlir::AffineMap::get(/*dimCount*/4, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), builder.getContext());
+  } else if (mapIdentifier == "loadFragVMMA") {
+    // dims are:[dim0, dim1, dim2]
+    // operands are: [threadIdx.x, bc_inner, iv]
+    auto threadIdExpr = dim0;
+    auto warpId = threadIdExpr.floorDiv(static_cast<uint64_t>(fmhaConfig["WARP_SIZE"]));
+    auto laneId = threadIdExpr % static_cast<uint64_t>(fmhaConfig["WARP_SIZE"]);
+
+    auto xwarp_o = warpId % fmhaConfig["WarpX_O"];
+    auto ni = dim2.floorDiv(MMALayout::B_REGS), r = dim2 % MMALayout::B_REGS;
+
+    llvm::SmallVector<mlir::AffineExpr> exprs;
+    exprs.push_back(dim1 + MMALayout::rowB(laneId, r));
+    exprs.push_back(xwarp_o * NTiles_O * MMALayout::N + ni * MMALayout::N + MMALayout::colB(laneId, r));
+    return mlir::AffineMap::get(/*dimCount*/3, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), builder.getContext());
+  } else if (mapIdentifier == "brIdxOMMA") {
+    // dims are:[dim0, dim1]
+    // operands are: [threadIdx.x, iv]
+    // iv is the row of tileO, (iv / 2, iv % 2) is (mi, r / 2).
+    auto threadIdExpr = dim0;
+    auto warpId = threadIdExpr.floorDiv(static_cast<uint64_t>(fmhaConfig["WARP_SIZE"]));
+    auto laneId = threadIdExpr % static_cast<uint64_t>(fmhaConfig["WARP_SIZE"]);
+
+    auto ywarp_o = warpId.floorDiv(fmhaConfig["WarpX_O"]);
+
+    llvm::SmallVector<mlir::AffineExpr> exprs;
+    exprs.push_back(ywarp_o * MTiles_O * MMALayout::M + dim1.floorDiv(2) * MMALayout::M + MMALayout::rowC(laneId, dim1 % 2 * 2));
+    return mlir::AffineMap::get(/*dimCount*/2, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), builder.getContext());
+  } else if (mapIdentifier == "storeTileOMMA") {
+    // dims are:[dim0, dim1, dim2, dim3, dim4, dim5]
+    // operands are: [blockIdx.z, blockIdx.y, blockIdx.x, threadIdx.x, br, hd]
+    // hd steps by 2, so (hd / 2) is ni and the lane stores the registers r and r + 1.
+    auto threadIdExpr = dim3;
+    auto warpId = threadIdExpr.floorDiv(static_cast<uint64_t>(fmhaConfig["WARP_SIZE"]));
+    auto laneId = threadIdExpr % static_cast<uint64_t>(fmhaConfig["WARP_SIZE"]);
+
+    auto xwarp_o = warpId % fmhaConfig["WarpX_O"];
+    auto ywarp_o = warpId.floorDiv(fmhaConfig["WarpX_O"]);
+
+    auto Br_Offset = ywarp_o * MTiles_O * MMALayout::M + dim4.floorDiv(2) * MMALayout::M + MMALayout::rowC(laneId, dim4 % 2 * 2);
+    auto Hd_Offset = xwarp_o * NTiles_O * MMALayout::N + dim5.floorDiv(2) * MMALayout::N + MMALayout::colC(laneId, dim5 % 2);
+
     llvm::SmallVector<mlir::AffineExpr> exprs;
     exprs.push_back(dim0);
     exprs.push_back(dim1);
@@ -2590,22 +2792,31 @@ void FMHAOptimizer::softmaxIR(mlir::OpBuilder& builder, mlir::Value tileS, mlir:
      
   }
   builder.restoreInsertionPoint(ip);
+  // the shared memory max/sum would be taken for staging by the phase timers.
+  for (mlir::Operation* op : {br_loop.getOperation(), br_shfl_loop.getOperation(), ifOp.getOperation(),
+                              br_broadcast_loop.getOperation(), outerLoop.getOperation()}) {
+    Rewriter::set_phase(op, Phase::softmax);
+  }
 }
 
 void FMHAOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& builder) {
+  mlir::SymbolTable symbolTable(module);
   for (auto& item : call2callsMap) {
     auto call2Matmul = item.first;
     auto call2Softmax = item.second[0];
     auto call2Matmul2 = item.second[1];
-    auto matmul = Analyzer::collectFunctions(module, call2Matmul.getCallee().str())[0];
-    auto softmax = Analyzer::collectFunctions(module, call2Softmax.getCallee().str())[0];
-    auto matmul2 = Analyzer::collectFunctions(module, call2Matmul2.getCallee().str())[0];
+    auto matmul = Analyzer::getTargetFunction(symbolTable, call2Matmul.getCallee().str());
+    auto softmax = Analyzer::getTargetFunction(symbolTable, call2Softmax.getCallee().str());
+    auto matmul2 = Analyzer::getTargetFunction(symbolTable, call2Matmul2.getCallee().str());
     auto buf = call2bufferMap[call2Matmul];
     auto matmul1Desc = buf.matmul1;
     auto Q = buf.Q;
     auto K = buf.K;
     auto V = buf.V;
     auto O = buf.O;
+    // head split views with a non-unit innermost stride or a misaligned offset get narrower vectors.
+    auto vectorWidth = fmhaConfig["Width"];
+    fmhaConfig["Width"] = Analyzer::getVectorWidth({Q, K, V, O}, vectorWidth);
 
     auto QType = Q.getType().dyn_cast<mlir::MemRefType>();
     auto elementType = QType.getElementType();
@@ -2691,6 +2902,16 @@ void FMHAOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& build
     auto BrTileO = fmhaConfig["BrTileO"];
     auto HdTileO = fmhaConfig["HdTileO"];
 
+    ///< S = QK^T stays on fma, the softmax reductions work on the thread layout of tileS.
+    bool mma = fmhaConfig["MMA"];
+    std::string mmaReason;
+    if (mma && !MMALayout::fits(Br, Hd, Slice, BrTileO * MMALayout::M / 2, HdTileO * MMALayout::N / 2, fmhaConfig["BLOCK_SIZE"], 
+                                elementType, elementType, mmaReason)) {
+      if (KCGLog::level == Log::Debug) llvm::errs() << "mma.sync is not generated, " << mmaReason << ", fall back to fma\n";
+      mma = false;
+    }
+    auto oWidth = mma ? 1 : fmhaConfig["Width"];
+
     auto tileO = Rewriter::alloc_buffer(/*parallelLevel*/blockLevel, MemorySpace::local, {BrTileO, HdTileO}, elementType);
 
     builder.setInsertionPointAfter(Analyzer::getLastOp<mlir::memref::AllocOp>(blockLevel));
@@ -2719,11 +2940,11 @@ void FMHAOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& build
 
     builder.setInsertionPointAfter(bar1);
 
-    Rewriter::read(builder, Q, ldgQ, getAffineMap("loadTileQ", builder), {gridLevel.getIVs()[0], gridLevel.getIVs()[1], 
+    auto readQ = Rewriter::read(builder, Q, ldgQ, getAffineMap("loadTileQ", builder), {gridLevel.getIVs()[0], gridLevel.getIVs()[1], 
       gridLevel.getIVs()[2], blockLevel.getIVs()[0], hd_outer.getInductionVar()}, fmhaConfig["Width"]);
-    Rewriter::read(builder, K, ldgK, getAffineMap("loadTileK", builder), {gridLevel.getIVs()[0], gridLevel.getIVs()[1], 
+    auto readK = Rewriter::read(builder, K, ldgK, getAffineMap("loadTileK", builder), {gridLevel.getIVs()[0], gridLevel.getIVs()[1], 
       blockLevel.getIVs()[0], outer_reduce.getInductionVar(), hd_outer.getInductionVar()}, fmhaConfig["Width"]);
-    Rewriter::write(builder, ldgQ, smQ, getAffineMap("storeTileQ", builder), {blockLevel.getIVs()[0]}, fmhaConfig["Width"]);
+    auto writeSmQ = Rewriter::write(builder, ldgQ, smQ, getAffineMap("storeTileQ", builder), {blockLevel.getIVs()[0]}, fmhaConfig["Width"]);
     auto writeSmK = Rewriter::write(builder, ldgK, smK, getAffineMap("storeTileK", builder), {blockLevel.getIVs()[0]}, fmhaConfig["Width"]);
 
     auto bar2 = Rewriter::barrier(writeSmK, Position::after);
@@ -2762,7 +2983,7 @@ void FMHAOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& build
     auto bar3 = Rewriter::barrier(outerLoop, Position::after);
     auto factor = Rewriter::alloc_buffer(bar3, Position::after, MemorySpace::local, {BrTileO}, elementType);
     builder.setInsertionPointAfter(factor.getDefiningOp());
-    Rewriter::read(builder, smFac, factor, getAffineMap("loadFactor", builder), {blockLevel.getIVs()[0]}, fmhaConfig["Width"]);
+    Rewriter::read(builder, smFac, factor, getAffineMap(mma ? "brIdxOMMA" : "loadFactor", builder), {blockLevel.getIVs()[0]}, oWidth);
 
     ///< Refactor tileO.
     {
@@ -2790,29 +3011,53 @@ void FMHAOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& build
 
     builder.setInsertionPointAfter(bar4);
 
-    Rewriter::read(builder, V, ldgV, getAffineMap("loadTileV", builder), {gridLevel.getIVs()[0], gridLevel.getIVs()[1], 
+    auto readV = Rewriter::read(builder, V, ldgV, getAffineMap("loadTileV", builder), {gridLevel.getIVs()[0], gridLevel.getIVs()[1], 
       blockLevel.getIVs()[0], outer_reduce.getInductionVar(), bc_outer.getInductionVar()}, fmhaConfig["Width"]);
 
     auto writeSmV = Rewriter::write(builder, ldgV, smV, getAffineMap("storeTileV", builder), {blockLevel.getIVs()[0]}, fmhaConfig["Width"]);
 
     auto bar5 = Rewriter::barrier(writeSmV, Position::after);
 
-    auto fragP = Rewriter::alloc_buffer(bar5, Position::after, MemorySpace::local, {BrTileO}, elementType);
-    auto fragV = Rewriter::alloc_buffer(fragP.getDefiningOp(), Position::after, MemorySpace::local, {HdTileO}, elementType);
+    auto fragPSize = mma ? BrTileO / 2 * MMALayout::A_REGS : BrTileO;
+    auto fragVSize = mma ? HdTileO / 2 * MMALayout::B_REGS : HdTileO;
+    auto fragP = Rewriter::alloc_buffer(bar5, Position::after, MemorySpace::local, {fragPSize}, elementType);
+    auto fragV = Rewriter::alloc_buffer(fragP.getDefiningOp(), Position::after, MemorySpace::local, {fragVSize}, elementType);
 
-    auto bc_inner = Rewriter::create_constant_loop(builder, 0, Slice, 1);
+    auto bc_inner = Rewriter::create_constant_loop(builder, 0, Slice, mma ? MMALayout::K : 1);
     builder.setInsertionPointToStart(bc_inner.getBody());
-    Rewriter::read(builder, smP, fragP, getAffineMap("loadFragP", builder), {blockLevel.getIVs()[0], bc_outer.getInductionVar(), bc_inner.getInductionVar()}, 
-      fmhaConfig["Width"]);
-    Rewriter::read(builder, smV, fragV, getAffineMap("loadFragV", builder), {blockLevel.getIVs()[0], bc_inner.getInductionVar()}, 
-      fmhaConfig["Width"]);
+    Rewriter::read(builder, smP, fragP, getAffineMap(mma ? "loadFragPMMA" : "loadFragP", builder), 
+      {blockLevel.getIVs()[0], bc_outer.getInductionVar(), bc_inner.getInductionVar()}, oWidth);
+    Rewriter::read(builder, smV, fragV, getAffineMap(mma ? "loadFragVMMA" : "loadFragV", builder), 
+      {blockLevel.getIVs()[0], bc_inner.getInductionVar()}, oWidth);
+
+    if (mma) {
+      Rewriter::mma(builder, tileO, fragP, fragV, getAffineMap("laneId", builder), {blockLevel.getIVs()[0]}, BrTileO / 2, HdTileO / 2);
+    } else {
+      Rewriter::outer_product(builder, tileO, fragP, fragV, BrTileO, HdTileO);
+    }
 
-    Rewriter::outer_product(builder, tileO, fragP, fragV, BrTileO, HdTileO);
+    ///< Multi-stage pipeline for Q/K and V tiles, STAGES = 1 keeps the single buffered loops.
+    if (fmhaConfig["STAGES"] > 1) {
+      std::vector<mlir::Value> smQK{smQ, smK};
+      std::vector<mlir::Value> smVs{smV};
+      if (fmhaConfig["ASYNC_COPY"]) {
+        auto copyQ = Rewriter::async_copy(readQ, writeSmQ);
+        auto copyK = Rewriter::async_copy(readK, writeSmK);
+        auto copyV = Rewriter::async_copy(readV, writeSmV);
+        Rewriter::async_pipeline({copyQ, copyK}, smQK, hd_outer, hd_inner, bar1, bar2, fmhaConfig["STAGES"]);
+        Rewriter::async_pipeline({copyV}, smVs, bc_outer, bc_inner, bar4, bar5, fmhaConfig["STAGES"]);
+      } else {
+        Rewriter::pipeline({readQ, readK}, {writeSmQ, writeSmK}, smQK, hd_outer, hd_inner, bar1, bar2, fmhaConfig["STAGES"]);
+        Rewriter::pipeline({readV}, {writeSmV}, smVs, bc_outer, bc_inner, bar4, bar5, fmhaConfig["STAGES"]);
+      }
+      smQ = smQK[0], smK = smQK[1];
+      smV = smVs[0];
+    }
 
     ///< Load sum
     auto rowSumO = Rewriter::alloc_buffer(outer_reduce, Position::after, MemorySpace::local, {BrTileO}, elementType);
     builder.setInsertionPointAfter(rowSumO.getDefiningOp());
-    Rewriter::read(builder, smSum, rowSumO, getAffineMap("brIdxO", builder), {blockLevel.getIVs()[0]}, fmhaConfig["Width"]);
+    Rewriter::read(builder, smSum, rowSumO, getAffineMap(mma ? "brIdxOMMA" : "brIdxO", builder), {blockLevel.getIVs()[0]}, oWidth);
     ///< Refactor tileO
     {
     auto outerLoop = Rewriter::create_constant_loop(builder, 0, fmhaConfig["BrTileO"], 1);
@@ -2834,17 +3079,24 @@ void FMHAOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder& build
     {
     auto outerLoop = Rewriter::create_constant_loop(builder, 0, fmhaConfig["BrTileO"], 1);
     builder.setInsertionPointToStart(outerLoop.getBody());
-    auto innerLoop = Rewriter::create_constant_loop(builder, 0, fmhaConfig["HdTileO"], fmhaConfig["Width"]);
+    ///< a lane of mma.sync holds 2 adjacent elements of O per row.
+    auto storeWidth = mma ? 2 : fmhaConfig["Width"];
+    auto innerLoop = Rewriter::create_constant_loop(builder, 0, fmhaConfig["HdTileO"], storeWidth);
     builder.setInsertionPointToStart(innerLoop.getBody());
   
     auto br = outerLoop.getInductionVar();
     auto hd = innerLoop.getInductionVar();
     
-    auto vectorType = mlir::VectorType::get(fmhaConfig["Width"], tileO.getType().dyn_cast<mlir::MemRefType>().getElementType());
+    auto vectorType = mlir::VectorType::get(storeWidth, tileO.getType().dyn_cast<mlir::MemRefType>().getElementType());
     auto ld = builder.create<mlir::AffineVectorLoadOp>(builder.getUnknownLoc(), vectorType, tileO, mlir::ValueRange({br, hd}));
-    auto st = builder.create<mlir::AffineVectorStoreOp>(builder.getUnknownLoc(), ld.getResult(), O, getAffineMap("storeTileO", builder), 
+    auto st = builder.create<mlir::AffineVectorStoreOp>(builder.getUnknownLoc(), ld.getResult(), O, getAffineMap(mma ? "storeTileOMMA" : "storeTileO", builder), 
         mlir::ValueRange({gridLevel.getIVs()[0], gridLevel.getIVs()[1], gridLevel.getIVs()[2], blockLevel.getIVs()[0], br, hd})); 
     }
+    // the tile loops are only unrolled by the backend, within the code size budget.
+    int64_t pragmaLimit = std::max({fmhaConfig["Slice"], fmhaConfig["BrTileS"], fmhaConfig["BcTileS"], fmhaConfig["BrTileO"], fmhaConfig["HdTileO"]});
+    UnrollPlanner::plan(funcOp, /*fullLimit*/0, pragmaLimit, fmhaConfig["UNROLL_BUDGET"]);
+    DUMP(funcOp, "unroll_plan");
+    fmhaConfig["Width"] = vectorWidth;
   }
 }
 
@@ -2881,6 +3133,21 @@ bool BatchMatmulOptimizer::applicable(mlir::ModuleOp& module) {
   return res;
 }
 
+void BatchMatmulOptimizer::remap(const BatchMatmulOptimizer& analysis, const CloneMapping& mapping) {
+  clear();
+  for (auto batchMatmul : analysis.batchMatmuls) {
+    auto cloned = mapping.map(batchMatmul);
+    batchMatmuls.insert(cloned);
+    batchMatmulLoops[cloned] = mapping.map(analysis.batchMatmulLoops.lookup(batchMatmul));
+    auto buf = analysis.batchMatmulBuffers.lookup(batchMatmul);
+    buf.A = mapping.map(buf.A);
+    buf.B = mapping.map(buf.B);
+    buf.C = mapping.map(buf.C);
+    // the descriptor is parsed from the name, which the clone keeps.
+    batchMatmulBuffers[cloned] = buf;
+  }
+}
+
 mlir::AffineExpr shiftExprDim(mlir::OpBuilder& builder, mlir::AffineExpr expr, int shift) {
   auto context = builder.getContext();
   if (auto dimExpr_ = expr.dyn_cast<mlir::AffineDimExpr>()) {
@@ -2983,6 +3250,43 @@ mlir::AffineMap BatchMatmulOptimizer::getAffineMap(const std::string& mapIdentif
     for (auto e : exprs) {llvm::outs() << e << "\n";} llvm::outs() << "\n";
     return mlir::AffineMap::get(8+batchNum, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), builder.getContext());
   }
+  // mma.sync: a warp computes (THREAD_SIZE / 2) x (THREAD_SIZE / 2) tiles of 16x8.
+  int64_t tiles = thread_size / 2;
+  int64_t warpsN = for_size / (MMALayout::N * tiles);
+  if (mapIdentifier == "laneId") {
+    return mlir::AffineMap::get(1, 0, dim0 % MMALayout::WARP_SIZE);
+  }
+  else if (mapIdentifier == "fiveMMA") {
+    // operands are: [k_inner, threadIdx.x, iv]
+    std::vector<mlir::AffineExpr> exprs;
+    auto warpId = dim1.floorDiv(MMALayout::WARP_SIZE), laneId = dim1 % MMALayout::WARP_SIZE;
+    auto mi = dim2.floorDiv(MMALayout::A_REGS), r = dim2 % MMALayout::A_REGS;
+    exprs.push_back(dim0 + MMALayout::colA(laneId, r));
+    exprs.push_back(warpId.floorDiv(warpsN) * (MMALayout::M * tiles) + mi * MMALayout::M + MMALayout::rowA(laneId, r));
+    return mlir::AffineMap::get(3, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), builder.getContext());
+  }
+  else if (mapIdentifier == "sixMMA") {
+    // operands are: [k_inner, threadIdx.x, iv]
+    std::vector<mlir::AffineExpr> exprs;
+    auto warpId = dim1.floorDiv(MMALayout::WARP_SIZE), laneId = dim1 % MMALayout::WARP_SIZE;
+    auto ni = dim2.floorDiv(MMALayout::B_REGS), r = dim2 % MMALayout::B_REGS;
+    exprs.push_back(dim0 + MMALayout::rowB(laneId, r));
+    exprs.push_back(warpId % warpsN * (MMALayout::N * tiles) + ni * MMALayout::N + MMALayout::colB(laneId, r));
+    return mlir::AffineMap::get(3, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), builder.getContext());
+  }
+  else if (mapIdentifier == "nineMMA") {
+    // operands are: [batch..., m_outer, n_outer, threadIdx.x, mi, ni, r / 2, r % 2]
+    std::vector<mlir::AffineExpr> exprs;
+    auto warpId = dim2.floorDiv(MMALayout::WARP_SIZE), laneId = dim2 % MMALayout::WARP_SIZE;
+    for (int i=0; i<batchNum; i++) {
+      exprs.push_back(builder.getAffineDimExpr(i));
+    }
+    auto yDimExpr = dim0 + warpId.floorDiv(warpsN) * (MMALayout::M * tiles) + dim3 * MMALayout::M + MMALayout::rowC(laneId, dim5 * 2);
+    auto xDimExpr = dim1 + warpId % warpsN * (MMALayout::N * tiles) + dim4 * MMALayout::N + MMALayout::colC(laneId, dim6);
+    exprs.push_back(shiftExprDim(builder, yDimExpr, batchNum));
+    exprs.push_back(shiftExprDim(builder, xDimExpr, batchNum));
+    return mlir::AffineMap::get(7+batchNum, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), builder.getContext());
+  }
   else {
     assert(false);
   }
@@ -2995,6 +3299,9 @@ void BatchMatmulOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder
     auto A = buffer.A; auto B = buffer.B; auto C = buffer.C;
     // auto descirpe = buffer.matmul;
     auto batchNum = buffer.matmul.batch.size();
+    // views with a non-unit innermost stride or a misaligned offset get narrower vectors.
+    auto vectorWidth = batchMatmulConfig["VECTORIZE_WIDTH"];
+    batchMatmulConfig["VECTORIZE_WIDTH"] = Analyzer::getVectorWidth({A, B, C}, vectorWidth);
 
     auto m_split_loops = Rewriter::split(loops[loops.size()-3], 3, {batchMatmulConfig["THREAD_SIZE"], batchMatmulConfig["BLOCK_SIZE_M"]});
     auto n_split_loops = Rewriter::split(loops[loops.size()-2], 3, {batchMatmulConfig["THREAD_SIZE"], batchMatmulConfig["FOR_SIZE_N"]});
@@ -3006,27 +3313,27 @@ void BatchMatmulOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder
     Rewriter::reorder({m_outer, n_outer, m_mider, n_mider, m_inner, n_inner});
     m_mider = Rewriter::modifyLoopStepToOne(m_mider);
     n_mider = Rewriter::modifyLoopStepToOne(n_mider);
-    DUMP(module);
+    DUMP(batchMatmul, "modifyLoopStepToOne");
 
     auto combineLoop = Rewriter::combineToOneDim({m_mider, n_mider});
-    DUMP(module);
+    DUMP(batchMatmul, "combineToOneDim");
 
     std::vector<mlir::AffineForOp> palLoops;
     for (int i=0; i< batchNum; i++) {palLoops.push_back(loops[i]);}
     palLoops.push_back(m_outer);
     auto gridLevel = Rewriter::parallel(palLoops);
     auto blockLevel = Rewriter::parallel({combineLoop});
-    DUMP(module);
+    DUMP(batchMatmul, "parallel");
 
     std::vector<mlir::AffineForOp> kmn_axes{loopK, m_inner, n_inner};
     auto tileC = Rewriter::bufferizeLoopCarryVar(kmn_axes);
     loopK = kmn_axes[0], m_inner = kmn_axes[1], n_inner = kmn_axes[2];
     Rewriter::reorder({loopK, m_inner, n_inner});
-    DUMP(module);
+    DUMP(batchMatmul, "reorder");
 
     auto k_axes = Rewriter::split(loopK, 2, {batchMatmulConfig["BLOCK_SIZE_K"]});
     auto k_outer = k_axes[0], k_inner = k_axes[1];
-    DUMP(module);
+    DUMP(batchMatmul, "split");
 
     int64_t blockThreads;
     auto blockDim = Analyzer::getParallelNumber(blockLevel, blockThreads);
@@ -3034,6 +3341,7 @@ void BatchMatmulOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder
     auto ldgASize = batchMatmulConfig["BLOCK_SIZE_K"] * batchMatmulConfig["BLOCK_SIZE_M"] / blockThreads;
     auto ldgBSize = batchMatmulConfig["BLOCK_SIZE_K"] * batchMatmulConfig["FOR_SIZE_N"] / blockThreads;
     auto fragSize = batchMatmulConfig["Slice"];
+    auto fragASize = fragSize, fragBSize = fragSize;
 
     auto blockElemIdx = Rewriter::getElementIdx(gridLevel);
     auto blockIdx = Rewriter::getParallelIdx(gridLevel);
@@ -3042,14 +3350,30 @@ void BatchMatmulOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder
 
     auto elementA = A.getType().dyn_cast<mlir::MemRefType>().getElementType();
     auto elementB = B.getType().dyn_cast<mlir::MemRefType>().getElementType();
+
+    bool mma = batchMatmulConfig["MMA"];
+    std::string mmaReason;
+    if (mma && !MMALayout::fits(batchMatmulConfig["BLOCK_SIZE_M"], batchMatmulConfig["FOR_SIZE_N"], batchMatmulConfig["BLOCK_SIZE_K"], 
+                                batchMatmulConfig["THREAD_SIZE"] * MMALayout::M / 2, batchMatmulConfig["THREAD_SIZE"] * MMALayout::N / 2, 
+                                blockThreads, elementA, elementB, mmaReason)) {
+      if (KCGLog::level == Log::Debug) llvm::errs() << "mma.sync is not generated, " << mmaReason << ", fall back to fma\n";
+      mma = false;
+    }
+    int64_t tiles = batchMatmulConfig["THREAD_SIZE"] / 2;
+    int64_t skew = mma ? MMALayout::SMEM_SKEW : 0;
+    if (mma) {
+      fragASize = tiles * MMALayout::A_REGS;
+      fragBSize = tiles * MMALayout::B_REGS;
+    }
+
     auto tileA = Rewriter::alloc_buffer(gridLevel, MemorySpace::local, {ldgASize}, elementA);  // reg8 zhong zhuang
     auto tileB = Rewriter::alloc_buffer(gridLevel, MemorySpace::local, {ldgBSize}, elementB);  // reg4
 
-    auto fragA = Rewriter::alloc_buffer(gridLevel, MemorySpace::local, {fragSize}, elementA);  // reg8
-    auto fragB = Rewriter::alloc_buffer(gridLevel, MemorySpace::local, {fragSize}, elementB);
+    auto fragA = Rewriter::alloc_buffer(gridLevel, MemorySpace::local, {fragASize}, elementA);  // reg8
+    auto fragB = Rewriter::alloc_buffer(gridLevel, MemorySpace::local, {fragBSize}, elementB);
 
-    auto smA = Rewriter::alloc_buffer(gridLevel, MemorySpace::shared, {batchMatmulConfig["BLOCK_SIZE_K"], batchMatmulConfig["BLOCK_SIZE_M"]}, elementA);
-    auto smB = Rewriter::alloc_buffer(gridLevel, MemorySpace::shared, {batchMatmulConfig["BLOCK_SIZE_K"], batchMatmulConfig["FOR_SIZE_N"]}, elementB);
+    auto smA = Rewriter::alloc_buffer(gridLevel, MemorySpace::shared, {batchMatmulConfig["BLOCK_SIZE_K"], batchMatmulConfig["BLOCK_SIZE_M"] + skew}, elementA);
+    auto smB = Rewriter::alloc_buffer(gridLevel, MemorySpace::shared, {batchMatmulConfig["BLOCK_SIZE_K"], batchMatmulConfig["FOR_SIZE_N"] + skew}, elementB);
 
     llvm::SmallVector<mlir::Value> operandsA({blockElemIdx[batchNum], threadIdx[0], k_outer.getInductionVar()});
     for (int i=0; i<batchNum; i++) { operandsA.insert(operandsA.begin(), blockIdx[i]); }
@@ -3057,7 +3381,7 @@ void BatchMatmulOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder
     llvm::SmallVector<mlir::Value> operandsB({k_outer.getInductionVar(), threadIdx[0], n_outer.getInductionVar()});
     for (int i=0; i<batchNum; i++) { operandsB.insert(operandsB.begin(), blockIdx[i]); }
     auto loadTileB = Rewriter::read(B, tileB, getAffineMap("two", builder, batchNum), operandsB, batchMatmulConfig["VECTORIZE_WIDTH"], loadTileA, Position::after);
-    DUMP(module);
+    DUMP(batchMatmul, "read");
 
     auto storeTileA = Rewriter::write(tileA, smA, getAffineMap("three", builder), 
                                       {threadIdx[0]}, batchMatmulConfig["VECTORIZE_WIDTH"], loadTileB, Position::after);
@@ -3065,93 +3389,109 @@ void BatchMatmulOptimizer::applyOptimzer(mlir::ModuleOp& module, mlir::OpBuilder
                                       {threadIdx[0]}, batchMatmulConfig["VECTORIZE_WIDTH"], storeTileA, Position::after);
     auto gpuBarrierPrefix = Rewriter::barrier(loadTileA, Position::before);
     auto gpuBarrierSuffix = Rewriter::barrier(storeTileB, Position::after);
-    DUMP(module);
-
-    int64_t oneDimLen = sqrt(batchMatmulConfig["FOR_SIZE_N"]);
-    auto threadIdx_ =  Rewriter::blockLevelOneToTwo(blockLevel, oneDimLen);
-
-    auto loadFragA = Rewriter::read(smA, fragA, getAffineMap("five", builder),
-                                    {k_inner.getInductionVar(), threadIdx_[0]}, batchMatmulConfig["VECTORIZE_WIDTH"], k_inner, Position::begin);
-    auto loadFragB = Rewriter::read(smB, fragB, getAffineMap("six", builder), 
-                                    {k_inner.getInductionVar(), threadIdx_[1]}, batchMatmulConfig["VECTORIZE_WIDTH"], loadFragA, Position::after);
-    DUMP(module);
-
-    Rewriter::cache_read(k_inner, A, fragA, getAffineMap("eight", builder), {m_inner.getInductionVar()});
-    Rewriter::cache_read(k_inner, B, fragB, getAffineMap("eight", builder), {n_inner.getInductionVar()});
-    DUMP(module);
+    DUMP(batchMatmul, "barrier");
+
+    mlir::AffineForOp loadFragA, loadFragB;
+    std::vector<mlir::Value> threadIdx_;
+    if (mma) {
+      // the mma fragments are gathered element-wise by the warps of the 1-D block.
+      loadFragA = Rewriter::read(smA, fragA, getAffineMap("fiveMMA", builder),
+                                 {k_inner.getInductionVar(), threadIdx[0]}, 1, k_inner, Position::begin);
+      loadFragB = Rewriter::read(smB, fragB, getAffineMap("sixMMA", builder), 
+                                 {k_inner.getInductionVar(), threadIdx[0]}, 1, loadFragA, Position::after);
+      DUMP(batchMatmul, "read");
+
+      m_inner.erase();
+      k_inner.setStep(MMALayout::K);
+      mlir::OpBuilder mmaBuilder(k_inner.getBody()->getTerminator());
+      Rewriter::mma(mmaBuilder, tileC, fragA, fragB, getAffineMap("laneId", builder), {threadIdx[0]}, tiles, tiles);
+      DUMP(batchMatmul, "mma");
+    } else {
+      int64_t oneDimLen = sqrt(batchMatmulConfig["FOR_SIZE_N"]);
+      threadIdx_ =  Rewriter::blockLevelOneToTwo(blockLevel, oneDimLen);
+
+      loadFragA = Rewriter::read(smA, fragA, getAffineMap("five", builder),
+                                 {k_inner.getInductionVar(), threadIdx_[0]}, batchMatmulConfig["VECTORIZE_WIDTH"], k_inner, Position::begin);
+      loadFragB = Rewriter::read(smB, fragB, getAffineMap("six", builder), 
+                                 {k_inner.getInductionVar(), threadIdx_[1]}, batchMatmulConfig["VECTORIZE_WIDTH"], loadFragA, Position::after);
+      DUMP(batchMatmul, "read");
+
+      Rewriter::cache_read(k_inner, A, fragA, getAffineMap("eight", builder), {m_inner.getInductionVar()});
+      Rewriter::cache_read(k_inner, B, fragB, getAffineMap("eight", builder), {n_inner.getInductionVar()});
+      DUMP(batchMatmul, "cache_read");
+    }
 
+    // a lane of mma.sync holds 2 adjacent elements of C per row.
+    int64_t writeWidth = mma ? 2 : batchMatmulConfig["VECTORIZE_WIDTH"];
     auto writeCbody = Rewriter::get_write(blockLevel, C);
     assert(writeCbody.size() == 1);
-    auto m_inner_axes = Rewriter::split(writeCbody[0][0], 2, {batchMatmulConfig["VECTORIZE_WIDTH"]});
-    auto n_inner_axes = Rewriter::split(writeCbody[0][1], 2, {batchMatmulConfig["VECTORIZE_WIDTH"]});
+    auto m_inner_axes = Rewriter::split(writeCbody[0][0], 2, {writeWidth});
+    auto n_inner_axes = Rewriter::split(writeCbody[0][1], 2, {writeWidth});
     auto m_inner_0 = m_inner_axes[0], m_inner_1 = m_inner_axes[1];
     auto n_inner_0 = n_inner_axes[0], n_inner_1 = n_inner_axes[1];
     Rewriter::reorder({m_inner_0, n_inner_0, m_inner_1, n_inner_1});
     m_inner_0 = Rewriter::modifyLoopStepToOne(m_inner_0);
     n_inner_0 = Rewriter::modifyLoopStepToOne(n_inner_0);
-    DUMP(module);
+    DUMP(batchMatmul, "modifyLoopStepToOne");
     
-    llvm::SmallVector<mlir::Value> operandsC({blockElemIdx[batchNum], m_inner_0.getInductionVar(), threadIdx_[0], m_inner_1.getInductionVar(),
-                                              n_outer.getInductionVar(), threadIdx_[1], n_inner_0.getInductionVar(), n_inner_1.getInductionVar()});
+    llvm::SmallVector<mlir::Value> operandsC;
+    if (mma) {
+      operandsC = {blockElemIdx[batchNum], n_outer.getInductionVar(), threadIdx[0], m_inner_0.getInductionVar(),
+                   n_inner_0.getInductionVar(), m_inner_1.getInductionVar(), n_inner_1.getInductionVar()};
+    } else {
+      operandsC = {blockElemIdx[batchNum], m_inner_0.getInductionVar(), threadIdx_[0], m_inner_1.getInductionVar(),
+                   n_outer.getInductionVar(), threadIdx_[1], n_inner_0.getInductionVar(), n_inner_1.getInductionVar()};
+    }
     for (int i=0; i<batchNum; i++) { operandsC.insert(operandsC.begin(), blockIdx[i]); }
-    Rewriter::cache_write(m_inner_0, C, C, getAffineMap("nine", builder, batchNum), operandsC);
-    Rewriter::vectorize(n_inner_1, batchMatmulConfig["VECTORIZE_WIDTH"]);
-    DUMP(module);
-
-    auto doubleLoadTileB = Rewriter::pipeline({loadTileB, storeTileB}, smB, k_outer);
-    auto doubleLoadTileA = Rewriter::pipeline({loadTileA, storeTileA}, smA, k_outer);
-    auto doubleLoadFragB = Rewriter::pipeline({loadFragB}, fragB, k_inner);
-    auto doubleLoadFragA = Rewriter::pipeline({loadFragA}, fragA, k_inner);
-    DUMP(module);
-
-    Rewriter::detach_last_loop(k_inner);
-    DUMP(module);
-
-    Rewriter::schedule(doubleLoadTileA[0][0], doubleLoadTileB[0][0], Position::before);
-    Rewriter::schedule(doubleLoadTileA[0][1], doubleLoadTileB[0][1], Position::before); 
-    Rewriter::schedule(gpuBarrierPrefix, doubleLoadTileB[0][1], Position::after);
-    Rewriter::schedule(doubleLoadTileB[1][0], doubleLoadTileA[1][0], Position::after);
-    Rewriter::schedule(doubleLoadTileA[1][1], doubleLoadTileB[1][1], Position::before);
-    Rewriter::schedule(gpuBarrierSuffix, doubleLoadTileB[1][1], Position::after);
-    auto ifOp = doubleLoadTileA[1][1]->getParentOp();
-    Rewriter::schedule(ifOp, k_inner, Position::after); 
-    Rewriter::extract_loop(doubleLoadFragA[0][0], k_outer, /*iteration*/0);
-    Rewriter::extract_loop(doubleLoadFragB[0][0], k_outer, /*iteration*/0);
-    Rewriter::schedule(doubleLoadFragB[0][0], k_outer, Position::end);
-    Rewriter::schedule(doubleLoadFragA[0][0], k_outer, Position::end);
-    DUMP(module);
-
-    Rewriter::change_double_buffer(doubleLoadFragA[0][0], smA);
-    Rewriter::change_double_buffer(doubleLoadFragB[0][0], smB);;
-    DUMP(module);
-
-    Rewriter::take_off_true_if(module);
-    Rewriter::delete_false_if(module);
-    DUMP(module);
+    Rewriter::cache_write(m_inner_0, C, C, getAffineMap(mma ? "nineMMA" : "nine", builder, batchNum), operandsC);
+    Rewriter::vectorize(n_inner_1, writeWidth);
+    DUMP(batchMatmul, "vectorize");
+
+    std::vector<std::vector<mlir::AffineForOp>> doubleLoadFragA, doubleLoadFragB;
+    if (!mma) {
+      doubleLoadFragB = Rewriter::pipeline({loadFragB}, fragB, k_inner);
+      doubleLoadFragA = Rewriter::pipeline({loadFragA}, fragA, k_inner);
+      DUMP(batchMatmul, "pipeline");
+
+      Rewriter::detach_last_loop(k_inner);
+      DUMP(batchMatmul, "detach_last_loop");
+    }
+
+    std::vector<mlir::Value> smems{smA, smB};
+    if (batchMatmulConfig["ASYNC_COPY"]) {
+      auto copyTileA = Rewriter::async_copy(loadTileA, storeTileA);
+      auto copyTileB = Rewriter::async_copy(loadTileB, storeTileB);
+      Rewriter::async_pipeline({copyTileA, copyTileB}, smems, k_outer, k_inner, 
+                               gpuBarrierPrefix, gpuBarrierSuffix, batchMatmulConfig["STAGES"]);
+    } else {
+      Rewriter::pipeline({loadTileA, loadTileB}, {storeTileA, storeTileB}, smems, k_outer, k_inner, 
+                         gpuBarrierPrefix, gpuBarrierSuffix, batchMatmulConfig["STAGES"]);
+    }
+    smA = smems[0], smB = smems[1];
+    if (!mma) {
+      Rewriter::extract_loop(doubleLoadFragA[0][0], k_outer, /*iteration*/0);
+      Rewriter::extract_loop(doubleLoadFragB[0][0], k_outer, /*iteration*/0);
+      Rewriter::schedule(doubleLoadFragB[0][0], k_outer, Position::end);
+      Rewriter::schedule(doubleLoadFragA[0][0], k_outer, Position::end);
+      DUMP(batchMatmul, "schedule");
+
+      Rewriter::change_double_buffer(doubleLoadFragA[0][0], smA);
+      Rewriter::change_double_buffer(doubleLoadFragB[0][0], smB);;
+      DUMP(batchMatmul, "change_double_buffer");
+    }
+
+    Rewriter::simplify_if(batchMatmul);
+    DUMP(batchMatmul, "simplify_if");
   
     int64_t threshold = std::max(batchMatmulConfig["BLOCK_SIZE_K"], std::max(batchMatmulConfig["THREAD_SIZE_M"], batchMatmulConfig["THREAD_SIZE"]));
-    Rewriter::unroll(module, [&](mlir::AffineForOp forOp)->bool {
-      if (!forOp.hasConstantBounds()) return false;
-      auto step = forOp.getStep();
-      auto ub = forOp.getConstantUpperBound();
-      auto lb = forOp.getConstantLowerBound();
-      auto times = (ub - lb) / step;
-      if (times >= std::min<int64_t>(threshold, batchMatmulConfig["VECTORIZE_WIDTH"])) return false;
-      return true;
-    });
-    DUMP(module);
-
-    Rewriter::unrollAttribute(module, [&](mlir::AffineForOp forOp)->bool {
-      if (!forOp.hasConstantBounds()) return false;
-      auto step = forOp.getStep();
-      auto ub = forOp.getConstantUpperBound();
-      auto lb = forOp.getConstantLowerBound();
-      auto times = (ub - lb) / step;
-      if (times > threshold) return false;
-      return true;
-    });
+    UnrollPlanner::plan(batchMatmul, /*fullLimit*/std::min<int64_t>(threshold, batchMatmulConfig["VECTORIZE_WIDTH"]), /*pragmaLimit*/threshold, 
+                        batchMatmulConfig["UNROLL_BUDGET"]);
     Rewriter::deleteExtraCstOp(gridLevel);
-    DUMP(module);
+    DUMP(batchMatmul, "deleteExtraCstOp");
+
+    Rewriter::scalar_replace(batchMatmul);
+    DUMP(batchMatmul, "scalar_replace");
+    batchMatmulConfig["VECTORIZE_WIDTH"] = vectorWidth;
   }
 }
 
@@ -1,13 +1,18 @@
 #include "Optimizer/Rewriter.h"
+#include "Optimizer/MMA.h"
 #include "enum.h"
+#include "log.h"
 
 #include "llvm/ADT/ArrayRef.h"
 
 #include "mlir/Dialect/Affine/IR/AffineOps.h"
 
 #include "mlir/IR/PatternMatch.h"
+#include "mlir/Support/MathExtras.h"
+#include "mlir/Transforms/GreedyPatternRewriteDriver.h"
 
 #include <algorithm>
+#include <functional>
 #include <map>
 #include <cmath>
 
@@ -50,6 +55,13 @@ mlir::AffineExpr getModifiedExpr(mlir::MLIRContext* context, mlir::AffineExpr in
   }
 }
 
+// keep the hints (e.g. async.copy) of `from` on the rebuilt memory access `to`.
+void inheritAttrs(mlir::Operation* from, mlir::Operation* to) {
+  for (auto attr : from->getAttrs()) {
+    if (!to->hasAttr(attr.getName())) to->setAttr(attr.getName(), attr.getValue());
+  }
+}
+
 mlir::AffineForOp findRootLoop(mlir::Operation* op) {
   while (true) {
     auto parentOp = op->getParentOp();
@@ -111,7 +123,7 @@ int replaceIndexWithExpr(mlir::Value oldIv, std::vector<mlir::Value>& newIvs, Af
   return operands.size();
 }
 
-std::vector<mlir::AffineForOp> Rewriter::split(mlir::AffineForOp forOp, uint64_t num_output, std::vector<int64_t>&& factors) {
+std::vector<mlir::AffineForOp> Rewriter::split(mlir::AffineForOp forOp, uint64_t num_output, std::vector<int64_t>&& factors, bool guardTail) {
   auto upperBoundsVector = factors;
   factors.insert(factors.begin(), 1);
   assert(factors.size() == num_output);
@@ -237,11 +249,93 @@ std::vector<mlir::AffineForOp> Rewriter::split(mlir::AffineForOp forOp, uint64_t
   // auto oldIv = forOp.getInductionVar();
   // oldIv.replaceAllUsesWith(ivReplacement.get<mlir::Value>());
 
+  if (guardTail && ub % steps[0] != 0) {
+    // sink the guard under the perfectly nested loops, so they can still be reordered.
+    auto body = innermostForOp.getBody();
+    while (body->getOperations().size() == 2) {
+      if (auto sonLoop = mlir::dyn_cast<mlir::AffineForOp>(body->front())) {
+        body = sonLoop.getBody();
+      } else {
+        break;
+      }
+    }
+    llvm::SmallVector<mlir::AffineExpr> exprs{ub - 1 - sumExpr};
+    llvm::SmallVector<bool> eqFlags{false};
+    auto set = mlir::IntegerSet::get(dimCount, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), llvm::ArrayRef<bool>(eqFlags));
+    builder.setInsertionPointToStart(body);
+    auto ifOp = builder.create<mlir::AffineIfOp>(builder.getUnknownLoc(), set, 
+                                                 mlir::ValueRange(llvm::ArrayRef<mlir::Value>(ivsVector)), false);
+    auto thenBlock = ifOp.getThenBlock();
+    thenBlock->getOperations().splice(thenBlock->begin(), body->getOperations(), 
+                                      std::next(mlir::Block::iterator(ifOp)), std::prev(body->end()));
+    ifOp->setAttr(std::string("affine.tail"), builder.getUnitAttr());
+  }
+
   forOp.erase();
 
   return loops;
 }
 
+mlir::AffineForOp Rewriter::version_tail(mlir::AffineForOp forOp) {
+  std::vector<mlir::AffineIfOp> guards;
+  forOp.walk([&](mlir::AffineIfOp ifOp) {
+    if (ifOp->hasAttr(std::string("affine.tail"))) guards.push_back(ifOp);
+  });
+  if (guards.empty()) return forOp;
+
+  // the guards are "ub - 1 - sum(ivs) >= 0", the last iteration of every loop in the tile is the worst case.
+  llvm::DenseMap<mlir::Value, int64_t> lastIvs;
+  forOp.walk([&](mlir::AffineForOp loop) {
+    assert(loop.hasConstantBounds());
+    auto lb = loop.getConstantLowerBound();
+    auto step = loop.getStep();
+    lastIvs[loop.getInductionVar()] = lb + (loop.getConstantUpperBound() - lb - 1) / step * step;
+  });
+
+  mlir::OpBuilder builder(forOp);
+  llvm::SmallVector<mlir::Value> operands;
+  llvm::SmallVector<mlir::AffineExpr> exprs;
+  for (auto guard : guards) {
+    auto set = guard.getIntegerSet();
+    llvm::SmallVector<mlir::AffineExpr> dimReplacements;
+    for (auto operand : guard.getOperands()) {
+      if (lastIvs.count(operand) != 0) {
+        dimReplacements.push_back(builder.getAffineConstantExpr(lastIvs[operand]));
+        continue;
+      }
+      auto iter = std::find(operands.begin(), operands.end(), operand);
+      dimReplacements.push_back(builder.getAffineDimExpr(iter - operands.begin()));
+      if (iter == operands.end()) operands.push_back(operand);
+    }
+    for (auto expr : set.getConstraints()) {
+      exprs.push_back(expr.replaceDims(dimReplacements));
+    }
+  }
+  for (auto& expr : exprs) {
+    expr = mlir::simplifyAffineExpr(expr, operands.size(), 0);
+  }
+  llvm::SmallVector<bool> eqFlags(exprs.size(), false);
+  auto set = mlir::IntegerSet::get(operands.size(), 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), llvm::ArrayRef<bool>(eqFlags));
+  auto ifOp = builder.create<mlir::AffineIfOp>(builder.getUnknownLoc(), set, mlir::ValueRange(operands), true);
+
+  builder.setInsertionPointToStart(ifOp.getThenBlock());
+  mlir::BlockAndValueMapping mapper;
+  auto mainLoop = mlir::dyn_cast<mlir::AffineForOp>(builder.clone(*forOp, mapper));
+  forOp->moveBefore(ifOp.getElseBlock()->getTerminator());
+
+  std::vector<mlir::AffineIfOp> mainGuards;
+  mainLoop.walk([&](mlir::AffineIfOp guard) {
+    if (guard->hasAttr(std::string("affine.tail"))) mainGuards.push_back(guard);
+  });
+  for (auto guard : mainGuards) {
+    auto thenBlock = guard.getThenBlock();
+    guard->getBlock()->getOperations().splice(mlir::Block::iterator(guard), thenBlock->getOperations(), 
+                                              thenBlock->begin(), std::prev(thenBlock->end()));
+    guard.erase();
+  }
+  return mainLoop;
+}
+
 // mlir::Value Rewriter::bufferizeLoopCarryVar(mlir::AffineForOp loop) {
 
 // }
@@ -499,7 +593,7 @@ void Rewriter::reorder(const std::vector<mlir::AffineForOp>& loops) {
   // bufferizeLoopCarryVar(loops);
   // bufferizeLoopCarryVar(loops);
   // give every loop a prioriry
-  std::map<mlir::AffineForOp, int, CompareLoop> loopPriority;
+  llvm::DenseMap<mlir::AffineForOp, int> loopPriority;
   int priority = loops.size();
   for (auto loop : loops) {
     loopPriority[loop] = priority--;
@@ -560,15 +654,34 @@ void Rewriter::reorder(const std::vector<mlir::AffineForOp>& loops) {
 
 // op in forOps must be perfect nested loops.
 mlir::AffineParallelOp Rewriter::parallel(const std::vector<mlir::AffineForOp>& forOps) {
-  // X, Y, Z
-  assert(forOps.size() <= 3);
+  // X, Y, Z, the loops before Y are folded to Z.
+  int foldCount = forOps.size() > 3 ? forOps.size() - 2 : 1;
   llvm::SmallVector<mlir::AffineMap> lbMaps;
   llvm::SmallVector<mlir::AffineMap> upMaps;
   llvm::SmallVector<mlir::Value> lbOperands;
   llvm::SmallVector<mlir::Value> upOperands;
   llvm::SmallVector<int64_t> steps;
 
-  for (auto forOp : forOps) {
+  mlir::OpBuilder builder(forOps[0]);
+
+  std::vector<int64_t> foldTrips;
+  int64_t foldNumber = 1;
+  for (int i = 0; i < foldCount && foldCount > 1; i++) {
+    auto forOp = forOps[i];
+    assert(forOp.hasConstantBounds());
+    auto step = forOp.getStep();
+    auto trip = (forOp.getConstantUpperBound() - forOp.getConstantLowerBound() + step - 1) / step;
+    foldTrips.push_back(trip);
+    foldNumber *= trip;
+  }
+  if (foldCount > 1) {
+    lbMaps.push_back(builder.getConstantAffineMap(0));
+    upMaps.push_back(builder.getConstantAffineMap(foldNumber));
+    steps.push_back(1);
+  }
+
+  for (int i = foldCount > 1 ? foldCount : 0; i < forOps.size(); i++) {
+    auto forOp = forOps[i];
     lbMaps.push_back(forOp.getLowerBoundMap());
     upMaps.push_back(forOp.getUpperBoundMap());
     lbOperands.append(forOp.getLowerBoundOperands().begin(), forOp.getLowerBoundOperands().end());
@@ -576,8 +689,6 @@ mlir::AffineParallelOp Rewriter::parallel(const std::vector<mlir::AffineForOp>&
     steps.push_back(forOp.getStep());
   }
 
-  mlir::OpBuilder builder(forOps[0]);
-
   mlir::AffineParallelOp parallelOp = builder.create<mlir::AffineParallelOp>(
     builder.getUnknownLoc(), mlir::TypeRange(), llvm::ArrayRef<mlir::arith::AtomicRMWKind>(),
     llvm::ArrayRef<mlir::AffineMap>(lbMaps), lbOperands,
@@ -594,16 +705,176 @@ mlir::AffineParallelOp Rewriter::parallel(const std::vector<mlir::AffineForOp>&
   auto newIvs = parallelOp.getIVs();
   int count = newIvs.size() - 1;
 
-  for (auto iter = forOps.rbegin(); iter != forOps.rend(); ++iter) {
+  for (auto iter = forOps.rbegin(); iter != forOps.rend() - (foldCount > 1 ? foldCount : 0); ++iter) {
     auto forOp = *iter;
     forOp.getInductionVar().replaceAllUsesWith(newIvs[count--]);
     forOp.erase();
   }
+  if (foldCount > 1) {
+    // iv = lb + step * (z floordiv stride mod trip)
+    builder.setInsertionPointToStart(parallelOp.getBody());
+    auto dim0 = builder.getAffineDimExpr(0);
+    int64_t stride = foldNumber;
+    for (int i = 0; i < foldCount; i++) {
+      auto forOp = forOps[i];
+      stride /= foldTrips[i];
+      auto expr = dim0.floorDiv(stride) % foldTrips[i] * forOp.getStep() + forOp.getConstantLowerBound();
+      auto map = mlir::AffineMap::get(/*dimCount*/1, 0, llvm::ArrayRef<mlir::AffineExpr>(expr), builder.getContext());
+      auto applyOp = builder.create<mlir::AffineApplyOp>(builder.getUnknownLoc(), map, mlir::ValueRange({newIvs[0]}));
+      forOp.getInductionVar().replaceAllUsesWith(applyOp.getResult());
+    }
+    for (int i = foldCount - 1; i >= 0; i--) {
+      forOps[i].erase();
+    }
+  }
   // make the lowerbound to 0 and step to 1
   mlir::normalizeAffineParallel(parallelOp);
   return parallelOp;
 }
 
+mlir::AffineParallelOp Rewriter::grid_stride(mlir::AffineParallelOp gridLevel, int64_t maxBlocks, int64_t smCount) {
+  // gridDim.x < 2^31, gridDim.y and gridDim.z <= 65535.
+  const int64_t maxGridX = 2147483647, maxGridYZ = 65535;
+  int64_t totalNumber;
+  auto gridDims = Analyzer::getParallelNumber(gridLevel, totalNumber);
+  bool overLimit = gridDims.back() > maxGridX;
+  for (int i = 0; i + 1 < gridDims.size(); i++) {
+    if (gridDims[i] > maxGridYZ) overLimit = true;
+  }
+  bool capped = totalNumber > maxBlocks || overLimit;
+  if (!capped) return gridLevel;
+
+  // whole waves: the capped grid is a multiple of the SM count.
+  auto gridSize = std::min(totalNumber, std::min(maxBlocks, maxGridX));
+  if (smCount > 0 && gridSize >= smCount) gridSize = gridSize / smCount * smCount;
+  auto strideNumber = (totalNumber + gridSize - 1) / gridSize;
+  bool partial = totalNumber % gridSize != 0;
+
+  auto& oldOps = gridLevel.getBody()->getOperations();
+  if (partial) {
+    // only the block levels are guarded, the ops out of them must not write memory.
+    // a grid coarsening loop (see coarsen) is guarded through the block level in its body.
+    std::function<bool(mlir::Block*)> guardable = [&](mlir::Block* block) {
+      for (auto& op : block->getOperations()) {
+        if (auto forOp = mlir::dyn_cast<mlir::AffineForOp>(op)) {
+          if (!guardable(forOp.getBody())) return false;
+        } else if (!mlir::isa<mlir::AffineParallelOp, mlir::AffineApplyOp, mlir::arith::ConstantOp, 
+                              mlir::memref::AllocOp, mlir::AffineYieldOp>(op)) {
+          if (KCGLog::level == Log::Debug) {
+            llvm::errs() << "Can't guard " << op.getName() << " in a grid-stride loop, the grid is left at " << totalNumber << " blocks\n";
+          }
+          return false;
+        }
+      }
+      return true;
+    };
+    if (!guardable(gridLevel.getBody())) return gridLevel;
+  }
+
+  mlir::OpBuilder builder(gridLevel);
+  auto parallelOp = builder.create<mlir::AffineParallelOp>(
+    builder.getUnknownLoc(), mlir::TypeRange(), llvm::ArrayRef<mlir::arith::AtomicRMWKind>(),
+    llvm::ArrayRef<int64_t>({gridSize}));
+  builder.setInsertionPointToStart(parallelOp.getBody());
+  auto strideLoop = builder.create<mlir::AffineForOp>(builder.getUnknownLoc(), 0, strideNumber, 1);
+  auto blockIdx = parallelOp.getIVs()[0];
+  auto strideIdx = strideLoop.getInductionVar();
+
+  // old index = (stride * gridSize + blockIdx.x) floordiv (inner dims) mod dim
+  builder.setInsertionPointToStart(strideLoop.getBody());
+  auto linear = builder.getAffineDimExpr(0) * gridSize + builder.getAffineDimExpr(1);
+  auto oldIvs = gridLevel.getIVs();
+  int64_t stride = totalNumber;
+  for (int i = 0; i < oldIvs.size(); i++) {
+    stride /= gridDims[i];
+    auto expr = linear.floorDiv(stride);
+    if (i != 0) expr = expr % gridDims[i];
+    auto map = mlir::AffineMap::get(/*dimCount*/2, 0, llvm::ArrayRef<mlir::AffineExpr>(expr), builder.getContext());
+    auto applyOp = builder.create<mlir::AffineApplyOp>(builder.getUnknownLoc(), map, mlir::ValueRange({strideIdx, blockIdx}));
+    oldIvs[i].replaceAllUsesWith(applyOp.getResult());
+  }
+
+  // shared memory stays at the kernel level, the rest runs in every stride.
+  std::vector<mlir::Operation*> ops;
+  for (auto& op : oldOps) {
+    if (!mlir::isa<mlir::AffineYieldOp>(op)) ops.push_back(&op);
+  }
+  for (auto op : ops) {
+    if (mlir::isa<mlir::memref::AllocOp>(op)) {
+      op->moveBefore(strideLoop);
+    } else {
+      op->moveBefore(strideLoop.getBody()->getTerminator());
+    }
+  }
+
+  if (partial) {
+    llvm::SmallVector<mlir::AffineExpr> exprs{totalNumber - 1 - linear};
+    llvm::SmallVector<bool> eqFlags{false};
+    auto set = mlir::IntegerSet::get(2, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), llvm::ArrayRef<bool>(eqFlags));
+    // the block levels, in the stride loop or in a coarsening loop of it.
+    std::vector<mlir::AffineParallelOp> blockLevels;
+    strideLoop.walk([&](mlir::AffineParallelOp blockLevel) {
+      if (blockLevel->getParentOfType<mlir::AffineParallelOp>() == parallelOp) blockLevels.push_back(blockLevel);
+    });
+    for (auto blockLevel : blockLevels) {
+      auto body = blockLevel.getBody();
+      builder.setInsertionPointToStart(body);
+      auto ifOp = builder.create<mlir::AffineIfOp>(builder.getUnknownLoc(), set, mlir::ValueRange({strideIdx, blockIdx}), false);
+      auto thenBlock = ifOp.getThenBlock();
+      thenBlock->getOperations().splice(thenBlock->begin(), body->getOperations(), 
+                                        std::next(mlir::Block::iterator(ifOp)), std::prev(body->end()));
+    }
+  }
+  gridLevel.erase();
+  return parallelOp;
+}
+
+mlir::AffineForOp Rewriter::coarsen(mlir::AffineParallelOp parallelOp, int64_t factor) {
+  if (factor <= 1) return nullptr;
+  int64_t totalNumber;
+  auto dims = Analyzer::getParallelNumber(parallelOp, totalNumber);
+  if (dims.back() % factor != 0) {
+    if (KCGLog::level == Log::Debug) llvm::errs() << "Can't coarsen " << dims.back() << " by " << factor << "\n";
+    return nullptr;
+  }
+  auto extent = dims.back() / factor;
+  dims.back() = extent;
+
+  mlir::OpBuilder builder(parallelOp);
+  llvm::SmallVector<mlir::AffineExpr> ubExprs;
+  for (auto dim : dims) {
+    ubExprs.push_back(builder.getAffineConstantExpr(dim));
+  }
+  parallelOp.setUpperBounds(mlir::ValueRange(), 
+    mlir::AffineMap::get(0, 0, llvm::ArrayRef<mlir::AffineExpr>(ubExprs), builder.getContext()));
+
+  auto body = parallelOp.getBody();
+  std::vector<mlir::Operation*> ops;
+  for (auto& op : body->getOperations()) {
+    if (!mlir::isa<mlir::AffineYieldOp>(op)) ops.push_back(&op);
+  }
+
+  builder.setInsertionPointToStart(body);
+  auto coarsenLoop = builder.create<mlir::AffineForOp>(builder.getUnknownLoc(), 0, factor, 1);
+  builder.setInsertionPointToStart(coarsenLoop.getBody());
+  auto ivX = parallelOp.getIVs().back();
+  auto expr = builder.getAffineDimExpr(0) * extent + builder.getAffineDimExpr(1);
+  auto map = mlir::AffineMap::get(/*dimCount*/2, 0, llvm::ArrayRef<mlir::AffineExpr>(expr), builder.getContext());
+  auto applyOp = builder.create<mlir::AffineApplyOp>(builder.getUnknownLoc(), map, 
+                                                     mlir::ValueRange({coarsenLoop.getInductionVar(), ivX}));
+  ivX.replaceAllUsesExcept(applyOp.getResult(), applyOp);
+
+  // buffers are reused by every iteration.
+  for (auto op : ops) {
+    if (mlir::isa<mlir::memref::AllocOp>(op)) {
+      op->moveBefore(coarsenLoop);
+    } else {
+      op->moveBefore(coarsenLoop.getBody()->getTerminator());
+    }
+  }
+  return coarsenLoop;
+}
+
 // dst is register.
 mlir::AffineForOp Rewriter::read(mlir::Value src, mlir::Value dst, mlir::AffineMap map, 
                                    llvm::SmallVector<mlir::Value> operands, int64_t width,
@@ -790,6 +1061,18 @@ mlir::AffineForOp Rewriter::vectorize(mlir::AffineForOp readOrWrite, int64_t wid
   int64_t ub = readOrWrite.getConstantUpperBound();
   int64_t lb = readOrWrite.getConstantLowerBound();
   assert(step = 1 && lb == 0 && ub % width == 0);
+  bool vectorizable = true;
+  readOrWrite.walk([&](mlir::Operation* op) {
+    mlir::Value memref;
+    if (auto load = mlir::dyn_cast<mlir::AffineLoadOp>(op)) memref = load.getMemRef();
+    else if (auto store = mlir::dyn_cast<mlir::AffineStoreOp>(op)) memref = store.getMemRef();
+    if (!memref) return;
+    auto type = memref.getType().dyn_cast<mlir::MemRefType>();
+    if (type.getMemorySpaceAsInt() == static_cast<int>(MemorySpace::global) && !Analyzer::isVectorizable(memref, width)) {
+      vectorizable = false;
+    }
+  });
+  if (!vectorizable) return readOrWrite;
   readOrWrite.setStep(width);
   readOrWrite.walk<mlir::WalkOrder::PreOrder>([&](mlir::AffineLoadOp load) {
     mlir::OpBuilder builder(load);
@@ -809,7 +1092,7 @@ mlir::AffineForOp Rewriter::vectorize(mlir::AffineForOp readOrWrite, int64_t wid
   return readOrWrite;
 }
 
-std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir::AffineForOp> readBodys, mlir::Value& buffer, mlir::AffineForOp compute_at) {
+std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir::AffineForOp> readBodys, mlir::Value& buffer, mlir::AffineForOp compute_at, int64_t stages) {
 
   // bool shared;
   // if (memorySpace == static_cast<int>(MemorySpace::shared)) {
@@ -822,12 +1105,18 @@ std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir:
 
   std::vector<std::vector<mlir::AffineForOp>> results;
 
-  /* step1: double buffer.*/
+  /* step1: multi buffer.*/
+  assert(stages >= 2);
+  int64_t step = compute_at.getStep();
+  int64_t ub = compute_at.getConstantUpperBound();
+  int64_t lb = compute_at.getConstantLowerBound();
+  // the prologue can't prefetch more tiles than the loop has.
+  assert((ub - lb) / step >= stages - 1);
 
   auto bufferType = buffer.getType().dyn_cast<mlir::MemRefType>();
   mlir::SmallVector<int64_t> shape;
-  /// double size on top dim.
-  shape.push_back(2);
+  /// `stages` times size on top dim.
+  shape.push_back(stages);
   for (auto dim : bufferType.getShape()) {
     shape.push_back(dim);
   }
@@ -876,11 +1165,12 @@ std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir:
       if (!needReplace) return;
       mlir::OpBuilder builder(store);
       auto newVectorStoreOp = builder.create<mlir::AffineVectorStoreOp>(builder.getUnknownLoc(), store.getValue(), store.getMemref(), store.getAffineMap(), operands);
+      inheritAttrs(store, newVectorStoreOp);
       store.erase();
     });
   };
-  //2. replace every reference to buffer with doubleBuffer, and select doubleBuffer[0];
-  auto replaceBufferRef = [&](mlir::AffineForOp body, mlir::Value bufferSrc, mlir::Value bufferDst) {
+  //2. replace every reference to buffer with doubleBuffer, and select doubleBuffer[stage];
+  auto replaceBufferRef = [&](mlir::AffineForOp body, mlir::Value bufferSrc, mlir::Value bufferDst, int64_t stage) {
     body.walk<mlir::WalkOrder::PreOrder>([&](mlir::AffineVectorLoadOp load) {
       auto oldMemref = load.getMemref();
       if (oldMemref != bufferSrc) return;
@@ -888,7 +1178,7 @@ std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir:
       auto oldAffineMap = load.getAffineMap();
       auto oldExprs = oldAffineMap.getResults();
       mlir::SmallVector<mlir::AffineExpr> exprs;
-      exprs.push_back(mlir::getAffineConstantExpr(0, body->getContext()));
+      exprs.push_back(mlir::getAffineConstantExpr(stage, body->getContext()));
       for (auto expr : oldExprs) exprs.push_back(expr);
       auto map = mlir::AffineMap::get(/*dimCount*/oldAffineMap.getNumDims(), 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), body->getContext());
 
@@ -904,27 +1194,32 @@ std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir:
       auto oldAffineMap = store.getAffineMap();
       auto oldExprs = oldAffineMap.getResults();
       mlir::SmallVector<mlir::AffineExpr> exprs;
-      exprs.push_back(mlir::getAffineConstantExpr(0, body->getContext()));
+      exprs.push_back(mlir::getAffineConstantExpr(stage, body->getContext()));
       for (auto expr : oldExprs) exprs.push_back(expr);
       auto map = mlir::AffineMap::get(/*dimCount*/oldAffineMap.getNumDims(), 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), body->getContext());
 
       mlir::OpBuilder builder(store);
       auto newVectorStoreOp = builder.create<mlir::AffineVectorStoreOp>(builder.getUnknownLoc(), store.getValue(), bufferDst, map, store.getMapOperands());
+      inheritAttrs(store, newVectorStoreOp);
       store.erase();
     });
   };
+  // prologue: the first `stages - 1` iterations are fetched before the loop, stage by stage.
   std::vector<mlir::AffineForOp> result;
   builder.setInsertionPoint(compute_at);
-  auto lbOp = builder.create<mlir::arith::ConstantIndexOp>(builder.getUnknownLoc(), compute_at.getConstantLowerBound());
   auto rootLoop = findRootLoop(compute_at);
-  lbOp->moveBefore(&(rootLoop->getBlock()->getOperations().front()));
-  for (auto readBody : readBodys) {
-    mlir::BlockAndValueMapping mapper;
-    auto newBody = builder.clone(*readBody, mapper);
-    auto loopBody = mlir::dyn_cast<mlir::AffineForOp>(newBody);
-    replaceOperand(loopBody, compute_at.getInductionVar(), lbOp.getResult());
-    replaceBufferRef(loopBody, buffer, doubleBuffer);
-    result.push_back(loopBody);
+  for (int64_t stage = 0; stage < stages - 1; stage++) {
+    auto iter = lb + stage * step;
+    auto iterOp = builder.create<mlir::arith::ConstantIndexOp>(builder.getUnknownLoc(), iter);
+    iterOp->moveBefore(&(rootLoop->getBlock()->getOperations().front()));
+    for (auto readBody : readBodys) {
+      mlir::BlockAndValueMapping mapper;
+      auto newBody = builder.clone(*readBody, mapper);
+      auto loopBody = mlir::dyn_cast<mlir::AffineForOp>(newBody);
+      replaceOperand(loopBody, compute_at.getInductionVar(), iterOp.getResult());
+      replaceBufferRef(loopBody, buffer, doubleBuffer, (iter / step) % stages);
+      result.push_back(loopBody);
+    }
   }
   results.push_back(result);
   results.push_back(readBodys);
@@ -935,10 +1230,6 @@ std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir:
   auto dim0 = builder.getAffineDimExpr(0);
   auto dim1 = builder.getAffineDimExpr(1);
 
-  int64_t step = compute_at.getStep();
-  int64_t ub = compute_at.getConstantUpperBound();
-  int64_t lb = compute_at.getConstantLowerBound();
-
   /*
   /// Array of affine constraints: a constraint is either an equality
   /// (affine_expr == 0) or an inequality (affine_expr >= 0).
@@ -949,9 +1240,10 @@ std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir:
   */
   llvm::SmallVector<mlir::AffineExpr> exprs;
   llvm::SmallVector<bool> eqFlags;
-  // iv + 2 * step <= ub
-  //-> ub - 2 * step - iv >= 0
-  exprs.push_back(ub - 2 * step - dim0);
+  // the last `stages - 1` iterations only drain the buffers.
+  // iv + stages * step <= ub
+  //-> ub - stages * step - iv >= 0
+  exprs.push_back(ub - stages * step - dim0);
   eqFlags.push_back(false);
   auto cst = mlir::IntegerSet::get(1, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), llvm::ArrayRef<bool>(eqFlags));
 
@@ -1017,10 +1309,11 @@ std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir:
       auto map = mlir::AffineMap::get(/*dimCount*/store.getAffineMap().getNumDims() + dimCount - 1, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), body->getContext());
       mlir::OpBuilder builder(store);
       auto newVectorStoreOp = builder.create<mlir::AffineVectorStoreOp>(builder.getUnknownLoc(), store.getValue(), store.getMemref(), map, operands);
+      inheritAttrs(store, newVectorStoreOp);
       store.erase();
     });
   };
-  // 3.replace every reference to buffer with doubleBuffer, and select doubleBuffer[0];
+  // 3.replace every reference to buffer with doubleBuffer, and select the stage `stages - 1` ahead;
   auto replaceBufferRefInLoop = [&](mlir::AffineForOp body, mlir::Value bufferSrc, mlir::Value bufferDst, mlir::AffineForOp compute_at) {
     body.walk<mlir::WalkOrder::PreOrder>([&](mlir::AffineVectorLoadOp load) {
       auto oldMemref = load.getMemref();
@@ -1046,7 +1339,7 @@ std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir:
       }
       auto dim = mlir::getAffineDimExpr(targetDim, body->getContext());
       mlir::SmallVector<mlir::AffineExpr> exprs;
-      exprs.push_back((dim.floorDiv(compute_at.getStep()) + 1) % 2);
+      exprs.push_back((dim.floorDiv(compute_at.getStep()) + stages - 1) % stages);
       auto oldAffineMap = load.getAffineMap();
       auto oldExprs = oldAffineMap.getResults();
       for (auto expr : oldExprs) exprs.push_back(expr);
@@ -1081,7 +1374,7 @@ std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir:
       }
       auto dim = mlir::getAffineDimExpr(targetDim, body->getContext());
       mlir::SmallVector<mlir::AffineExpr> exprs;
-      exprs.push_back((dim.floorDiv(compute_at.getStep()) + 1) % 2);
+      exprs.push_back((dim.floorDiv(compute_at.getStep()) + stages - 1) % stages);
       auto oldAffineMap = store.getAffineMap();
       auto oldExprs = oldAffineMap.getResults();
       for (auto expr : oldExprs) exprs.push_back(expr);
@@ -1089,12 +1382,13 @@ std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir:
 
       mlir::OpBuilder builder(store);
       auto newVectorStoreOp = builder.create<mlir::AffineVectorStoreOp>(builder.getUnknownLoc(), store.getValue(), bufferDst, map, operands);
+      inheritAttrs(store, newVectorStoreOp);
       store.erase();
     });
   };
   for (auto readBody : readBodys) {
     auto dim0 = builder.getAffineDimExpr(0);
-    replaceAffineExprInLoop(readBody, compute_at.getInductionVar(), dim0 + compute_at.getStep(), 1);
+    replaceAffineExprInLoop(readBody, compute_at.getInductionVar(), dim0 + (stages - 1) * compute_at.getStep(), 1);
     replaceBufferRefInLoop(readBody, buffer, doubleBuffer, compute_at);
   }
   //4. replace load
@@ -1125,7 +1419,7 @@ std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir:
       }
       auto dim = mlir::getAffineDimExpr(targetDim, load->getContext());
       mlir::SmallVector<mlir::AffineExpr> exprs;
-      exprs.push_back(dim.floorDiv(compute_at.getStep()) % 2);
+      exprs.push_back(dim.floorDiv(compute_at.getStep()) % stages);
       auto oldAffineMap = load.getAffineMap();
       auto oldExprs = oldAffineMap.getResults();
       for (auto expr : oldExprs) exprs.push_back(expr);
@@ -1159,7 +1453,7 @@ std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir:
       }
       auto dim = mlir::getAffineDimExpr(targetDim, load->getContext());
       mlir::SmallVector<mlir::AffineExpr> exprs;
-      exprs.push_back(dim.floorDiv(compute_at.getStep()) % 2);
+      exprs.push_back(dim.floorDiv(compute_at.getStep()) % stages);
       auto oldAffineMap = load.getAffineMap();
       auto oldExprs = oldAffineMap.getResults();
       for (auto expr : oldExprs) exprs.push_back(expr);
@@ -1182,6 +1476,291 @@ std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir:
   return results;
 }
 
+std::vector<std::vector<mlir::AffineForOp>> Rewriter::pipeline(std::vector<mlir::AffineForOp> loads, std::vector<mlir::AffineForOp> stores,
+  std::vector<mlir::Value>& buffers, mlir::AffineForOp compute_at, mlir::Operation* compute, 
+  mlir::gpu::BarrierOp prefix, mlir::gpu::BarrierOp suffix, int64_t stages) {
+  assert(loads.size() == stores.size() && loads.size() == buffers.size());
+  std::vector<std::vector<std::vector<mlir::AffineForOp>>> pipelines;
+  for (int i = 0; i < buffers.size(); i++) {
+    pipelines.push_back(pipeline({loads[i], stores[i]}, buffers[i], compute_at, stages));
+  }
+
+  /* prologue: loads of every buffer go ahead of the stores, stage by stage.*/
+  std::vector<mlir::AffineForOp> prologue;
+  for (int64_t stage = 0; stage < stages - 1; stage++) {
+    for (auto& item : pipelines) prologue.push_back(item[0][2 * stage]);
+    for (auto& item : pipelines) prologue.push_back(item[0][2 * stage + 1]);
+  }
+  for (auto op : prologue) op->moveBefore(compute_at);
+  prefix->moveBefore(compute_at);
+
+  /* main loop: issue the loads first, and store them after `compute` to hide the latency.*/
+  auto loadIf = mlir::dyn_cast<mlir::AffineIfOp>(pipelines[0][1][0]->getParentOp());
+  mlir::OpBuilder builder(compute->getContext());
+  builder.setInsertionPointAfter(compute);
+  auto storeIf = builder.create<mlir::AffineIfOp>(builder.getUnknownLoc(), loadIf.getIntegerSet(), 
+                                                  loadIf.getOperands(), /*withElseRegion=*/false);
+  std::vector<mlir::AffineForOp> body;
+  for (auto& item : pipelines) {
+    item[1][0]->moveBefore(loadIf.getThenBlock()->getTerminator());
+    body.push_back(item[1][0]);
+  }
+  for (auto& item : pipelines) {
+    auto ifOp = item[1][1]->getParentOp();
+    item[1][1]->moveBefore(storeIf.getThenBlock()->getTerminator());
+    body.push_back(item[1][1]);
+    if (ifOp != loadIf) ifOp->erase();
+  }
+  suffix->moveBefore(storeIf.getThenBlock()->getTerminator());
+
+  return {prologue, body};
+}
+
+mlir::AffineForOp Rewriter::async_copy(mlir::AffineForOp load, mlir::AffineForOp store) {
+  mlir::AffineVectorLoadOp globalLoad;
+  mlir::AffineVectorStoreOp regStore;
+  load.walk([&](mlir::AffineVectorLoadOp op) { globalLoad = op; });
+  load.walk([&](mlir::AffineVectorStoreOp op) { regStore = op; });
+  assert(globalLoad && regStore);
+  assert(load.getConstantUpperBound() == store.getConstantUpperBound());
+  auto reg = regStore.getMemref();
+  auto srcType = globalLoad.getMemref().getType().dyn_cast<mlir::MemRefType>();
+  assert(srcType.getMemorySpaceAsInt() == static_cast<int>(MemorySpace::global));
+
+  store.walk([&](mlir::AffineVectorLoadOp regLoad) {
+    if (regLoad.getMemref() != reg) return;
+    // reg[iv * width (+ lane)] is loaded by the iteration `iv` of `load`, 
+    // so read the same element from src directly. loop iterator is the last operand.
+    auto regOperands = regLoad.getMapOperands();
+    llvm::SmallVector<mlir::Value> operands(globalLoad.getMapOperands());
+    operands.back() = regOperands[0];
+    auto oldMap = globalLoad.getAffineMap();
+    llvm::SmallVector<mlir::AffineExpr> exprs;
+    for (auto expr : oldMap.getResults()) exprs.push_back(expr);
+    int dimCount = oldMap.getNumDims();
+    if (regOperands.size() == 2) {
+      operands.push_back(regOperands[1]);
+      exprs.back() = exprs.back() + mlir::getAffineDimExpr(dimCount, load->getContext());
+      dimCount += 1;
+    }
+    auto map = mlir::AffineMap::get(/*dimCount*/dimCount, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), load->getContext());
+
+    mlir::OpBuilder builder(regLoad);
+    auto ld = builder.create<mlir::AffineVectorLoadOp>(builder.getUnknownLoc(), regLoad.getVectorType(), 
+                                                       globalLoad.getMemref(), map, operands);
+    regLoad.getResult().replaceAllUsesWith(ld.getResult());
+    for (auto user : ld.getResult().getUsers()) {
+      user->setAttr(std::string("async.copy"), builder.getUnitAttr());
+    }
+    regLoad.erase();
+  });
+
+  store->moveBefore(load);
+  load.erase();
+  if (reg.use_empty()) reg.getDefiningOp()->erase();
+  return store;
+}
+
+std::vector<std::vector<mlir::AffineForOp>> Rewriter::async_pipeline(std::vector<mlir::AffineForOp> copies,
+  std::vector<mlir::Value>& buffers, mlir::AffineForOp compute_at, mlir::Operation* compute, 
+  mlir::gpu::BarrierOp prefix, mlir::gpu::BarrierOp suffix, int64_t stages) {
+  assert(copies.size() == buffers.size());
+  std::vector<std::vector<std::vector<mlir::AffineForOp>>> pipelines;
+  for (int i = 0; i < buffers.size(); i++) {
+    pipelines.push_back(pipeline({copies[i]}, buffers[i], compute_at, stages));
+  }
+  mlir::OpBuilder builder(compute->getContext());
+
+  /* prologue: the copies of all stages are committed as one group, wait for them before the loop.*/
+  std::vector<mlir::AffineForOp> prologue;
+  for (int64_t stage = 0; stage < stages - 1; stage++) {
+    for (auto& item : pipelines) prologue.push_back(item[0][stage]);
+  }
+  for (auto op : prologue) op->moveBefore(compute_at);
+  prefix->moveBefore(compute_at);
+  prefix->setAttr(std::string("async.wait"), builder.getI64IntegerAttr(0));
+
+  /* main loop: the copies of tile iv + stages - 1 are issued first and committed after `compute`, 
+     then wait until the tile of the next iteration is landed, so `stages - 2` groups are still in flight.*/
+  auto copyIf = mlir::dyn_cast<mlir::AffineIfOp>(pipelines[0][1][0]->getParentOp());
+  std::vector<mlir::AffineForOp> body;
+  for (auto& item : pipelines) {
+    auto ifOp = item[1][0]->getParentOp();
+    item[1][0]->moveBefore(copyIf.getThenBlock()->getTerminator());
+    body.push_back(item[1][0]);
+    if (ifOp != copyIf) ifOp->erase();
+  }
+  suffix->moveAfter(compute);
+  suffix->setAttr(std::string("async.wait"), builder.getI64IntegerAttr(stages - 2));
+
+  return {prologue, body};
+}
+
+mlir::AffineIfOp Rewriter::warp_specialize(mlir::AffineParallelOp blockLevel, mlir::AffineForOp compute_at, 
+  std::vector<mlir::AffineForOp> copies, std::vector<mlir::Value>& buffers, mlir::gpu::BarrierOp prefix, 
+  mlir::gpu::BarrierOp suffix, int64_t stages, int64_t producerWarps, int64_t warpSize, bool async) {
+  // named barrier 0 is __syncthreads, 16 barriers per block.
+  assert(stages >= 2 && 2 * stages < 16);
+  int64_t blockThreads;
+  auto blockDims = Analyzer::getParallelNumber(blockLevel, blockThreads);
+  assert(blockDims.size() == 2);
+  auto producerThreads = producerWarps * warpSize;
+  // every warp has one role.
+  assert(blockThreads % warpSize == 0 && producerThreads % blockDims[1] == 0);
+  assert(blockThreads % producerThreads == 0);
+  auto barrierThreads = blockThreads + producerThreads;
+
+  auto step = compute_at.getStep();
+  auto lb = compute_at.getConstantLowerBound();
+  auto ub = compute_at.getConstantUpperBound();
+  auto kIv = compute_at.getInductionVar();
+  auto context = compute_at->getContext();
+  mlir::OpBuilder builder(context);
+
+  /* step1: ring of `stages` buffers, iteration k uses the stage ((k - lb) / step) % stages.*/
+  for (auto& buffer : buffers) {
+    auto bufferType = buffer.getType().dyn_cast<mlir::MemRefType>();
+    mlir::SmallVector<int64_t> shape{stages};
+    for (auto dim : bufferType.getShape()) shape.push_back(dim);
+    auto ringType = mlir::MemRefType::get(shape, bufferType.getElementType(), {}, bufferType.getMemorySpaceAsInt());
+    auto defineBufferOp = buffer.getDefiningOp();
+    builder.setInsertionPoint(defineBufferOp);
+    auto ring = builder.create<mlir::memref::AllocOp>(builder.getUnknownLoc(), ringType).getResult();
+
+    auto stageMap = [&](mlir::AffineMap map, mlir::ValueRange oldOperands, llvm::SmallVector<mlir::Value>& operands) {
+      operands.assign(oldOperands.begin(), oldOperands.end());
+      operands.push_back(kIv);
+      auto k = builder.getAffineDimExpr(map.getNumDims());
+      llvm::SmallVector<mlir::AffineExpr> exprs{(k - lb).floorDiv(step) % stages};
+      exprs.append(map.getResults().begin(), map.getResults().end());
+      return mlir::AffineMap::get(map.getNumDims() + 1, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), context);
+    };
+    std::vector<mlir::Operation*> users(buffer.getUsers().begin(), buffer.getUsers().end());
+    for (auto user : users) {
+      assert(compute_at->isAncestor(user));
+      builder.setInsertionPoint(user);
+      llvm::SmallVector<mlir::Value> operands;
+      if (auto load = mlir::dyn_cast<mlir::AffineVectorLoadOp>(user)) {
+        auto map = stageMap(load.getAffineMap(), load.getMapOperands(), operands);
+        auto newLoad = builder.create<mlir::AffineVectorLoadOp>(builder.getUnknownLoc(), load.getVectorType(), ring, map, operands);
+        load.getResult().replaceAllUsesWith(newLoad.getResult());
+      } else if (auto store = mlir::dyn_cast<mlir::AffineVectorStoreOp>(user)) {
+        auto map = stageMap(store.getAffineMap(), store.getMapOperands(), operands);
+        auto newStore = builder.create<mlir::AffineVectorStoreOp>(builder.getUnknownLoc(), store.getValue(), ring, map, operands);
+        inheritAttrs(store, newStore);
+      } else if (auto load = mlir::dyn_cast<mlir::AffineLoadOp>(user)) {
+        auto map = stageMap(load.getAffineMap(), load.getMapOperands(), operands);
+        auto newLoad = builder.create<mlir::AffineLoadOp>(builder.getUnknownLoc(), ring, map, operands);
+        load.getResult().replaceAllUsesWith(newLoad.getResult());
+      } else if (auto store = mlir::dyn_cast<mlir::AffineStoreOp>(user)) {
+        auto map = stageMap(store.getAffineMap(), store.getMapOperands(), operands);
+        auto newStore = builder.create<mlir::AffineStoreOp>(builder.getUnknownLoc(), store.getValue(), ring, map, operands);
+        inheritAttrs(store, newStore);
+      } else {
+        assert(false);
+      }
+      user->erase();
+    }
+    defineBufferOp->erase();
+    buffer = ring;
+  }
+
+  /* step2: the producer warps are the rows appended after the consumer rows.*/
+  auto consumerRows = blockDims[0];
+  blockDims[0] += producerThreads / blockDims[1];
+  llvm::SmallVector<mlir::AffineExpr> ubExprs;
+  for (auto dim : blockDims) ubExprs.push_back(builder.getAffineConstantExpr(dim));
+  blockLevel.setUpperBounds(mlir::ValueRange(), 
+    mlir::AffineMap::get(0, 0, llvm::ArrayRef<mlir::AffineExpr>(ubExprs), context));
+  auto threadIdx = blockLevel.getIVs();
+  auto ty = threadIdx[0], tx = threadIdx[1];
+
+  prefix.erase();
+  suffix.erase();
+  auto body = blockLevel.getBody();
+  std::vector<mlir::Operation*> ops;
+  for (auto& op : body->getOperations()) {
+    // declarations are shared by both roles.
+    if (mlir::isa<mlir::memref::AllocOp, mlir::arith::ConstantOp, mlir::AffineYieldOp>(op)) continue;
+    ops.push_back(&op);
+  }
+  builder.setInsertionPoint(body->getTerminator());
+  llvm::SmallVector<mlir::AffineExpr> roleExprs{builder.getAffineDimExpr(0) - consumerRows};
+  llvm::SmallVector<bool> roleFlags{false};
+  auto roleSet = mlir::IntegerSet::get(1, 0, llvm::ArrayRef<mlir::AffineExpr>(roleExprs), llvm::ArrayRef<bool>(roleFlags));
+  auto roleIf = builder.create<mlir::AffineIfOp>(builder.getUnknownLoc(), roleSet, mlir::ValueRange({ty}), true);
+  for (auto op : ops) {
+    op->moveBefore(roleIf.getElseBlock()->getTerminator());
+  }
+
+  // barrier `base + stage of k`, the stage is selected by affine.if, so the barrier id is a constant.
+  auto namedBarrier = [&](mlir::Value k, int64_t base, bool arrive, bool wait) {
+    for (int64_t stage = 0; stage < stages; stage++) {
+      auto dim0 = builder.getAffineDimExpr(0);
+      llvm::SmallVector<mlir::AffineExpr> exprs{(dim0 - lb).floorDiv(step) % stages - stage};
+      llvm::SmallVector<bool> eqFlags{true};
+      auto set = mlir::IntegerSet::get(1, 0, llvm::ArrayRef<mlir::AffineExpr>(exprs), llvm::ArrayRef<bool>(eqFlags));
+      auto ifOp = builder.create<mlir::AffineIfOp>(builder.getUnknownLoc(), set, mlir::ValueRange({k}), false);
+      ifOp->setAttr(std::string("barrier.stage"), builder.getUnitAttr());
+      mlir::OpBuilder::InsertionGuard guard(builder);
+      builder.setInsertionPointToStart(ifOp.getThenBlock());
+      auto barrierOp = builder.create<mlir::gpu::BarrierOp>(builder.getUnknownLoc());
+      barrierOp->setAttr(std::string("barrier.id"), builder.getI64IntegerAttr(base + stage));
+      barrierOp->setAttr(std::string("barrier.count"), builder.getI64IntegerAttr(barrierThreads));
+      if (arrive) barrierOp->setAttr(std::string("barrier.arrive"), builder.getUnitAttr());
+      if (wait) barrierOp->setAttr(std::string("async.wait"), builder.getI64IntegerAttr(0));
+    }
+  };
+  const int64_t fullBase = 1, emptyBase = 1 + stages;
+
+  /* step3: producers copy the tiles of all consumer threads, (producerThreads) threads at a time.*/
+  builder.setInsertionPointToStart(roleIf.getThenBlock());
+  auto producerLoop = builder.create<mlir::AffineForOp>(builder.getUnknownLoc(), lb, ub, step);
+  auto pk = producerLoop.getInductionVar();
+  builder.setInsertionPointToStart(producerLoop.getBody());
+  // the first `stages` tiles have free buffers.
+  llvm::SmallVector<mlir::AffineExpr> emptyExprs{builder.getAffineDimExpr(0) - (lb + stages * step)};
+  llvm::SmallVector<bool> emptyFlags{false};
+  auto emptySet = mlir::IntegerSet::get(1, 0, llvm::ArrayRef<mlir::AffineExpr>(emptyExprs), llvm::ArrayRef<bool>(emptyFlags));
+  auto emptyIf = builder.create<mlir::AffineIfOp>(builder.getUnknownLoc(), emptySet, mlir::ValueRange({pk}), false);
+  auto repeat = builder.create<mlir::AffineForOp>(builder.getUnknownLoc(), 0, blockThreads / producerThreads, 1);
+  namedBarrier(pk, fullBase, /*arrive*/true, /*wait*/async);
+  builder.setInsertionPointToStart(emptyIf.getThenBlock());
+  namedBarrier(pk, emptyBase, /*arrive*/false, /*wait*/false);
+
+  // tid = (ty - consumerRows) * blockDim.x + tx + r * producerThreads
+  builder.setInsertionPointToStart(repeat.getBody());
+  auto tid = (builder.getAffineDimExpr(0) - consumerRows) * blockDims[1] + builder.getAffineDimExpr(1) + 
+             builder.getAffineDimExpr(2) * producerThreads;
+  auto yMap = mlir::AffineMap::get(3, 0, llvm::ArrayRef<mlir::AffineExpr>(tid.floorDiv(blockDims[1])), context);
+  auto xMap = mlir::AffineMap::get(3, 0, llvm::ArrayRef<mlir::AffineExpr>(tid % blockDims[1]), context);
+  auto vy = builder.create<mlir::AffineApplyOp>(builder.getUnknownLoc(), yMap, mlir::ValueRange({ty, tx, repeat.getInductionVar()}));
+  auto vx = builder.create<mlir::AffineApplyOp>(builder.getUnknownLoc(), xMap, mlir::ValueRange({ty, tx, repeat.getInductionVar()}));
+  for (auto copy : copies) {
+    copy->moveBefore(repeat.getBody()->getTerminator());
+  }
+  repeat.walk([&](mlir::Operation* op) {
+    if (op == vy.getOperation() || op == vx.getOperation()) return;
+    op->replaceUsesOfWith(ty, vy.getResult());
+    op->replaceUsesOfWith(tx, vx.getResult());
+    op->replaceUsesOfWith(kIv, pk);
+  });
+
+  /* step4: consumers wait for the tile, and release it after the compute.*/
+  builder.setInsertionPointToStart(compute_at.getBody());
+  namedBarrier(kIv, fullBase, /*arrive*/false, /*wait*/false);
+  // no producer waits for the last `stages` tiles.
+  builder.setInsertionPoint(compute_at.getBody()->getTerminator());
+  llvm::SmallVector<mlir::AffineExpr> releaseExprs{ub - stages * step - 1 - builder.getAffineDimExpr(0)};
+  llvm::SmallVector<bool> releaseFlags{false};
+  auto releaseSet = mlir::IntegerSet::get(1, 0, llvm::ArrayRef<mlir::AffineExpr>(releaseExprs), llvm::ArrayRef<bool>(releaseFlags));
+  auto releaseIf = builder.create<mlir::AffineIfOp>(builder.getUnknownLoc(), releaseSet, mlir::ValueRange({kIv}), false);
+  builder.setInsertionPointToStart(releaseIf.getThenBlock());
+  namedBarrier(kIv, emptyBase, /*arrive*/true, /*wait*/false);
+
+  return roleIf;
+}
+
 void Rewriter::detach_last_loop(mlir::AffineForOp forOp) {
   auto step = forOp.getStep();
   auto ub = forOp.getConstantUpperBound();
@@ -1347,269 +1926,548 @@ std::pair<bool, int64_t> getMinValue(mlir::Value value) {
   return result;
 }
 
-int64_t eval(mlir::AffineExpr expr, std::vector<int64_t> values) {
+/// @brief the range [min, max] of `expr` when every dim i is in [minValues[i], maxValues[i]].
+///        the divisors and moduli of an affine expr are positive constants, and one side of a mul is constant,
+///        so every kind is bounded by its operand bounds.
+std::pair<int64_t, int64_t> evalBounds(mlir::AffineExpr expr, const std::vector<int64_t>& maxValues, 
+                                       const std::vector<int64_t>& minValues) {
   if (auto dimExpr = expr.dyn_cast<mlir::AffineDimExpr>()) {
-    return values[dimExpr.getPosition()];
+    return {minValues[dimExpr.getPosition()], maxValues[dimExpr.getPosition()]};
   }
   if (auto constExpr = expr.dyn_cast<mlir::AffineConstantExpr>()) {
-    return constExpr.getValue();
+    return {constExpr.getValue(), constExpr.getValue()};
   }
   auto binaryExpr = expr.dyn_cast<mlir::AffineBinaryOpExpr>();
   assert(binaryExpr);
-  auto lhs = eval(binaryExpr.getLHS(), values);
-  auto rhs = eval(binaryExpr.getRHS(), values);
+  auto lhs = evalBounds(binaryExpr.getLHS(), maxValues, minValues);
+  auto rhs = evalBounds(binaryExpr.getRHS(), maxValues, minValues);
   switch (binaryExpr.getKind()) {
-    case mlir::AffineExprKind::Add: return lhs + rhs;
-    case mlir::AffineExprKind::CeilDiv: return (lhs + rhs - 1) / rhs;
-    case mlir::AffineExprKind::FloorDiv: return lhs / rhs;
-    case mlir::AffineExprKind::Mod: return lhs % rhs;
-    case mlir::AffineExprKind::Mul: return lhs * rhs;
+    case mlir::AffineExprKind::Add: return {lhs.first + rhs.first, lhs.second + rhs.second};
+    case mlir::AffineExprKind::Mul: {
+      auto products = {lhs.first * rhs.first, lhs.first * rhs.second, lhs.second * rhs.first, lhs.second * rhs.second};
+      return {std::min(products), std::max(products)};
+    }
+    case mlir::AffineExprKind::FloorDiv: return {mlir::floorDiv(lhs.first, rhs.first), mlir::floorDiv(lhs.second, rhs.first)};
+    case mlir::AffineExprKind::CeilDiv: return {mlir::ceilDiv(lhs.first, rhs.first), mlir::ceilDiv(lhs.second, rhs.first)};
+    case mlir::AffineExprKind::Mod: {
+      auto divisor = rhs.first;
+      // in one period the mod is monotonic, otherwise it may take any residue.
+      if (mlir::floorDiv(lhs.first, divisor) == mlir::floorDiv(lhs.second, divisor)) {
+        return {mlir::mod(lhs.first, divisor), mlir::mod(lhs.second, divisor)};
+      }
+      return {0, divisor - 1};
+    }
     default: assert(false);
   }
 }
 
-struct TakeOffTrueIf : 
-  public mlir::PassWrapper<TakeOffTrueIf, mlir::OperationPass<mlir::ModuleOp>> {
-   MLIR_DEFINE_EXPLICIT_INTERNAL_INLINE_TYPE_ID(TakeOffTrueIf)
-   TakeOffTrueIf() = default;
-   void runOnOperation() override {
-     auto module = getOperation();
-     module.walk<mlir::WalkOrder::PreOrder>([&](mlir::AffineIfOp ifOp) {
-      bool result = true;
-      auto iset = ifOp.getIntegerSet();
-      auto operands = ifOp->getOperands();
+/// @brief the bounds of every operand of `ifOp`, false if one of them isn't a constant or the iv of a loop with constant bounds.
+bool getOperandBounds(mlir::AffineIfOp ifOp, std::vector<int64_t>& maxValues, std::vector<int64_t>& minValues) {
+  for (auto operand : ifOp->getOperands()) {
+    auto forOp = mlir::getForInductionVarOwner(operand);
+    if (!operand.getDefiningOp<mlir::arith::ConstantIndexOp>() && !forOp) return false;
+    auto maxValue = getMaxValue(operand);
+    auto minValue = getMinValue(operand);
+    //can't deduction
+    if (!maxValue.first || !minValue.first) return false;
+    maxValues.push_back(maxValue.second);
+    minValues.push_back(minValue.second);
+  }
+  return true;
+}
 
-      int constraintNum = iset.getNumConstraints();
-      std::vector<int64_t> maxValues;
-      std::vector<int64_t> minValues;
+/// @brief moves the ops of `block` (but its yield) in front of `op`.
+void inlineBlockBefore(mlir::PatternRewriter& rewriter, mlir::Block* block, mlir::Operation* op) {
+  rewriter.eraseOp(block->getTerminator());
+  rewriter.mergeBlockBefore(block, op);
+}
 
-      for (auto operand : operands) {
-        auto maxValue = getMaxValue(operand);
-        if (maxValue.first) {
-          maxValues.push_back(maxValue.second);
-        } else {
-          //can't deduction
-          return;
-        }
-        auto minValue = getMinValue(operand);
-        if (minValue.first) {
-          minValues.push_back(minValue.second);
-        } else {
-          //can't deduction
-          return;
-        }
-      }
-      for (int i = 0; i < constraintNum; i++) {
-        auto expr = iset.getConstraint(i);
-        auto isEq = iset.isEq(i);
-        if (isEq) {
-          if (eval(expr, maxValues) != 0 | eval(expr, minValues) != 0) {
-            result = false;
-            break;
-          }
-        } else {
-          if (eval(expr, maxValues) < 0 | eval(expr, minValues) < 0) {
-            result = false;
-            break;
-          }
-        }
+struct TakeOffTrueIf : public mlir::OpRewritePattern<mlir::AffineIfOp> {
+  using mlir::OpRewritePattern<mlir::AffineIfOp>::OpRewritePattern;
+
+  mlir::LogicalResult matchAndRewrite(mlir::AffineIfOp ifOp, mlir::PatternRewriter& rewriter) const override {
+    // the stage selectors are periodic, the bounds of the operands say nothing.
+    if (ifOp->hasAttr(std::string("barrier.stage"))) return mlir::failure();
+    std::vector<int64_t> maxValues;
+    std::vector<int64_t> minValues;
+    if (!getOperandBounds(ifOp, maxValues, minValues)) return mlir::failure();
+
+    // true if every constraint holds over the whole range of its operands.
+    auto iset = ifOp.getIntegerSet();
+    for (int i = 0; i < iset.getNumConstraints(); i++) {
+      auto bounds = evalBounds(iset.getConstraint(i), maxValues, minValues);
+      if (iset.isEq(i)) {
+        if (bounds.first != 0 || bounds.second != 0) return mlir::failure();
+      } else {
+        if (bounds.first < 0) return mlir::failure();
       }
-      if (result) {
-        ifOp.getBody()->getOperations().back().erase();
-        ifOp->getBlock()->getOperations().splice(
-          mlir::Block::iterator(ifOp),
-          ifOp.getBody()->getOperations());
-        ifOp.erase();
+    }
+    inlineBlockBefore(rewriter, ifOp.getThenBlock(), ifOp);
+    rewriter.eraseOp(ifOp);
+    return mlir::success();
+  }
+};
+
+struct DeleteFalseIf : public mlir::OpRewritePattern<mlir::AffineIfOp> {
+  using mlir::OpRewritePattern<mlir::AffineIfOp>::OpRewritePattern;
+
+  mlir::LogicalResult matchAndRewrite(mlir::AffineIfOp ifOp, mlir::PatternRewriter& rewriter) const override {
+    if (ifOp->hasAttr(std::string("barrier.stage"))) return mlir::failure();
+    std::vector<int64_t> maxValues;
+    std::vector<int64_t> minValues;
+    if (!getOperandBounds(ifOp, maxValues, minValues)) return mlir::failure();
+
+    // false if one constraint fails over the whole range of its operands.
+    auto iset = ifOp.getIntegerSet();
+    bool alwaysFalse = false;
+    for (int i = 0; i < iset.getNumConstraints(); i++) {
+      auto bounds = evalBounds(iset.getConstraint(i), maxValues, minValues);
+      if (iset.isEq(i)) {
+        if (bounds.first > 0 || bounds.second < 0) alwaysFalse = true;
+      } else {
+        if (bounds.second < 0) alwaysFalse = true;
       }
-     });
-   }
+    }
+    if (!alwaysFalse) return mlir::failure();
+    // the versioned tails keep their else body.
+    if (ifOp.hasElse()) {
+      inlineBlockBefore(rewriter, ifOp.getElseBlock(), ifOp);
+    }
+    // delete the entile body of if operaiton.
+    rewriter.eraseOp(ifOp);
+    return mlir::success();
+  }
 };
 
-std::unique_ptr<mlir::OperationPass<mlir::ModuleOp>> 
-TakeOffTrueIfPass() {
-  return std::make_unique<TakeOffTrueIf>();
-}
+void Rewriter::simplify_if(mlir::Operation* scope) {
+  std::vector<mlir::Operation*> ifOps;
+  scope->walk<mlir::WalkOrder::PreOrder>([&](mlir::AffineIfOp ifOp) {
+    ifOps.push_back(ifOp);
+  });
+  if (ifOps.empty()) return;
 
-void Rewriter::take_off_true_if(mlir::ModuleOp module) {
-  mlir::PassManager pm(module.getContext());
-  pm.addPass(TakeOffTrueIfPass());
-  if (mlir::failed(pm.run(module))) {
-    llvm::errs() << "Take off the true if failed.";
-  }
-  return;
+  mlir::RewritePatternSet patterns(scope->getContext());
+  patterns.add<TakeOffTrueIf, DeleteFalseIf>(scope->getContext());
+  // strict: only the ifs are rewritten, the driver doesn't fold or move the constants out of the kernels.
+  // the result only tells whether an if was rewritten, none being constant is not an error.
+  (void)mlir::applyOpPatternsAndFold(ifOps, std::move(patterns), /*strict*/true);
 }
 
-struct DeleteFalseIf : 
-  public mlir::PassWrapper<DeleteFalseIf, mlir::OperationPass<mlir::ModuleOp>> {
-   MLIR_DEFINE_EXPLICIT_INTERNAL_INLINE_TYPE_ID(DeleteFalseIf)
-   DeleteFalseIf() = default;
-   void runOnOperation() override {
-     auto module = getOperation();
-     module.walk<mlir::WalkOrder::PreOrder>([&](mlir::AffineIfOp ifOp) {
-      auto iset = ifOp.getIntegerSet();
-      auto operands = ifOp->getOperands();
+void Rewriter::unroll(mlir::Operation* scope, mlir::function_ref<bool(mlir::AffineForOp)> unrollCheckFn) {
+  scope->walk<mlir::WalkOrder::PostOrder>([&](mlir::AffineForOp forOp) {
+    if (!unrollCheckFn(forOp)) return;
+    // the backend emits the whole mma loop as one instruction.
+    for (auto parent = forOp; parent; parent = parent->getParentOfType<mlir::AffineForOp>()) {
+      if (parent->getAttr("affine.mma")) return;
+    }
 
-      int constraintNum = iset.getNumConstraints();
-      std::vector<int64_t> maxValues;
-      std::vector<int64_t> minValues;
+    auto rootLoop = findRootLoop(forOp);
+    auto& allOps = rootLoop->getBlock()->getOperations();
 
-      for (auto operand : operands) {
-        auto maxValue = getMaxValue(operand);
-        if (maxValue.first) {
-          maxValues.push_back(maxValue.second);
-        } else {
-          //can't deduction
-          return;
-        }
-        auto minValue = getMinValue(operand);
-        if (minValue.first) {
-          minValues.push_back(minValue.second);
-        } else {
-          //can't deduction
-          return;
+    auto findConstValue = [&](int64_t value)->mlir::Value {
+      auto curIter = allOps.begin();
+      while (true) {
+        auto constOp = mlir::dyn_cast<mlir::arith::ConstantIndexOp>(*curIter);
+        if (!constOp) break;
+        if (value == constOp.value()) {
+          return constOp.getResult();
         }
+        curIter++;
       }
-      int64_t count = 0;
-      for (int i = 0; i < constraintNum; i++) {
-        auto expr = iset.getConstraint(i);
-        auto isEq = iset.isEq(i);
-        ///TODO:need to verify all the case of all inputs.
-        if (isEq) {
-          if (eval(expr, maxValues) != 0 && eval(expr, minValues) != 0) {
-            count += 1;
-          }
-        } else {
-          if (eval(expr, maxValues) < 0 && eval(expr, minValues) < 0) {
-            count += 1;
+      return nullptr;
+    };
+
+    mlir::OpBuilder builder(forOp);
+
+    for (auto index = forOp.getConstantLowerBound(); index < forOp.getConstantUpperBound(); index += forOp.getStep()) {
+      auto iterVarReplace = findConstValue(index);
+      if (!iterVarReplace) {
+        auto constOp = builder.create<mlir::arith::ConstantIndexOp>(builder.getUnknownLoc(), index);
+        constOp->moveBefore(&(rootLoop->getBlock()->getOperations().front()));
+        iterVarReplace = constOp.getResult();
+      }
+      mlir::BlockAndValueMapping mapper;
+      auto cloned = builder.clone(*forOp, mapper);
+      auto clonedForOp = mlir::dyn_cast<mlir::AffineForOp>(cloned);
+      clonedForOp.getBody()->getOperations().back().erase();
+      clonedForOp.walk<mlir::WalkOrder::PreOrder>([&](mlir::Operation* op) {
+        auto oldOperands = op->getOperands();
+        llvm::SmallVector<mlir::Value> operands;
+        for (auto operand : oldOperands) {
+          if (operand == clonedForOp.getInductionVar()) {
+            operands.push_back(iterVarReplace);
+          } else {
+            operands.push_back(operand);
           }
         }
-      }
-      if (count == constraintNum) {
-        // delete the entile body of if operaiton.
-        ifOp.erase();
-      }
-     });
-   }
-};
+        op->setOperands(operands);
+      });
+      clonedForOp->getBlock()->getOperations().splice(
+        mlir::Block::iterator(clonedForOp),
+        clonedForOp.getBody()->getOperations());
+      clonedForOp.erase();
+    }
+    forOp.erase();
+  });
+}
 
-std::unique_ptr<mlir::OperationPass<mlir::ModuleOp>> 
-DeleteFalseIfPass() {
-  return std::make_unique<DeleteFalseIf>();
+void Rewriter::unrollAttribute(mlir::Operation* scope, mlir::function_ref<bool(mlir::AffineForOp)> unrollCheckFn) {
+  mlir::OpBuilder builder(scope->getContext());
+  scope->walk<mlir::WalkOrder::PostOrder>([&](mlir::AffineForOp forOp) {
+    if (!unrollCheckFn(forOp)) return;
+    forOp->setAttr(std::string("affine.loop"), builder.getStringAttr("unroll"));
+  });
 }
 
-void Rewriter::delete_false_if(mlir::ModuleOp module) {
-  mlir::PassManager pm(module.getContext());
-  pm.addPass(DeleteFalseIfPass());
-  if (mlir::failed(pm.run(module))) {
-    llvm::errs() << "Delete false if failed.";
+int Rewriter::deduplicate_kernels(mlir::ModuleOp module) {
+  // hash -> unique funcs seen so far (with their keys, to resolve hash collisions).
+  std::map<size_t, std::vector<std::pair<mlir::func::FuncOp, std::string>>> uniqueFuncs;
+  // duplicated func name -> the name of the func replacing it.
+  std::map<std::string, std::string> replaceNames;
+  std::vector<mlir::func::FuncOp> duplicates;
+
+  auto funcOps = Analyzer::collectFunctions(module);
+  for (auto funcOp : funcOps) {
+    if (funcOp.isDeclaration()) continue;
+    auto key = Analyzer::getStructuralKey(funcOp);
+    auto& bucket = uniqueFuncs[llvm::hash_value(key)];
+    bool found = false;
+    for (auto& item : bucket) {
+      if (item.second == key) {
+        replaceNames[funcOp.getSymName().str()] = item.first.getSymName().str();
+        duplicates.push_back(funcOp);
+        found = true;
+        break;
+      }
+    }
+    if (!found) bucket.push_back(std::make_pair(funcOp, std::move(key)));
+  }
+  if (duplicates.size() == 0) return 0;
+
+  auto callOps = Analyzer::collectFuncCalls(module);
+  for (auto callOp : callOps) {
+    auto callee = callOp.getCallee().str();
+    if (replaceNames.count(callee) == 0) continue;
+    callOp.setCalleeAttr(mlir::FlatSymbolRefAttr::get(module.getContext(), replaceNames[callee]));
   }
-  return;
+  for (auto funcOp : duplicates) {
+    funcOp.erase();
+  }
+  return duplicates.size();
 }
 
-struct UnrollAffineFor : public mlir::PassWrapper<UnrollAffineFor, mlir::OperationPass<mlir::ModuleOp>> {
-   MLIR_DEFINE_EXPLICIT_INTERNAL_INLINE_TYPE_ID(UnrollAffineFor)
-   UnrollAffineFor(mlir::function_ref<bool(mlir::AffineForOp)> unrollCheckFn_ = nullptr) : unrollCheckFn(unrollCheckFn_) {};
-   void runOnOperation() override {
+int Rewriter::fast_math(mlir::ModuleOp module) {
+  bool graphLevel = module->hasAttr(std::string("compute_dag.fast_math"));
+  int rewriteNum = 0;
+  auto funcOps = Analyzer::collectFunctions(module);
+  for (auto funcOp : funcOps) {
+    if (funcOp.isDeclaration()) continue;
+    if (!graphLevel && !funcOp->hasAttr(std::string("func.fast_math"))) continue;
+
+    // x / sqrt(y) -> x * rsqrt(y), one rsqrt per sqrt.
+    std::vector<mlir::arith::DivFOp> divOps;
+    funcOp.walk([&](mlir::arith::DivFOp divOp) { divOps.push_back(divOp); });
+    std::map<mlir::Operation*, mlir::Value> rsqrts;
+    for (auto divOp : divOps) {
+      auto sqrtOp = divOp.getRhs().getDefiningOp<mlir::math::SqrtOp>();
+      if (!sqrtOp) continue;
+      if (rsqrts.count(sqrtOp) == 0) {
+        mlir::OpBuilder builder(sqrtOp);
+        builder.setInsertionPointAfter(sqrtOp);
+        rsqrts[sqrtOp] = builder.create<mlir::math::RsqrtOp>(sqrtOp.getLoc(), sqrtOp.getOperand());
+      }
+      mlir::OpBuilder builder(divOp);
+      auto mulOp = builder.create<mlir::arith::MulFOp>(divOp.getLoc(), divOp.getLhs(), rsqrts[sqrtOp]);
+      divOp.getResult().replaceAllUsesWith(mulOp.getResult());
+      divOp.erase();
+      if (sqrtOp.getResult().use_empty()) sqrtOp.erase();
+      rewriteNum += 1;
+    }
 
-     auto module = getOperation();
-     module.walk<mlir::WalkOrder::PostOrder>([&](mlir::AffineForOp forOp) {
-      if (!unrollCheckFn(forOp)) return;
+    // a * b + c -> fma(a, b, c), when the product has no other user.
+    std::vector<mlir::arith::AddFOp> addOps;
+    funcOp.walk([&](mlir::arith::AddFOp addOp) { addOps.push_back(addOp); });
+    for (auto addOp : addOps) {
+      auto type = addOp.getType();
+      if (!type.isF32() && !type.isF64()) continue;
+      for (int i = 0; i < 2; i++) {
+        auto mulOp = addOp->getOperand(i).getDefiningOp<mlir::arith::MulFOp>();
+        if (!mulOp || !mulOp->hasOneUse() || mulOp->getBlock() != addOp->getBlock()) continue;
+        mlir::OpBuilder builder(addOp);
+        auto fmaOp = builder.create<mlir::math::FmaOp>(addOp.getLoc(), mulOp.getLhs(), mulOp.getRhs(), addOp->getOperand(1 - i));
+        addOp.getResult().replaceAllUsesWith(fmaOp.getResult());
+        addOp.erase();
+        mulOp.erase();
+        rewriteNum += 1;
+        break;
+      }
+    }
 
-      auto rootLoop = findRootLoop(forOp);
-      auto& allOps = rootLoop->getBlock()->getOperations();
+    // the backend emits the intrinsics for the tagged ops.
+    funcOp.walk([&](mlir::Operation* op) {
+      if (!mlir::isa<mlir::math::ExpOp, mlir::math::TanhOp, mlir::math::LogOp, mlir::math::PowFOp, mlir::arith::DivFOp>(op)) return;
+      if (!op->getResult(0).getType().isF32()) return;
+      op->setAttr(std::string("fast.math"), mlir::UnitAttr::get(op->getContext()));
+      rewriteNum += 1;
+    });
+  }
+  return rewriteNum;
+}
 
-      auto findConstValue = [&](int64_t value)->mlir::Value {
-        auto curIter = allOps.begin();
-        while (true) {
-          auto constOp = mlir::dyn_cast<mlir::arith::ConstantIndexOp>(*curIter);
-          if (!constOp) break;
-          if (value == constOp.value()) {
-            return constOp.getResult();
-          }
-          curIter++;
-        }
-        return nullptr;
-      };
+void Rewriter::set_phase(mlir::Operation* op, Phase phase) {
+  mlir::OpBuilder builder(op->getContext());
+  op->walk([&](mlir::Operation* nestedOp) {
+    nestedOp->setAttr(std::string("profile.phase"), builder.getI64IntegerAttr(static_cast<int64_t>(phase)));
+  });
+}
 
-      mlir::OpBuilder builder(forOp);
+/// @brief the phases of the ops nested in `op` (itself included), one bit per phase.
+unsigned phaseMask(mlir::Operation* op) {
+  auto bit = [](Phase phase) { return 1u << static_cast<int>(phase); };
+  auto memorySpace = [](mlir::Value mem) {
+    return static_cast<MemorySpace>(mem.getType().dyn_cast<mlir::MemRefType>().getMemorySpaceAsInt());
+  };
+  auto loadedFrom = [&](mlir::Value value) -> llvm::Optional<MemorySpace> {
+    auto defOp = value.getDefiningOp();
+    if (auto loadOp = mlir::dyn_cast_or_null<mlir::AffineLoadOp>(defOp)) return memorySpace(loadOp.getMemref());
+    if (auto loadOp = mlir::dyn_cast_or_null<mlir::AffineVectorLoadOp>(defOp)) return memorySpace(loadOp.getMemref());
+    if (auto loadOp = mlir::dyn_cast_or_null<mlir::memref::LoadOp>(defOp)) return memorySpace(loadOp.getMemref());
+    return llvm::None;
+  };
+  auto storeMask = [&](mlir::Value value, mlir::Value mem) {
+    switch (memorySpace(mem)) {
+      case MemorySpace::shared: return bit(Phase::stage);
+      case MemorySpace::local: {
+        // a copy into registers stages a tile (from global) or loads a fragment (from shared).
+        auto from = loadedFrom(value);
+        if (from == MemorySpace::global) return bit(Phase::stage);
+        if (from == MemorySpace::shared) return bit(Phase::compute);
+        return 0u;
+      }
+      default: return bit(Phase::epilogue);
+    }
+  };
 
-      for (auto index = forOp.getConstantLowerBound(); index < forOp.getConstantUpperBound(); index += forOp.getStep()) {
-        auto iterVarReplace = findConstValue(index);
-        if (!iterVarReplace) {
-          auto constOp = builder.create<mlir::arith::ConstantIndexOp>(builder.getUnknownLoc(), index);
-          constOp->moveBefore(&(rootLoop->getBlock()->getOperations().front()));
-          iterVarReplace = constOp.getResult();
-        }
-        mlir::BlockAndValueMapping mapper;
-        auto cloned = builder.clone(*forOp, mapper);
-        auto clonedForOp = mlir::dyn_cast<mlir::AffineForOp>(cloned);
-        clonedForOp.getBody()->getOperations().back().erase();
-        clonedForOp.walk<mlir::WalkOrder::PreOrder>([&](mlir::Operation* op) {
-          auto oldOperands = op->getOperands();
-          llvm::SmallVector<mlir::Value> operands;
-          for (auto operand : oldOperands) {
-            if (operand == clonedForOp.getInductionVar()) {
-              operands.push_back(iterVarReplace);
-            } else {
-              operands.push_back(operand);
-            }
-          }
-          op->setOperands(operands);
-        });
-        clonedForOp->getBlock()->getOperations().splice(
-          mlir::Block::iterator(clonedForOp),
-          clonedForOp.getBody()->getOperations());
-        clonedForOp.erase();
+  if (auto phase = op->getAttrOfType<mlir::IntegerAttr>(std::string("profile.phase"))) {
+    return 1u << phase.getInt();
+  }
+  if (mlir::isa<mlir::gpu::BarrierOp>(op)) return bit(Phase::barrier);
+  if (op->hasAttr(std::string("affine.mma"))) return bit(Phase::compute);
+  if (auto storeOp = mlir::dyn_cast<mlir::AffineStoreOp>(op)) return storeMask(storeOp.getValue(), storeOp.getMemref());
+  if (auto storeOp = mlir::dyn_cast<mlir::AffineVectorStoreOp>(op)) return storeMask(storeOp.getValue(), storeOp.getMemref());
+  if (auto storeOp = mlir::dyn_cast<mlir::memref::StoreOp>(op)) return storeMask(storeOp.getValue(), storeOp.getMemref());
+  if (mlir::isa<mlir::arith::AddFOp, mlir::arith::SubFOp, mlir::arith::MulFOp, mlir::arith::DivFOp, mlir::arith::MaxFOp,
+                mlir::arith::CmpFOp, mlir::math::FmaOp, mlir::math::ExpOp, mlir::math::LogOp, mlir::math::TanhOp,
+                mlir::math::SqrtOp, mlir::math::RsqrtOp, mlir::math::PowFOp, mlir::gpu::ShuffleOp>(op)) {
+    return bit(Phase::compute);
+  }
+  unsigned mask = 0;
+  for (auto& region : op->getRegions()) {
+    for (auto& nestedOp : region.getOps()) {
+      mask |= phaseMask(&nestedOp);
+    }
+  }
+  return mask;
+}
+
+/// @brief times the runs of single phase ops of `block`, the ops and loads between them belong to the run.
+int profileBlock(mlir::Block& block) {
+  int regions = 0;
+  int current = -1;
+  auto marker = [&](mlir::Operation* before, const std::string& attrName, mlir::Attribute attr) {
+    mlir::OpBuilder builder(before);
+    auto markerOp = builder.create<mlir::arith::ConstantIntOp>(builder.getUnknownLoc(), 0, 32);
+    markerOp->setAttr(attrName, attr);
+  };
+  auto close = [&](mlir::Operation* before) {
+    if (current < 0) return;
+    marker(before, "profile.end", mlir::OpBuilder(before).getI64IntegerAttr(current));
+    current = -1;
+  };
+  std::vector<mlir::Operation*> ops;
+  for (auto& op : block.getOperations()) ops.push_back(&op);
+  for (auto op : ops) {
+    if (op->hasTrait<mlir::OpTrait::IsTerminator>()) {
+      close(op);
+      continue;
+    }
+    auto mask = phaseMask(op);
+    if (mask == 0) continue;
+    if (llvm::isPowerOf2_32(mask)) {
+      int phase = llvm::Log2_32(mask);
+      if (phase == current) continue;
+      close(op);
+      marker(op, "profile.begin", mlir::UnitAttr::get(op->getContext()));
+      current = phase;
+      regions += 1;
+      continue;
+    }
+    close(op);
+    for (auto& region : op->getRegions()) {
+      for (auto& nestedBlock : region.getBlocks()) {
+        regions += profileBlock(nestedBlock);
       }
-      forOp.erase();
-     });
-   }
-  mlir::function_ref<bool(mlir::AffineForOp)> unrollCheckFn;
-};
+    }
+  }
+  if (current >= 0) {
+    close(block.getTerminator());
+  }
+  return regions;
+}
 
-std::unique_ptr<mlir::OperationPass<mlir::ModuleOp>> UnrollAffineForPass(mlir::function_ref<bool(mlir::AffineForOp)> unrollCheckFn = nullptr) {
-  return std::make_unique<UnrollAffineFor>(unrollCheckFn);
+int Rewriter::profile_phases(mlir::ModuleOp module) {
+  int regions = 0;
+  for (auto funcOp : module.getOps<mlir::func::FuncOp>()) {
+    if (funcOp.isDeclaration()) continue;
+    for (auto kernel : funcOp.getBody().front().getOps<mlir::AffineParallelOp>()) {
+      regions += profileBlock(*kernel.getBody());
+    }
+  }
+  return regions;
 }
 
-void Rewriter::unroll(mlir::ModuleOp module, mlir::function_ref<bool(mlir::AffineForOp)> unrollCheckFn) {
+/// @brief value of an index which is a constant in the IR, through the affine.apply of constants.
+llvm::Optional<int64_t> getConstantIndex(mlir::Value value) {
+  if (auto constOp = value.getDefiningOp<mlir::arith::ConstantIndexOp>()) {
+    return constOp.value();
+  }
+  if (auto applyOp = value.getDefiningOp<mlir::AffineApplyOp>()) {
+    auto map = applyOp.getAffineMap();
+    if (map.getNumSymbols() != 0) return llvm::None;
+    llvm::SmallVector<mlir::AffineExpr> dims;
+    for (auto operand : applyOp.getMapOperands()) {
+      auto constIndex = getConstantIndex(operand);
+      if (!constIndex.hasValue()) return llvm::None;
+      dims.push_back(mlir::getAffineConstantExpr(constIndex.getValue(), value.getContext()));
+    }
+    auto expr = mlir::simplifyAffineExpr(map.getResult(0).replaceDims(dims), 0, 0);
+    if (auto constExpr = expr.dyn_cast<mlir::AffineConstantExpr>()) {
+      return constExpr.getValue();
+    }
+  }
+  return llvm::None;
+}
 
-  mlir::PassManager pm(module.getContext());
-  pm.addPass(UnrollAffineForPass(unrollCheckFn));
-  if (mlir::failed(pm.run(module))) {
-    llvm::errs() << "Unroll affine for failed.";
+/// @brief the index becomes a constant once the backend unrolls the loops (#pragma unroll, mma.sync).
+bool isUnrollResolvable(mlir::Value value) {
+  if (getConstantIndex(value).hasValue()) return true;
+  if (auto arg = value.dyn_cast<mlir::BlockArgument>()) {
+    auto forOp = mlir::dyn_cast<mlir::AffineForOp>(arg.getOwner()->getParentOp());
+    if (!forOp || !forOp.hasConstantBounds()) return false;
+    for (auto parent = forOp; parent; parent = parent->getParentOfType<mlir::AffineForOp>()) {
+      if (parent->hasAttr(std::string("affine.mma"))) return true;
+    }
+    // a partial unroll (UnrollPlanner) leaves the index dynamic.
+    auto attr = forOp->getAttrOfType<mlir::StringAttr>(std::string("affine.loop"));
+    return attr && attr.getValue() == "unroll" && !forOp->hasAttr(std::string("affine.unroll_factor"));
+  }
+  if (auto applyOp = value.getDefiningOp<mlir::AffineApplyOp>()) {
+    for (auto operand : applyOp.getMapOperands()) {
+      if (!isUnrollResolvable(operand)) return false;
+    }
+    return true;
   }
-  return;
+  return false;
 }
 
-struct UnrollAttribute : 
-  public mlir::PassWrapper<UnrollAttribute, mlir::OperationPass<mlir::ModuleOp>> {
-   MLIR_DEFINE_EXPLICIT_INTERNAL_INLINE_TYPE_ID(UnrollAttribute)
-   UnrollAttribute(mlir::function_ref<bool(mlir::AffineForOp)> unrollCheckFn_ = nullptr) : unrollCheckFn(unrollCheckFn_) {};
-   void runOnOperation() override {
+int Rewriter::scalar_replace(mlir::func::FuncOp funcOp) {
+  std::vector<mlir::memref::AllocOp> allocOps;
+  funcOp.walk([&](mlir::memref::AllocOp allocOp) {
+    auto type = allocOp.getType();
+    if (type.getMemorySpaceAsInt() == static_cast<int>(MemorySpace::local)) {
+      allocOps.push_back(allocOp);
+    }
+  });
 
-     auto module = getOperation();
-     module.walk<mlir::WalkOrder::PostOrder>([&](mlir::AffineForOp forOp) {
-      if (!unrollCheckFn(forOp)) return;
-      mlir::OpBuilder builder(forOp->getContext());
-      forOp->setAttr(std::string("affine.loop"), builder.getStringAttr("unroll"));
-     });
-   }
-  mlir::function_ref<bool(mlir::AffineForOp)> unrollCheckFn;
-};
+  int dynamicNum = 0;
+  for (auto allocOp : allocOps) {
+    auto buffer = allocOp.getResult();
+    auto type = allocOp.getType();
+    auto context = allocOp->getContext();
+    bool allConstant = true, dynamic = false, hasVector = false;
+    // access -> its indices folded to constants.
+    std::vector<std::pair<mlir::Operation*, llvm::SmallVector<mlir::AffineExpr>>> accesses;
 
-std::unique_ptr<mlir::OperationPass<mlir::ModuleOp>> 
-UnrollAttributePass(mlir::function_ref<bool(mlir::AffineForOp)> unrollCheckFn = nullptr) {
-  return std::make_unique<UnrollAttribute>(unrollCheckFn);
-}
+    std::vector<mlir::Operation*> users(buffer.getUsers().begin(), buffer.getUsers().end());
+    for (auto user : users) {
+      mlir::AffineMap map;
+      llvm::SmallVector<mlir::Value> operands;
+      if (auto loadOp = mlir::dyn_cast<mlir::AffineLoadOp>(user)) {
+        map = loadOp.getAffineMap();
+        operands = loadOp.getMapOperands();
+      } else if (auto storeOp = mlir::dyn_cast<mlir::AffineStoreOp>(user)) {
+        map = storeOp.getAffineMap();
+        operands = storeOp.getMapOperands();
+      } else if (auto loadOp = mlir::dyn_cast<mlir::AffineVectorLoadOp>(user)) {
+        map = loadOp.getAffineMap();
+        operands = loadOp.getMapOperands();
+        hasVector = true;
+      } else if (auto storeOp = mlir::dyn_cast<mlir::AffineVectorStoreOp>(user)) {
+        map = storeOp.getAffineMap();
+        operands = storeOp.getMapOperands();
+        hasVector = true;
+      } else if (auto loadOp = mlir::dyn_cast<mlir::memref::LoadOp>(user)) {
+        map = mlir::AffineMap::getMultiDimIdentityMap(loadOp.getIndices().size(), context);
+        operands = loadOp.getIndices();
+      } else {
+        llvm::errs() << "Unknown user of local buffer: " << user->getName() << "\n";
+        dynamic = true;
+        continue;
+      }
 
-void Rewriter::unrollAttribute(mlir::ModuleOp module, mlir::function_ref<bool(mlir::AffineForOp)> unrollCheckFn) {
+      llvm::SmallVector<mlir::AffineExpr> dims;
+      for (int i = 0; i < operands.size(); i++) {
+        auto constIndex = getConstantIndex(operands[i]);
+        if (constIndex.hasValue()) {
+          dims.push_back(mlir::getAffineConstantExpr(constIndex.getValue(), context));
+        } else {
+          dims.push_back(mlir::getAffineDimExpr(i, context));
+          if (!isUnrollResolvable(operands[i])) dynamic = true;
+        }
+      }
+      llvm::SmallVector<mlir::AffineExpr> exprs;
+      for (auto expr : map.getResults()) {
+        auto simplified = mlir::simplifyAffineExpr(expr.replaceDims(dims), operands.size(), map.getNumSymbols());
+        if (!simplified.isa<mlir::AffineConstantExpr>()) allConstant = false;
+        exprs.push_back(simplified);
+      }
+      accesses.push_back(std::make_pair(user, exprs));
+    }
 
-  mlir::PassManager pm(module.getContext());
-  pm.addPass(UnrollAttributePass(unrollCheckFn));
-  if (mlir::failed(pm.run(module))) {
-    llvm::errs() << "Unroll affine for failed.";
+    if (dynamic) {
+      if (KCGLog::level == Log::Debug) {
+        llvm::errs() << "Local buffer " << type << " is indexed dynamically, it will be spilled to local memory\n";
+      }
+      allocOp->setAttr(std::string("memory.dynamic"), mlir::UnitAttr::get(context));
+      dynamicNum += 1;
+      continue;
+    }
+    // the components of a vector are named one by one, only float vectors are assembled.
+    if (!allConstant || (hasVector && !type.getElementType().isF32())) continue;
+
+    for (auto& access : accesses) {
+      auto user = access.first;
+      auto map = mlir::AffineMap::get(0, 0, access.second, context);
+      mlir::OpBuilder builder(user);
+      mlir::Operation* newOp = nullptr;
+      if (auto loadOp = mlir::dyn_cast<mlir::AffineLoadOp>(user)) {
+        newOp = builder.create<mlir::AffineLoadOp>(user->getLoc(), buffer, map, mlir::ValueRange({}));
+      } else if (auto storeOp = mlir::dyn_cast<mlir::AffineStoreOp>(user)) {
+        newOp = builder.create<mlir::AffineStoreOp>(user->getLoc(), storeOp.getValue(), buffer, map, mlir::ValueRange({}));
+      } else if (auto loadOp = mlir::dyn_cast<mlir::AffineVectorLoadOp>(user)) {
+        newOp = builder.create<mlir::AffineVectorLoadOp>(user->getLoc(), loadOp.getVectorType(), buffer, map, mlir::ValueRange({}));
+      } else if (auto storeOp = mlir::dyn_cast<mlir::AffineVectorStoreOp>(user)) {
+        newOp = builder.create<mlir::AffineVectorStoreOp>(user->getLoc(), storeOp.getValue(), buffer, map, mlir::ValueRange({}));
+      } else if (auto loadOp = mlir::dyn_cast<mlir::memref::LoadOp>(user)) {
+        newOp = builder.create<mlir::AffineLoadOp>(user->getLoc(), buffer, map, mlir::ValueRange({}));
+      }
+      inheritAttrs(user, newOp);
+      user->replaceAllUsesWith(newOp);
+      user->erase();
+    }
+    allocOp->setAttr(std::string("memory.scalar"), mlir::UnitAttr::get(context));
   }
-  return;
+  return dynamicNum;
 }
 
 // void Rewriter::loweringAffineDialect(mlir::ModuleOp module) {
@@ -1635,9 +2493,10 @@ void Rewriter::change_double_buffer(mlir::AffineForOp scope, mlir::Value buffer)
         if (i == 0) {
           auto binaryExpr = oldExprs[i].dyn_cast<mlir::AffineBinaryOpExpr>();
           assert(binaryExpr && binaryExpr.getKind() == mlir::AffineExprKind::Mod);
+          // the modulus is the stage count of the pipelined buffer.
           auto constExpr = binaryExpr.getRHS().dyn_cast<mlir::AffineConstantExpr>();
-          assert(constExpr && constExpr.getValue() == 2);
-          exprs.push_back((binaryExpr.getLHS() + 1) % 2);
+          assert(constExpr && constExpr.getValue() >= 2);
+          exprs.push_back((binaryExpr.getLHS() + 1) % constExpr.getValue());
         } else {
           exprs.push_back(oldExprs[i]);
         }
@@ -1701,6 +2560,75 @@ mlir::AffineForOp Rewriter::outer_product(mlir::OpBuilder& builder, mlir::Value
   builder.restoreInsertionPoint(ip);
 }
 
+mlir::AffineForOp Rewriter::mma(mlir::OpBuilder& builder, mlir::Value tileC, mlir::Value fragA, mlir::Value fragB,
+  mlir::AffineMap laneMap, llvm::SmallVector<mlir::Value> operands, int64_t mTiles, int64_t nTiles) {
+  auto elementA = fragA.getType().dyn_cast<mlir::MemRefType>().getElementType();
+  auto elementB = fragB.getType().dyn_cast<mlir::MemRefType>().getElementType();
+  if (!MMALayout::supported(elementA, elementB)) {
+    llvm::errs() << "mma.sync is only generated for f32(tf32) operands\n";
+    assert(false);
+  }
+  auto context = builder.getContext();
+  auto lane = laneMap.getResult(0);
+  auto numDims = laneMap.getNumDims();
+  assert(operands.size() == numDims);
+  // dims are: [operands of laneMap..., i, k]
+  auto reg = mlir::getAffineDimExpr(numDims, context);
+  auto kIdx = mlir::getAffineDimExpr(numDims + 1, context);
+  auto srcLaneAMap = mlir::AffineMap::get(numDims + 2, 0, MMALayout::srcLaneA(lane, reg, kIdx));
+  auto srcLaneBMap = mlir::AffineMap::get(numDims + 2, 0, MMALayout::srcLaneB(lane, reg, kIdx));
+  // dims are: [mi/ni, i, k]
+  auto tile = mlir::getAffineDimExpr(0, context);
+  auto iv = mlir::getAffineDimExpr(1, context);
+  auto kv = mlir::getAffineDimExpr(2, context);
+  auto fragAMap = mlir::AffineMap::get(3, 0, tile * MMALayout::A_REGS + MMALayout::regA(iv, kv));
+  auto fragBMap = mlir::AffineMap::get(3, 0, tile * MMALayout::B_REGS + MMALayout::regB(iv, kv));
+  // dims are: [mi, ni, i]
+  auto mi = mlir::getAffineDimExpr(0, context);
+  auto ni = mlir::getAffineDimExpr(1, context);
+  auto ci = mlir::getAffineDimExpr(2, context);
+  auto tileCMap = mlir::AffineMap::get(3, 0, {mi * 2 + ci.floorDiv(2), ni * 2 + ci % 2}, context);
+
+  auto width = builder.create<mlir::arith::ConstantIntOp>(builder.getUnknownLoc(), MMALayout::WARP_SIZE, 32);
+  auto mLoop = Rewriter::create_constant_loop(builder, 0, mTiles, 1);
+  auto ip = builder.saveInsertionPoint();
+  builder.setInsertionPointToStart(mLoop.getBody());
+  auto nLoop = Rewriter::create_constant_loop(builder, 0, nTiles, 1);
+  builder.setInsertionPointToStart(nLoop.getBody());
+  auto iLoop = Rewriter::create_constant_loop(builder, 0, MMALayout::C_REGS, 1);
+  // the backend emits one mma.sync for this loop, the body is the SIMT fallback:
+  // every lane fetches the A/B registers it needs from the lanes holding them.
+  iLoop->setAttr(std::string("affine.mma"), builder.getStringAttr("m16n8k8"));
+  builder.setInsertionPointToStart(iLoop.getBody());
+  auto kLoop = Rewriter::create_constant_loop(builder, 0, MMALayout::K, 1);
+  builder.setInsertionPointToStart(kLoop.getBody());
+  {
+    auto m = mLoop.getInductionVar();
+    auto n = nLoop.getInductionVar();
+    auto i = iLoop.getInductionVar();
+    auto k = kLoop.getInductionVar();
+    auto laneOperands = operands;
+    laneOperands.push_back(i);
+    laneOperands.push_back(k);
+    auto ld_a = builder.create<mlir::AffineLoadOp>(builder.getUnknownLoc(), fragA, fragAMap, mlir::ValueRange({m, i, k}));
+    auto src_a = builder.create<mlir::AffineApplyOp>(builder.getUnknownLoc(), srcLaneAMap, laneOperands);
+    auto lane_a = builder.create<mlir::arith::IndexCastOp>(builder.getUnknownLoc(), builder.getI32Type(), src_a.getResult());
+    auto a = builder.create<mlir::gpu::ShuffleOp>(builder.getUnknownLoc(), ld_a.getResult(), lane_a.getResult(),
+      width.getResult(), mlir::gpu::ShuffleMode::IDX);
+    auto ld_b = builder.create<mlir::AffineLoadOp>(builder.getUnknownLoc(), fragB, fragBMap, mlir::ValueRange({n, i, k}));
+    auto src_b = builder.create<mlir::AffineApplyOp>(builder.getUnknownLoc(), srcLaneBMap, laneOperands);
+    auto lane_b = builder.create<mlir::arith::IndexCastOp>(builder.getUnknownLoc(), builder.getI32Type(), src_b.getResult());
+    auto b = builder.create<mlir::gpu::ShuffleOp>(builder.getUnknownLoc(), ld_b.getResult(), lane_b.getResult(),
+      width.getResult(), mlir::gpu::ShuffleMode::IDX);
+    auto ld_c = builder.create<mlir::AffineLoadOp>(builder.getUnknownLoc(), tileC, tileCMap, mlir::ValueRange({m, n, i}));
+    auto mul = builder.create<mlir::arith::MulFOp>(builder.getUnknownLoc(), a.getResult(0), b.getResult(0));
+    auto add = builder.create<mlir::arith::AddFOp>(builder.getUnknownLoc(), mul, ld_c);
+    builder.create<mlir::AffineStoreOp>(builder.getUnknownLoc(), add.getResult(), tileC, tileCMap, mlir::ValueRange({m, n, i}));
+  }
+  builder.restoreInsertionPoint(ip);
+  return mLoop;
+}
+
 /*---------------------------extr-------------------------------*/
 int getMaxExprDim(mlir::AffineExpr expr) {
   // 获取表达式中最高维度
@@ -0,0 +1,133 @@
+#include "Optimizer/Snapshot.h"
+
+#include <algorithm>
+
+namespace KernelCodeGen {
+
+size_t KCGSnapshot::capacity = 32;
+std::vector<std::string> KCGSnapshot::filter;
+bool KCGSnapshot::echo = false;
+std::deque<KCGSnapshot::Entry> KCGSnapshot::ring;
+int64_t KCGSnapshot::nextId = 0;
+const void* KCGSnapshot::owner = nullptr;
+
+std::string scopeName(mlir::Operation* op) {
+  if (auto name = op->getAttrOfType<mlir::StringAttr>(mlir::SymbolTable::getSymbolAttrName())) {
+    return name.str();
+  }
+  return op->getName().getStringRef().str();
+}
+
+std::vector<std::string> snapshotLines(mlir::Operation* op) {
+  std::string text;
+  llvm::raw_string_ostream os(text);
+  op->print(os);
+  os.flush();
+  std::vector<std::string> lines;
+  llvm::SmallVector<llvm::StringRef> refs;
+  llvm::StringRef(text).split(refs, '\n');
+  for (auto ref : refs) lines.push_back(ref.str());
+  return lines;
+}
+
+void printHeader(llvm::raw_ostream& os, const KCGSnapshot::Entry& entry) {
+  os << "// ---- snapshot " << entry.id << ": " << entry.step << " @" << entry.scope << "\n";
+}
+
+void KCGSnapshot::capture(mlir::Operation* scope, const std::string& step) {
+  if (KCGLog::level != Log::Debug || capacity == 0) return;
+  if (!filter.empty() && std::none_of(filter.begin(), filter.end(),
+                                      [&](const std::string& key) { return step.find(key) != std::string::npos; })) {
+    return;
+  }
+  while (ring.size() >= capacity) {
+    ring.front().ir->erase();
+    ring.pop_front();
+  }
+  ring.push_back({nextId++, step, scopeName(scope), scope->clone(), owner});
+  if (echo) {
+    printHeader(llvm::errs(), ring.back());
+    ring.back().ir->print(llvm::errs());
+    llvm::errs() << "\n";
+  }
+}
+
+void KCGSnapshot::print(llvm::raw_ostream& os, int count, const void* owner_) {
+  std::vector<const Entry*> owned;
+  for (auto& entry : ring) {
+    if (entry.owner == owner_) owned.push_back(&entry);
+  }
+  size_t begin = count < 0 ? 0 : owned.size() - std::min<size_t>(count, owned.size());
+  for (size_t i = begin; i < owned.size(); i++) {
+    printHeader(os, *owned[i]);
+    owned[i]->ir->print(os);
+    os << "\n";
+  }
+}
+
+void KCGSnapshot::diff(llvm::raw_ostream& os, int64_t id) {
+  auto cur = std::find_if(ring.begin(), ring.end(), [&](const Entry& entry) { return entry.id == id; });
+  if (cur == ring.end()) {
+    os << "// snapshot " << id << " is not in the ring\n";
+    return;
+  }
+  printHeader(os, *cur);
+  auto prev = std::find_if(std::make_reverse_iterator(cur), ring.rend(),
+                           [&](const Entry& entry) { return entry.scope == cur->scope && entry.owner == cur->owner; });
+  auto after = snapshotLines(cur->ir);
+  if (prev == ring.rend()) {
+    for (auto& line : after) os << "+" << line << "\n";
+    return;
+  }
+  auto before = snapshotLines(prev->ir);
+  // a step usually rewrites one region, only the middle between the common prefix and suffix is diffed.
+  size_t head = 0;
+  while (head < before.size() && head < after.size() && before[head] == after[head]) head++;
+  size_t tail = 0;
+  while (tail < before.size() - head && tail < after.size() - head &&
+         before[before.size() - 1 - tail] == after[after.size() - 1 - tail]) tail++;
+  size_t n = before.size() - head - tail, m = after.size() - head - tail;
+  if (n == 0 && m == 0) {
+    os << "// unchanged since snapshot " << prev->id << "\n";
+    return;
+  }
+  os << "@@ -" << head + 1 << "," << n << " +" << head + 1 << "," << m << " @@ since snapshot " << prev->id << "\n";
+  // lcs table of the middle; a huge rewrite falls back to all removed, then all added.
+  if (n * m > (1 << 22)) {
+    for (size_t i = 0; i < n; i++) os << "-" << before[head + i] << "\n";
+    for (size_t j = 0; j < m; j++) os << "+" << after[head + j] << "\n";
+    return;
+  }
+  std::vector<std::vector<int>> lcs(n + 1, std::vector<int>(m + 1, 0));
+  for (int i = n - 1; i >= 0; i--) {
+    for (int j = m - 1; j >= 0; j--) {
+      lcs[i][j] = before[head + i] == after[head + j] ? lcs[i + 1][j + 1] + 1 : std::max(lcs[i + 1][j], lcs[i][j + 1]);
+    }
+  }
+  size_t i = 0, j = 0;
+  while (i < n || j < m) {
+    if (i < n && j < m && before[head + i] == after[head + j]) {
+      os << " " << before[head + i] << "\n";
+      i++; j++;
+    } else if (j == m || (i < n && lcs[i + 1][j] >= lcs[i][j + 1])) {
+      os << "-" << before[head + i++] << "\n";
+    } else {
+      os << "+" << after[head + j++] << "\n";
+    }
+  }
+}
+
+void KCGSnapshot::printDiffs(llvm::raw_ostream& os, const void* owner_) {
+  for (auto& entry : ring) {
+    if (entry.owner == owner_) diff(os, entry.id);
+  }
+}
+
+void KCGSnapshot::clear(const void* owner_) {
+  for (auto& entry : ring) {
+    if (entry.owner == owner_) entry.ir->erase();
+  }
+  ring.erase(std::remove_if(ring.begin(), ring.end(), [&](const Entry& entry) { return entry.owner == owner_; }), ring.end());
+}
+
+}
@@ -0,0 +1,133 @@
+#include "Optimizer/TuneTrace.h"
+
+#include <sstream>
+#include <algorithm>
+
+namespace KernelCodeGen {
+
+std::string jsonConfig(const std::map<std::string, int>& config) {
+  std::stringstream json;
+  json << "{";
+  bool first = true;
+  for (auto& item : config) {
+    json << (first ? "" : ", ") << "\"" << item.first << "\": " << item.second;
+    first = false;
+  }
+  json << "}";
+  return json.str();
+}
+
+std::string jsonUs(double us) {
+  return us < 0 ? std::string("null") : std::to_string(us);
+}
+
+std::string TuneTraceJsonl(const std::vector<TuneTrial>& trials) {
+  std::stringstream jsonl;
+  for (auto& trial : trials) {
+    jsonl << "{\"optimizer\": \"" << trial.optimizer << "\", \"index\": " << trial.index << ", \"config\": " << jsonConfig(trial.config)
+          << ", \"applicable\": " << (trial.applicable ? "true" : "false") << ", \"status\": \"" << trial.status
+          << "\", \"reason\": \"" << trial.reason << "\", \"start_ms\": " << trial.startMs << ", \"match_ms\": " << trial.matchMs
+          << ", \"transform_ms\": " << trial.transformMs << ", \"evaluate_ms\": " << trial.evaluateMs
+          << ", \"validation\": \"" << trial.validation << "\", \"validate_ms\": " << trial.validateMs
+          << ", \"predicted_us\": " << jsonUs(trial.latencyUs) << ", \"best_us\": " << jsonUs(trial.bestUs)
+          << ", \"bound_us\": " << jsonUs(trial.boundUs) << "}\n";
+  }
+  return jsonl.str();
+}
+
+std::string TuneChromeTrace(const std::vector<TuneTrial>& trials) {
+  std::vector<std::string> tracks;
+  std::stringstream json;
+  json << "{\"traceEvents\": [";
+  bool first = true;
+  auto slice = [&](const std::string& name, int tid, double startMs, double durMs, const std::string& args) {
+    // the timestamps are in us.
+    json << (first ? "\n" : ",\n") << "  {\"name\": \"" << name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tid
+         << ", \"ts\": " << startMs * 1e3 << ", \"dur\": " << durMs * 1e3 << ", \"args\": " << args << "}";
+    first = false;
+  };
+  for (auto& trial : trials) {
+    auto track = std::find(tracks.begin(), tracks.end(), trial.optimizer);
+    int tid = track - tracks.begin();
+    if (track == tracks.end()) tracks.push_back(trial.optimizer);
+    std::stringstream args;
+    args << "{\"index\": " << trial.index << ", \"status\": \"" << trial.status << "\", \"reason\": \"" << trial.reason
+         << "\", \"predicted_us\": " << jsonUs(trial.latencyUs) << ", \"config\": " << jsonConfig(trial.config) << "}";
+    if (trial.matchMs > 0) {
+      slice("match", tid, trial.startMs - trial.matchMs, trial.matchMs, "{}");
+    }
+    auto name = "config " + std::to_string(trial.index);
+    if (trial.status != "ok" && trial.status != "failed") {
+      // nothing ran, an instant marks the decision.
+      json << (first ? "\n" : ",\n") << "  {\"name\": \"" << name << " " << trial.status << "\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": "
+           << tid << ", \"ts\": " << trial.startMs * 1e3 << ", \"args\": " << args.str() << "}";
+      first = false;
+      continue;
+    }
+    slice(name + " transform", tid, trial.startMs, trial.transformMs, args.str());
+    slice(name + " evaluate", tid, trial.startMs + trial.transformMs, trial.evaluateMs, "{}");
+    if (!trial.validation.empty()) {
+      slice(name + " validate", tid, trial.startMs + trial.transformMs + trial.evaluateMs, trial.validateMs,
+            "{\"validation\": \"" + trial.validation + "\"}");
+    }
+  }
+  for (int i = 0; i < tracks.size(); i++) {
+    json << (first ? "\n" : ",\n") << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << i
+         << ", \"args\": {\"name\": \"" << tracks[i] << "\"}}";
+    first = false;
+  }
+  json << "\n]}\n";
+  return json.str();
+}
+
+std::string TuneConvergenceReport(const std::vector<TuneTrial>& trials) {
+  std::vector<std::string> optimizers;
+  for (auto& trial : trials) {
+    if (std::find(optimizers.begin(), optimizers.end(), trial.optimizer) == optimizers.end()) {
+      optimizers.push_back(trial.optimizer);
+    }
+  }
+  std::stringstream json;
+  json << "{\"optimizers\": [";
+  for (int i = 0; i < optimizers.size(); i++) {
+    int tried = 0, failed = 0, pruned = 0, skipped = 0, bestTrial = -1;
+    int rejected = 0;
+    double matchMs = 0.0, transformMs = 0.0, evaluateMs = 0.0, validateMs = 0.0, bestUs = -1.0, boundUs = -1.0;
+    bool applicable = true;
+    std::stringstream curve;
+    for (auto& trial : trials) {
+      if (trial.optimizer != optimizers[i]) continue;
+      applicable = trial.applicable;
+      matchMs += trial.matchMs;
+      transformMs += trial.transformMs;
+      evaluateMs += trial.evaluateMs;
+      validateMs += trial.validateMs;
+      if (trial.validation == "mismatch") rejected++;
+      if (trial.status == "pruned") pruned++;
+      if (trial.status == "skipped") skipped++;
+      if (trial.status != "ok" && trial.status != "failed") continue;
+      if (trial.status == "failed") failed++;
+      // the best so far after each config actually run, x is the trial number.
+      curve << (tried == 0 ? "" : ", ") << "[" << tried << ", " << jsonUs(trial.bestUs) << "]";
+      if (trial.status == "ok" && trial.bestUs >= 0 && (bestUs < 0 || trial.bestUs < bestUs)) {
+        bestUs = trial.bestUs;
+        boundUs = trial.boundUs;
+        bestTrial = tried;
+      }
+      tried++;
+    }
+    json << (i == 0 ? "\n" : ",\n") << "  {\"optimizer\": \"" << optimizers[i] << "\", \"applicable\": " << (applicable ? "true" : "false")
+         << ", \"tried\": " << tried << ", \"failed\": " << failed << ", \"pruned\": " << pruned << ", \"skipped\": " << skipped
+         << ", \"wrong_results\": " << rejected << ",\n";
+    json << "   \"best_trial\": " << bestTrial << ", \"trials_after_best\": " << (bestTrial < 0 ? 0 : tried - 1 - bestTrial)
+         << ", \"best_us\": " << jsonUs(bestUs) << ", \"bound_us\": " << jsonUs(boundUs)
+         << ", \"gap_to_bound\": " << (bestUs >= 0 && boundUs > 0 ? std::to_string(bestUs / boundUs - 1.0) : "null") << ",\n";
+    json << "   \"match_ms\": " << matchMs << ", \"transform_ms\": " << transformMs << ", \"evaluate_ms\": " << evaluateMs
+         << ", \"validate_ms\": " << validateMs << ",\n";
+    json << "   \"best_so_far\": [" << curve.str() << "]}";
+  }
+  json << (optimizers.empty() ? "]}\n" : "\n]}\n");
+  return json.str();
+}
+
+}
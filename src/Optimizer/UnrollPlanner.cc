@@ -0,0 +1,146 @@
+#include "Optimizer/UnrollPlanner.h"
+#include "Optimizer/Rewriter.h"
+#include "log.h"
+
+#include <vector>
+
+namespace KernelCodeGen {
+
+int64_t getTripCount(mlir::AffineForOp forOp) {
+  if (!forOp.hasConstantBounds()) return -1;
+  auto step = forOp.getStep();
+  return (forOp.getConstantUpperBound() - forOp.getConstantLowerBound() + step - 1) / step;
+}
+
+/// @brief the backend emits the whole mma loop as one instruction, its loops are not planned.
+bool inMMALoop(mlir::AffineForOp forOp) {
+  for (auto parent = forOp; parent; parent = parent->getParentOfType<mlir::AffineForOp>()) {
+    if (parent->hasAttr(std::string("affine.mma"))) return true;
+  }
+  return false;
+}
+
+int64_t UnrollPlanner::estimate(mlir::Operation* op, const std::map<mlir::Operation*, Decision>& decisions) {
+  auto estimateBlock = [&](mlir::Block& block) -> int64_t {
+    int64_t size = 0;
+    for (auto& inner : block.getOperations()) {
+      size += estimate(&inner, decisions);
+    }
+    return size;
+  };
+
+  if (auto forOp = mlir::dyn_cast<mlir::AffineForOp>(op)) {
+    if (forOp->hasAttr(std::string("affine.mma"))) return 1;
+    auto body = estimateBlock(*forOp.getBody());
+    auto tripCount = getTripCount(forOp);
+    int64_t factor = 1;
+    if (decisions.count(op) != 0) {
+      factor = decisions.at(op).factor;
+    } else if (auto attr = forOp->getAttrOfType<mlir::StringAttr>(std::string("affine.loop"))) {
+      if (attr.getValue() == "unroll") {
+        auto factorAttr = forOp->getAttrOfType<mlir::IntegerAttr>(std::string("affine.unroll_factor"));
+        factor = factorAttr ? factorAttr.getInt() : tripCount;
+      }
+    }
+    if (tripCount > 0 && factor >= tripCount) return tripCount * body;
+    // increment, compare and branch.
+    return std::max<int64_t>(factor, 1) * body + 3;
+  }
+  if (auto ifOp = mlir::dyn_cast<mlir::AffineIfOp>(op)) {
+    int64_t size = estimateBlock(*ifOp.getThenBlock()) + 2;
+    if (ifOp.hasElse()) size += estimateBlock(*ifOp.getElseBlock());
+    return size;
+  }
+  if (op->getNumRegions() != 0) {
+    int64_t size = 0;
+    for (auto& region : op->getRegions()) {
+      for (auto& block : region.getBlocks()) {
+        size += estimateBlock(block);
+      }
+    }
+    return size;
+  }
+  // declarations and constexprs.
+  if (mlir::isa<mlir::arith::ConstantOp, mlir::memref::AllocOp, mlir::AffineYieldOp, mlir::func::ReturnOp>(op)) {
+    return 0;
+  }
+  return 1;
+}
+
+int64_t UnrollPlanner::plan(mlir::Operation* scope, int64_t fullLimit, int64_t pragmaLimit, int64_t budget) {
+  int64_t maxSize = 0;
+  auto builder = mlir::OpBuilder(scope->getContext());
+
+  std::vector<mlir::func::FuncOp> funcOps;
+  scope->walk([&](mlir::func::FuncOp funcOp) {
+    if (!funcOp.isDeclaration()) funcOps.push_back(funcOp);
+  });
+  for (auto funcOp : funcOps) {
+    std::map<mlir::Operation*, Decision> decisions;
+    std::vector<mlir::AffineForOp> loops;
+    funcOp.walk<mlir::WalkOrder::PreOrder>([&](mlir::AffineForOp forOp) {
+      if (forOp->hasAttr(std::string("affine.loop")) || inMMALoop(forOp)) return;
+      auto tripCount = getTripCount(forOp);
+      if (tripCount < 0) return;
+      if (tripCount < fullLimit) {
+        decisions[forOp] = Decision{tripCount, tripCount, true};
+        loops.push_back(forOp);
+      } else if (tripCount <= pragmaLimit) {
+        decisions[forOp] = Decision{tripCount, tripCount, false};
+        loops.push_back(forOp);
+      }
+    });
+
+    auto size = estimate(funcOp, decisions);
+    while (budget > 0 && size > budget) {
+      mlir::Operation* best = nullptr;
+      int64_t bestFactor = 0;
+      auto bestSize = size;
+      for (auto forOp : loops) {
+        auto& decision = decisions[forOp];
+        if (decision.factor <= 1) continue;
+        auto old = decision;
+        // next smaller divisor, so the unrolled loop has no remainder.
+        auto factor = decision.factor - 1;
+        while (decision.tripCount % factor != 0) factor--;
+        decision.factor = factor;
+        decision.inIR = false;
+        auto newSize = estimate(funcOp, decisions);
+        decision = old;
+        if (newSize < bestSize) {
+          best = forOp;
+          bestFactor = factor;
+          bestSize = newSize;
+        }
+      }
+      if (!best) {
+        if (KCGLog::level == Log::Debug) {
+          llvm::errs() << "Kernel " << funcOp.getSymName() << " is estimated to " << size
+                       << " instructions, over the unroll budget " << budget << "\n";
+        }
+        break;
+      }
+      decisions[best].factor = bestFactor;
+      decisions[best].inIR = false;
+      size = bestSize;
+    }
+    maxSize = std::max(maxSize, size);
+
+    // attributes first, the loops cloned by the IR unroll keep them.
+    for (auto& item : decisions) {
+      auto& decision = item.second;
+      if (decision.inIR) continue;
+      item.first->setAttr(std::string("affine.loop"), builder.getStringAttr("unroll"));
+      if (decision.factor != decision.tripCount) {
+        item.first->setAttr(std::string("affine.unroll_factor"), builder.getI64IntegerAttr(decision.factor));
+      }
+    }
+    Rewriter::unroll(funcOp, [&](mlir::AffineForOp forOp)->bool {
+      auto iter = decisions.find(forOp);
+      return iter != decisions.end() && iter->second.inIR;
+    });
+  }
+  return maxSize;
+}
+
+}
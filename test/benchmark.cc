@@ -0,0 +1,280 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "KernelCodeGen.h"
+using namespace KernelCodeGen;
+
+/* Compiler throughput: the wall time of the generator itself on representative graphs, as json.
+   Run the same command on two commits and diff the outputs, e.g.
+     ../bin/codegen_benchmark --repeat 5 --output throughput.json
+   Every case runs in its own process, its peak RSS doesn't include the cases before it. */
+
+struct BenchCase {
+  std::string name;
+  std::function<void(ComputeDAG&)> build;
+};
+
+struct BenchRun {
+  double initMs, createGraphMs, buildMs, optimizeMs, finalizeMs, codegenMs, totalMs;
+  std::vector<OptimizerTiming> optimizers;
+  std::vector<TuneTrial> trace;
+  size_t kernels;
+  size_t sourceBytes;
+};
+
+double msSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// @brief runs `body` in a forked child, `output` is the string it returns and `peakRssKb` its peak RSS.
+///        the parent never builds a graph, so the child starts from a small process.
+bool runIsolated(const std::function<std::string()>& body, std::string& output, long& peakRssKb) {
+  int fds[2];
+  if (pipe(fds) != 0) return false;
+  std::cout.flush();
+  std::cerr.flush();
+  auto pid = fork();
+  if (pid < 0) return false;
+  if (pid == 0) {
+    close(fds[0]);
+    auto str = body();
+    for (size_t written = 0; written < str.size();) {
+      auto n = write(fds[1], str.data() + written, str.size() - written);
+      if (n <= 0) _exit(1);
+      written += n;
+    }
+    close(fds[1]);
+    _exit(0);
+  }
+  close(fds[1]);
+  char buffer[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buffer, sizeof(buffer))) > 0) output.append(buffer, n);
+  close(fds[0]);
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid) return false;
+  peakRssKb = usage.ru_maxrss;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+std::string stats(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  std::stringstream str;
+  str << "{\"min\": " << values.front() << ", \"median\": " << values[values.size() / 2] << "}";
+  return str.str();
+}
+
+void attention(ComputeDAG& graph, mlir::Value Q, mlir::Value K, mlir::Value V) {
+  auto S = graph.create<BatchedMatmul>(Q, Layout::rowMajor, K, Layout::colMajor);
+  auto P = graph.create<Softmax>(S, -1, MemorySpace::inplace);
+  graph.create<BatchedMatmul>(P, Layout::rowMajor, V, Layout::rowMajor);
+}
+
+std::vector<BenchCase> benchCases(int layers) {
+  std::vector<BenchCase> cases;
+  for (int64_t size : {512, 1024, 2048, 4096}) {
+    cases.push_back({"matmul_" + std::to_string(size), [=](ComputeDAG& graph) {
+      auto A = graph.create<PlaceHolder>(std::vector<int64_t>{size, size}, std::string{"float32"});
+      auto B = graph.create<PlaceHolder>(std::vector<int64_t>{size, size}, std::string{"float32"});
+      graph.create<Matmul>(A, B);
+    }});
+  }
+  cases.push_back({"batched_matmul", [](ComputeDAG& graph) {
+    auto A = graph.create<PlaceHolder>(std::vector<int64_t>{64, 2048, 64}, std::string{"float32"});
+    auto B = graph.create<PlaceHolder>(std::vector<int64_t>{64, 2048, 64}, std::string{"float32"});
+    graph.create<BatchedMatmul>(A, Layout::rowMajor, B, Layout::colMajor);
+  }});
+  // same shapes as test_flash_attention.
+  cases.push_back({"fmha", [](ComputeDAG& graph) {
+    std::vector<int64_t> shape{8, 32, 2048, 64};
+    auto Q = graph.create<PlaceHolder>(shape, std::string{"float32"});
+    auto K = graph.create<PlaceHolder>(shape, std::string{"float32"});
+    auto V = graph.create<PlaceHolder>(shape, std::string{"float32"});
+    attention(graph, Q, K, V);
+  }});
+  cases.push_back({"layernorm", [](ComputeDAG& graph) {
+    auto A = graph.create<PlaceHolder>(std::vector<int64_t>{2, 768, 768}, std::string{"float32"});
+    auto scale = graph.create<PlaceHolder>(std::vector<int64_t>{768, 768}, std::string{"float32"});
+    auto bias = graph.create<PlaceHolder>(std::vector<int64_t>{768, 768}, std::string{"float32"});
+    graph.create<LayerNorm>(A, scale, bias, 1, 1e-5);
+  }});
+  cases.push_back({"gather", [](ComputeDAG& graph) {
+    auto A = graph.create<PlaceHolder>(std::vector<int64_t>{2, 768, 768}, std::string{"float32"});
+    auto indices = graph.create<PlaceHolder>(std::vector<int64_t>{1}, std::string{"index"});
+    graph.create<Gather>(A, indices, 0);
+  }});
+  // a bert-base like encoder: attention + projection + layernorm, then the ffn + layernorm.
+  cases.push_back({"transformer_" + std::to_string(layers), [=](ComputeDAG& graph) {
+    int64_t batch = 8, seq = 512, hidden = 768, heads = 12, ffn = 4 * hidden;
+    int64_t tokens = batch * seq, headDim = hidden / heads;
+    auto weight = [&](int64_t rows, int64_t cols) {
+      return graph.create<PlaceHolder>(std::vector<int64_t>{rows, cols}, std::string{"float32"});
+    };
+    auto vec = [&](int64_t size) {
+      return graph.create<PlaceHolder>(std::vector<int64_t>{size}, std::string{"float32"});
+    };
+    auto x = weight(tokens, hidden);
+    for (int layer = 0; layer < layers; layer++) {
+      std::vector<int64_t> headShape{batch, heads, seq, headDim};
+      auto Q = graph.create<Reshape>(graph.create<Matmul>(x, weight(hidden, hidden)), headShape);
+      auto K = graph.create<Reshape>(graph.create<Matmul>(x, weight(hidden, hidden)), headShape);
+      auto V = graph.create<Reshape>(graph.create<Matmul>(x, weight(hidden, hidden)), headShape);
+      auto S = graph.create<BatchedMatmul>(Q, Layout::rowMajor, K, Layout::colMajor);
+      auto P = graph.create<Softmax>(S, -1, MemorySpace::inplace);
+      auto O = graph.create<BatchedMatmul>(P, Layout::rowMajor, V, Layout::rowMajor);
+      auto proj = graph.create<Matmul>(graph.create<Reshape>(O, std::vector<int64_t>{tokens, hidden}), weight(hidden, hidden));
+      auto residual = graph.create<Binary>(x, proj, "Add");
+      auto norm = graph.create<LayerNorm>(residual, vec(hidden), vec(hidden), 1, 1e-5);
+      auto up = graph.create<ElementWise>(graph.create<Matmul>(norm, weight(hidden, ffn)), "Gelu", MemorySpace::inplace);
+      auto down = graph.create<Matmul>(up, weight(ffn, hidden));
+      x = graph.create<LayerNorm>(graph.create<Binary>(norm, down, "Add"), vec(hidden), vec(hidden), 1, 1e-5);
+    }
+  }});
+  return cases;
+}
+
+BenchRun runCase(const BenchCase& benchCase, const TuneBudget& budget, const ValidationConfig& validation) {
+  BenchRun run;
+  auto begin = std::chrono::steady_clock::now();
+  // the context setup is part of the service startup.
+  KernelCodeGenerator generator("CUDA");
+  generator.opts.push_back(std::move(std::make_unique<FMHAOptimizer>()));
+  generator.opts.push_back(std::move(std::make_unique<MatmulOptimizer>()));
+  generator.opts.push_back(std::move(std::make_unique<BatchMatmulOptimizer>()));
+  generator.opts.push_back(std::move(std::make_unique<BinaryOptimizer>()));
+  generator.opts.push_back(std::move(std::make_unique<ElementWiseOptimizer>()));
+  generator.opts.push_back(std::move(std::make_unique<LayerNormOptimizer>()));
+  generator.opts.push_back(std::move(std::make_unique<GatherOptimizer>()));
+  generator.setTuneBudget(budget);
+  generator.setValidation(validation);
+  run.initMs = msSince(begin);
+
+  auto start = std::chrono::steady_clock::now();
+  auto& graph = generator.createGraph(benchCase.name);
+  run.createGraphMs = msSince(start);
+
+  start = std::chrono::steady_clock::now();
+  benchCase.build(graph);
+  run.buildMs = msSince(start);
+
+  start = std::chrono::steady_clock::now();
+  auto module = generator.optimize(graph);
+  run.optimizeMs = msSince(start);
+  run.optimizers = generator.getOptimizerTimings();
+  run.trace = generator.getTuneTrace();
+  run.finalizeMs = generator.getFinalizeTime();
+
+  start = std::chrono::steady_clock::now();
+  auto sourceCode = generator.codegen(module);
+  run.codegenMs = msSince(start);
+  run.totalMs = msSince(begin);
+
+  run.kernels = profileKernels(module).size();
+  run.sourceBytes = sourceCode.size();
+  return run;
+}
+
+/// @brief the json of one case without its closing brace, the median of `repeat` runs.
+std::string measureCase(const BenchCase& benchCase, int repeat, const TuneBudget& budget, const ValidationConfig& validation,
+                        const std::string& trace) {
+  std::stringstream json;
+  std::vector<BenchRun> runs;
+  for (int i = 0; i < repeat; i++) {
+    runs.push_back(runCase(benchCase, budget, validation));
+  }
+  auto collect = [&](double BenchRun::*field) {
+    std::vector<double> values;
+    for (auto& run : runs) values.push_back(run.*field);
+    return stats(values);
+  };
+  // the optimizers and their trials are the same on every run, each is reported by its median.
+  auto& last = runs.back();
+  // the tuning of the last run: PREFIX_<case>.jsonl, .trace.json (chrome://tracing) and .convergence.json.
+  if (!trace.empty()) {
+    std::ofstream(trace + "_" + benchCase.name + ".jsonl") << TuneTraceJsonl(last.trace);
+    std::ofstream(trace + "_" + benchCase.name + ".trace.json") << TuneChromeTrace(last.trace);
+    std::ofstream(trace + "_" + benchCase.name + ".convergence.json") << TuneConvergenceReport(last.trace);
+  }
+  json << "    {\"name\": \"" << benchCase.name << "\", \"kernels\": " << last.kernels << ", \"source_bytes\": " << last.sourceBytes << ",\n";
+  json << "     \"init_ms\": " << collect(&BenchRun::initMs) << ", \"create_graph_ms\": " << collect(&BenchRun::createGraphMs)
+       << ", \"build_ms\": " << collect(&BenchRun::buildMs) << ",\n";
+  json << "     \"optimize_ms\": " << collect(&BenchRun::optimizeMs) << ", \"finalize_ms\": " << collect(&BenchRun::finalizeMs)
+       << ", \"codegen_ms\": " << collect(&BenchRun::codegenMs) << ", \"total_ms\": " << collect(&BenchRun::totalMs) << ",\n";
+  json << "     \"optimizers\": [";
+  for (int j = 0; j < last.optimizers.size(); j++) {
+    std::vector<double> matchMs;
+    for (auto& run : runs) matchMs.push_back(run.optimizers[j].matchMs);
+    json << (j == 0 ? "" : ", ") << "\n       {\"name\": \"" << last.optimizers[j].optimizer << "\", \"match_ms\": " << stats(matchMs)
+         << ", \"pruned\": " << last.optimizers[j].pruned << ", \"stop\": \"" << last.optimizers[j].stop << "\", \"trials_ms\": [";
+    for (int t = 0; t < last.optimizers[j].trialMs.size(); t++) {
+      std::vector<double> trialMs;
+      // a time budget can end the runs after different trials.
+      for (auto& run : runs) {
+        if (t < run.optimizers[j].trialMs.size()) trialMs.push_back(run.optimizers[j].trialMs[t]);
+      }
+      std::sort(trialMs.begin(), trialMs.end());
+      json << (t == 0 ? "" : ", ") << trialMs[trialMs.size() / 2];
+    }
+    json << "]}";
+  }
+  json << (last.optimizers.empty() ? "]" : "\n     ]");
+  return json.str();
+}
+
+int main(int argc, char* argv[]) {
+  int repeat = 3, layers = 4;
+  std::string only, output = "terminal", trace;
+  TuneBudget budget;
+  ValidationConfig validation;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--repeat" && i + 1 < argc) repeat = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "--layers" && i + 1 < argc) layers = std::atoi(argv[++i]);
+    else if (arg == "--case" && i + 1 < argc) only = argv[++i];
+    else if (arg == "--output" && i + 1 < argc) output = argv[++i];
+    else if (arg == "--trace" && i + 1 < argc) trace = argv[++i];
+    else if (arg == "--budget-ms" && i + 1 < argc) budget.ms = std::atof(argv[++i]);
+    else if (arg == "--budget-trials" && i + 1 < argc) budget.trials = std::atoi(argv[++i]);
+    else if (arg == "--bound-tolerance" && i + 1 < argc) budget.boundTolerance = std::atof(argv[++i]);
+    else if (arg == "--validate") validation.enable = true;
+    else {
+      std::cerr << "usage: codegen_benchmark [--repeat N] [--layers N] [--case NAME] [--output FILE]\n"
+                << "                         [--budget-ms MS] [--budget-trials N] [--bound-tolerance FRACTION] [--trace PREFIX]\n"
+                << "                         [--validate]\n";
+      return 1;
+    }
+  }
+
+  std::stringstream json;
+  json << "{\n  \"benchmark\": \"compiler_throughput\", \"repeat\": " << repeat << ",\n  \"cases\": [";
+  bool first = true;
+  for (auto& benchCase : benchCases(layers)) {
+    if (!only.empty() && benchCase.name != only) continue;
+    std::string caseJson;
+    long peakRssKb = 0;
+    if (!runIsolated([&]() { return measureCase(benchCase, repeat, budget, validation, trace); }, caseJson, peakRssKb)) {
+      std::cerr << "codegen_benchmark: case " << benchCase.name << " failed\n";
+      return 1;
+    }
+    json << (first ? "\n" : ",\n") << caseJson << ", \"peak_rss_kb\": " << peakRssKb << "}";
+    first = false;
+  }
+  json << "\n  ]\n}\n";
+
+  if (output == "terminal") {
+    std::cout << json.str();
+  } else {
+    std::ofstream(output) << json.str();
+  }
+  return 0;
+}
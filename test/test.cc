@@ -2,6 +2,7 @@
 #include <string>
 #include <vector>
 #include "KernelCodeGen.h"
+#include "Optimizer/MMA.h"
 using namespace KernelCodeGen;
 
 
@@ -135,6 +136,8 @@ void test_flash_attention() {
   generator.dump(module);
   auto&& sourceCode = generator.codegen(module);
   generator.save(sourceCode, "../test/flash-attn/demo.cu");
+  generator.save(generator.manifest(module), "../test/flash-attn/demo.json");
+  generator.save(generator.harness(module), "../test/flash-attn/demo_bench.cu");
   // std::string adaptorCode = "";
   // adaptorCode += "#include \"matmulKernel.cu\"\n";
   // adaptorCode += "const int M = " + std::to_string(m) + ";\n";
@@ -146,11 +149,235 @@ void test_flash_attention() {
 
 }
 
+void test_mma() {
+  /* the fragment layouts of mma.sync.m16n8k8 against a host GEMM, 0 if consistent. */
+  auto error = MMALayout::verify();
+  std::cout << "mma.sync m16n8k8 max error: " << error << "\n";
+  assert(error < 1e-4);
+
+  /* the tilings mma.sync can't lower fall back to fma. */
+  std::string reason;
+  auto f32 = mlir::FloatType::getF32(&sharedContext());
+  auto f64 = mlir::FloatType::getF64(&sharedContext());
+  assert(MMALayout::fits(128, 128, 8, 64, 32, 256, f32, f32, reason));
+  assert(!MMALayout::fits(128, 128, 4, 64, 32, 256, f32, f32, reason));
+  std::cout << "k tile of 4: " << reason << "\n";
+  assert(!MMALayout::fits(128, 128, 8, 24, 32, 256, f32, f32, reason));
+  std::cout << "warp tile of 24x32: " << reason << "\n";
+  assert(!MMALayout::fits(128, 128, 8, 64, 32, 128, f32, f32, reason));
+  std::cout << "128 threads: " << reason << "\n";
+  assert(!MMALayout::fits(128, 128, 8, 64, 32, 256, f64, f64, reason));
+  std::cout << "f64: " << reason << "\n";
+
+  /* a matmul tuned with MMA on is lowered to mma.sync. */
+  KernelCodeGenerator generator("CUDA");
+  auto graph = generator.createGraph("mma_demo");
+  generator.opts.push_back(std::move(std::make_unique<MatmulOptimizer>()));
+  generator.setConfigs("Matmul", {
+    { {"BLOCK_SIZE_M", 128}, {"BLOCK_SIZE_N", 128}, {"BLOCK_SIZE_K", 8}, {"GROUP_SIZE_M", 8}, 
+      {"THREAD_SIZE_M", 8}, {"THREAD_SIZE_N", 8}, {"VECTORIZE_WIDTH", 4}, {"WARP_SIZE", 32}, {"STAGES", 2}, {"ASYNC_COPY", 0}, {"MMA", 1}, {"UNROLL_BUDGET", 8192},
+      {"WARP_SPECIALIZE", 0}}
+  });
+  int m = 1024, n = 1024, k = 1024;
+  auto A = graph.create<PlaceHolder>(std::vector<int64_t>{m, k}, std::string{"float32"});
+  auto B = graph.create<PlaceHolder>(std::vector<int64_t>{k, n}, std::string{"float32"});
+  auto C = graph.create<Matmul>(A, B);
+  auto module = generator.optimize(graph);
+  auto&& sourceCode = generator.codegen(module);
+  bool emitted = sourceCode.find("mma.sync.aligned.m16n8k8") != std::string::npos;
+  std::cout << "mma.sync emitted: " << (emitted ? "yes" : "no") << "\n";
+  assert(emitted);
+}
+
+void test_warp_specialize() {
+  /* one producer warp stages the tiles for the 256 consumer threads through named barriers. */
+  KernelCodeGenerator generator("CUDA");
+  auto graph = generator.createGraph("warp_specialize_demo");
+  generator.opts.push_back(std::move(std::make_unique<MatmulOptimizer>()));
+  generator.setConfigs("Matmul", {
+    { {"BLOCK_SIZE_M", 128}, {"BLOCK_SIZE_N", 128}, {"BLOCK_SIZE_K", 8}, {"GROUP_SIZE_M", 8}, 
+      {"THREAD_SIZE_M", 8}, {"THREAD_SIZE_N", 8}, {"VECTORIZE_WIDTH", 4}, {"WARP_SIZE", 32}, {"STAGES", 3}, {"ASYNC_COPY", 1}, {"MMA", 0}, {"UNROLL_BUDGET", 8192},
+      {"WARP_SPECIALIZE", 1}}
+  });
+  int m = 1024, n = 1024, k = 1024;
+  auto A = graph.create<PlaceHolder>(std::vector<int64_t>{m, k}, std::string{"float32"});
+  auto B = graph.create<PlaceHolder>(std::vector<int64_t>{k, n}, std::string{"float32"});
+  auto C = graph.create<Matmul>(A, B);
+  auto module = generator.optimize(graph);
+  auto&& sourceCode = generator.codegen(module);
+
+  /* 16x16 consumer threads and 2 rows (one warp) of producers appended to the block. */
+  auto& launches = generator.getLaunches();
+  assert(launches.size() == 1);
+  std::cout << "block: (" << launches[0].block[0] << ", " << launches[0].block[1] << ")\n";
+  assert(launches[0].block[0] == 16 && launches[0].block[1] == 18);
+
+  /* full[s] = 1 + s: producers arrive, consumers sync. empty[s] = 4 + s: consumers arrive, producers sync. */
+  for (int stage = 0; stage < 3; stage++) {
+    for (auto id : {1 + stage, 4 + stage}) {
+      auto arrive = "bar.arrive " + std::to_string(id) + ", 288;";
+      auto sync = "bar.sync " + std::to_string(id) + ", 288;";
+      bool emitted = sourceCode.find(arrive) != std::string::npos && sourceCode.find(sync) != std::string::npos;
+      std::cout << "barrier " << id << ": " << (emitted ? "yes" : "no") << "\n";
+      assert(emitted);
+    }
+  }
+}
+
+/* the funcs of `module`, printed in order. */
+std::vector<std::string> printFuncs(mlir::ModuleOp module) {
+  std::vector<std::string> funcs;
+  for (auto funcOp : module.getOps<mlir::func::FuncOp>()) {
+    std::string str;
+    llvm::raw_string_ostream os(str);
+    funcOp.print(os);
+    funcs.push_back(os.str());
+  }
+  return funcs;
+}
+
+void test_incremental() {
+  auto build = [](ComputeDAG& graph) {
+    auto A = graph.create<PlaceHolder>(std::vector<int64_t>{1024, 1024}, std::string{"float32"});
+    auto B = graph.create<PlaceHolder>(std::vector<int64_t>{1024, 1024}, std::string{"float32"});
+    auto C = graph.create<Matmul>(A, B);
+    graph.create<ElementWise>(C, "Gelu", MemorySpace::inplace);
+  };
+  auto setup = [](KernelCodeGenerator& generator) {
+    generator.opts.push_back(std::move(std::make_unique<MatmulOptimizer>()));
+    generator.opts.push_back(std::move(std::make_unique<ElementWiseOptimizer>()));
+    generator.setIncremental(true);
+  };
+
+  /* the second optimize of the same graph reuses every func, and emits the same kernels as a fresh run,
+     also with fast math, which rewrites the funcs after they are tuned. */
+  for (bool fastMath : {false, true}) {
+    KernelCodeGenerator fresh("CUDA");
+    setup(fresh);
+    auto& freshGraph = fresh.createGraph("incremental_demo");
+    build(freshGraph);
+    freshGraph.setFastMath(fastMath);
+    auto freshModule = fresh.optimize(freshGraph);
+    auto freshFuncs = printFuncs(freshModule);
+    auto freshSource = fresh.codegen(freshModule);
+
+    KernelCodeGenerator reuse("CUDA");
+    setup(reuse);
+    auto& reuseGraph = reuse.createGraph("incremental_demo");
+    build(reuseGraph);
+    reuseGraph.setFastMath(fastMath);
+    auto reuseModule = reuse.optimize(reuseGraph);
+    reuse.codegen(reuseModule);
+    reuseModule = reuse.optimize(reuseGraph);
+    std::cout << "reused funcs" << (fastMath ? " (fast math): " : ": ") << reuse.getReusedFuncs() << "\n";
+    assert(reuse.getReusedFuncs() == 2);
+    assert(printFuncs(reuseModule) == freshFuncs);
+    assert(reuse.codegen(reuseModule) == freshSource);
+  }
+
+  KernelCodeGenerator generator("CUDA");
+  setup(generator);
+  auto& graph = generator.createGraph("incremental_demo");
+  build(graph);
+  generator.optimize(graph);
+
+  /* other configs drop the cache. */
+  generator.setConfigs("ElementWise", {
+    {{"BLOCK_SIZE_M", 64}, {"BLOCK_SIZE_N", 64}, {"THREAD_SIZE_M", 4}, {"THREAD_SIZE_N", 4}, {"VECTORIZE_WIDTH", 4}, {"UNROLL_BUDGET", 8192}, {"GRID_CAP", 65535}, {"SM_COUNT", 108},
+     {"BLOCK_COARSEN", 2}, {"GRID_COARSEN", 1}}
+  });
+  generator.optimize(graph);
+  std::cout << "reused funcs after setConfigs: " << generator.getReusedFuncs() << "\n";
+  assert(generator.getReusedFuncs() == 0);
+}
+
+void test_non_divisible() {
+  /* 1000 isn't a multiple of the 64x64 tiles: the whole tiles take the vectorized path, the last ones a guarded tail. */
+  KernelCodeGenerator generator("CUDA");
+  auto graph = generator.createGraph("non_divisible_demo");
+  generator.opts.push_back(std::move(std::make_unique<ElementWiseOptimizer>()));
+  auto X = graph.create<PlaceHolder>(std::vector<int64_t>{1000, 1000}, std::string{"float32"});
+  graph.create<ElementWise>(X, "Gelu", MemorySpace::inplace);
+  auto module = generator.optimize(graph);
+  auto&& sourceCode = generator.codegen(module);
+
+  auto count = [&](const std::string& pattern) {
+    int found = 0;
+    for (auto pos = sourceCode.find(pattern); pos != std::string::npos; pos = sourceCode.find(pattern, pos + 1)) found++;
+    return found;
+  };
+  /* one if versions the tile, the tail guards each element with its own. */
+  std::cout << "versioned tiles: " << count("} else {") << ", guards: " << count("if (") << "\n";
+  assert(count("} else {") >= 1);
+  assert(count("reinterpret_cast<float4*>") >= 1);
+  assert(count("if (") >= 2);
+
+  /* the kernels compute what the naive loops do, on the whole 1000x1000. */
+  auto reference = InterpretGraph(graph.module, 1 << 28);
+  auto candidate = InterpretGraph(module, 1 << 28);
+  std::string reason;
+  bool matched = reference.ok && candidate.ok && CompareRuns(reference, candidate, reason);
+  std::cout << "non-divisible results: " << (matched ? "match" : reference.reason + candidate.reason + reason) << "\n";
+  assert(matched);
+}
+
+void test_validation() {
+  /* a register buffer of 2 loaded 4 at a time goes out of its bounds on the host interpreter: that config is dropped. */
+  KernelCodeGenerator generator("CUDA");
+  auto graph = generator.createGraph("validation_demo");
+  generator.opts.push_back(std::move(std::make_unique<ElementWiseOptimizer>()));
+  generator.setValidation(ValidationConfig{true});
+  generator.setConfigs("ElementWise", {
+    {{"BLOCK_SIZE_M", 64}, {"BLOCK_SIZE_N", 64}, {"THREAD_SIZE_M", 4}, {"THREAD_SIZE_N", 2}, {"VECTORIZE_WIDTH", 4}, {"UNROLL_BUDGET", 8192}, {"GRID_CAP", 65535}, {"SM_COUNT", 108},
+     {"BLOCK_COARSEN", 1}, {"GRID_COARSEN", 1}},
+    {{"BLOCK_SIZE_M", 64}, {"BLOCK_SIZE_N", 64}, {"THREAD_SIZE_M", 4}, {"THREAD_SIZE_N", 4}, {"VECTORIZE_WIDTH", 4}, {"UNROLL_BUDGET", 8192}, {"GRID_CAP", 65535}, {"SM_COUNT", 108},
+     {"BLOCK_COARSEN", 1}, {"GRID_COARSEN", 1}}
+  });
+  auto X = graph.create<PlaceHolder>(std::vector<int64_t>{1024, 1024}, std::string{"float32"});
+  graph.create<ElementWise>(X, "Gelu", MemorySpace::inplace);
+  generator.optimize(graph);
+  auto& trace = generator.getTuneTrace();
+  assert(trace.size() == 2);
+  std::cout << "broken config: " << trace[0].validation << ", " << trace[0].reason << "\n";
+  assert(trace[0].validation == "mismatch" && trace[0].status == "failed");
+  std::cout << "correct config: " << trace[1].validation << "\n";
+  assert(trace[1].validation == "passed" && trace[1].status == "ok");
+  assert(ElementWiseOptimizer::elementWiseConfig["THREAD_SIZE_N"] == 4);
+
+  /* every config spills: the spilling one is still lowered, once it is validated. */
+  KernelCodeGenerator spilled("CUDA");
+  auto spilledGraph = spilled.createGraph("validation_spilled_demo");
+  spilled.opts.push_back(std::move(std::make_unique<MatmulOptimizer>()));
+  spilled.setValidation(ValidationConfig{true});
+  spilled.setConfigs("Matmul", {
+    { {"BLOCK_SIZE_M", 128}, {"BLOCK_SIZE_N", 128}, {"BLOCK_SIZE_K", 8}, {"GROUP_SIZE_M", 8}, 
+      {"THREAD_SIZE_M", 8}, {"THREAD_SIZE_N", 8}, {"VECTORIZE_WIDTH", 4}, {"WARP_SIZE", 32}, {"STAGES", 2}, {"ASYNC_COPY", 0}, {"MMA", 0}, {"UNROLL_BUDGET", 1},
+      {"WARP_SPECIALIZE", 0}}
+  });
+  int m = 256, n = 256, k = 256;
+  auto A = spilledGraph.create<PlaceHolder>(std::vector<int64_t>{m, k}, std::string{"float32"});
+  auto B = spilledGraph.create<PlaceHolder>(std::vector<int64_t>{k, n}, std::string{"float32"});
+  spilledGraph.create<Matmul>(A, B);
+  auto module = spilled.optimize(spilledGraph);
+  auto& spilledTrace = spilled.getTuneTrace();
+  assert(spilledTrace.size() == 1);
+  std::cout << "spilled config: " << spilledTrace[0].validation << ", " << spilledTrace[0].reason << "\n";
+  assert(spilledTrace[0].status == "failed" && spilledTrace[0].reason.find("spilled") != std::string::npos);
+  assert(spilledTrace[0].validation == "passed");
+  spilled.codegen(module);
+  assert(spilled.getLaunches().size() == 1);
+}
+
 
 int main(int argc, char* argv[]) {
 
   // test_matmul();
   test_operators();
   // test_flash_attention();
+  test_mma();
+  test_warp_specialize();
+  test_incremental();
+  test_non_divisible();
+  test_validation();
 
 }
\ No newline at end of file